@@ -0,0 +1,312 @@
+/*
+ * texturepack_utils - https://github.com/Rosalie241/texturepack_utils
+ *  Copyright (C) 2023 Rosalie Wanders <rosalie@mailbox.org>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 3.
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "budget.h"
+#include "trace.h"
+
+/*
+ * Tar archive writer
+ *
+ * Files are queued from any thread and written by a single writer
+ * thread in the order they were queued, so the archive is written
+ * sequentially and nothing else touches the output. The queue is
+ * limited to ARCHIVE_QUEUE_SIZE bytes, adding a file blocks while
+ * the queue is full.
+ *
+ * The archive is ustar, names which don't fit in ustar use a GNU
+ * long name entry, which every tar implementation understands.
+ */
+
+#define ARCHIVE_BLOCK_SIZE 512
+#define ARCHIVE_QUEUE_SIZE (64 * 1024 * 1024)
+
+struct archive_header
+{
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char checksum[8];
+    char typeflag;
+    char linkname[100];
+    char magic[6];
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];
+    char padding[12];
+};
+
+struct archive_entry
+{
+    struct archive_entry* next;
+    char*                 name;
+    /* NULL for a directory */
+    uint8_t*              data;
+    size_t                size;
+};
+
+struct archive
+{
+    FILE*                 file;
+    bool                  closeFile;
+    int64_t               mtime;
+    pthread_t             thread;
+    pthread_mutex_t       mutex;
+    pthread_cond_t        cond;
+    struct archive_entry* head;
+    struct archive_entry* tail;
+    bool                  done;
+    bool                  error;
+    /* bytes waiting in the queue */
+    struct memory_budget  queue;
+    uint64_t              files;
+    uint64_t              bytes;
+};
+
+static void archive_fill_header(struct archive_header* header, const char* name, size_t size,
+                                char typeflag, int64_t mtime)
+{
+    memset(header, 0, sizeof(struct archive_header));
+    strncpy(header->name, name, sizeof(header->name));
+    snprintf(header->mode, sizeof(header->mode), "%07o", typeflag == '5' ? 0755 : 0644);
+    snprintf(header->uid, sizeof(header->uid), "%07o", 0);
+    snprintf(header->gid, sizeof(header->gid), "%07o", 0);
+    snprintf(header->size, sizeof(header->size), "%011llo", (unsigned long long)size);
+    snprintf(header->mtime, sizeof(header->mtime), "%011llo", (unsigned long long)mtime);
+    header->typeflag = typeflag;
+    memcpy(header->magic, "ustar", 6);
+    memcpy(header->version, "00", 2);
+}
+
+static void archive_checksum_header(struct archive_header* header)
+{
+    const uint8_t* bytes = (const uint8_t*)header;
+    uint32_t checksum = 0;
+
+    /* the checksum is calculated as if its field contains spaces */
+    memset(header->checksum, ' ', sizeof(header->checksum));
+    for (size_t i = 0; i < sizeof(struct archive_header); i++)
+    {
+        checksum += bytes[i];
+    }
+    snprintf(header->checksum, sizeof(header->checksum), "%06o", checksum);
+    header->checksum[7] = ' ';
+}
+
+static bool archive_write_padding(struct archive* archive, size_t size)
+{
+    static const uint8_t zeroes[ARCHIVE_BLOCK_SIZE] = {0};
+    size_t padding = (ARCHIVE_BLOCK_SIZE - (size % ARCHIVE_BLOCK_SIZE)) % ARCHIVE_BLOCK_SIZE;
+    return padding == 0 || fwrite(zeroes, padding, 1, archive->file) == 1;
+}
+
+static bool archive_write_entry(struct archive* archive, const struct archive_entry* entry)
+{
+    struct archive_header header;
+    const char* name = entry->name;
+    size_t length = strlen(name);
+    char typeflag = entry->data == NULL ? '5' : '0';
+
+    if (length > sizeof(header.name))
+    {
+        /* split the name into the prefix and the name at a slash */
+        const char* slash = strchr(name + length - sizeof(header.name) - 1, '/');
+        if (slash != NULL && (size_t)(slash - name) <= sizeof(header.prefix) && slash[1] != '\0')
+        {
+            archive_fill_header(&header, slash + 1, entry->size, typeflag, archive->mtime);
+            memcpy(header.prefix, name, slash - name);
+            name = NULL;
+        }
+        else
+        {
+            /* GNU long name, the name follows as the data of an entry */
+            archive_fill_header(&header, "././@LongLink", length + 1, 'L', 0);
+            archive_checksum_header(&header);
+            if (fwrite(&header, sizeof(header), 1, archive->file) != 1 ||
+                fwrite(entry->name, length + 1, 1, archive->file) != 1 ||
+                !archive_write_padding(archive, length + 1))
+            {
+                return false;
+            }
+        }
+    }
+
+    if (name != NULL)
+    {
+        archive_fill_header(&header, name, entry->size, typeflag, archive->mtime);
+    }
+    archive_checksum_header(&header);
+
+    if (fwrite(&header, sizeof(header), 1, archive->file) != 1)
+    {
+        return false;
+    }
+    if (entry->data != NULL &&
+        (fwrite(entry->data, entry->size, 1, archive->file) != 1 ||
+         !archive_write_padding(archive, entry->size)))
+    {
+        return false;
+    }
+    return true;
+}
+
+static void* archive_writer(void* arg)
+{
+    struct archive* archive = (struct archive*)arg;
+
+    while (true)
+    {
+        pthread_mutex_lock(&archive->mutex);
+        while (archive->head == NULL && !archive->done)
+        {
+            pthread_cond_wait(&archive->cond, &archive->mutex);
+        }
+        struct archive_entry* entry = archive->head;
+        if (entry == NULL)
+        {
+            pthread_mutex_unlock(&archive->mutex);
+            break;
+        }
+        archive->head = entry->next;
+        if (archive->head == NULL)
+        {
+            archive->tail = NULL;
+        }
+        pthread_mutex_unlock(&archive->mutex);
+
+        /* after a write error the queue is only drained */
+        uint64_t start = trace_begin();
+        if (!archive->error && !archive_write_entry(archive, entry))
+        {
+            archive->error = true;
+        }
+        trace_end("write", start, entry->size);
+
+        archive->files++;
+        archive->bytes += entry->size;
+        memory_budget_release(&archive->queue, entry->size);
+        free(entry->data);
+        free(entry->name);
+        free(entry);
+    }
+
+    return NULL;
+}
+
+/* starts writing an archive to file, which is closed by archive_close()
+ * when closeFile is set, every file gets mtime as its modification time */
+static bool archive_open(struct archive* archive, FILE* file, bool closeFile, int64_t mtime)
+{
+    memset(archive, 0, sizeof(struct archive));
+    archive->file      = file;
+    archive->closeFile = closeFile;
+    archive->mtime     = mtime;
+    pthread_mutex_init(&archive->mutex, NULL);
+    pthread_cond_init(&archive->cond, NULL);
+    memory_budget_init(&archive->queue, ARCHIVE_QUEUE_SIZE);
+
+    if (pthread_create(&archive->thread, NULL, archive_writer, archive) != 0)
+    {
+        pthread_mutex_destroy(&archive->mutex);
+        pthread_cond_destroy(&archive->cond);
+        memory_budget_destroy(&archive->queue);
+        return false;
+    }
+    return true;
+}
+
+static bool archive_queue(struct archive* archive, const char* name, uint8_t* data, size_t size)
+{
+    struct archive_entry* entry = (struct archive_entry*)malloc(sizeof(struct archive_entry));
+    char* entryName = strdup(name);
+    if (entry == NULL || entryName == NULL)
+    {
+        free(entry);
+        free(entryName);
+        free(data);
+        return false;
+    }
+
+    entry->next = NULL;
+    entry->name = entryName;
+    entry->data = data;
+    entry->size = size;
+
+    /* wait for the writer to catch up */
+    memory_budget_acquire(&archive->queue, size);
+
+    pthread_mutex_lock(&archive->mutex);
+    if (archive->tail != NULL)
+    {
+        archive->tail->next = entry;
+    }
+    else
+    {
+        archive->head = entry;
+    }
+    archive->tail = entry;
+    pthread_cond_signal(&archive->cond);
+    pthread_mutex_unlock(&archive->mutex);
+    return true;
+}
+
+/* queues a file, the archive takes ownership of data */
+static bool archive_add_file(struct archive* archive, const char* name, uint8_t* data, size_t size)
+{
+    return archive_queue(archive, name, data, size);
+}
+
+/* queues a directory, name has to end with a slash */
+static bool archive_add_directory(struct archive* archive, const char* name)
+{
+    return archive_queue(archive, name, NULL, 0);
+}
+
+/* writes the queued files and the end of the archive,
+ * returns false when anything couldn't be written */
+static bool archive_close(struct archive* archive)
+{
+    static const uint8_t end[ARCHIVE_BLOCK_SIZE * 2] = {0};
+
+    pthread_mutex_lock(&archive->mutex);
+    archive->done = true;
+    pthread_cond_signal(&archive->cond);
+    pthread_mutex_unlock(&archive->mutex);
+    pthread_join(archive->thread, NULL);
+
+    bool ret = !archive->error &&
+               fwrite(end, sizeof(end), 1, archive->file) == 1 &&
+               fflush(archive->file) == 0;
+    if (archive->closeFile && fclose(archive->file) != 0)
+    {
+        ret = false;
+    }
+
+    pthread_mutex_destroy(&archive->mutex);
+    pthread_cond_destroy(&archive->cond);
+    memory_budget_destroy(&archive->queue);
+    return ret;
+}
+
+#endif /* ARCHIVE_H */
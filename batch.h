@@ -0,0 +1,418 @@
+/*
+ * texturepack_utils - https://github.com/Rosalie241/texturepack_utils
+ *  Copyright (C) 2023 Rosalie Wanders <rosalie@mailbox.org>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 3.
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+/*
+ * Work-stealing thread pool
+ *
+ * Every worker owns a deque, tasks submitted by a worker are pushed
+ * to the back of its own deque and popped from the back again (LIFO),
+ * idle workers steal from the front of the other deques (FIFO).
+ * Tasks submitted from outside the pool are spread over the deques.
+ */
+
+typedef void (*threadpool_func)(void* arg);
+
+struct threadpool_task
+{
+    threadpool_func func;
+    void*           arg;
+};
+
+struct threadpool_deque
+{
+    pthread_mutex_t         mutex;
+    struct threadpool_task* tasks;
+    size_t                  capacity;
+    size_t                  head;
+    size_t                  count;
+};
+
+struct threadpool
+{
+    pthread_t*               threads;
+    struct threadpool_deque* deques;
+    int32_t                  count;
+
+    pthread_mutex_t          mutex;
+    /* signaled when tasks are queued or the pool stops */
+    pthread_cond_t           taskCond;
+    /* signaled when all tasks have finished */
+    pthread_cond_t           doneCond;
+    size_t                   queued;
+    size_t                   pending;
+    uint32_t                 nextDeque;
+    int32_t                  started;
+    bool                     stop;
+};
+
+/* index of the worker running on this thread, -1 outside the pool */
+static __thread int32_t threadpool_worker = -1;
+
+static bool threadpool_deque_push(struct threadpool_deque* deque, struct threadpool_task task)
+{
+    pthread_mutex_lock(&deque->mutex);
+    if (deque->count == deque->capacity)
+    {
+        size_t capacity = deque->capacity == 0 ? 64 : deque->capacity * 2;
+        struct threadpool_task* tasks = (struct threadpool_task*)malloc(capacity * sizeof(struct threadpool_task));
+        if (tasks == NULL)
+        {
+            pthread_mutex_unlock(&deque->mutex);
+            return false;
+        }
+
+        for (size_t i = 0; i < deque->count; i++)
+        {
+            tasks[i] = deque->tasks[(deque->head + i) % deque->capacity];
+        }
+
+        free(deque->tasks);
+        deque->tasks    = tasks;
+        deque->capacity = capacity;
+        deque->head     = 0;
+    }
+
+    deque->tasks[(deque->head + deque->count) % deque->capacity] = task;
+    deque->count++;
+    pthread_mutex_unlock(&deque->mutex);
+    return true;
+}
+
+static bool threadpool_deque_pop(struct threadpool_deque* deque, bool back, struct threadpool_task* task)
+{
+    bool ret = false;
+
+    pthread_mutex_lock(&deque->mutex);
+    if (deque->count > 0)
+    {
+        if (back)
+        {
+            *task = deque->tasks[(deque->head + deque->count - 1) % deque->capacity];
+        }
+        else
+        {
+            *task = deque->tasks[deque->head];
+            deque->head = (deque->head + 1) % deque->capacity;
+        }
+        deque->count--;
+        ret = true;
+    }
+    pthread_mutex_unlock(&deque->mutex);
+    return ret;
+}
+
+/* takes a task from our own deque or steals one from another worker */
+static bool threadpool_take(struct threadpool* pool, int32_t worker, struct threadpool_task* task)
+{
+    int32_t start = worker < 0 ? 0 : worker;
+
+    for (int32_t i = 0; i < pool->count; i++)
+    {
+        int32_t index = (start + i) % pool->count;
+        if (threadpool_deque_pop(&pool->deques[index], index == worker, task))
+        {
+            pthread_mutex_lock(&pool->mutex);
+            pool->queued--;
+            pthread_mutex_unlock(&pool->mutex);
+            return true;
+        }
+    }
+    return false;
+}
+
+static void threadpool_run(struct threadpool* pool, struct threadpool_task* task)
+{
+    task->func(task->arg);
+
+    pthread_mutex_lock(&pool->mutex);
+    if (--pool->pending == 0)
+    {
+        pthread_cond_broadcast(&pool->doneCond);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+static void* threadpool_thread(void* arg)
+{
+    struct threadpool* pool = (struct threadpool*)arg;
+    struct threadpool_task task;
+
+    pthread_mutex_lock(&pool->mutex);
+    threadpool_worker = pool->started++;
+    pthread_mutex_unlock(&pool->mutex);
+
+    while (true)
+    {
+        if (threadpool_take(pool, threadpool_worker, &task))
+        {
+            threadpool_run(pool, &task);
+            continue;
+        }
+
+        pthread_mutex_lock(&pool->mutex);
+        while (pool->queued == 0 && !pool->stop)
+        {
+            pthread_cond_wait(&pool->taskCond, &pool->mutex);
+        }
+        bool stop = pool->stop && pool->queued == 0;
+        pthread_mutex_unlock(&pool->mutex);
+
+        if (stop)
+        {
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+static bool threadpool_submit(struct threadpool* pool, threadpool_func func, void* arg)
+{
+    struct threadpool_task task = { func, arg };
+    int32_t index = threadpool_worker;
+
+    pthread_mutex_lock(&pool->mutex);
+    if (index < 0)
+    {
+        index = (int32_t)(pool->nextDeque++ % pool->count);
+    }
+    pool->pending++;
+    pool->queued++;
+    pthread_mutex_unlock(&pool->mutex);
+
+    if (!threadpool_deque_push(&pool->deques[index], task))
+    {
+        /* run it ourselves instead */
+        pthread_mutex_lock(&pool->mutex);
+        pool->queued--;
+        pthread_mutex_unlock(&pool->mutex);
+        threadpool_run(pool, &task);
+        return true;
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+    pthread_cond_signal(&pool->taskCond);
+    pthread_mutex_unlock(&pool->mutex);
+    return true;
+}
+
+/* waits until every submitted task, including the tasks
+ * submitted by those tasks, has finished, this must not
+ * be called from a task */
+static void threadpool_wait(struct threadpool* pool)
+{
+    pthread_mutex_lock(&pool->mutex);
+    while (pool->pending > 0)
+    {
+        pthread_cond_wait(&pool->doneCond, &pool->mutex);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+static struct threadpool* threadpool_create(int32_t threads)
+{
+    struct threadpool* pool = (struct threadpool*)calloc(1, sizeof(struct threadpool));
+    if (pool == NULL)
+    {
+        return NULL;
+    }
+
+    if (threads < 1)
+    {
+        threads = 1;
+    }
+
+    pool->count   = threads;
+    pool->threads = (pthread_t*)calloc(threads, sizeof(pthread_t));
+    pool->deques  = (struct threadpool_deque*)calloc(threads, sizeof(struct threadpool_deque));
+    if (pool->threads == NULL || pool->deques == NULL)
+    {
+        free(pool->threads);
+        free(pool->deques);
+        free(pool);
+        return NULL;
+    }
+
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->taskCond, NULL);
+    pthread_cond_init(&pool->doneCond, NULL);
+    for (int32_t i = 0; i < threads; i++)
+    {
+        pthread_mutex_init(&pool->deques[i].mutex, NULL);
+    }
+
+    for (int32_t i = 0; i < threads; i++)
+    {
+        if (pthread_create(&pool->threads[i], NULL, threadpool_thread, pool) != 0)
+        {
+            /* continue with the workers we've got */
+            pool->count = i;
+            break;
+        }
+    }
+
+    if (pool->count == 0)
+    {
+        fprintf(stderr, "Error: failed to create any worker thread\n");
+        free(pool->threads);
+        free(pool->deques);
+        free(pool);
+        return NULL;
+    }
+
+    return pool;
+}
+
+static void threadpool_destroy(struct threadpool* pool)
+{
+    threadpool_wait(pool);
+
+    pthread_mutex_lock(&pool->mutex);
+    pool->stop = true;
+    pthread_cond_broadcast(&pool->taskCond);
+    pthread_mutex_unlock(&pool->mutex);
+
+    for (int32_t i = 0; i < pool->count; i++)
+    {
+        pthread_join(pool->threads[i], NULL);
+        free(pool->deques[i].tasks);
+        pthread_mutex_destroy(&pool->deques[i].mutex);
+    }
+
+    pthread_mutex_destroy(&pool->mutex);
+    pthread_cond_destroy(&pool->taskCond);
+    pthread_cond_destroy(&pool->doneCond);
+    free(pool->threads);
+    free(pool->deques);
+    free(pool);
+}
+
+static int32_t threadpool_default_threads(void)
+{
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (int32_t)count : 1;
+}
+
+/*
+ * Input collection
+ */
+
+struct batch_inputs
+{
+    char**  paths;
+    int32_t count;
+    int32_t capacity;
+};
+
+static bool batch_inputs_add(struct batch_inputs* inputs, const char* path)
+{
+    if (inputs->count == inputs->capacity)
+    {
+        int32_t capacity = inputs->capacity == 0 ? 16 : inputs->capacity * 2;
+        char** paths = (char**)realloc(inputs->paths, capacity * sizeof(char*));
+        if (paths == NULL)
+        {
+            return false;
+        }
+        inputs->paths    = paths;
+        inputs->capacity = capacity;
+    }
+
+    inputs->paths[inputs->count] = strdup(path);
+    if (inputs->paths[inputs->count] == NULL)
+    {
+        return false;
+    }
+    inputs->count++;
+    return true;
+}
+
+static int batch_compare_paths(const void* a, const void* b)
+{
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+/* adds the path to the inputs, when it's a directory every file
+ * in it which ends with suffix (ignoring case) is added instead */
+static bool batch_inputs_collect(struct batch_inputs* inputs, const char* path, const char* suffix)
+{
+    struct stat st;
+    if (stat(path, &st) == -1 || !S_ISDIR(st.st_mode))
+    {
+        return batch_inputs_add(inputs, path);
+    }
+
+    DIR* dir = opendir(path);
+    if (dir == NULL)
+    {
+        perror("opendir");
+        return false;
+    }
+
+    int32_t start = inputs->count;
+    size_t  suffixLength = strlen(suffix);
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        size_t length = strlen(entry->d_name);
+        if (length < suffixLength ||
+            strcasecmp(entry->d_name + length - suffixLength, suffix) != 0)
+        {
+            continue;
+        }
+
+        char* fullPath = (char*)malloc(strlen(path) + length + 2);
+        if (fullPath == NULL)
+        {
+            closedir(dir);
+            return false;
+        }
+        sprintf(fullPath, "%s/%s", path, entry->d_name);
+        bool ret = batch_inputs_add(inputs, fullPath);
+        free(fullPath);
+        if (!ret)
+        {
+            closedir(dir);
+            return false;
+        }
+    }
+    closedir(dir);
+
+    /* process directories in a stable order */
+    qsort(inputs->paths + start, inputs->count - start, sizeof(char*), batch_compare_paths);
+    return true;
+}
+
+static void batch_inputs_free(struct batch_inputs* inputs)
+{
+    for (int32_t i = 0; i < inputs->count; i++)
+    {
+        free(inputs->paths[i]);
+    }
+    free(inputs->paths);
+    inputs->paths    = NULL;
+    inputs->count    = 0;
+    inputs->capacity = 0;
+}
+
+#endif /* BATCH_H */
@@ -0,0 +1,199 @@
+/*
+ * texturepack_utils - https://github.com/Rosalie241/texturepack_utils
+ *  Copyright (C) 2023 Rosalie Wanders <rosalie@mailbox.org>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 3.
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef BUDGET_H
+#define BUDGET_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <pthread.h>
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif /* _WIN32 */
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif /* __GLIBC__ */
+
+/*
+ * Memory budget
+ *
+ * Byte-counting admission control: before a texture is read, the
+ * memory it's going to need is acquired from the budget, which waits
+ * until enough of the budget is free again. A texture which needs more
+ * than the whole budget is admitted once nothing else is in flight,
+ * so it runs on its own instead of failing.
+ *
+ * glibc raises its mmap threshold every time a big buffer is freed,
+ * after which big buffers end up in the per-thread heaps and aren't
+ * given back, so RSS would keep growing past the budget. Tools call
+ * memory_budget_init_malloc in main to set a fixed M_MMAP_THRESHOLD
+ * when there's a limit.
+ */
+
+struct memory_budget
+{
+    pthread_mutex_t mutex;
+    pthread_cond_t  cond;
+    /* 0 means unlimited */
+    uint64_t        limit;
+    uint64_t        used;
+    uint64_t        peak;
+    /* amount of textures which needed more than the limit */
+    uint32_t        oversized;
+};
+
+static void memory_budget_init(struct memory_budget* budget, uint64_t limit)
+{
+    pthread_mutex_init(&budget->mutex, NULL);
+    pthread_cond_init(&budget->cond, NULL);
+    budget->limit     = limit;
+    budget->used      = 0;
+    budget->peak      = 0;
+    budget->oversized = 0;
+}
+
+/* tunes malloc so freed textures are given back, this
+ * is process-wide, so it's only called from main */
+static void memory_budget_init_malloc(uint64_t limit)
+{
+#ifdef __GLIBC__
+    if (limit != 0)
+    {
+        mallopt(M_MMAP_THRESHOLD, 1024 * 1024);
+    }
+#else
+    (void)limit;
+#endif /* __GLIBC__ */
+}
+
+static void memory_budget_destroy(struct memory_budget* budget)
+{
+    pthread_mutex_destroy(&budget->mutex);
+    pthread_cond_destroy(&budget->cond);
+}
+
+/* takes size from the budget when it fits, the mutex must be held */
+static bool memory_budget_take(struct memory_budget* budget, uint64_t size)
+{
+    if (budget->limit != 0 && budget->used != 0 &&
+        budget->used + size > budget->limit)
+    {
+        return false;
+    }
+
+    if (budget->limit != 0 && size > budget->limit)
+    {
+        budget->oversized++;
+    }
+
+    budget->used += size;
+    if (budget->used > budget->peak)
+    {
+        budget->peak = budget->used;
+    }
+    return true;
+}
+
+/* takes size from the budget, waits until it fits */
+static void memory_budget_acquire(struct memory_budget* budget, uint64_t size)
+{
+    pthread_mutex_lock(&budget->mutex);
+    while (!memory_budget_take(budget, size))
+    {
+        pthread_cond_wait(&budget->cond, &budget->mutex);
+    }
+    pthread_mutex_unlock(&budget->mutex);
+}
+
+/* takes size from the budget when it fits right now,
+ * for callers which have to free memory themselves first */
+static bool memory_budget_try_acquire(struct memory_budget* budget, uint64_t size)
+{
+    pthread_mutex_lock(&budget->mutex);
+    bool ret = memory_budget_take(budget, size);
+    pthread_mutex_unlock(&budget->mutex);
+    return ret;
+}
+
+static void memory_budget_release(struct memory_budget* budget, uint64_t size)
+{
+    pthread_mutex_lock(&budget->mutex);
+    budget->used -= size;
+    pthread_cond_broadcast(&budget->cond);
+    pthread_mutex_unlock(&budget->mutex);
+}
+
+/* parses a size in bytes, with an optional K, M or G suffix */
+static bool memory_budget_parse(const char* str, uint64_t* size)
+{
+    char* end = NULL;
+    unsigned long long value = strtoull(str, &end, 10);
+    if (end == str)
+    {
+        return false;
+    }
+
+    switch (toupper((unsigned char)*end))
+    {
+    case 'G':
+        value *= 1024;
+        /* fallthrough */
+    case 'M':
+        value *= 1024;
+        /* fallthrough */
+    case 'K':
+        value *= 1024;
+        end++;
+        break;
+    case '\0':
+        break;
+    default:
+        return false;
+    }
+
+    if (toupper((unsigned char)*end) == 'B')
+    {
+        end++;
+    }
+
+    if (*end != '\0')
+    {
+        return false;
+    }
+
+    *size = value;
+    return true;
+}
+
+static void memory_budget_report(FILE* log, struct memory_budget* budget)
+{
+    fprintf(log, "-> Peak texture memory: %.1f MiB", budget->peak / (1024.0 * 1024.0));
+    if (budget->limit != 0)
+    {
+        fprintf(log, " of %.1f MiB", budget->limit / (1024.0 * 1024.0));
+    }
+#ifndef _WIN32
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0)
+    {
+        /* ru_maxrss is in KiB */
+        fprintf(log, ", peak RSS: %.1f MiB", usage.ru_maxrss / 1024.0);
+    }
+#endif /* _WIN32 */
+    fprintf(log, "\n");
+    if (budget->oversized > 0)
+    {
+        fprintf(log, "-> %u textures were larger than the budget and ran on their own\n", budget->oversized);
+    }
+}
+
+#endif /* BUDGET_H */
@@ -7,42 +7,337 @@
  *  You should have received a copy of the GNU General Public License
  *  along with this program. If not, see <https://www.gnu.org/licenses/>.
  */
-#include <stdio.h>
-#include <stdint.h>
-#include <stdlib.h>
-#include <string.h>
+#ifndef _WIN32
+#include <linux/limits.h>
+#endif /* _WIN32 */
+#include "hts.h"
+#include "batch.h"
+#include "budget.h"
+#include "trace.h"
+#include "index.h"
+#include "journal.h"
+#include "htsi.h"
+#include "htcseek.h"
 #include <utility>
-#include <zlib.h>
-#include <unordered_map>
+#include <vector>
+#include <algorithm>
 #include <ctype.h>
 
-struct GHQTexInfo
+struct PackJob
 {
-    uint8_t* data;
-    int32_t width;
-    int32_t height;
-    uint32_t format;
-    uint16_t texture_format;
-    uint16_t pixel_type;
-    uint8_t is_hires_tex;
+    struct memory_budget* budget;
+    bool                  checkpoint;
+    bool                  resume;
+    bool                  writeIndex;
+    bool                  seekIndex;
+    int32_t               threads;
+    char                  inFilename[PATH_MAX];
+    bool                  error;
 };
 
-int main(int argc, char** argv)
+/* the records between two access points of the seek index */
+struct HtcSegment
+{
+    const char*                  inFilename;
+    const char*                  outFilename;
+    int                          fd;
+    int                          outFd;
+    const struct htc_seek_point* point;
+    /* inflated offset of the next segment, -1 for the last one */
+    int64_t                      end;
+    struct memory_budget*        budget;
+    /* checksum and output offset of every texture */
+    std::vector<std::pair<uint64_t, int64_t>> textures;
+    /* output offset after the last texture */
+    int64_t                      outEnd;
+    bool                         error;
+};
+
+/* journal record of a texture which was written */
+struct HtcRecord
+{
+    uint64_t checksum;
+    /* where the texture starts and ends in the output */
+    int64_t  offset;
+    int64_t  end;
+    /* uncompressed position in the HTC after the texture */
+    int64_t  inputOffset;
+};
+
+/* checks the records against the partial output, returns how many
+ * of them describe textures which are really there, a record can
+ * only be trusted when every record before it can be trusted */
+static size_t validate_records(int fd, const struct HtcRecord* records, size_t count)
 {
-    if (argc < 2)
+    struct stat st;
+    if (fstat(fd, &st) == -1)
     {
-        printf("Usage: %s [HTC FILE]\n", argv[0]);
-        return 1;
+        return 0;
+    }
+
+    int64_t expectedOffset = sizeof(int32_t) + sizeof(int64_t);
+    for (size_t i = 0; i < count; i++)
+    {
+        struct GHQTexInfo info = {0};
+        if (records[i].offset != expectedOffset ||
+            records[i].end > st.st_size ||
+            !pread_info(fd, records[i].offset, true, &info, false) ||
+            records[i].offset + info_header_size(true) + info.dataSize != records[i].end)
+        {
+            return i;
+        }
+        expectedOffset = records[i].end;
+    }
+
+    return count;
+}
+
+/* inflates and converts the records of one segment, they're written
+ * straight to their place in the output, because every record in the
+ * HTS is exactly the checksum smaller than in the HTC */
+static void convert_segment(void* arg)
+{
+    struct HtcSegment* segment = (struct HtcSegment*)arg;
+    const struct htc_seek_point* point = segment->point;
+    int32_t headerSize = info_header_size(true);
+    int64_t position   = point->recordOffset;
+    int64_t outOffset  = sizeof(int32_t) + sizeof(int64_t) + (position - HTC_HEADER_SIZE) -
+                         (point->recordIndex * (HTC_RECORD_HEADER_SIZE - headerSize));
+
+    segment->outEnd = outOffset;
+
+    /* a segment without records doesn't need to inflate anything */
+    if (segment->end != -1 && position >= segment->end)
+    {
+        return;
+    }
+
+    /* the reader holds its input buffer */
+    struct htc_seek_reader* reader = (struct htc_seek_reader*)malloc(sizeof(struct htc_seek_reader));
+    if (reader == NULL || !htc_seek_reader_open(reader, segment->fd, point))
+    {
+        fprintf(stderr, "%s: failed to start inflating at %lld!\n", segment->inFilename, (long long)point->in);
+        free(reader);
+        segment->error = true;
+        return;
+    }
+
+    if (!htc_seek_reader_skip(reader, position - point->out))
+    {
+        fprintf(stderr, "%s: invalid gzip stream!\n", segment->inFilename);
+        segment->error = true;
+    }
+
+    while (!segment->error && (segment->end == -1 || position < segment->end))
+    {
+        uint8_t header[HTC_RECORD_HEADER_SIZE];
+        uint8_t outHeader[HTC_RECORD_HEADER_SIZE];
+        uint64_t checksum;
+        struct GHQTexInfo info = {0};
+        /* reading includes inflating */
+        uint64_t start = trace_begin();
+
+        int64_t length = htc_seek_reader_read(reader, header, sizeof(header));
+        if (length < 0 || (segment->end != -1 && length != sizeof(header)))
+        {
+            fprintf(stderr, "%s: invalid gzip stream!\n", segment->inFilename);
+            segment->error = true;
+            break;
+        }
+        /* a record without a checksum is the end */
+        if (length < (int64_t)sizeof(checksum))
+        {
+            break;
+        }
+        if (length != sizeof(header))
+        {
+            fprintf(stderr, "%s: truncated texture header!\n", segment->inFilename);
+            break;
+        }
+
+#define PREAD(x, offset) memcpy(&x, header + offset, sizeof(x))
+        PREAD(checksum, 0);
+        PREAD(info.width, 8);
+        PREAD(info.height, 12);
+        PREAD(info.format, 16);
+        PREAD(info.texture_format, 20);
+        PREAD(info.pixel_type, 22);
+        PREAD(info.is_hires_tex, 24);
+        PREAD(info.dataSize, 25);
+#undef PREAD
+
+        memory_budget_acquire(segment->budget, info.dataSize);
+
+        info.data = (uint8_t*)malloc(info.dataSize);
+        if (info.data == NULL)
+        {
+            fprintf(stderr, "malloc failed!\n");
+            memory_budget_release(segment->budget, info.dataSize);
+            segment->error = true;
+            break;
+        }
+
+        length = htc_seek_reader_read(reader, info.data, info.dataSize);
+        if (length != (int64_t)info.dataSize)
+        {
+            free(info.data);
+            memory_budget_release(segment->budget, info.dataSize);
+            if (length < 0 || segment->end != -1)
+            {
+                fprintf(stderr, "%s: invalid gzip stream!\n", segment->inFilename);
+                segment->error = true;
+            }
+            else
+            {
+                fprintf(stderr, "%s: truncated texture data!\n", segment->inFilename);
+            }
+            break;
+        }
+
+        trace_texture(checksum, info.width, info.height);
+        trace_end("read", start, info.dataSize);
+
+        start = trace_begin();
+        build_info_header(outHeader, true, &info);
+        if (!pwrite_full(segment->outFd, outHeader, headerSize, outOffset) ||
+            !pwrite_full(segment->outFd, info.data, info.dataSize, outOffset + headerSize))
+        {
+            perror(segment->outFilename);
+            segment->error = true;
+        }
+        trace_end("write", start, info.dataSize);
+
+        free(info.data);
+        memory_budget_release(segment->budget, info.dataSize);
+        if (segment->error)
+        {
+            break;
+        }
+
+        /* the end only moves past records which were written completely */
+        segment->textures.push_back(std::make_pair(checksum, outOffset));
+        outOffset += headerSize + info.dataSize;
+        position  += HTC_RECORD_HEADER_SIZE + info.dataSize;
+        segment->outEnd = outOffset;
+    }
+
+    htc_seek_reader_close(reader);
+    free(reader);
+}
+
+/* converts every segment of the seek index on its own thread pool,
+ * end is set to the output offset after the last texture */
+static bool convert_segments(const char* inFilename, const char* outFilename, int fd, int outFd,
+                             const struct htc_seek* seek, struct memory_budget* budget, int32_t threads,
+                             struct hts_index* mapping, int64_t* end)
+{
+    uint64_t count = seek->header.pointCount;
+    std::vector<HtcSegment> segments(count);
+
+    struct threadpool* pool = threadpool_create((int32_t)std::min<uint64_t>(threads, count));
+    if (pool == NULL)
+    {
+        fprintf(stderr, "failed to create thread pool!\n");
+        return false;
+    }
+
+    printf("inflating %s in %llu segments\n", inFilename, (unsigned long long)count);
+
+    for (uint64_t i = 0; i < count; i++)
+    {
+        HtcSegment& segment = segments[i];
+        segment.inFilename  = inFilename;
+        segment.outFilename = outFilename;
+        segment.fd          = fd;
+        segment.outFd       = outFd;
+        segment.point       = &seek->points[i];
+        segment.end         = (i + 1) < count ? seek->points[i + 1].recordOffset : -1;
+        segment.budget      = budget;
+        segment.error       = false;
+        threadpool_submit(pool, convert_segment, &segment);
+    }
+    threadpool_destroy(pool);
+
+    /* the segments are in file order, so the first texture wins,
+     * they're reported here so the output isn't interleaved */
+    for (auto& segment : segments)
+    {
+        if (segment.error)
+        {
+            return false;
+        }
+
+        for (auto& texture : segment.textures)
+        {
+            printf("adding texture %08X %08X to %s\n", (uint32_t)(texture.first & 0xffffffff),
+                   (uint32_t)(texture.first >> 32), outFilename);
+            if (hts_index_find(mapping, texture.first, 0) == -1 &&
+                !hts_index_insert(mapping, texture.first, 0, texture.second, NULL))
+            {
+                fprintf(stderr, "malloc failed!\n");
+                return false;
+            }
+        }
+    }
+
+    *end = segments.back().outEnd;
+    return true;
+}
+
+/* reads the seek index of the HTC file, or builds it when
+ * build is set, returns false when there's none to use */
+static bool open_seek_index(const char* inFilename, int fd, bool build, struct htc_seek* seek)
+{
+    char filename[PATH_MAX];
+
+    if (!htc_seek_filename(inFilename, filename, sizeof(filename)))
+    {
+        return false;
+    }
+
+    if (htc_seek_read(filename, fd, seek))
+    {
+        return true;
+    }
+    if (!build)
+    {
+        return false;
+    }
+
+    printf("indexing %s\n", inFilename);
+    if (!htc_seek_build(inFilename, seek))
+    {
+        fprintf(stderr, "Warning: %s: failed to build seek index, reading it from front to back\n", inFilename);
+        return false;
     }
 
-    char inFilename[200];
-    char outFilename[200];
+    /* the index is still good for this conversion */
+    if (!htc_seek_write(filename, seek))
+    {
+        fprintf(stderr, "Warning: %s: failed to write seek index\n", inFilename);
+    }
+    return true;
+}
+
+static bool convert_htc(const char* filename, struct memory_budget* budget, bool checkpoint, bool resume, bool writeIndex,
+                        bool seekIndex, int32_t threads)
+{
+    char inFilename[PATH_MAX];
+    char outFilename[PATH_MAX];
+    char partFilename[PATH_MAX];
+    char journalFilename[PATH_MAX];
+
+    if (strlen(filename) < 4)
+    {
+        fprintf(stderr, "%s: file doesn't end with .htc!\n", filename);
+        return false;
+    }
 
-    strcpy(inFilename, argv[1]);
+    strcpy(inFilename, filename);
     strcpy(outFilename, inFilename);
 
-    /* make sure the end of inFileame 
-     *  contains .htc, if it does, 
+    /* make sure the end of inFileame
+     *  contains .htc, if it does,
      *  overwrite it with .hts
      */
     char* inFileExtension = outFilename + strlen(outFilename) - 4;
@@ -50,107 +345,483 @@ int main(int argc, char** argv)
     for (int i = 0; i < 4; i++) { inFileExtension[i] = tolower(inFileExtension[i]); }
     if (strcmp(inFileExtension, ".htc") != 0)
     {
-        fprintf(stderr, "file doesn't end with .htc!\n");
-        return 1;
+        fprintf(stderr, "%s: file doesn't end with .htc!\n", inFilename);
+        return false;
     }
 
     /* overwrite .htc with .hts */
     strcpy(inFileExtension, ".hts");
 
+    /* the HTS is written next to it and renamed when it's
+     * complete, so there's never a half written HTS */
+    if (snprintf(partFilename, sizeof(partFilename), "%s.part", outFilename) >= (int)sizeof(partFilename) ||
+        snprintf(journalFilename, sizeof(journalFilename), "%s.journal", outFilename) >= (int)sizeof(journalFilename))
+    {
+        fprintf(stderr, "%s: filename too long!\n", inFilename);
+        return false;
+    }
+
     /* try to open provided filename */
     gzFile gzfp = gzopen(inFilename, "rb");
     if (gzfp == NULL)
     {
         perror("gzopen");
-        return 1;
+        return false;
+    }
+
+    struct journal journal = {0};
+    struct HtcRecord* records = NULL;
+    size_t recordCount = 0;
+    if (checkpoint)
+    {
+        struct journal_identity identity;
+        void* journalRecords;
+        if (!journal_identity(inFilename, sizeof(struct HtcRecord), 0, &identity) ||
+            !journal_open(&journal, journalFilename, &identity, resume, &journalRecords, &recordCount))
+        {
+            fprintf(stderr, "%s: failed to open journal %s!\n", inFilename, journalFilename);
+            gzclose(gzfp);
+            return false;
+        }
+        records = (struct HtcRecord*)journalRecords;
     }
 
-    FILE* outFile = fopen(outFilename, "wb+");
+    /* a journal without partial output can't be resumed,
+     * its records would point into an output which is gone */
+    FILE* outFile = NULL;
+    if (recordCount > 0)
+    {
+        outFile = fopen(partFilename, "rb+");
+        if (outFile == NULL)
+        {
+            fprintf(stderr, "Warning: %s is missing, starting over\n", partFilename);
+            recordCount = 0;
+            if (!journal_truncate(&journal, 0))
+            {
+                fprintf(stderr, "%s: failed to reset journal %s!\n", inFilename, journalFilename);
+                free(records);
+                journal_close(&journal, journalFilename, false);
+                gzclose(gzfp);
+                return false;
+            }
+        }
+    }
+    if (outFile == NULL)
+    {
+        outFile = fopen(partFilename, "wb+");
+    }
     if (outFile == NULL)
     {
         perror("fopen");
-        return 1;
+        free(records);
+        journal_close(&journal, journalFilename, false);
+        gzclose(gzfp);
+        return false;
     }
 
-    /* write header to outFile */
-    int32_t outConfig = 1075970048, mapOffset = -1;
-    fwrite(&outConfig, 4, 1, outFile);
-    fwrite(&mapOffset, 4, 1, outFile);
+    /* the HTC doesn't say how many textures it contains */
+    struct hts_index mapping;
+    if (!hts_index_init(&mapping, recordCount))
+    {
+        fprintf(stderr, "malloc failed!\n");
+        free(records);
+        journal_close(&journal, journalFilename, false);
+        gzclose(gzfp);
+        fclose(outFile);
+        return false;
+    }
 
-    /* read header (skip for now) */
-    gzseek(gzfp, 4, SEEK_CUR);
-    
-    std::unordered_map<uint64_t, int64_t> mapping;
+    int32_t outConfig = HTS_CONFIG_UNCOMPRESSED;
+    int64_t mappingOffset = -1;
 
-    /* keep reading until the end */
-    while (!gzeof(gzfp))
+    /* only keep what's in the partial output, the
+     * textures after the last checkpoint are redone */
+    size_t validCount = validate_records(fileno(outFile), records, recordCount);
+    if (validCount > 0)
     {
-        int32_t dataSize;
-        uint64_t checksum;
-        struct GHQTexInfo info;
-
-        gzread(gzfp, &checksum, 8);
-        gzread(gzfp, &info.width, 4);
-        gzread(gzfp, &info.height, 4);
-        gzread(gzfp, &info.format, 4);
-        gzread(gzfp, &info.texture_format, 2);
-        gzread(gzfp, &info.pixel_type, 2);
-        gzread(gzfp, &info.is_hires_tex, 1);
-        gzread(gzfp, &dataSize, 4);
-        
-        info.data = (uint8_t*)malloc(dataSize);
-        if (info.data == NULL)
+        const struct HtcRecord* last = &records[validCount - 1];
+
+        if (validCount < recordCount)
         {
-            fprintf(stderr, "malloc failed!\n");
-            return 1;
+            fprintf(stderr, "Warning: %s: %zu journal records don't match %s, dropping them\n",
+                    inFilename, recordCount - validCount, partFilename);
+        }
+
+        /* the first texture wins, like below */
+        for (size_t i = 0; i < validCount; i++)
+        {
+            if (hts_index_find(&mapping, records[i].checksum, 0) == -1)
+            {
+                hts_index_insert(&mapping, records[i].checksum, 0, records[i].offset, NULL);
+            }
+        }
+
+        if (!journal_truncate(&journal, validCount) ||
+            ftruncate(fileno(outFile), last->end) == -1 ||
+            FSEEK(outFile, last->end, SEEK_SET) != 0 ||
+            gzseek(gzfp, last->inputOffset, SEEK_SET) != last->inputOffset)
+        {
+            fprintf(stderr, "%s: failed to resume from %s!\n", inFilename, partFilename);
+            free(records);
+            hts_index_free(&mapping);
+            journal_close(&journal, journalFilename, false);
+            gzclose(gzfp);
+            fclose(outFile);
+            return false;
+        }
+
+        printf("resuming %s after %zu textures\n", outFilename, validCount);
+    }
+    else
+    {
+        if (recordCount > 0)
+        {
+            fprintf(stderr, "Warning: %s doesn't match %s, starting over\n", journalFilename, partFilename);
+            if (!journal_truncate(&journal, 0) ||
+                ftruncate(fileno(outFile), 0) == -1 ||
+                FSEEK(outFile, 0, SEEK_SET) != 0)
+            {
+                fprintf(stderr, "%s: failed to reset journal %s!\n", inFilename, journalFilename);
+                free(records);
+                hts_index_free(&mapping);
+                journal_close(&journal, journalFilename, false);
+                gzclose(gzfp);
+                fclose(outFile);
+                return false;
+            }
         }
-        
-        gzread(gzfp, info.data, dataSize);
 
-        printf("adding texture %08X %08X to %s\n", (uint32_t)(checksum & 0xffffffff), (uint32_t)(checksum >> 32), outFilename);
+        /* write header to outFile */
+        fwrite(&outConfig, sizeof(outConfig), 1, outFile);
+        fwrite(&mappingOffset, sizeof(mappingOffset), 1, outFile);
 
-        /* add to mapping list */
-        mapping.insert(std::make_pair(checksum, ftell(outFile)));
+        /* read header (skip for now) */
+        gzseek(gzfp, 4, SEEK_CUR);
+    }
 
-        /* write texture data to file */
-#define FWRITE(x) fwrite(&x, sizeof(x), 1, outFile)
-        FWRITE(info.width);
-        FWRITE(info.height);
-        FWRITE(info.format);
-        FWRITE(info.texture_format);
-        FWRITE(info.pixel_type);
-        FWRITE(info.is_hires_tex);
-        FWRITE(dataSize);
-#undef FWRITE
-        fwrite(info.data, dataSize, 1, outFile);
+    free(records);
 
-        /* free malloc'd data */
-        free(info.data);
+    bool ret = true;
+
+    /* the journal follows the stream from front to back, so with
+     * --checkpoint the HTC is always read that way, otherwise the
+     * segments of its seek index are converted in parallel */
+    struct htc_seek seek = {0};
+    int htcFd = checkpoint ? -1 : open(inFilename, O_RDONLY);
+    if (htcFd != -1 && open_seek_index(inFilename, htcFd, seekIndex, &seek))
+    {
+        int64_t end = 0;
+        ret = fflush(outFile) == 0 &&
+              convert_segments(inFilename, outFilename, htcFd, fileno(outFile), &seek, budget, threads, &mapping, &end) &&
+              FSEEK(outFile, end, SEEK_SET) == 0;
+        htc_seek_free(&seek);
+    }
+    else
+    {
+        /* keep reading until the end */
+        while (true)
+        {
+            uint64_t checksum;
+            struct GHQTexInfo info = {0};
+            /* the HTC is one gzip stream, so reading includes inflating */
+            uint64_t start = trace_begin();
+
+            /* a record without a checksum is the end */
+            if (gzread(gzfp, &checksum, 8) != 8)
+            {
+                break;
+            }
+            gzread(gzfp, &info.width, 4);
+            gzread(gzfp, &info.height, 4);
+            gzread(gzfp, &info.format, 4);
+            gzread(gzfp, &info.texture_format, 2);
+            gzread(gzfp, &info.pixel_type, 2);
+            gzread(gzfp, &info.is_hires_tex, 1);
+            if (gzread(gzfp, &info.dataSize, 4) != 4)
+            {
+                fprintf(stderr, "%s: truncated texture header!\n", inFilename);
+                break;
+            }
+
+            memory_budget_acquire(budget, info.dataSize);
+
+            info.data = (uint8_t*)malloc(info.dataSize);
+            if (info.data == NULL)
+            {
+                fprintf(stderr, "malloc failed!\n");
+                memory_budget_release(budget, info.dataSize);
+                ret = false;
+                break;
+            }
+
+            if (gzread(gzfp, info.data, info.dataSize) != (int)info.dataSize)
+            {
+                fprintf(stderr, "%s: truncated texture data!\n", inFilename);
+                free(info.data);
+                memory_budget_release(budget, info.dataSize);
+                break;
+            }
+
+            trace_texture(checksum, info.width, info.height);
+            trace_end("read", start, info.dataSize);
+
+            printf("adding texture %08X %08X to %s\n", (uint32_t)(checksum & 0xffffffff), (uint32_t)(checksum >> 32), outFilename);
+
+            struct HtcRecord record;
+            record.checksum = checksum;
+            record.offset   = FTELL(outFile);
+
+            /* add to mapping list, the first texture wins */
+            if (hts_index_find(&mapping, checksum, 0) == -1 &&
+                !hts_index_insert(&mapping, checksum, 0, record.offset, NULL))
+            {
+                fprintf(stderr, "malloc failed!\n");
+                free(info.data);
+                memory_budget_release(budget, info.dataSize);
+                ret = false;
+                break;
+            }
+
+            /* write texture data to file */
+            start = trace_begin();
+            write_info_header(outFile, true, &info);
+            fwrite(info.data, info.dataSize, 1, outFile);
+            trace_end("write", start, info.dataSize);
+
+            /* free malloc'd data */
+            free(info.data);
+            memory_budget_release(budget, info.dataSize);
+
+            if (checkpoint)
+            {
+                record.end         = FTELL(outFile);
+                record.inputOffset = gztell(gzfp);
+
+                /* the textures have to be on disk
+                 * before the journal says they are */
+                bool commit = false;
+                if (!journal_add(&journal, &record, &commit))
+                {
+                    fprintf(stderr, "malloc failed!\n");
+                    ret = false;
+                    break;
+                }
+                if (commit)
+                {
+                    start = trace_begin();
+                    if (fflush(outFile) != 0 ||
+                        fdatasync(fileno(outFile)) == -1 ||
+                        !journal_commit(&journal))
+                    {
+                        fprintf(stderr, "%s: failed to write checkpoint!\n", inFilename);
+                        ret = false;
+                        break;
+                    }
+                    trace_end("checkpoint", start, 0);
+                }
+            }
+        }
     }
 
+    if (htcFd != -1)
+    {
+        close(htcFd);
+    }
     gzclose(gzfp);
 
+    if (!ret)
+    {
+        /* keep the partial output and journal for --resume */
+        hts_index_free(&mapping);
+        journal_close(&journal, journalFilename, false);
+        fclose(outFile);
+        return false;
+    }
+
     /* add mapping to HTS */
     printf("adding mapping to %s\n", outFilename);
 
+    /* write the mapping in file order */
+    struct hts_index_entry* entries = hts_index_sorted(&mapping);
+    if (entries == NULL)
+    {
+        fprintf(stderr, "malloc failed!\n");
+        hts_index_free(&mapping);
+        journal_close(&journal, journalFilename, false);
+        fclose(outFile);
+        return false;
+    }
+
 #define FWRITE(x) fwrite(&x, sizeof(x), 1, outFile)
-    int64_t mappingOffset = ftell(outFile);
-    int32_t mappingSize = (int32_t)mapping.size();
+    mappingOffset = FTELL(outFile);
+    int32_t mappingSize = (int32_t)mapping.count;
     FWRITE(mappingSize);
-    for (auto item : mapping)
+    for (int32_t i = 0; i < mappingSize; i++)
     {
-        FWRITE(item.first);
-        FWRITE(item.second);
+        FWRITE(entries[i].checksum);
+        FWRITE(entries[i].value);
     }
 
+    free(entries);
+    hts_index_free(&mapping);
+
     /* write mapping offset */
-    fseek(outFile, 4L, SEEK_SET);
+    FSEEK(outFile, sizeof(outConfig), SEEK_SET);
     FWRITE(mappingOffset);
 #undef FWRITE
 
-    fclose(outFile);
+    /* only rename a complete HTS into place */
+    if (fflush(outFile) != 0 ||
+        (checkpoint && fsync(fileno(outFile)) == -1) ||
+        fclose(outFile) != 0 ||
+        rename(partFilename, outFilename) == -1)
+    {
+        perror(outFilename);
+        journal_close(&journal, journalFilename, false);
+        return false;
+    }
 
-    printf("completed\n");
+    journal_close(&journal, journalFilename, checkpoint);
+
+    if (writeIndex && !htsi_generate(outFilename))
+    {
+        return false;
+    }
+
+    printf("completed %s\n", outFilename);
+    return true;
+}
+
+static void convert_pack(void* arg)
+{
+    struct PackJob* pack = (struct PackJob*)arg;
+    pack->error = !convert_htc(pack->inFilename, pack->budget, pack->checkpoint, pack->resume, pack->writeIndex,
+                               pack->seekIndex, pack->threads);
+}
+
+int main(int argc, char** argv)
+{
+    struct batch_inputs inputs = {0};
+    int32_t threads = threadpool_default_threads();
+    uint64_t maxMemory = 0;
+    const char* traceFilename = NULL;
+    bool checkpoint = false;
+    bool resume = false;
+    bool writeIndex = false;
+    bool seekIndex = false;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-j") == 0 && (i + 1) < argc)
+        {
+            threads = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--trace") == 0 && (i + 1) < argc)
+        {
+            traceFilename = argv[++i];
+        }
+        else if (strcmp(argv[i], "--checkpoint") == 0)
+        {
+            checkpoint = true;
+        }
+        else if (strcmp(argv[i], "--resume") == 0)
+        {
+            /* resuming needs the journal too */
+            checkpoint = true;
+            resume = true;
+        }
+        else if (strcmp(argv[i], "--index") == 0)
+        {
+            writeIndex = true;
+        }
+        else if (strcmp(argv[i], "--seek-index") == 0)
+        {
+            seekIndex = true;
+        }
+        else if (strcmp(argv[i], "--max-memory") == 0 && (i + 1) < argc)
+        {
+            if (!memory_budget_parse(argv[++i], &maxMemory))
+            {
+                fprintf(stderr, "invalid memory size: %s\n", argv[i]);
+                batch_inputs_free(&inputs);
+                return 1;
+            }
+        }
+        else if (!batch_inputs_collect(&inputs, argv[i], ".htc"))
+        {
+            batch_inputs_free(&inputs);
+            return 1;
+        }
+    }
+
+    if (inputs.count == 0)
+    {
+        printf("Usage: %s [HTC FILE|DIRECTORY]... [-j THREADS] [--max-memory SIZE] [--trace JSON FILE] [--checkpoint] [--resume] [--index] [--seek-index]\n", argv[0]);
+        printf("\n");
+        printf("--seek-index writes a NAME.htc.seek index of a HTC file the first time it's converted,\n");
+        printf("HTC files with one are inflated on every thread, unless --checkpoint is given\n");
+        return 1;
+    }
+
+    struct PackJob* packs = (struct PackJob*)calloc(inputs.count, sizeof(struct PackJob));
+    /* the threads left over when there are less packs
+     * than threads inflate the segments of the packs */
+    int32_t packThreads = std::max(std::min(threads, inputs.count), 1);
+    struct threadpool* pool = threadpool_create(packThreads);
+    if (packs == NULL || pool == NULL)
+    {
+        fprintf(stderr, "failed to create thread pool!\n");
+        free(packs);
+        batch_inputs_free(&inputs);
+        return 1;
+    }
+
+    if (traceFilename != NULL && !trace_open(traceFilename, "htc2uhts"))
+    {
+        free(packs);
+        threadpool_destroy(pool);
+        batch_inputs_free(&inputs);
+        return 1;
+    }
+
+    memory_budget_init_malloc(maxMemory);
+
+    struct memory_budget budget;
+    memory_budget_init(&budget, maxMemory);
+
+    /* a HTC file is a single gzip stream,
+     * so every pack is converted on its own */
+    for (int32_t i = 0; i < inputs.count; i++)
+    {
+        packs[i].budget = &budget;
+        packs[i].checkpoint = checkpoint;
+        packs[i].resume = resume;
+        packs[i].writeIndex = writeIndex;
+        packs[i].seekIndex = seekIndex;
+        packs[i].threads = std::max(threads / packThreads, 1);
+        snprintf(packs[i].inFilename, sizeof(packs[i].inFilename), "%s", inputs.paths[i]);
+        threadpool_submit(pool, convert_pack, &packs[i]);
+    }
+
+    threadpool_destroy(pool);
+    trace_close();
+
+    memory_budget_report(stdout, &budget);
+    memory_budget_destroy(&budget);
+
+    /* report every pack, one bad
+     * pack doesn't stop the others */
+    int ret = 0;
+    for (int32_t i = 0; i < inputs.count; i++)
+    {
+        if (packs[i].error)
+        {
+            fprintf(stderr, "failed to convert %s\n", packs[i].inFilename);
+            ret = 1;
+        }
+    }
 
-    return 0;
+    free(packs);
+    batch_inputs_free(&inputs);
+    return ret;
 }
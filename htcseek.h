@@ -0,0 +1,526 @@
+/*
+ * texturepack_utils - https://github.com/Rosalie241/texturepack_utils
+ *  Copyright (C) 2023 Rosalie Wanders <rosalie@mailbox.org>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 3.
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef HTCSEEK_H
+#define HTCSEEK_H
+
+#include "hts.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+/*
+ * HTC seek index (NAME.htc.seek)
+ *
+ * A HTC file is a single gzip stream, which can only be inflated from
+ * the start. The seek index has access points at deflate block
+ * boundaries about every HTC_SEEK_SPAN bytes of inflated data, the way
+ * zran.c of zlib makes them: the compressed position, the bits of the
+ * byte before it which belong to the next block, the inflated position
+ * and the last 32 KiB inflated before it, which inflate needs as its
+ * dictionary to continue from there.
+ *
+ * Every point also has the first texture record which starts at or
+ * after it and how many records are before that one, so the stream
+ * can be split into segments of whole records, which are inflated and
+ * parsed at the same time.
+ *
+ * Layout, everything little endian:
+ *
+ *   header    magic, version, point count, HTC size, gzip trailer,
+ *             inflated size, record count
+ *   points    compressed offset, inflated offset, record offset,
+ *             record index, bits, dictionary size, window
+ *
+ * The size and the gzip trailer (CRC32 and inflated size) of the HTC
+ * file are checked when the seek index is read, an index of a HTC
+ * file which changed has to be built again. Points which are out of
+ * range or out of order make the whole index invalid.
+ */
+
+#define HTC_SEEK_MAGIC   0x4B435448 /* HTCK */
+#define HTC_SEEK_VERSION 1
+
+/* inflated bytes between access points */
+#define HTC_SEEK_SPAN   (4 * 1024 * 1024)
+#define HTC_SEEK_WINDOW 32768
+
+/* checksum, width, height, format, texture_format,
+ * pixel_type, is_hires_tex and dataSize */
+#define HTC_RECORD_HEADER_SIZE 29
+/* the config at the start of the inflated stream */
+#define HTC_HEADER_SIZE 4
+
+struct htc_seek_header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t pointCount;
+    int64_t  htcSize;
+    uint32_t crc;
+    uint32_t isize;
+    int64_t  inflatedSize;
+    uint64_t recordCount;
+};
+
+struct htc_seek_point
+{
+    int64_t  in;
+    int64_t  out;
+    int64_t  recordOffset;
+    int64_t  recordIndex;
+    int32_t  bits;
+    uint32_t dictSize;
+    uint8_t  window[HTC_SEEK_WINDOW];
+};
+
+struct htc_seek
+{
+    struct htc_seek_header header;
+    struct htc_seek_point* points;
+};
+
+struct htc_seek_reader
+{
+    int      fd;
+    int64_t  in;
+    bool     end;
+    z_stream strm;
+    uint8_t  input[64 * 1024];
+};
+
+static void htc_seek_free(struct htc_seek* seek)
+{
+    free(seek->points);
+    memset(seek, 0, sizeof(struct htc_seek));
+}
+
+static bool htc_seek_filename(const char* htcFilename, char* filename, size_t size)
+{
+    int ret = snprintf(filename, size, "%s.seek", htcFilename);
+    return ret > 0 && (size_t)ret < size;
+}
+
+/* the size and the gzip trailer of the HTC file */
+static bool htc_seek_identity(int fd, int64_t* size, uint32_t* crc, uint32_t* isize)
+{
+    struct stat st;
+    uint32_t trailer[2];
+
+    if (fstat(fd, &st) == -1 || st.st_size < 18 ||
+        !pread_full(fd, trailer, sizeof(trailer), st.st_size - sizeof(trailer)))
+    {
+        return false;
+    }
+
+    *size  = st.st_size;
+    *crc   = trailer[0];
+    *isize = trailer[1];
+    return true;
+}
+
+static bool htc_seek_add_point(struct htc_seek* seek, size_t* capacity, z_stream* strm,
+                               int64_t in, int64_t out, const uint8_t* window)
+{
+    if (seek->header.pointCount == *capacity)
+    {
+        size_t newCapacity = *capacity == 0 ? 16 : *capacity * 2;
+        struct htc_seek_point* points = (struct htc_seek_point*)realloc(seek->points, newCapacity * sizeof(struct htc_seek_point));
+        if (points == NULL)
+        {
+            return false;
+        }
+        seek->points = points;
+        *capacity    = newCapacity;
+    }
+
+    struct htc_seek_point* point = &seek->points[seek->header.pointCount++];
+    memset(point, 0, sizeof(struct htc_seek_point) - HTC_SEEK_WINDOW);
+    point->in           = in;
+    point->out          = out;
+    point->bits         = strm->data_type & 7;
+    point->dictSize     = out < HTC_SEEK_WINDOW ? (uint32_t)out : HTC_SEEK_WINDOW;
+    /* resolved once the next record starts */
+    point->recordOffset = -1;
+
+    /* the window is circular, the oldest byte is the next one
+     * to be written, so the dictionary ends at the newest */
+    uint32_t left = strm->avail_out;
+    memcpy(point->window, window + HTC_SEEK_WINDOW - left, left);
+    memcpy(point->window + left, window, HTC_SEEK_WINDOW - left);
+    return true;
+}
+
+/* follows the record structure of the inflated data, pending points
+ * get the first record which starts at or after them */
+struct htc_seek_parser
+{
+    uint8_t  header[HTC_RECORD_HEADER_SIZE];
+    int32_t  headerFill;
+    int64_t  skip;
+    int64_t  position;
+    uint64_t pending;
+};
+
+static void htc_seek_parse(struct htc_seek* seek, struct htc_seek_parser* parser, const uint8_t* data, size_t size)
+{
+    while (size > 0)
+    {
+        size_t take;
+        if (parser->skip > 0)
+        {
+            take = parser->skip < (int64_t)size ? (size_t)parser->skip : size;
+            parser->skip -= take;
+        }
+        else
+        {
+            if (parser->headerFill == 0)
+            {
+                /* a record starts here */
+                while (parser->pending < seek->header.pointCount &&
+                       seek->points[parser->pending].out <= parser->position)
+                {
+                    seek->points[parser->pending].recordOffset = parser->position;
+                    seek->points[parser->pending].recordIndex  = seek->header.recordCount;
+                    parser->pending++;
+                }
+            }
+
+            take = HTC_RECORD_HEADER_SIZE - parser->headerFill;
+            take = take < size ? take : size;
+            memcpy(parser->header + parser->headerFill, data, take);
+            parser->headerFill += take;
+
+            if (parser->headerFill == HTC_RECORD_HEADER_SIZE)
+            {
+                uint32_t dataSize;
+                memcpy(&dataSize, parser->header + HTC_RECORD_HEADER_SIZE - sizeof(dataSize), sizeof(dataSize));
+                parser->skip       = dataSize;
+                parser->headerFill = 0;
+                seek->header.recordCount++;
+            }
+        }
+
+        data             += take;
+        size             -= take;
+        parser->position += take;
+    }
+}
+
+/* inflates the whole HTC file once and builds its seek index */
+static bool htc_seek_build(const char* htcFilename, struct htc_seek* seek)
+{
+    struct htc_seek_parser parser = {0};
+    z_stream strm = {0};
+    size_t capacity = 0;
+    int64_t in = 0, out = 0, last = 0;
+    uint8_t* input  = (uint8_t*)malloc(64 * 1024);
+    uint8_t* window = (uint8_t*)malloc(HTC_SEEK_WINDOW);
+    bool ret = false;
+    int zret = Z_OK;
+
+    memset(seek, 0, sizeof(struct htc_seek));
+    parser.skip = HTC_HEADER_SIZE;
+
+    int fd = open(htcFilename, O_RDONLY);
+    if (fd == -1)
+    {
+        fprintf(stderr, "%s: %s\n", htcFilename, strerror(errno));
+        free(input);
+        free(window);
+        return false;
+    }
+
+    /* 47 expects a gzip or zlib header */
+    if (input == NULL || window == NULL ||
+        !htc_seek_identity(fd, &seek->header.htcSize, &seek->header.crc, &seek->header.isize) ||
+        inflateInit2(&strm, 47) != Z_OK)
+    {
+        fprintf(stderr, "%s: failed to start indexing!\n", htcFilename);
+        free(input);
+        free(window);
+        close(fd);
+        return false;
+    }
+
+    strm.avail_out = HTC_SEEK_WINDOW;
+    strm.next_out  = window;
+    do
+    {
+        if (strm.avail_in == 0)
+        {
+            ssize_t length = pread(fd, input, 64 * 1024, in);
+            if (length <= 0)
+            {
+                fprintf(stderr, "%s: truncated gzip stream!\n", htcFilename);
+                goto out;
+            }
+            strm.avail_in = (uInt)length;
+            strm.next_in  = input;
+        }
+
+        if (strm.avail_out == 0)
+        {
+            strm.avail_out = HTC_SEEK_WINDOW;
+            strm.next_out  = window;
+        }
+
+        /* stop at the end of every block */
+        uInt availIn = strm.avail_in;
+        uInt availOut = strm.avail_out;
+        uint8_t* nextOut = strm.next_out;
+        zret = inflate(&strm, Z_BLOCK);
+        in  += availIn - strm.avail_in;
+        out += availOut - strm.avail_out;
+        /* no progress isn't an error, more input comes next */
+        if (zret != Z_OK && zret != Z_STREAM_END && zret != Z_BUF_ERROR)
+        {
+            fprintf(stderr, "%s: invalid gzip stream!\n", htcFilename);
+            goto out;
+        }
+
+        htc_seek_parse(seek, &parser, nextOut, availOut - strm.avail_out);
+
+        /* after the gzip header or a block which isn't the last one */
+        if ((strm.data_type & 192) == 128 &&
+            (seek->header.pointCount == 0 || (out - last) >= HTC_SEEK_SPAN))
+        {
+            if (!htc_seek_add_point(seek, &capacity, &strm, in, out, window))
+            {
+                fprintf(stderr, "%s: failed to allocate memory!\n", htcFilename);
+                goto out;
+            }
+            last = out;
+        }
+    } while (zret != Z_STREAM_END);
+
+    /* GLideN64 writes a single gzip member */
+    if (in != seek->header.htcSize)
+    {
+        fprintf(stderr, "%s: data after the gzip stream, can't be indexed!\n", htcFilename);
+        goto out;
+    }
+
+    /* points after the start of the last record */
+    for (uint64_t i = parser.pending; i < seek->header.pointCount; i++)
+    {
+        seek->points[i].recordOffset = out;
+        seek->points[i].recordIndex  = seek->header.recordCount;
+    }
+    seek->header.magic        = HTC_SEEK_MAGIC;
+    seek->header.version      = HTC_SEEK_VERSION;
+    seek->header.inflatedSize = out;
+    ret = true;
+out:
+    inflateEnd(&strm);
+    free(input);
+    free(window);
+    close(fd);
+    if (!ret)
+    {
+        htc_seek_free(seek);
+    }
+    return ret;
+}
+
+static bool htc_seek_write(const char* filename, const struct htc_seek* seek)
+{
+    char partFilename[PATH_MAX + 8];
+    bool ret = true;
+
+    snprintf(partFilename, sizeof(partFilename), "%s.part", filename);
+    FILE* file = fopen(partFilename, "wb");
+    if (file == NULL)
+    {
+        fprintf(stderr, "%s: %s\n", partFilename, strerror(errno));
+        return false;
+    }
+
+    ret &= fwrite(&seek->header, sizeof(seek->header), 1, file) == 1;
+    if (seek->header.pointCount > 0)
+    {
+        ret &= fwrite(seek->points, sizeof(struct htc_seek_point), seek->header.pointCount, file) == seek->header.pointCount;
+    }
+
+    ret &= fflush(file) == 0 && fsync(fileno(file)) == 0;
+    ret &= fclose(file) == 0;
+    if (!ret || rename(partFilename, filename) == -1)
+    {
+        fprintf(stderr, "%s: failed to write seek index!\n", filename);
+        unlink(partFilename);
+        return false;
+    }
+    return true;
+}
+
+/* checks the access points, so a corrupt seek index can't make
+ * inflate read past a window or segments overlap */
+static bool htc_seek_valid_points(const struct htc_seek_header* header, const struct htc_seek_point* points)
+{
+    for (uint64_t i = 0; i < header->pointCount; i++)
+    {
+        const struct htc_seek_point* point = &points[i];
+        if (point->dictSize > HTC_SEEK_WINDOW ||
+            point->bits < 0 || point->bits > 7 ||
+            point->in < 0 || point->in > header->htcSize ||
+            (point->bits != 0 && point->in == 0) ||
+            point->out < 0 || point->out > header->inflatedSize ||
+            point->recordOffset < point->out || point->recordOffset > header->inflatedSize ||
+            point->recordIndex < 0 || (uint64_t)point->recordIndex > header->recordCount)
+        {
+            return false;
+        }
+
+        if (i > 0)
+        {
+            const struct htc_seek_point* previous = &points[i - 1];
+            if (point->in <= previous->in ||
+                point->out <= previous->out ||
+                point->recordOffset < previous->recordOffset ||
+                point->recordIndex < previous->recordIndex)
+            {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+/* reads the seek index of the HTC file, returns false when
+ * there's none or when it belongs to a different HTC file */
+static bool htc_seek_read(const char* filename, int htcFd, struct htc_seek* seek)
+{
+    struct htc_seek_header header;
+    int64_t  size;
+    uint32_t crc, isize;
+    struct stat st;
+
+    memset(seek, 0, sizeof(struct htc_seek));
+
+    FILE* file = fopen(filename, "rb");
+    if (file == NULL)
+    {
+        return false;
+    }
+
+    if (fread(&header, sizeof(header), 1, file) != 1 ||
+        fstat(fileno(file), &st) == -1 ||
+        !htc_seek_identity(htcFd, &size, &crc, &isize) ||
+        header.magic != HTC_SEEK_MAGIC ||
+        header.version != HTC_SEEK_VERSION ||
+        header.htcSize != size || header.crc != crc || header.isize != isize ||
+        header.pointCount == 0 ||
+        (uint64_t)st.st_size != sizeof(header) + (header.pointCount * sizeof(struct htc_seek_point)))
+    {
+        fclose(file);
+        return false;
+    }
+
+    seek->points = (struct htc_seek_point*)malloc(header.pointCount * sizeof(struct htc_seek_point));
+    if (seek->points == NULL ||
+        fread(seek->points, sizeof(struct htc_seek_point), header.pointCount, file) != header.pointCount ||
+        !htc_seek_valid_points(&header, seek->points))
+    {
+        fclose(file);
+        htc_seek_free(seek);
+        return false;
+    }
+
+    fclose(file);
+    seek->header = header;
+    return true;
+}
+
+/* starts inflating at an access point */
+static bool htc_seek_reader_open(struct htc_seek_reader* reader, int fd, const struct htc_seek_point* point)
+{
+    uint8_t byte = 0;
+
+    memset(&reader->strm, 0, sizeof(reader->strm));
+    reader->fd  = fd;
+    reader->in  = point->in;
+    reader->end = false;
+
+    /* the bits of the block which are in the byte before it */
+    if (point->bits != 0 && !pread_full(fd, &byte, 1, point->in - 1))
+    {
+        return false;
+    }
+
+    if (inflateInit2(&reader->strm, -15) != Z_OK)
+    {
+        return false;
+    }
+    if ((point->bits != 0 && inflatePrime(&reader->strm, point->bits, byte >> (8 - point->bits)) != Z_OK) ||
+        inflateSetDictionary(&reader->strm, point->window + HTC_SEEK_WINDOW - point->dictSize, point->dictSize) != Z_OK)
+    {
+        inflateEnd(&reader->strm);
+        return false;
+    }
+    return true;
+}
+
+/* returns how many bytes were read, which is less than size at
+ * the end of the stream, or -1 when the stream is invalid */
+static int64_t htc_seek_reader_read(struct htc_seek_reader* reader, void* buffer, size_t size)
+{
+    reader->strm.next_out  = (Bytef*)buffer;
+    reader->strm.avail_out = (uInt)size;
+
+    while (reader->strm.avail_out > 0 && !reader->end)
+    {
+        if (reader->strm.avail_in == 0)
+        {
+            ssize_t length = pread(reader->fd, reader->input, sizeof(reader->input), reader->in);
+            if (length <= 0)
+            {
+                return -1;
+            }
+            reader->in           += length;
+            reader->strm.next_in  = reader->input;
+            reader->strm.avail_in = (uInt)length;
+        }
+
+        int ret = inflate(&reader->strm, Z_NO_FLUSH);
+        if (ret == Z_STREAM_END)
+        {
+            reader->end = true;
+        }
+        else if (ret != Z_OK && ret != Z_BUF_ERROR)
+        {
+            return -1;
+        }
+    }
+
+    return size - reader->strm.avail_out;
+}
+
+static bool htc_seek_reader_skip(struct htc_seek_reader* reader, int64_t size)
+{
+    uint8_t buffer[16 * 1024];
+    while (size > 0)
+    {
+        size_t length = size < (int64_t)sizeof(buffer) ? (size_t)size : sizeof(buffer);
+        if (htc_seek_reader_read(reader, buffer, length) != (int64_t)length)
+        {
+            return false;
+        }
+        size -= length;
+    }
+    return true;
+}
+
+static void htc_seek_reader_close(struct htc_seek_reader* reader)
+{
+    inflateEnd(&reader->strm);
+}
+
+#endif /* HTCSEEK_H */
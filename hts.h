@@ -0,0 +1,628 @@
+/*
+ * texturepack_utils - https://github.com/Rosalie241/texturepack_utils
+ *  Copyright (C) 2023 Rosalie Wanders <rosalie@mailbox.org>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 3.
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef HTS_H
+#define HTS_H
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif /* _GNU_SOURCE */
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <zlib.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif /* __linux__ */
+
+#define UNDEFINED_1            0x08000000
+#define TXCACHE_FORMAT_VERSION UNDEFINED_1
+
+#define GL_TEXFMT_GZ 0x80000000
+
+/* HTS config values */
+#define HTS_CONFIG_UNCOMPRESSED 1075970048
+#define HTS_CONFIG_COMPRESSED   1084358656
+
+/* GL formats used by GLideN64 */
+#define GL_RGB                    0x1907
+#define GL_RGBA                   0x1908
+#define GL_UNSIGNED_BYTE          0x1401
+#define GL_UNSIGNED_SHORT_4_4_4_4 0x8033
+#define GL_UNSIGNED_SHORT_5_5_5_1 0x8034
+#define GL_UNSIGNED_SHORT_5_6_5   0x8363
+#define GL_RGBA4                  0x8056
+#define GL_RGB5_A1                0x8057
+#define GL_RGBA8                  0x8058
+#define GL_RGB565                 0x8D62
+
+typedef struct
+{
+    union
+    {
+        uint16_t _formatsize;
+        struct
+        {
+            uint8_t _format;
+            uint8_t _size;
+        };
+    };
+} N64FormatSize;
+
+union StorageOffset
+{
+    struct {
+        int64_t _offset : 48;
+        int64_t _formatsize : 16;
+    };
+    int64_t _data;
+};
+
+struct GHQTexInfo
+{
+    uint8_t*      data;
+    int32_t       width;
+    int32_t       height;
+    uint32_t      format;
+    uint16_t      texture_format;
+    uint16_t      pixel_type;
+    uint8_t       is_hires_tex;
+    N64FormatSize n64_format_size;
+    uint32_t      dataSize;
+};
+
+#define FREAD(x) fread(&x, sizeof(x), 1, file)
+#define FWRITE(x) fwrite(&x, sizeof(x), 1, file);
+#ifdef _WIN32
+#define FSEEK(x, y, z) _fseeki64(x, y, z)
+#define FTELL(x) _ftelli64(x)
+#else
+#define FSEEK(x, y, z) fseek(x, y, z)
+#define FTELL(x) ftell(x)
+#endif
+
+/* returns the size of a pixel in bytes,
+ * or 0 when the pixel format is unsupported */
+static int32_t texture_pixel_size(struct GHQTexInfo* info)
+{
+    switch (info->pixel_type)
+    {
+    case GL_UNSIGNED_BYTE:
+        return info->texture_format == GL_RGBA ? 4 : 0;
+    case GL_UNSIGNED_SHORT_4_4_4_4:
+    case GL_UNSIGNED_SHORT_5_5_5_1:
+    case GL_UNSIGNED_SHORT_5_6_5:
+        return 2;
+    default:
+        return 0;
+    }
+}
+
+/* returns the size of the uncompressed texture data,
+ * or 0 when the pixel format is unsupported */
+static size_t texture_inflated_size(struct GHQTexInfo* info)
+{
+    return (size_t)info->width * info->height * texture_pixel_size(info);
+}
+
+/* compresses the texture with the given zlib level, returns false and
+ * leaves the texture alone when that fails or doesn't make it smaller */
+static bool compress_texture(struct GHQTexInfo* info, int level)
+{
+    uLongf destLen = compressBound(info->dataSize);
+    void*  dest    = malloc(destLen);
+    if (dest == NULL)
+    {
+        return false;
+    }
+
+    if (compress2((unsigned char*)dest, &destLen, info->data, info->dataSize, level) != Z_OK ||
+        destLen >= info->dataSize)
+    {
+        free(dest);
+        return false;
+    }
+
+    free(info->data);
+    info->dataSize = destLen;
+    info->data     = (uint8_t*)dest;
+    info->format  |= GL_TEXFMT_GZ;
+    return true;
+}
+
+static bool decompress_texture(struct GHQTexInfo* info)
+{
+    void* dest     = NULL;
+    uLongf destLen = texture_inflated_size(info);
+    int ret        = 0;
+
+    /* unknown pixel formats have to guess */
+    if (destLen == 0)
+    {
+        destLen = info->dataSize * 2;
+    }
+
+    do
+    {
+        dest = realloc(dest, destLen);
+        if (dest == NULL)
+        {
+            return false;
+        }
+
+        ret = uncompress((unsigned char*)dest, &destLen, info->data, info->dataSize);
+        if (ret == Z_BUF_ERROR)
+        { /* increase buffer size as needed */
+            destLen = destLen + destLen;
+        }
+        else if (ret != Z_OK)
+        {
+            return false;
+        }
+    } while (ret == Z_BUF_ERROR);
+
+    free(info->data);
+    info->data     = (uint8_t*)dest;
+    info->dataSize = destLen;
+    info->format  &= ~GL_TEXFMT_GZ;
+    return true;
+}
+
+static bool read_info_data(FILE* file, struct GHQTexInfo* info)
+{
+    info->data = (uint8_t*)malloc(info->dataSize);
+    if (info->data == NULL)
+    {
+        return false;
+    }
+
+    fread(info->data, info->dataSize, 1, file);
+    return true;
+}
+
+static bool read_info(FILE* file, bool oldFormat, struct GHQTexInfo* info, bool readData)
+{
+    FREAD(info->width);
+    FREAD(info->height);
+    FREAD(info->format);
+    FREAD(info->texture_format);
+    FREAD(info->pixel_type);
+    FREAD(info->is_hires_tex);
+    if (!oldFormat)
+    {
+        FREAD(info->n64_format_size._formatsize);
+    }
+    FREAD(info->dataSize);
+
+    if (readData)
+    {
+        return read_info_data(file, info);
+    }
+    return true;
+}
+
+static void write_info_header(FILE* file, bool oldFormat, struct GHQTexInfo* info)
+{
+    FWRITE(info->width);
+    FWRITE(info->height);
+    FWRITE(info->format);
+    FWRITE(info->texture_format);
+    FWRITE(info->pixel_type);
+    FWRITE(info->is_hires_tex);
+    if (!oldFormat)
+    {
+        FWRITE(info->n64_format_size._formatsize);
+    }
+    FWRITE(info->dataSize);
+}
+
+static bool copy_payload(FILE* file, int64_t offset, FILE* outputFile, int64_t size)
+{
+    int64_t copied = 0;
+
+    /* make sure everything we've written so far
+     * has reached the file descriptor */
+    if (fflush(outputFile) != 0)
+    {
+        return false;
+    }
+
+#ifdef __linux__
+    int   fd        = fileno(file);
+    int   outputFd  = fileno(outputFile);
+    off_t inputPos  = offset;
+    off_t outputPos = lseek(outputFd, 0, SEEK_CUR);
+    /* copy_file_range() doesn't support pipes */
+    bool  useSendfile = (outputPos == -1);
+
+    /* let the kernel copy the payload, this avoids
+     * bouncing the data through userspace */
+    while (!useSendfile && copied < size)
+    {
+        ssize_t ret = copy_file_range(fd, &inputPos, outputFd, NULL, size - copied, 0);
+        if (ret <= 0)
+        {
+            /* cross-filesystem copies or older kernels */
+            useSendfile = (ret == -1 && 
+                            (errno == EXDEV || errno == ENOSYS || 
+                             errno == EINVAL || errno == EOPNOTSUPP));
+            break;
+        }
+        copied += ret;
+    }
+
+    while (useSendfile && copied < size)
+    {
+        ssize_t ret = sendfile(outputFd, fd, &inputPos, size - copied);
+        if (ret <= 0)
+        {
+            break;
+        }
+        copied += ret;
+    }
+
+    /* the file descriptor has moved on without
+     * the stream, so resynchronize them */
+    if (outputPos != -1)
+    {
+        FSEEK(outputFile, outputPos + copied, SEEK_SET);
+    }
+#endif /* __linux__ */
+
+    /* fall back to a read/write loop */
+    if (copied < size)
+    {
+        const size_t bufferSize = 1024 * 1024;
+        uint8_t* buffer = (uint8_t*)malloc(bufferSize);
+        if (buffer == NULL)
+        {
+            return false;
+        }
+
+        FSEEK(file, offset + copied, SEEK_SET);
+        while (copied < size)
+        {
+            size_t chunkSize = (size - copied) < (int64_t)bufferSize ? (size_t)(size - copied) : bufferSize;
+            if (fread(buffer, chunkSize, 1, file) != 1 ||
+                fwrite(buffer, chunkSize, 1, outputFile) != 1)
+            {
+                free(buffer);
+                return false;
+            }
+            copied += chunkSize;
+        }
+        free(buffer);
+    }
+
+    return true;
+}
+
+static int32_t info_header_size(bool oldFormat)
+{
+    int32_t size = sizeof(int32_t) +  /* width */
+                   sizeof(int32_t) +  /* height */
+                   sizeof(uint32_t) + /* format */
+                   sizeof(uint16_t) + /* texture_format */
+                   sizeof(uint16_t) + /* pixel_type */
+                   sizeof(uint8_t) +  /* is_hires_tex */
+                   sizeof(uint32_t);  /* dataSize */
+    if (!oldFormat)
+    {
+        size += sizeof(uint16_t); /* n64_format_size */
+    }
+    return size;
+}
+
+static bool check_header(FILE* file, bool* oldFormat, bool* compressed)
+{
+	int32_t header    = -1;
+	int32_t version   = -1;
+
+	/* determine HTS format */
+    FREAD(version);
+    if (version == TXCACHE_FORMAT_VERSION)
+    {
+        FREAD(header);
+        *oldFormat = false;
+    }
+    else
+    {
+        header = version;
+        *oldFormat = true;
+    }
+    
+    if (/* uncompressed HTS */
+        header != HTS_CONFIG_UNCOMPRESSED &&
+        /* compressed HTS */
+        header != HTS_CONFIG_COMPRESSED)
+    {
+        fprintf(stderr, "Error: expected header = 1075970048 or 1084358656\n");
+        fprintf(stderr, "Error: got header %i\n", header);
+        return false;
+    }
+
+    if (compressed != NULL)
+    {
+    	*compressed = (header == HTS_CONFIG_COMPRESSED);
+    }
+
+    return true;
+}
+
+struct HtsMappingEntry
+{
+    uint64_t            checksum;
+    union StorageOffset offset;
+};
+
+/* reads the mapping offset which follows the header and the mapping,
+ * entries has to be freed, returns false when the mapping doesn't fit
+ * in the file */
+static bool read_hts_mapping(FILE* file, int64_t* mappingOffset, struct HtsMappingEntry** entries, int32_t* count)
+{
+    int64_t fileSize = -1;
+    int64_t offset   = -1;
+    int32_t size     = -1;
+
+    *entries = NULL;
+    *count   = 0;
+
+    if (FREAD(offset) != 1 ||
+        FSEEK(file, 0, SEEK_END) != 0 || (fileSize = FTELL(file)) < 0 ||
+        offset < 0 || offset >= fileSize ||
+        FSEEK(file, offset, SEEK_SET) != 0 || FREAD(size) != 1 ||
+        size < 0 || (fileSize - offset - 4) / 16 < size)
+    {
+        fprintf(stderr, "Error: invalid mapping offset or size\n");
+        return false;
+    }
+
+    struct HtsMappingEntry* mapping = (struct HtsMappingEntry*)malloc(((size_t)size + 1) * sizeof(struct HtsMappingEntry));
+    if (mapping == NULL)
+    {
+        fprintf(stderr, "Error: failed to allocate memory for the mapping\n");
+        return false;
+    }
+
+    for (int32_t i = 0; i < size; i++)
+    {
+        if (FREAD(mapping[i].checksum) != 1 || FREAD(mapping[i].offset._data) != 1)
+        {
+            fprintf(stderr, "Error: failed to read mapping\n");
+            free(mapping);
+            return false;
+        }
+    }
+
+    *mappingOffset = offset;
+    *entries       = mapping;
+    *count         = size;
+    return true;
+}
+
+static bool pread_full(int fd, void* buffer, size_t size, int64_t offset)
+{
+    uint8_t* data = (uint8_t*)buffer;
+    while (size > 0)
+    {
+        ssize_t ret = pread(fd, data, size, offset);
+        if (ret <= 0)
+        {
+            return false;
+        }
+        data   += ret;
+        size   -= ret;
+        offset += ret;
+    }
+    return true;
+}
+
+static bool pwrite_full(int fd, const void* buffer, size_t size, int64_t offset)
+{
+    const uint8_t* data = (const uint8_t*)buffer;
+    while (size > 0)
+    {
+        ssize_t ret = pwrite(fd, data, size, offset);
+        if (ret == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (ret <= 0)
+        {
+            return false;
+        }
+        data   += ret;
+        size   -= ret;
+        offset += ret;
+    }
+    return true;
+}
+
+/* reads the texture data of the texture at offset,
+ * info has to contain the texture header already */
+static bool pread_info_data(int fd, int64_t offset, bool oldFormat, struct GHQTexInfo* info)
+{
+    info->data = (uint8_t*)malloc(info->dataSize);
+    if (info->data == NULL)
+    {
+        return false;
+    }
+
+    if (!pread_full(fd, info->data, info->dataSize, offset + info_header_size(oldFormat)))
+    {
+        free(info->data);
+        info->data = NULL;
+        return false;
+    }
+    return true;
+}
+
+/* parses a texture header which is already in memory,
+ * header has to hold info_header_size() bytes */
+static void parse_info_header(const uint8_t* header, bool oldFormat, struct GHQTexInfo* info)
+{
+    const uint8_t* ptr = header;
+
+#define PREAD(x) memcpy(&x, ptr, sizeof(x)); ptr += sizeof(x)
+    PREAD(info->width);
+    PREAD(info->height);
+    PREAD(info->format);
+    PREAD(info->texture_format);
+    PREAD(info->pixel_type);
+    PREAD(info->is_hires_tex);
+    if (!oldFormat)
+    {
+        PREAD(info->n64_format_size._formatsize);
+    }
+    PREAD(info->dataSize);
+#undef PREAD
+
+    info->data = NULL;
+}
+
+/* the opposite of parse_info_header(),
+ * header has to hold info_header_size() bytes */
+static void build_info_header(uint8_t* header, bool oldFormat, const struct GHQTexInfo* info)
+{
+    uint8_t* ptr = header;
+
+#define PWRITE(x) memcpy(ptr, &x, sizeof(x)); ptr += sizeof(x)
+    PWRITE(info->width);
+    PWRITE(info->height);
+    PWRITE(info->format);
+    PWRITE(info->texture_format);
+    PWRITE(info->pixel_type);
+    PWRITE(info->is_hires_tex);
+    if (!oldFormat)
+    {
+        PWRITE(info->n64_format_size._formatsize);
+    }
+    PWRITE(info->dataSize);
+#undef PWRITE
+}
+
+/* same as read_info() but doesn't use or move the file position,
+ * so it can be used by multiple threads on the same file */
+static bool pread_info(int fd, int64_t offset, bool oldFormat, struct GHQTexInfo* info, bool readData)
+{
+    uint8_t header[32];
+    int32_t headerSize = info_header_size(oldFormat);
+
+    if (!pread_full(fd, header, headerSize, offset))
+    {
+        return false;
+    }
+
+    parse_info_header(header, oldFormat, info);
+    if (readData)
+    {
+        return pread_info_data(fd, offset, oldFormat, info);
+    }
+    return true;
+}
+
+/* expands a 16-bit pixel to RGBA8 the same way the GPU does */
+static void unpack_pixel(uint16_t pixel_type, uint16_t pixel, uint8_t* rgba)
+{
+    uint32_t r, g, b;
+    switch (pixel_type)
+    {
+    case GL_UNSIGNED_SHORT_4_4_4_4:
+        rgba[0] = ((pixel >> 12) & 0xf) * 17;
+        rgba[1] = ((pixel >> 8) & 0xf) * 17;
+        rgba[2] = ((pixel >> 4) & 0xf) * 17;
+        rgba[3] = (pixel & 0xf) * 17;
+        break;
+    case GL_UNSIGNED_SHORT_5_5_5_1:
+        r = (pixel >> 11) & 0x1f;
+        g = (pixel >> 6) & 0x1f;
+        b = (pixel >> 1) & 0x1f;
+        rgba[0] = (r << 3) | (r >> 2);
+        rgba[1] = (g << 3) | (g >> 2);
+        rgba[2] = (b << 3) | (b >> 2);
+        rgba[3] = (pixel & 0x1) ? 0xff : 0;
+        break;
+    case GL_UNSIGNED_SHORT_5_6_5:
+        r = (pixel >> 11) & 0x1f;
+        g = (pixel >> 5) & 0x3f;
+        b = pixel & 0x1f;
+        rgba[0] = (r << 3) | (r >> 2);
+        rgba[1] = (g << 2) | (g >> 4);
+        rgba[2] = (b << 3) | (b >> 2);
+        rgba[3] = 0xff;
+        break;
+    }
+}
+
+/* packs an RGBA8 pixel into a 16-bit pixel, rounding to nearest */
+static uint16_t pack_pixel(uint16_t pixel_type, const uint8_t* rgba)
+{
+#define SCALE(x, max) (((uint32_t)(x) * (max) + 127) / 255)
+    switch (pixel_type)
+    {
+    case GL_UNSIGNED_SHORT_4_4_4_4:
+        return (SCALE(rgba[0], 15) << 12) | (SCALE(rgba[1], 15) << 8) |
+               (SCALE(rgba[2], 15) << 4) | SCALE(rgba[3], 15);
+    case GL_UNSIGNED_SHORT_5_5_5_1:
+        return (SCALE(rgba[0], 31) << 11) | (SCALE(rgba[1], 31) << 6) |
+               (SCALE(rgba[2], 31) << 1) | (rgba[3] >= 0x80 ? 1 : 0);
+    case GL_UNSIGNED_SHORT_5_6_5:
+        return (SCALE(rgba[0], 31) << 11) | (SCALE(rgba[1], 63) << 5) |
+               SCALE(rgba[2], 31);
+    default:
+        return 0;
+    }
+#undef SCALE
+}
+
+/* converts the (uncompressed) texture data to RGBA8,
+ * dest must be able to hold width * height * 4 bytes */
+static void texture_to_rgba8(struct GHQTexInfo* info, uint8_t* dest)
+{
+    int32_t pixels = info->width * info->height;
+
+    if (info->pixel_type == GL_UNSIGNED_BYTE)
+    {
+        memcpy(dest, info->data, pixels * 4);
+        return;
+    }
+
+    for (int32_t i = 0; i < pixels; i++)
+    {
+        uint16_t pixel;
+        memcpy(&pixel, info->data + (i * 2), sizeof(pixel));
+        unpack_pixel(info->pixel_type, pixel, dest + (i * 4));
+    }
+}
+
+/* converts RGBA8 pixels to the given pixel type,
+ * dest must be able to hold pixels * pixel size bytes */
+static void texture_from_rgba8(const uint8_t* src, int32_t pixels, uint16_t pixel_type, uint8_t* dest)
+{
+    if (pixel_type == GL_UNSIGNED_BYTE)
+    {
+        memcpy(dest, src, pixels * 4);
+        return;
+    }
+
+    for (int32_t i = 0; i < pixels; i++)
+    {
+        uint16_t pixel = pack_pixel(pixel_type, src + (i * 4));
+        memcpy(dest + (i * 2), &pixel, sizeof(pixel));
+    }
+}
+
+#undef FREAD
+#undef FWRITE
+
+#endif /* HTS_H */
@@ -0,0 +1,459 @@
+/*
+ * texturepack_utils - https://github.com/Rosalie241/texturepack_utils
+ *  Copyright (C) 2023 Rosalie Wanders <rosalie@mailbox.org>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 3.
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef _WIN32
+#include <linux/limits.h>
+#endif /* _WIN32 */
+#include "hts.h"
+#include "batch.h"
+#include "budget.h"
+#include "trace.h"
+#include <vector>
+#include <algorithm>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif /* __SSE2__ */
+
+/* maximum amount of textures processed in parallel
+ * before they're written to the output file */
+#define BATCH_SIZE 256
+
+struct LiteJob
+{
+    int                   fd;
+    bool                  oldFormat;
+    int32_t               scale;
+    int32_t               maxSize;
+    struct memory_budget* budget;
+};
+
+struct LiteEntry
+{
+    const struct LiteJob* job;
+    uint64_t            checksum;
+    union StorageOffset offset;
+    struct GHQTexInfo   info;
+    /* memory taken from the budget */
+    uint64_t            memorySize;
+    bool                failed;
+};
+
+/* averages 2x2 blocks of RGBA8 pixels from row0 and row1 into out */
+static void downscale_row(const uint8_t* row0, const uint8_t* row1, uint8_t* out, int32_t outWidth)
+{
+    int32_t x = 0;
+
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i two  = _mm_set1_epi16(2);
+
+    /* 8 input pixels per row result in 4 output pixels */
+    for (; x + 4 <= outWidth; x += 4)
+    {
+        __m128i a0 = _mm_loadu_si128((const __m128i*)(row0 + (x * 8)));
+        __m128i a1 = _mm_loadu_si128((const __m128i*)(row0 + (x * 8) + 16));
+        __m128i b0 = _mm_loadu_si128((const __m128i*)(row1 + (x * 8)));
+        __m128i b1 = _mm_loadu_si128((const __m128i*)(row1 + (x * 8) + 16));
+
+        /* vertical sums, 2 pixels per register */
+        __m128i s0 = _mm_add_epi16(_mm_unpacklo_epi8(a0, zero), _mm_unpacklo_epi8(b0, zero));
+        __m128i s1 = _mm_add_epi16(_mm_unpackhi_epi8(a0, zero), _mm_unpackhi_epi8(b0, zero));
+        __m128i s2 = _mm_add_epi16(_mm_unpacklo_epi8(a1, zero), _mm_unpacklo_epi8(b1, zero));
+        __m128i s3 = _mm_add_epi16(_mm_unpackhi_epi8(a1, zero), _mm_unpackhi_epi8(b1, zero));
+
+        /* horizontal sums of neighbouring pixels */
+        __m128i h0 = _mm_add_epi16(_mm_unpacklo_epi64(s0, s1), _mm_unpackhi_epi64(s0, s1));
+        __m128i h1 = _mm_add_epi16(_mm_unpacklo_epi64(s2, s3), _mm_unpackhi_epi64(s2, s3));
+
+        h0 = _mm_srli_epi16(_mm_add_epi16(h0, two), 2);
+        h1 = _mm_srli_epi16(_mm_add_epi16(h1, two), 2);
+
+        _mm_storeu_si128((__m128i*)(out + (x * 4)), _mm_packus_epi16(h0, h1));
+    }
+#endif /* __SSE2__ */
+
+    for (; x < outWidth; x++)
+    {
+        for (int32_t c = 0; c < 4; c++)
+        {
+            out[(x * 4) + c] = (row0[(x * 8) + c] + row0[(x * 8) + 4 + c] +
+                                row1[(x * 8) + c] + row1[(x * 8) + 4 + c] + 2) / 4;
+        }
+    }
+}
+
+/* halves the dimensions of an RGBA8 image using a box filter,
+ * odd dimensions drop the last row/column, a dimension of 1 stays 1 */
+static void downscale_rgba8(const uint8_t* src, int32_t width, int32_t height,
+                            uint8_t* dest, int32_t* outWidth, int32_t* outHeight)
+{
+    int32_t newWidth  = std::max(width / 2, 1);
+    int32_t newHeight = std::max(height / 2, 1);
+
+    for (int32_t y = 0; y < newHeight; y++)
+    {
+        const uint8_t* row0 = src + ((size_t)std::min(y * 2, height - 1) * width * 4);
+        const uint8_t* row1 = src + ((size_t)std::min((y * 2) + 1, height - 1) * width * 4);
+        uint8_t* out = dest + ((size_t)y * newWidth * 4);
+
+        if (width > 1)
+        {
+            downscale_row(row0, row1, out, newWidth);
+        }
+        else
+        {
+            for (int32_t c = 0; c < 4; c++)
+            {
+                out[c] = (row0[c] + row1[c] + 1) / 2;
+            }
+        }
+    }
+
+    *outWidth  = newWidth;
+    *outHeight = newHeight;
+}
+
+static bool downscale_texture(struct GHQTexInfo* info, int32_t scale, int32_t maxSize)
+{
+    bool compressed = (info->format & GL_TEXFMT_GZ) != 0;
+    int32_t pixelSize = 0;
+    uint64_t start = 0;
+
+    if (compressed)
+    {
+        start = trace_begin();
+        if (!decompress_texture(info))
+        {
+            return false;
+        }
+        trace_end("inflate", start, info->dataSize);
+    }
+
+    pixelSize = texture_pixel_size(info);
+    if (pixelSize == 0)
+    {
+        fprintf(stderr, "Warning: unsupported pixel type 0x%04X, keeping texture as-is\n", info->pixel_type);
+    }
+    else if ((size_t)info->width * info->height * pixelSize > info->dataSize)
+    {
+        fprintf(stderr, "Error: texture data is smaller than its dimensions\n");
+        return false;
+    }
+    else
+    {
+        start = trace_begin();
+
+        int32_t width  = info->width;
+        int32_t height = info->height;
+        uint8_t* pixels  = (uint8_t*)malloc((size_t)width * height * 4);
+        uint8_t* scratch = (uint8_t*)malloc((size_t)std::max(width / 2, 1) * std::max(height / 2, 1) * 4);
+        if (pixels == NULL || scratch == NULL)
+        {
+            free(pixels);
+            free(scratch);
+            return false;
+        }
+
+        texture_to_rgba8(info, pixels);
+
+        /* halve until we've reached the requested scale and size */
+        for (int32_t factor = 1;
+             (width > 1 || height > 1) &&
+             (factor < scale || (maxSize > 0 && std::max(width, height) > maxSize));
+             factor *= 2)
+        {
+            downscale_rgba8(pixels, width, height, scratch, &width, &height);
+            std::swap(pixels, scratch);
+        }
+
+        info->width    = width;
+        info->height   = height;
+        info->dataSize = width * height * pixelSize;
+        texture_from_rgba8(pixels, width * height, info->pixel_type, info->data);
+
+        free(pixels);
+        free(scratch);
+
+        trace_end("convert", start, info->dataSize);
+    }
+
+    /* recompress when the input was compressed, store
+     * it uncompressed when that doesn't make it smaller */
+    if (compressed)
+    {
+        start = trace_begin();
+        /* textures which don't get smaller are stored uncompressed */
+        compress_texture(info, 1);
+        trace_end("deflate", start, info->dataSize);
+    }
+
+    return true;
+}
+
+/* returns how much memory downscale_texture() needs at most */
+static uint64_t texture_memory_size(struct GHQTexInfo* info)
+{
+    uint64_t pixels = (uint64_t)info->width * info->height;
+
+    /* the input, the inflated input, the RGBA8 pixels
+     * with their scratch buffer and the output */
+    return info->dataSize + (2 * texture_inflated_size(info)) + (pixels * 5);
+}
+
+static void process_entry(void* arg)
+{
+    struct LiteEntry* entry = (struct LiteEntry*)arg;
+    const struct LiteJob* job = entry->job;
+
+    trace_texture(entry->checksum, entry->info.width, entry->info.height);
+    uint64_t start = trace_begin();
+    entry->failed = !pread_info_data(job->fd, entry->offset._offset, job->oldFormat, &entry->info);
+    trace_end("read", start, entry->info.dataSize);
+
+    entry->failed = entry->failed || !downscale_texture(&entry->info, job->scale, job->maxSize);
+
+    /* only the output stays around until it's written */
+    uint64_t kept = entry->failed ? 0 : std::min<uint64_t>(entry->info.dataSize, entry->memorySize);
+    memory_budget_release(job->budget, entry->memorySize - kept);
+    entry->memorySize = kept;
+}
+
+int main(int argc, char** argv)
+{
+    const char* inputFilename  = NULL;
+    const char* outputFilename = NULL;
+    int32_t scale   = 1;
+    int32_t maxSize = 0;
+    int32_t threads = threadpool_default_threads();
+    uint64_t maxMemory = 0;
+    const char* traceFilename = NULL;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--scale") == 0 && (i + 1) < argc)
+        {
+            scale = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--max-size") == 0 && (i + 1) < argc)
+        {
+            maxSize = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-j") == 0 && (i + 1) < argc)
+        {
+            threads = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--trace") == 0 && (i + 1) < argc)
+        {
+            traceFilename = argv[++i];
+        }
+        else if (strcmp(argv[i], "--max-memory") == 0 && (i + 1) < argc)
+        {
+            if (!memory_budget_parse(argv[++i], &maxMemory))
+            {
+                fprintf(stderr, "Error: invalid memory size: %s\n", argv[i]);
+                return 1;
+            }
+        }
+        else if (inputFilename == NULL)
+        {
+            inputFilename = argv[i];
+        }
+        else if (outputFilename == NULL)
+        {
+            outputFilename = argv[i];
+        }
+    }
+
+    if (inputFilename == NULL || outputFilename == NULL ||
+        (scale != 1 && scale != 2 && scale != 4) || maxSize < 0 ||
+        (scale == 1 && maxSize == 0))
+    {
+        printf("Usage: %s [HTS FILE] [OUTPUT HTS FILE] [--scale 2|4] [--max-size PIXELS] [-j THREADS] [--max-memory SIZE] [--trace JSON FILE]\n", argv[0]);
+        return 1;
+    }
+
+    FILE* file = fopen(inputFilename, "rb");
+    if (file == NULL)
+    {
+        perror("fopen");
+        return 1;
+    }
+
+    bool oldFormat   = false;
+    bool compression = false;
+    if (!check_header(file, &oldFormat, &compression))
+    {
+        fclose(file);
+        return 1;
+    }
+
+    int64_t mappingOffset = -1;
+    int32_t mappingSize   = -1;
+    struct HtsMappingEntry* mapping = NULL;
+    if (!read_hts_mapping(file, &mappingOffset, &mapping, &mappingSize))
+    {
+        fclose(file);
+        return 1;
+    }
+
+    std::vector<LiteEntry> entries(mappingSize);
+    for (int32_t i = 0; i < mappingSize; i++)
+    {
+        entries[i].checksum = mapping[i].checksum;
+        entries[i].offset   = mapping[i].offset;
+    }
+    free(mapping);
+
+    /* read the input front to back */
+    std::sort(entries.begin(), entries.end(), [](const LiteEntry& a, const LiteEntry& b)
+    {
+        return a.offset._offset < b.offset._offset;
+    });
+
+    FILE* outputFile = fopen(outputFilename, "wb");
+    if (outputFile == NULL)
+    {
+        perror("fopen");
+        fclose(file);
+        return 1;
+    }
+
+    int header = TXCACHE_FORMAT_VERSION;
+    int config = compression ? HTS_CONFIG_COMPRESSED : HTS_CONFIG_UNCOMPRESSED;
+    int64_t inputSize  = 0;
+    int64_t outputSize = 0;
+    int32_t failed     = 0;
+
+#define FWRITE(x) fwrite(&x, sizeof(x), 1, outputFile);
+    // write header and dummy mapping offset
+    if (!oldFormat)
+    {
+        FWRITE(header);
+    }
+    FWRITE(config);
+    mappingOffset = 0;
+    FWRITE(mappingOffset);
+
+    if (traceFilename != NULL && !trace_open(traceFilename, "hts2lite"))
+    {
+        fclose(file);
+        fclose(outputFile);
+        remove(outputFilename);
+        return 1;
+    }
+
+    memory_budget_init_malloc(maxMemory);
+
+    struct memory_budget budget;
+    memory_budget_init(&budget, maxMemory);
+
+    struct LiteJob job = { fileno(file), oldFormat, scale, maxSize, &budget };
+    struct threadpool* pool = threadpool_create(threads);
+    if (pool == NULL)
+    {
+        fprintf(stderr, "Error: failed to create thread pool\n");
+        trace_close();
+        fclose(file);
+        fclose(outputFile);
+        remove(outputFilename);
+        return 1;
+    }
+
+    printf("-> Processing %s...\n", inputFilename);
+
+    for (size_t start = 0, end = 0; start < entries.size(); start = end)
+    {
+        /* admit textures until the batch is full or the memory
+         * budget is used up, the batch has to be written out
+         * before its memory can be used again */
+        for (end = start; end < entries.size() && (end - start) < BATCH_SIZE; end++)
+        {
+            struct LiteEntry* entry = &entries[end];
+            entry->job        = &job;
+            entry->memorySize = 0;
+            if (!pread_info(job.fd, entry->offset._offset, oldFormat, &entry->info, false))
+            {
+                entry->failed = true;
+                continue;
+            }
+
+            entry->memorySize = texture_memory_size(&entry->info);
+            if (!memory_budget_try_acquire(&budget, entry->memorySize))
+            {
+                break;
+            }
+            threadpool_submit(pool, process_entry, entry);
+        }
+        threadpool_wait(pool);
+
+        /* write the batch in order */
+        for (size_t i = start; i < end; i++)
+        {
+            struct LiteEntry* entry = &entries[i];
+            if (entry->failed)
+            {
+                fprintf(stderr, "Error: failed to downscale texture %016llX\n", (unsigned long long)entry->checksum);
+                free(entry->info.data);
+                failed++;
+                continue;
+            }
+
+            trace_texture(entry->checksum, entry->info.width, entry->info.height);
+            uint64_t start = trace_begin();
+
+            entry->offset._offset = FTELL(outputFile);
+            write_info_header(outputFile, oldFormat, &entry->info);
+            fwrite(entry->info.data, entry->info.dataSize, 1, outputFile);
+
+            trace_end("write", start, entry->info.dataSize);
+
+            free(entry->info.data);
+            entry->info.data = NULL;
+            memory_budget_release(&budget, entry->memorySize);
+        }
+
+        printf("-> [%zu/%zu]\n", end, entries.size());
+    }
+
+    threadpool_destroy(pool);
+    trace_close();
+    memory_budget_report(stdout, &budget);
+    memory_budget_destroy(&budget);
+
+    printf("-> Writing header and mappings...\n");
+
+    mappingOffset = FTELL(outputFile);
+    mappingSize   = (int32_t)(entries.size() - failed);
+
+    FWRITE(mappingSize);
+    for (auto& entry : entries)
+    {
+        if (!entry.failed)
+        {
+            FWRITE(entry.checksum);
+            FWRITE(entry.offset._data);
+        }
+    }
+
+    // write correct mapping offset
+    FSEEK(outputFile, oldFormat ? sizeof(config) : sizeof(header) + sizeof(config), SEEK_SET);
+    FWRITE(mappingOffset);
+#undef FWRITE
+
+    FSEEK(file, 0, SEEK_END);
+    inputSize = FTELL(file);
+    FSEEK(outputFile, 0, SEEK_END);
+    outputSize = FTELL(outputFile);
+
+    printf("-> %s: %lld bytes -> %lld bytes\n", outputFilename, (long long)inputSize, (long long)outputSize);
+
+    fclose(file);
+    fclose(outputFile);
+    return failed == 0 ? 0 : 1;
+}
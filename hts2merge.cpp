@@ -11,527 +11,785 @@
 #ifndef _WIN32
 #include <linux/limits.h>
 #endif /* _WIN32 */
-#include <png.h>
-#include <stdio.h>
-#include <stdbool.h>
-#include <stdint.h>
-#include <stdlib.h>
+#include "hts.h"
+#include "batch.h"
+#include "budget.h"
+#include "trace.h"
+#include "index.h"
+#include "htsi.h"
 #include <sys/stat.h>
-#include <string.h>
-#include <unistd.h>
 #include <libgen.h>
-#include <zlib.h>
-#include <unordered_map>
+#include <vector>
+#include <algorithm>
 
-#define UNDEFINED_1            0x08000000
-#define TXCACHE_FORMAT_VERSION UNDEFINED_1
+#define FREAD(x) fread(&x, sizeof(x), 1, file)
+#define FWRITE(x) fwrite(&x, sizeof(x), 1, file);
 
-#define GL_TEXFMT_GZ 0x80000000
+struct MergeInput
+{
+    FILE*       file;
+    const char* filename;
+    bool        oldFormat;
+};
 
-typedef struct
+struct MergeEntry
 {
-    union
-    {
-        uint16_t _formatsize;
-        struct
-        {
-            uint8_t _format;
-            uint8_t _size;
-        };
-    };
-} N64FormatSize;
+    uint64_t           checksum;
+    union StorageOffset offset;
+    /* where the payload comes from,
+     * input == -1 means the staging file */
+    int32_t            input;
+    int64_t            payloadOffset;
+    int64_t            outputOffset;
+    struct GHQTexInfo  info;
+};
+
+/* textures up to SMALL and MEDIUM bytes (uncompressed)
+ * get the level of their size class */
+#define SIZE_CLASS_SMALL  (64 * 1024)
+#define SIZE_CLASS_MEDIUM (1024 * 1024)
+#define SIZE_CLASS_COUNT  3
+
+/* large textures are sampled before compressing them */
+#define SAMPLE_THRESHOLD  SIZE_CLASS_MEDIUM
+#define SAMPLE_CHUNK_SIZE (16 * 1024)
+#define SAMPLE_CHUNKS     4
 
-union StorageOffset
+static const char* sizeClassNames[SIZE_CLASS_COUNT] = { "small", "medium", "large" };
+
+struct CompressionPolicy
 {
-    struct {
-        int64_t _offset : 48;
-        int64_t _formatsize : 16;
-    };
-    int64_t _data;
+    /* zlib level per size class, 0 stores them uncompressed */
+    int32_t levels[SIZE_CLASS_COUNT];
+    /* compressed data has to be at most this many
+     * percent of the raw data, otherwise it's stored raw */
+    int32_t maxRatio;
 };
 
-struct GHQTexInfo
+enum CompressionDecision
 {
-    uint8_t*      data;
-    int32_t       width;
-    int32_t       height;
-    uint32_t      format;
-    uint16_t      texture_format;
-    uint16_t      pixel_type;
-    uint8_t       is_hires_tex;
-    N64FormatSize n64_format_size;
-    uint32_t      dataSize;
+    /* already compressed well enough, copied as it is */
+    DECISION_KEPT,
+    /* compressed, per size class */
+    DECISION_COMPRESSED,
+    DECISION_RAW = DECISION_COMPRESSED + SIZE_CLASS_COUNT,
+    /* was compressed, but didn't save enough */
+    DECISION_INFLATED,
+    DECISION_COUNT
 };
 
-#define FREAD(x) fread(&x, sizeof(x), 1, file)
-#define FWRITE(x) fwrite(&x, sizeof(x), 1, file);
-#ifdef _WIN32
-#define FSEEK(x, y, z) _fseeki64(x, y, z)
-#define FTELL(x) _ftelli64(x)
-#else
-#define FSEEK(x, y, z) fseek(x, y, z)
-#define FTELL(x) ftell(x)
-#endif
-
-static bool compress_texture(struct GHQTexInfo* info)
+struct CompressionStats
 {
-    void* dest     = NULL;
-    uLongf destLen = info->dataSize;
-    dest = malloc(destLen);
+    uint64_t count[DECISION_COUNT];
+    /* uncompressed and stored size */
+    uint64_t rawSize[DECISION_COUNT];
+    uint64_t storedSize[DECISION_COUNT];
+};
 
-    if (compress2((unsigned char*)dest, &destLen, info->data, info->dataSize, 1) != Z_OK)
+static int32_t size_class(uint64_t size)
+{
+    if (size <= SIZE_CLASS_SMALL)
     {
-        free(dest);
-        return false;
+        return 0;
     }
-
-    free(info->data);
-    info->dataSize = destLen;
-    info->data     = (uint8_t*)dest;
-    info->format  |= GL_TEXFMT_GZ;
-    return true;
+    return size <= SIZE_CLASS_MEDIUM ? 1 : 2;
 }
 
-static bool decompress_texture(struct GHQTexInfo* info)
+/* estimates how well data compresses from a few chunks spread over
+ * it, returns the compressed size in percent of the raw size */
+static int32_t sample_ratio(const uint8_t* data, size_t size)
 {
-    void* dest     = NULL;
-    uLongf destLen = info->dataSize * 2;
-    int ret        = 0;
-    do
+    uint8_t sample[SAMPLE_CHUNK_SIZE + (SAMPLE_CHUNK_SIZE / 100) + 64];
+    uint64_t compressedSize = 0;
+    uint64_t rawSize = 0;
+
+    for (int32_t i = 0; i < SAMPLE_CHUNKS; i++)
     {
-        dest = realloc(dest, destLen);
-        if (dest == NULL)
+        size_t offset = ((size - SAMPLE_CHUNK_SIZE) / (SAMPLE_CHUNKS - 1)) * i;
+        uLongf sampleSize = sizeof(sample);
+        if (compress2(sample, &sampleSize, data + offset, SAMPLE_CHUNK_SIZE, 1) != Z_OK)
         {
-            return false;
+            return 100;
         }
+        compressedSize += sampleSize;
+        rawSize += SAMPLE_CHUNK_SIZE;
+    }
 
-        ret = uncompress((unsigned char*)dest, &destLen, info->data, info->dataSize);
-        if (ret == Z_BUF_ERROR)
-        { /* increase buffer size as needed */
-            destLen = destLen + destLen;
-        }
-        else if (ret != Z_OK)
-        {
-            return false;
-        }
-    } while (ret == Z_BUF_ERROR);
+    return (int32_t)((compressedSize * 100) / rawSize);
+}
 
-    free(info->data);
-    info->data     = (uint8_t*)dest;
-    info->dataSize = destLen;
-    info->format  &= ~GL_TEXFMT_GZ;
-    return true;
+static void count_decision(struct CompressionStats* stats, int32_t decision, uint64_t rawSize, uint64_t storedSize)
+{
+    stats->count[decision]++;
+    stats->rawSize[decision]    += rawSize;
+    stats->storedSize[decision] += storedSize;
 }
 
-static bool read_info(FILE* file, bool oldFormat, struct GHQTexInfo* info, bool readData = true)
+static void report_compression(FILE* log, const char* outputFilename, const struct CompressionPolicy* policy,
+                               const struct CompressionStats* stats)
 {
-    FREAD(info->width);
-    FREAD(info->height);
-    FREAD(info->format);
-    FREAD(info->texture_format);
-    FREAD(info->pixel_type);
-    FREAD(info->is_hires_tex);
-    if (!oldFormat)
-    {
-        FREAD(info->n64_format_size._formatsize);
-    }
-    FREAD(info->dataSize);
+    const double MiB = 1024.0 * 1024.0;
 
-    if (readData)
+    /* keep the report together when merging in parallel */
+    flockfile(log);
+    fprintf(log, "-> Compression of %s:\n", outputFilename);
+    for (int32_t decision = 0; decision < DECISION_COUNT; decision++)
     {
-        info->data = (uint8_t*)malloc(info->dataSize);
-        if (info->data == NULL)
+        char name[64];
+        if (stats->count[decision] == 0)
         {
-            return false;
+            continue;
         }
 
-        fread(info->data, info->dataSize, 1, file);
+        if (decision == DECISION_KEPT)
+        {
+            snprintf(name, sizeof(name), "kept compressed");
+        }
+        else if (decision < DECISION_RAW)
+        {
+            int32_t sizeClass = decision - DECISION_COMPRESSED;
+            snprintf(name, sizeof(name), "compressed (%s, level %i)", sizeClassNames[sizeClass], policy->levels[sizeClass]);
+        }
+        else if (decision == DECISION_RAW)
+        {
+            snprintf(name, sizeof(name), "stored raw");
+        }
+        else
+        {
+            snprintf(name, sizeof(name), "inflated, stored raw");
+        }
+
+        fprintf(log, "   %-30s %8llu textures, %9.1f MiB -> %9.1f MiB\n", name,
+                (unsigned long long)stats->count[decision],
+                stats->rawSize[decision] / MiB, stats->storedSize[decision] / MiB);
     }
-    return true;
+    funlockfile(log);
 }
 
-static bool write_info(FILE* file, bool oldFormat, bool compression, struct GHQTexInfo* info)
+static bool read_mapping(struct MergeInput* input, int32_t inputIndex, bool writeOldFormat,
+                         std::vector<MergeEntry>& entries, struct hts_index* mapping)
 {
-    bool compress = false;
-    bool decompress = false;
+    FILE*   file          = input->file;
+    int64_t mappingOffset = -1;
+    int32_t mappingSize   = -1;
 
-    /* we have to change the format early */
-    if (compression && 
-        (info->format & GL_TEXFMT_GZ) == 0)
-    {
-        compress = true;
-        info->format |= GL_TEXFMT_GZ;
-    }
-    else if (!compression && 
-             info->format & GL_TEXFMT_GZ)
-    {
-        decompress = true;
-        info->format &= ~GL_TEXFMT_GZ;
-    }
+    FREAD(mappingOffset);
 
-	FWRITE(info->width);
-    FWRITE(info->height);
-    FWRITE(info->format);
-    FWRITE(info->texture_format);
-    FWRITE(info->pixel_type);
-    FWRITE(info->is_hires_tex);
-    if (!oldFormat)
+    /* seek to mapping */
+    FSEEK(file, mappingOffset, SEEK_SET);
+
+    FREAD(mappingSize);
+
+    if (mappingSize < 0 || !hts_index_reserve(mapping, mappingSize))
     {
-        FWRITE(info->n64_format_size._formatsize);
+        fprintf(stderr, "Error: %s: invalid mapping\n", input->filename);
+        return false;
     }
+    entries.reserve(entries.size() + mappingSize);
 
-    /* compress/decompress data when required */
-    if (compress)
+    for (int32_t i = 0; i < mappingSize; i++)
     {
-    	if (!compress_texture(info))
+        struct MergeEntry entry = {0};
+
+        FREAD(entry.checksum);
+        FREAD(entry.offset._data);
+        entry.input = inputIndex;
+
+        /* the old format doesn't have the format size */
+        uint16_t formatSize = writeOldFormat ? 0 : (uint16_t)entry.offset._formatsize;
+
+        /* later textures replace earlier ones */
+        int64_t existing = hts_index_find(mapping, entry.checksum, formatSize);
+        if (existing != -1)
         {
-            return false;
+            entries[existing] = entry;
+        }
+        else
+        {
+            hts_index_insert(mapping, entry.checksum, formatSize, (int64_t)entries.size(), NULL);
+            entries.push_back(entry);
         }
     }
-    else if (decompress)
+
+    return true;
+}
+
+static bool read_entry_info(struct MergeInput* inputs, std::vector<MergeEntry>& entries)
+{
+    for (size_t i = 0; i < entries.size(); i++)
     {
-        if (!decompress_texture(info))
+        struct MergeEntry* entry = &entries[i];
+        FILE* file = inputs[entry->input].file;
+
+        /* seek to texture */
+        FSEEK(file, entry->offset._offset, SEEK_SET);
+
+        if (!read_info(file, inputs[entry->input].oldFormat, &entry->info, false))
         {
+            fprintf(stderr, "Error: failed to read texture info\n");
             return false;
         }
+
+        entry->payloadOffset = FTELL(file);
+
+#ifdef VERBOSE
+        printf("-> [%zu/%zu]\n"
+               "-> info.width = %i\n"
+               "-> info.height = %i\n"
+               "-> info.format = %u\n"
+               "-> info.texture_format = %i\n"
+               "-> info.pixel_type = %i\n"
+               "-> info.is_hires_tex = %i\n"
+               "-> info.n64_format_size = %i\n", 
+                (i + 1), entries.size(),
+                entry->info.width,
+                entry->info.height,
+                entry->info.format,
+                entry->info.texture_format,
+                entry->info.pixel_type,
+                entry->info.is_hires_tex,
+                entry->info.n64_format_size._formatsize);
+#endif // VERBOSE
     }
 
-    FWRITE(info->dataSize);
-    fwrite(info->data, info->dataSize, 1, file);
-	return true;
+    return true;
 }
 
-static bool check_size(struct GHQTexInfo* info, size_t size, bool compression)
+/* reads the payload and stages it with the new compression,
+ * for a compressed output every texture is decided on its own */
+static bool stage_entries(struct MergeInput* inputs, FILE* stagingFile, bool compression,
+                          const struct CompressionPolicy* policy, struct memory_budget* budget,
+                          std::vector<MergeEntry>& entries, struct CompressionStats* stats)
 {
-    /* compress/decompress data when required */
-    if (compression && 
-        (info->format & GL_TEXFMT_GZ) == 0)
+    for (auto& entry : entries)
     {
-        if (!compress_texture(info))
+        bool     compressed   = (entry.info.format & GL_TEXFMT_GZ) != 0;
+        uint64_t inflatedSize = texture_inflated_size(&entry.info);
+        bool     inflate      = false;
+        int32_t  level        = 0;
+
+        if (!compression)
+        {
+            inflate = compressed;
+        }
+        else if (compressed)
+        {
+            /* the header says how well it compressed, so textures
+             * which barely got smaller are only inflated, which
+             * makes them faster to load */
+            inflate = inflatedSize > 0 && (entry.info.dataSize * 100) > (inflatedSize * policy->maxRatio);
+            if (!inflate)
+            {
+                count_decision(stats, DECISION_KEPT, inflatedSize, entry.info.dataSize);
+            }
+        }
+        else
+        {
+            level = policy->levels[size_class(entry.info.dataSize)];
+            if (level == 0)
+            {
+                count_decision(stats, DECISION_RAW, entry.info.dataSize, entry.info.dataSize);
+            }
+        }
+
+        /* only payloads which need (de)compression
+         * have to go through userspace */
+        if (!inflate && level == 0)
         {
+            continue;
+        }
+
+        /* the input and the (de)compressed data */
+        uint64_t memorySize = entry.info.dataSize +
+                              std::max<uint64_t>(inflatedSize, compressBound(entry.info.dataSize));
+        memory_budget_acquire(budget, memorySize);
+
+        trace_texture(entry.checksum, entry.info.width, entry.info.height);
+        uint64_t start = trace_begin();
+
+        FILE* file = inputs[entry.input].file;
+        FSEEK(file, entry.payloadOffset, SEEK_SET);
+
+        if (!read_info_data(file, &entry.info))
+        {
+            fprintf(stderr, "Error: failed to read texture data\n");
+            memory_budget_release(budget, memorySize);
             return false;
         }
-    }
-    else if (!compression && 
-             info->format & GL_TEXFMT_GZ)
-    {
-        if (!decompress_texture(info))
+        trace_end("read", start, entry.info.dataSize);
+
+        if (inflate)
+        {
+            start = trace_begin();
+            if (!decompress_texture(&entry.info))
+            {
+                fprintf(stderr, "Error: failed to decompress texture\n");
+                free(entry.info.data);
+                memory_budget_release(budget, memorySize);
+                return false;
+            }
+            trace_end("inflate", start, entry.info.dataSize);
+
+            if (compression)
+            {
+                count_decision(stats, DECISION_INFLATED, entry.info.dataSize, entry.info.dataSize);
+            }
+        }
+        else
+        {
+            uint64_t rawSize = entry.info.dataSize;
+
+            /* incompressible textures are stored raw, big ones
+             * are only compressed when a sample compresses well */
+            start = trace_begin();
+            bool worthIt = (rawSize <= SAMPLE_THRESHOLD || sample_ratio(entry.info.data, rawSize) <= policy->maxRatio) &&
+                           compress_texture(&entry.info, level) &&
+                           (entry.info.dataSize * 100) <= (rawSize * policy->maxRatio);
+            trace_end("deflate", start, entry.info.dataSize);
+
+            if (!worthIt)
+            {
+                /* the payload in the input is what's stored */
+                count_decision(stats, DECISION_RAW, rawSize, rawSize);
+                entry.info.dataSize = rawSize;
+                entry.info.format  &= ~GL_TEXFMT_GZ;
+                free(entry.info.data);
+                entry.info.data = NULL;
+                memory_budget_release(budget, memorySize);
+                continue;
+            }
+
+            count_decision(stats, DECISION_COMPRESSED + size_class(rawSize), rawSize, entry.info.dataSize);
+        }
+
+        start = trace_begin();
+        entry.input         = -1;
+        entry.payloadOffset = FTELL(stagingFile);
+        if (fwrite(entry.info.data, entry.info.dataSize, 1, stagingFile) != 1)
         {
+            fprintf(stderr, "Error: failed to stage texture data\n");
+            free(entry.info.data);
+            memory_budget_release(budget, memorySize);
             return false;
         }
+        trace_end("stage", start, entry.info.dataSize);
+
+        free(entry.info.data);
+        entry.info.data = NULL;
+        memory_budget_release(budget, memorySize);
     }
 
-    /* does it fit? */
-    return info->dataSize <= size;
+    return true;
 }
 
-static bool check_header(FILE* file, bool* oldFormat, bool* compressed)
+static bool compare_entry_source(const MergeEntry& a, const MergeEntry& b)
 {
-	int32_t header    = -1;
-	int32_t version   = -1;
+    if (a.input != b.input)
+    {
+        return a.input < b.input;
+    }
+    return a.offset._offset < b.offset._offset;
+}
 
-	/* determine HTS format */
-    FREAD(version);
-    if (version == TXCACHE_FORMAT_VERSION)
+static bool write_merge(struct MergeInput* inputs, FILE* stagingFile, FILE* outputFile, const char* outputFilename,
+                        bool oldFormat, bool compression, std::vector<MergeEntry>& entries)
+{
+    int header = TXCACHE_FORMAT_VERSION;
+    int config = compression ? HTS_CONFIG_COMPRESSED : HTS_CONFIG_UNCOMPRESSED;
+    int64_t mappingOffset = 0;
+    int32_t mappingSize   = (int32_t)entries.size();
+    bool    ret           = true;
+
+    /* every payload size is known by now, 
+     * so lay out the whole file up front */
+    mappingOffset = oldFormat ? sizeof(config) : sizeof(header) + sizeof(config);
+    mappingOffset += sizeof(mappingOffset);
+    for (auto& entry : entries)
     {
-        FREAD(header);
-        *oldFormat = false;
+        entry.outputOffset = mappingOffset;
+        mappingOffset += info_header_size(oldFormat) + entry.info.dataSize;
     }
-    else
+
+#undef FWRITE
+#define FWRITE(x) fwrite(&x, sizeof(x), 1, outputFile)
+    if (!oldFormat)
     {
-        header = version;
-        *oldFormat = true;
+        ret &= FWRITE(header) == 1;
     }
-    
-    if (/* uncompressed HTS */
-        header != 1075970048 &&
-        /* compressed HTS */
-        header != 1084358656)
+    ret &= FWRITE(config) == 1;
+    ret &= FWRITE(mappingOffset) == 1;
+
+    for (auto& entry : entries)
     {
-        fprintf(stderr, "Error: expected header = 1075970048 or 1084358656\n");
-        fprintf(stderr, "Error: got header %i\n", header);
-        return false;
+        FILE* file = entry.input == -1 ? stagingFile : inputs[entry.input].file;
+
+        trace_texture(entry.checksum, entry.info.width, entry.info.height);
+        uint64_t start = trace_begin();
+
+        write_info_header(outputFile, oldFormat, &entry.info);
+        if (!copy_payload(file, entry.payloadOffset, outputFile, entry.info.dataSize))
+        {
+            fprintf(stderr, "Error: failed to copy texture data\n");
+            return false;
+        }
+
+        trace_end("write", start, entry.info.dataSize);
     }
 
-    if (compressed != NULL)
+    ret &= FWRITE(mappingSize) == 1;
+    for (auto& entry : entries)
     {
-    	*compressed = (header == 1084358656);
+        union StorageOffset offset = entry.offset;
+        offset._offset = entry.outputOffset;
+        ret &= FWRITE(entry.checksum) == 1;
+        ret &= FWRITE(offset._data) == 1;
     }
 
-    return true;
+    /* write_info_header() doesn't return errors, the stream keeps them */
+    ret &= ferror(outputFile) == 0;
+    ret &= fflush(outputFile) == 0;
+    if (!ret)
+    {
+        fprintf(stderr, "Error: failed to write %s\n", outputFilename);
+    }
+    return ret;
 }
 
-static bool write_cache(FILE* file, FILE* outputFile, bool readOldFormat, bool writeOldFormat, bool compression,
-                        std::unordered_multimap<uint64_t, StorageOffset>& mapping)
+#undef FREAD
+#undef FWRITE
+
+static bool merge_packs(const char* filename, const char* filename2, const char* outputFilename,
+                        const struct CompressionPolicy* policy, struct memory_budget* budget)
 {
-	int64_t mappingOffset = -1;
-    int32_t mappingSize   = -1;
+    struct MergeInput inputs[2] = {0};
+    bool  toStdout    = (strcmp(outputFilename, "-") == 0);
+    FILE* log         = toStdout ? stderr : stdout;
+    FILE* outputFile  = NULL;
+    FILE* stagingFile = NULL;
+    bool  ret         = false;
+    struct hts_index mapping = {0};
+    char  partFilename[PATH_MAX + 8];
+
+    /* write to NAME.part and rename it when everything
+     * made it to disk, so a failure never leaves a truncated pack */
+    snprintf(partFilename, sizeof(partFilename), "%s.part", outputFilename);
+
+    inputs[0].filename = filename;
+    inputs[1].filename = filename2;
+    for (int i = 0; i < 2; i++)
+    {
+        inputs[i].file = fopen(inputs[i].filename, "rb");
+        if (inputs[i].file == NULL)
+        {
+            fprintf(stderr, "Error: %s: %s\n", inputs[i].filename, strerror(errno));
+            goto out;
+        }
+    }
 
-	FREAD(mappingOffset);
+    {
+        std::vector<MergeEntry> entries;
 
-    /* seek to mapping */
-    FSEEK(file, mappingOffset, SEEK_SET);
+        /* read file header & mapping */
+        bool oldFormat   = false;
+        bool compression = false;
 
-    FREAD(mappingSize);
+        if (!check_header(inputs[0].file, &inputs[0].oldFormat, &compression) ||
+            !check_header(inputs[1].file, &inputs[1].oldFormat, NULL))
+        {
+            goto out;
+        }
 
-    for (int32_t i = 0; i < mappingSize; i++)
-    {
-        /* write each file to PNG */
-        uint64_t checksum = 0;
-        union StorageOffset offset = {0};
-        int64_t currentOffset = 0;
-        int64_t outputFileCurrentOffset = 0;
-        struct GHQTexInfo info = {0};
-        struct GHQTexInfo info2 = {0};
-        char filename[PATH_MAX];
+        // TODO: support file 1 being new format and
+        // file 2 being old format
+        if (!inputs[0].oldFormat && inputs[1].oldFormat)
+        {
+            fprintf(stderr, "Error: unsupported format mismatch!\n");
+            goto out;
+        }
 
-        FREAD(checksum);
-        FREAD(offset._data);
+        oldFormat = inputs[0].oldFormat;
 
-        /* store current offset */
-        currentOffset = FTELL(file);
+        if (!hts_index_init(&mapping, 0))
+        {
+            goto out;
+        }
 
-        /* seek to texture */
-        FSEEK(file, offset._offset, SEEK_SET);
+        /* plan the merge using only the mappings 
+         * and the texture headers */
+        for (int i = 0; i < 2; i++)
+        {
+            fprintf(log, "-> Processing %s...\n", inputs[i].filename);
+            if (!read_mapping(&inputs[i], i, oldFormat, entries, &mapping))
+            {
+                goto out;
+            }
+        }
+
+        /* read the inputs front to back */
+        std::sort(entries.begin(), entries.end(), compare_entry_source);
 
-        if (!read_info(file, readOldFormat, &info))
+        if (!read_entry_info(inputs, entries))
         {
-        	fprintf(stderr, "Error: failed to read texture info\n");
-            continue;
+            goto out;
         }
 
-#ifdef VERBOSE
-        if (readOldFormat)
-        {
-            printf("-> [%i/%i]\n"
-                   "-> info.width = %i\n"
-                   "-> info.height = %i\n"
-                   "-> info.format = %u\n"
-                   "-> info.texture_format = %i\n"
-                   "-> info.pixel_type = %i\n"
-                   "-> info.is_hires_tex = %i\n", 
-                    (i + 1), mappingSize,
-                    info.width,
-                    info.height,
-                    info.format,
-                    info.texture_format,
-                    info.pixel_type,
-                    info.is_hires_tex);
+        stagingFile = tmpfile();
+        if (stagingFile == NULL)
+        {
+            perror("tmpfile");
+            goto out;
         }
-        else
+
+        struct CompressionStats stats = {};
+        if (!stage_entries(inputs, stagingFile, compression, policy, budget, entries, &stats) ||
+            fflush(stagingFile) != 0)
         {
-            printf("-> [%i/%i]\n"
-                   "-> info.width = %i\n"
-                   "-> info.height = %i\n"
-                   "-> info.format = %u\n"
-                   "-> info.texture_format = %i\n"
-                   "-> info.pixel_type = %i\n"
-                   "-> info.is_hires_tex = %i\n"
-                   "-> info.n64_format_size = %i\n", 
-                    (i + 1), mappingSize,
-                    info.width,
-                    info.height,
-                    info.format,
-                    info.texture_format,
-                    info.pixel_type,
-                    info.is_hires_tex,
-                    info.n64_format_size._formatsize);
+            goto out;
         }
-#endif // VERBOSE
 
-        std::unordered_multimap<uint64_t, StorageOffset>::iterator mappingIter = mapping.end();
-        if (writeOldFormat)
+        outputFile = toStdout ? stdout : fopen(partFilename, "wb");
+        if (outputFile == NULL)
         {
-            mappingIter = mapping.find(checksum);
+            fprintf(stderr, "Error: %s: %s\n", partFilename, strerror(errno));
+            goto out;
         }
-        else
+
+        fprintf(log, "-> Writing %zu textures, header and mappings to %s...\n", entries.size(), outputFilename);
+
+        if (!write_merge(inputs, stagingFile, outputFile, outputFilename, oldFormat, compression, entries))
         {
-            /* find match with format size included */
-            auto range = mapping.equal_range(checksum);
-            for (auto rangeIter = range.first; rangeIter != range.second; rangeIter++)
-            {
-                if (rangeIter->second._formatsize == offset._formatsize)
-                {
-                    mappingIter = rangeIter;
-                    break;
-                }
-            }
+            goto out;
         }
 
-        /* try and see if we can replace
-         * the existing texture */
-        bool replaceTexture = false;
-        if (mappingIter != mapping.end())
+        if (compression)
         {
-            outputFileCurrentOffset = FTELL(outputFile);
-            FSEEK(outputFile, mappingIter->second._offset, SEEK_SET);
-            if (read_info(outputFile, writeOldFormat, &info2, false) &&
-                /* does the texture fit? */
-                check_size(&info, info2.dataSize, compression))
-            {
-                replaceTexture = true;
-                /* set offset to the texture */
-                FSEEK(outputFile, mappingIter->second._offset, SEEK_SET);
-            }
-            else
-            {
-                /* restore offset because the texture doesn't fit */
-                FSEEK(outputFile, outputFileCurrentOffset, SEEK_SET);
-            }
+            report_compression(log, outputFilename, policy, &stats);
         }
+    }
 
-        /* update offset in mapping */
-        offset._offset = FTELL(outputFile);
-        if (mappingIter != mapping.end())
+    ret = true;
+out:
+    hts_index_free(&mapping);
+    for (int i = 0; i < 2; i++)
+    {
+        if (inputs[i].file != NULL)
         {
-            mappingIter->second = offset;
+            fclose(inputs[i].file);
         }
-        else
+    }
+    if (stagingFile != NULL)
+    {
+        fclose(stagingFile);
+    }
+    if (outputFile != NULL && outputFile != stdout)
+    {
+        bool written = ret && fsync(fileno(outputFile)) == 0;
+        written &= fclose(outputFile) == 0;
+        if (ret && (!written || rename(partFilename, outputFilename) == -1))
         {
-            mapping.insert({checksum, offset});
+            fprintf(stderr, "Error: failed to write %s\n", outputFilename);
+            ret = false;
         }
+        if (!ret)
+        {
+            unlink(partFilename);
+        }
+    }
+    return ret;
+}
+
+struct MergeJob
+{
+    const struct CompressionPolicy* policy;
+    struct memory_budget* budget;
+    bool                  writeIndex;
+    char                  filename[PATH_MAX];
+    char                  filename2[PATH_MAX];
+    char                  outputFilename[PATH_MAX];
+    bool                  error;
+};
+
+static void merge_job(void* arg)
+{
+    struct MergeJob* job = (struct MergeJob*)arg;
+    job->error = !merge_packs(job->filename, job->filename2, job->outputFilename, job->policy, job->budget) ||
+                 (job->writeIndex && !htsi_generate(job->outputFilename));
+}
 
-        write_info(outputFile, writeOldFormat, compression, &info);
+/* reads the batch list, every line contains
+ * 2 input files and an output file */
+static bool read_batch(const char* filename, std::vector<MergeJob>& jobs)
+{
+    FILE* file = fopen(filename, "r");
+    if (file == NULL)
+    {
+        perror("fopen");
+        return false;
+    }
 
-        /* restore offset when we've replaced
-         * a texture */
-        if (replaceTexture)
+    char line[PATH_MAX * 3 + 16];
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        struct MergeJob job = {};
+        if (line[0] == '#' || line[strspn(line, " \t\r\n")] == '\0')
         {
-            FSEEK(outputFile, outputFileCurrentOffset, SEEK_SET);
+            continue;
         }
 
-        /* free texture data */
-        if (info.data != NULL)
+        if (sscanf(line, "%4095s %4095s %4095s", job.filename, job.filename2, job.outputFilename) != 3 ||
+            strcmp(job.outputFilename, "-") == 0)
         {
-            free(info.data);
+            fprintf(stderr, "Error: invalid line in batch list: %s", line);
+            fclose(file);
+            return false;
         }
-
-        /* restore offset */
-        FSEEK(file, currentOffset, SEEK_SET);
+        jobs.push_back(job);
     }
 
+    fclose(file);
     return true;
 }
 
-#undef FREAD
-#undef FWRITE
-
 int main(int argc, char** argv)
 {
-    if (argc < 4)
+    const char* batchFilename = NULL;
+    const char* filenames[3]  = { NULL, NULL, NULL };
+    int32_t     filenameCount = 0;
+    int32_t     threads       = threadpool_default_threads();
+    uint64_t    maxMemory     = 0;
+    const char* traceFilename = NULL;
+    struct CompressionPolicy policy = { { 9, 6, 6 }, 90 };
+    bool        writeIndex    = false;
+
+    for (int i = 1; i < argc; i++)
     {
-        printf("Usage: %s [HTS FILE] [HTS FILE] [OUTPUT HTS FILE]\n", argv[0]);
-        return 1;
+        if (strcmp(argv[i], "--batch") == 0 && (i + 1) < argc)
+        {
+            batchFilename = argv[++i];
+        }
+        else if (strcmp(argv[i], "-j") == 0 && (i + 1) < argc)
+        {
+            threads = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--trace") == 0 && (i + 1) < argc)
+        {
+            traceFilename = argv[++i];
+        }
+        else if (strcmp(argv[i], "--levels") == 0 && (i + 1) < argc)
+        {
+            int32_t* levels = policy.levels;
+            if (sscanf(argv[++i], "%d,%d,%d", &levels[0], &levels[1], &levels[2]) != 3 ||
+                levels[0] < 0 || levels[0] > 9 || levels[1] < 0 || levels[1] > 9 || levels[2] < 0 || levels[2] > 9)
+            {
+                fprintf(stderr, "Error: invalid levels: %s\n", argv[i]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--max-ratio") == 0 && (i + 1) < argc)
+        {
+            policy.maxRatio = atoi(argv[++i]);
+            if (policy.maxRatio <= 0 || policy.maxRatio > 100)
+            {
+                fprintf(stderr, "Error: invalid ratio: %s\n", argv[i]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--max-memory") == 0 && (i + 1) < argc)
+        {
+            if (!memory_budget_parse(argv[++i], &maxMemory))
+            {
+                fprintf(stderr, "Error: invalid memory size: %s\n", argv[i]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--index") == 0)
+        {
+            writeIndex = true;
+        }
+        else if (filenameCount < 3)
+        {
+            filenames[filenameCount++] = argv[i];
+        }
     }
 
-    char filename[PATH_MAX];
-    char filename2[PATH_MAX];
-    char outputFilename[PATH_MAX];
-
-    strcpy(filename, argv[1]);
-    strcpy(filename2, argv[2]);
-    strcpy(outputFilename, argv[3]);
-
-    FILE* file = fopen(filename, "rb");
-    if (file == NULL)
+    if (batchFilename == NULL && filenameCount < 3)
     {
-        perror("fopen");
+        printf("Usage: %s [HTS FILE] [HTS FILE] [OUTPUT HTS FILE] [OPTIONS]\n", argv[0]);
+        printf("       %s --batch [LIST FILE] [-j THREADS] [OPTIONS]\n", argv[0]);
+        printf("\n");
+        printf("Options: [--levels SMALL,MEDIUM,LARGE] [--max-ratio PERCENT] [--max-memory SIZE] [--trace JSON FILE] [--index]\n");
+        printf("\n");
+        printf("Use - as output file to write to stdout\n");
+        printf("--index writes a NAME.htsi index sidecar next to the output\n");
+        printf("Every line in the list file contains [HTS FILE] [HTS FILE] [OUTPUT HTS FILE]\n");
+        printf("When the output is compressed, textures up to 64 KiB (small), 1 MiB (medium) and larger\n");
+        printf("ones are compressed with their level (0 to 9, 0 stores them raw, default 9,6,6) and\n");
+        printf("stored raw when that doesn't make them at most PERCENT of their size (default 90)\n");
         return 1;
     }
-    FILE* file2 = fopen(filename2, "rb");
-    if (file == NULL)
+
+    if (traceFilename != NULL && !trace_open(traceFilename, "hts2merge"))
     {
-        perror("fopen");
         return 1;
     }
 
-    std::unordered_multimap<uint64_t, StorageOffset> mapping;
+    memory_budget_init_malloc(maxMemory);
 
-    /* read file header & mapping */
-    bool oldFormat   = false;
-    bool oldFormat2  = false;
-    bool compression = false;
-    
-    FILE* outputFile = fopen(outputFilename, "wb+");
+    struct memory_budget budget;
+    memory_budget_init(&budget, maxMemory);
 
-    if (!check_header(file, &oldFormat, &compression) ||
-    	!check_header(file2, &oldFormat2, NULL))
+    if (batchFilename == NULL)
     {
-    	fclose(file);
-    	fclose(file2);
-    	fclose(outputFile);
-    	return 1;
+        bool ret = merge_packs(filenames[0], filenames[1], filenames[2], &policy, &budget);
+        if (ret && writeIndex && strcmp(filenames[2], "-") != 0)
+        {
+            ret = htsi_generate(filenames[2]);
+        }
+        trace_close();
+        memory_budget_report(strcmp(filenames[2], "-") == 0 ? stderr : stdout, &budget);
+        memory_budget_destroy(&budget);
+        return ret ? 0 : 1;
     }
 
-    // TODO: support file 1 being new format and
-    // file 2 being old format
-    if (!oldFormat && oldFormat2)
+    std::vector<MergeJob> jobs;
+    if (!read_batch(batchFilename, jobs))
     {
-    	fprintf(stderr, "Error: unsupported format mismatch!\n");
-    	fclose(file);
-    	fclose(file2);
-    	fclose(outputFile);
-    	return 1;
+        return 1;
     }
 
-    int header = TXCACHE_FORMAT_VERSION;
-    int config = compression ? 1084358656 : 1075970048;
-    int64_t mappingOffset = 0;
-    int mappingSize = 0;
-
-#define FREAD(x) fread(&x, sizeof(x), 1, outputFile)
-#define FWRITE(x) fwrite(&x, sizeof(x), 1, outputFile);
-
-    // write header and dummy mapping offset
-    if (!oldFormat)
+    struct threadpool* pool = threadpool_create(std::min(threads, std::max((int32_t)jobs.size(), 1)));
+    if (pool == NULL)
     {
-    	FWRITE(header);
-	}
-    FWRITE(config);
-    FWRITE(mappingOffset);
-
-    // write first HTS file to output file
-    printf("-> Processing %s...\n", filename);
-    if (!write_cache(file, outputFile, oldFormat, oldFormat, compression, mapping))
-    {
-        fclose(file);
-        fclose(file2);
-        fclose(outputFile);
-    	return 1;
+        fprintf(stderr, "Error: failed to create thread pool\n");
+        return 1;
     }
-    // write second HTS file to output file
-    printf("-> Processing %s...\n", filename2);
-    if (!write_cache(file2, outputFile, oldFormat2, oldFormat, compression, mapping))
+
+    for (auto& job : jobs)
     {
-        fclose(file);
-        fclose(file2);
-        fclose(outputFile);
-    	return 1;
+        job.policy = &policy;
+        job.budget = &budget;
+        job.writeIndex = writeIndex;
+        threadpool_submit(pool, merge_job, &job);
     }
 
-    printf("-> Writing header and mappings...\n");
+    threadpool_destroy(pool);
+    trace_close();
 
-    mappingOffset = FTELL(outputFile);
-    mappingSize = (int)mapping.size();
+    memory_budget_report(stdout, &budget);
+    memory_budget_destroy(&budget);
 
-    // write mappings
-    FWRITE(mappingSize);
-    for (const auto& m : mapping)
+    /* report every merge, one bad
+     * merge doesn't stop the others */
+    int ret = 0;
+    printf("-> Summary:\n");
+    for (auto& job : jobs)
     {
-    	FWRITE(m.first);
-    	FWRITE(m.second._data);
+        printf("   %s: %s\n", job.outputFilename, job.error ? "failed" : "ok");
+        if (job.error)
+        {
+            ret = 1;
+        }
     }
 
-    // write correct mapping offset
-    int offset = oldFormat ? sizeof(config) : sizeof(header) + sizeof(config);
-    FSEEK(outputFile, offset, SEEK_SET);
-    FWRITE(mappingOffset);
-
-#undef FREAD
-#undef FWRITE
-
-    fclose(file);
-    fclose(file2);
-    fclose(outputFile);
-    return 0;
+    return ret;
 }
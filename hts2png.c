@@ -11,157 +11,451 @@
 #ifndef _WIN32
 #include <linux/limits.h>
 #endif /* _WIN32 */
+#include "hts.h"
+#include "batch.h"
+#include "budget.h"
+#include "trace.h"
+#include "index.h"
+#include "journal.h"
+#include "archive.h"
+#include "overlay.h"
 #include <png.h>
-#include <stdio.h>
-#include <stdbool.h>
-#include <stdint.h>
-#include <stdlib.h>
 #include <sys/stat.h>
-#include <string.h>
-#include <unistd.h>
 #include <libgen.h>
-#include <zlib.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif /* __SSE2__ */
 
-#define UNDEFINED_1            0x08000000
-#define TXCACHE_FORMAT_VERSION UNDEFINED_1
+struct PackJob;
 
-#define GL_TEXFMT_GZ 0x80000000
+struct TextureJob
+{
+    struct PackJob*     pack;
+    uint64_t            checksum;
+    union StorageOffset offset;
+    /* the pack, or the base of an overlay which has it */
+    int                 fd;
+    int32_t             index;
+    /* the journal says it was written before */
+    bool                done;
+};
 
-typedef struct
+/* journal record of a PNG which was written */
+struct PngRecord
 {
-    union
-    {
-        uint16_t _formatsize;
-        struct
-        {
-            uint8_t _format;
-            uint8_t _size;
-        };
-    };
-} N64FormatSize;
+    uint64_t checksum;
+    uint64_t offset;
+};
 
-union StorageOffset
+struct PackJob
 {
-    struct {
-        int64_t _offset : 48;
-        int64_t _formatsize : 16;
-    };
-    int64_t _data;
+    struct threadpool*    pool;
+    struct memory_budget* budget;
+    /* always write RGBA PNGs */
+    bool                  rgba;
+    bool                  checkpoint;
+    bool                  resume;
+    /* the PNGs go into the archive instead of the ident directory */
+    struct archive*       archive;
+    char                  filename[PATH_MAX];
+    char                  ident[PATH_MAX];
+    char                  base_ident[PATH_MAX];
+    FILE*                 file;
+    /* textures of an overlay are read from its bases */
+    bool                  isOverlay;
+    struct overlay        overlay;
+    bool                  oldFormat;
+    int32_t               mappingSize;
+    struct TextureJob*    textures;
+    atomic_int            remaining;
+    atomic_int            failed;
+    atomic_int            skipped;
+    bool                  error;
+    /* guards the journal */
+    pthread_mutex_t       mutex;
+    struct journal        journal;
+    char                  journalFilename[PATH_MAX * 2];
 };
 
-struct GHQTexInfo
+static void get_filename_from_info(uint64_t checksum, bool oldFormat, struct GHQTexInfo* info, char* ident, char* filename)
+{
+    const uint32_t chksum    = checksum & 0xffffffff;
+    const uint32_t palchksum = checksum >> 32;
+    const uint32_t n64fmt    = info->n64_format_size._format;
+    const uint32_t n64fmt_sz = info->n64_format_size._size;
+
+    if (oldFormat)
+    {
+        if (palchksum == 0)
+        {
+            sprintf(filename, "%s#%08X#%01X#%01X_all.png", ident, chksum, 3, 0);
+        }
+        else
+        {
+            sprintf(filename, "%s#%08X#%01X#%01X#%08X_ciByRGBA.png", ident, chksum, 3, 0, palchksum);
+        }
+    }
+    else
+    {
+        if (n64fmt == 0x02)
+        {
+            sprintf(filename, "%s#%08X#%01X#%01X_all.png", ident, chksum, n64fmt, n64fmt_sz);
+        }
+        else
+        {
+            sprintf(filename, "%s#%08X#%01X#%01X#%08X_ciByRGBA.png", ident, chksum, n64fmt, n64fmt_sz, palchksum);
+        }
+    }
+}
+
+/* PNG data is buffered, so writing it
+ * shows up as a few spans in the trace */
+#define PNG_WRITE_BUFFER_SIZE (64 * 1024)
+
+struct PngOutput
 {
-    uint8_t*      data;
-    int32_t       width;
-    int32_t       height;
-    uint32_t      format;
-    uint16_t      texture_format;
-    uint16_t      pixel_type;
-    uint8_t       is_hires_tex;
-    N64FormatSize n64_format_size;
+    /* NULL when encoding to memory */
+    FILE*    file;
+    size_t   size;
+    bool     error;
+    uint8_t  buffer[PNG_WRITE_BUFFER_SIZE];
+    /* the whole PNG when encoding to memory */
+    uint8_t* data;
+    size_t   dataSize;
+    size_t   dataCapacity;
 };
 
-bool read_info(FILE* file, bool oldFormat, struct GHQTexInfo* info)
+/* progress goes to stderr when the archive is written to stdout */
+static FILE* logFile;
+
+static void png_output_flush(png_structp png_ptr)
 {
-    uint32_t dataSize = 0;
-#define FREAD(x) fread(&x, sizeof(x), 1, file)
-    FREAD(info->width);
-    FREAD(info->height);
-    FREAD(info->format);
-    FREAD(info->texture_format);
-    FREAD(info->pixel_type);
-    FREAD(info->is_hires_tex);
-    if (!oldFormat)
+    struct PngOutput* output = png_get_io_ptr(png_ptr);
+    if (output->file == NULL || output->size == 0)
     {
-        FREAD(info->n64_format_size._formatsize);
+        return;
     }
-    FREAD(dataSize);
-#undef FREAD
 
-    info->data = malloc(dataSize);
-    if (info->data == NULL)
+    uint64_t start = trace_begin();
+    if (fwrite(output->buffer, output->size, 1, output->file) != 1)
     {
-        return false;
+        output->error = true;
     }
+    trace_end("write", start, output->size);
+    output->size = 0;
+}
 
-    fread(info->data, dataSize, 1, file);
+static void png_output_write(png_structp png_ptr, png_bytep data, png_size_t length)
+{
+    struct PngOutput* output = png_get_io_ptr(png_ptr);
 
-    if (info->format & GL_TEXFMT_GZ)
+    if (output->file == NULL)
     {
-        void* dest     = NULL;
-        uLongf destLen = dataSize * 2;
-        int ret        = 0;
-        do
+        if ((output->dataSize + length) > output->dataCapacity)
         {
-            dest = malloc(destLen);
-            if (dest == NULL)
+            size_t capacity = output->dataCapacity == 0 ? PNG_WRITE_BUFFER_SIZE : output->dataCapacity * 2;
+            while (capacity < (output->dataSize + length))
             {
-                return false;
-            }
-
-            ret = uncompress(dest, &destLen, info->data, dataSize);
-            if (ret == Z_BUF_ERROR)
-            { /* increase buffer size as needed */
-                free(dest);
-                destLen = destLen + destLen;
+                capacity *= 2;
             }
-            else if (ret != Z_OK)
+            uint8_t* buffer = realloc(output->data, capacity);
+            if (buffer == NULL)
             {
-                return false;
+                output->error = true;
+                return;
             }
-        } while (ret == Z_BUF_ERROR);
+            output->data         = buffer;
+            output->dataCapacity = capacity;
+        }
+        memcpy(output->data + output->dataSize, data, length);
+        output->dataSize += length;
+        return;
+    }
+
+    while (length > 0)
+    {
+        size_t size = PNG_WRITE_BUFFER_SIZE - output->size;
+        if (size > length)
+        {
+            size = length;
+        }
+
+        memcpy(output->buffer + output->size, data, size);
+        output->size += size;
+        data   += size;
+        length -= size;
+
+        if (output->size == PNG_WRITE_BUFFER_SIZE)
+        {
+            png_output_flush(png_ptr);
+        }
+    }
+}
+
+#define PNG_PALETTE_SLOTS 1024
+
+/* the smallest lossless PNG color type for a texture */
+struct PngFormat
+{
+    png_byte  colorType;
+    png_byte  bitDepth;
+    int32_t   paletteSize;
+    png_color palette[256];
+    png_byte  trans[256];
+    int32_t   transSize;
+    /* RGBA color -> palette index */
+    uint32_t  colors[PNG_PALETTE_SLOTS];
+    uint8_t   indices[PNG_PALETTE_SLOTS];
+    bool      used[PNG_PALETTE_SLOTS];
+};
+
+/* checks whether every pixel is opaque and whether every
+ * pixel is gray, with SSE2 it checks 4 pixels at a time */
+static void scan_rgba8(const uint8_t* data, size_t pixels, bool* opaque, bool* gray)
+{
+    size_t i = 0;
+    uint32_t alpha = 0xFF;
+    uint32_t same  = 1;
+
+#ifdef __SSE2__
+    const __m128i alphaMask = _mm_set1_epi32((int)0xFF000000);
+    /* byte 0 is r == g, byte 1 is g == b */
+    const __m128i grayMask  = _mm_set1_epi32(0x0000FFFF);
+    __m128i alphaAll = _mm_set1_epi32(-1);
+    __m128i sameAll  = _mm_set1_epi32(-1);
+
+    for (; (i + 4) <= pixels; i += 4)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)(data + (i * 4)));
+        alphaAll = _mm_and_si128(alphaAll, v);
+        sameAll  = _mm_and_si128(sameAll, _mm_cmpeq_epi8(v, _mm_srli_epi32(v, 8)));
 
-        free(info->data);
-        info->data = dest;
+        /* stop as soon as neither can be true anymore */
+        if ((i & 1023) == 0 &&
+            _mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(alphaAll, alphaMask), alphaMask)) != 0xFFFF &&
+            _mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(sameAll, grayMask), grayMask)) != 0xFFFF)
+        {
+            *opaque = false;
+            *gray   = false;
+            return;
+        }
     }
 
-    return true;
+    alpha = _mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(alphaAll, alphaMask), alphaMask)) == 0xFFFF ? 0xFF : 0;
+    same  = _mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(sameAll, grayMask), grayMask)) == 0xFFFF;
+#endif /* __SSE2__ */
+
+    for (; i < pixels; i++)
+    {
+        const uint8_t* pixel = data + (i * 4);
+        alpha &= pixel[3];
+        same  &= (pixel[0] == pixel[1]) & (pixel[1] == pixel[2]);
+    }
+
+    *opaque = alpha == 0xFF;
+    *gray   = same != 0;
 }
 
-void get_filename_from_info(uint64_t checksum, bool oldFormat, struct GHQTexInfo* info, char* ident, char* filename)
+static inline uint32_t png_palette_slot(uint32_t color)
 {
-    const uint32_t chksum    = checksum & 0xffffffff;
-    const uint32_t palchksum = checksum >> 32;
-    const uint32_t n64fmt    = info->n64_format_size._format;
-    const uint32_t n64fmt_sz = info->n64_format_size._size;
+    return (color * 0x9E3779B1) >> 22;
+}
 
-    if (oldFormat)
+static inline uint8_t png_palette_index(const struct PngFormat* format, uint32_t color)
+{
+    uint32_t slot = png_palette_slot(color);
+    while (format->colors[slot] != color)
     {
-        if (palchksum == 0)
+        slot = (slot + 1) & (PNG_PALETTE_SLOTS - 1);
+    }
+    return format->indices[slot];
+}
+
+/* collects the colors of the texture, returns false when there are more than 256 */
+static bool build_png_palette(const uint8_t* data, size_t pixels, struct PngFormat* format)
+{
+    uint32_t colors[256];
+    int32_t count = 0;
+    uint32_t last = 0;
+
+    memset(format->used, 0, sizeof(format->used));
+
+    for (size_t i = 0; i < pixels; i++)
+    {
+        uint32_t color;
+        memcpy(&color, data + (i * 4), sizeof(color));
+
+        /* textures have long runs of the same color */
+        if (i > 0 && color == last)
         {
-            sprintf(filename, "%s#%08X#%01X#%01X_all.png", ident, chksum, 3, 0);
+            continue;
         }
-        else
+        last = color;
+
+        uint32_t slot = png_palette_slot(color);
+        while (format->used[slot] && format->colors[slot] != color)
         {
-            sprintf(filename, "%s#%08X#%01X#%01X#%08X_ciByRGBA.png", ident, chksum, 3, 0, palchksum);
+            slot = (slot + 1) & (PNG_PALETTE_SLOTS - 1);
+        }
+        if (format->used[slot])
+        {
+            continue;
+        }
+        if (count == 256)
+        {
+            return false;
+        }
+
+        format->used[slot]    = true;
+        format->colors[slot]  = color;
+        format->indices[slot] = (uint8_t)count;
+        colors[count++]       = color;
+    }
+
+    /* the tRNS chunk only has to cover the palette up to
+     * the last translucent color, so those come first */
+    uint8_t remap[256];
+    int32_t index = 0;
+    for (int32_t pass = 0; pass < 2; pass++)
+    {
+        for (int32_t i = 0; i < count; i++)
+        {
+            bool translucent = (colors[i] >> 24) != 0xFF;
+            if (translucent == (pass == 0))
+            {
+                remap[i] = (uint8_t)index;
+                format->palette[index].red   = colors[i] & 0xFF;
+                format->palette[index].green = (colors[i] >> 8) & 0xFF;
+                format->palette[index].blue  = (colors[i] >> 16) & 0xFF;
+                format->trans[index]         = colors[i] >> 24;
+                if (translucent)
+                {
+                    format->transSize = index + 1;
+                }
+                index++;
+            }
+        }
+    }
+    for (int32_t i = 0; i < PNG_PALETTE_SLOTS; i++)
+    {
+        if (format->used[i])
+        {
+            format->indices[i] = remap[format->indices[i]];
         }
     }
+
+    format->paletteSize = count;
+    format->bitDepth    = count <= 2 ? 1 : count <= 4 ? 2 : count <= 16 ? 4 : 8;
+    return true;
+}
+
+/* picks the smallest color type which doesn't lose anything */
+static void choose_png_format(struct GHQTexInfo* info, bool forceRgba, struct PngFormat* format)
+{
+    size_t pixels = (size_t)info->width * info->height;
+    bool opaque;
+    bool gray;
+
+    format->colorType   = PNG_COLOR_TYPE_RGBA;
+    format->bitDepth    = 8;
+    format->paletteSize = 0;
+    format->transSize   = 0;
+
+    if (forceRgba)
+    {
+        return;
+    }
+
+    uint64_t start = trace_begin();
+    scan_rgba8(info->data, pixels, &opaque, &gray);
+
+    /* the palette itself isn't compressed, so it only pays off with
+     * a lot more pixels than colors, gray is as small as a palette
+     * with 256 colors and deflates better, but with a few colors a
+     * palette has fewer bits per pixel */
+    if (build_png_palette(info->data, pixels, format) &&
+        pixels >= (size_t)format->paletteSize * 16 &&
+        !(gray && opaque && format->paletteSize > 16))
+    {
+        format->colorType = PNG_COLOR_TYPE_PALETTE;
+    }
+    else if (gray)
+    {
+        format->colorType = opaque ? PNG_COLOR_TYPE_GRAY : PNG_COLOR_TYPE_GRAY_ALPHA;
+        format->bitDepth  = 8;
+    }
+    else if (opaque)
+    {
+        format->colorType = PNG_COLOR_TYPE_RGB;
+        format->bitDepth  = 8;
+    }
     else
     {
-        if (n64fmt == 0x02)
+        format->bitDepth  = 8;
+    }
+    trace_end("scan", start, pixels * 4);
+}
+
+/* converts a row of RGBA8 pixels to the gray or palette color type,
+ * palette indices are 1 byte each, libpng packs them */
+static void convert_png_row(const uint8_t* src, int32_t width, const struct PngFormat* format, uint8_t* dest)
+{
+    switch (format->colorType)
+    {
+    case PNG_COLOR_TYPE_GRAY:
+        for (int32_t x = 0; x < width; x++)
         {
-            sprintf(filename, "%s#%08X#%01X#%01X_all.png", ident, chksum, n64fmt, n64fmt_sz);
+            dest[x] = src[x * 4];
         }
-        else
+        break;
+    case PNG_COLOR_TYPE_GRAY_ALPHA:
+        for (int32_t x = 0; x < width; x++)
         {
-            sprintf(filename, "%s#%08X#%01X#%01X#%08X_ciByRGBA.png", ident, chksum, n64fmt, n64fmt_sz, palchksum);
+            dest[(x * 2)]     = src[x * 4];
+            dest[(x * 2) + 1] = src[(x * 4) + 3];
         }
+        break;
+    case PNG_COLOR_TYPE_PALETTE:
+    {
+        uint32_t last = 0;
+        uint8_t index = 0;
+        for (int32_t x = 0; x < width; x++)
+        {
+            uint32_t color;
+            memcpy(&color, src + (x * 4), sizeof(color));
+            if (x == 0 || color != last)
+            {
+                index = png_palette_index(format, color);
+                last  = color;
+            }
+            dest[x] = index;
+        }
+        break;
+    }
     }
 }
 
-bool write_info_to_png(char* filename, struct GHQTexInfo* info)
+/* encodes the RGBA8 texture to output, which has to be set up already */
+static bool encode_png(struct PngOutput* output, struct GHQTexInfo* info, bool forceRgba)
 {
-    FILE* file = fopen(filename, "wb");
-    if (file == NULL)
+    struct PngFormat format;
+    uint64_t start = trace_begin();
+
+    choose_png_format(info, forceRgba, &format);
+
+    /* converted rows, RGB and RGBA are written as they are */
+    uint8_t* row = malloc((size_t)info->width * 2);
+    if (row == NULL)
     {
-        perror("fopen");
         return false;
     }
 
     png_structp png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
     if (png_ptr == NULL)
     {
-        fclose(file);
+        free(row);
         return false;
     }
 
@@ -170,257 +464,751 @@ bool write_info_to_png(char* filename, struct GHQTexInfo* info)
     if (info_ptr == NULL)
     {
         png_destroy_write_struct(&png_ptr, &info_ptr);
-        fclose(file);
+        free(row);
         return false;
     }
 
     if (setjmp(png_jmpbuf(png_ptr))) {
         png_destroy_write_struct(&png_ptr, &info_ptr);
-        fclose(file);
+        free(row);
         return false;
     }
 
-    png_init_io(png_ptr, file);
+    png_set_write_fn(png_ptr, output, png_output_write, png_output_flush);
 
-    if (setjmp(png_jmpbuf(png_ptr))) {
-        png_destroy_write_struct(&png_ptr, &info_ptr);
-        fclose(file);
-        return false;
-    }
-
-    png_byte bit_depth  = 8;
-    png_byte color_type = PNG_COLOR_TYPE_RGBA;
     png_set_IHDR(png_ptr, info_ptr, info->width, info->height, 
-        bit_depth, color_type, PNG_INTERLACE_NONE, 
+        format.bitDepth, format.colorType, PNG_INTERLACE_NONE, 
         PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
 
+    if (format.colorType == PNG_COLOR_TYPE_PALETTE)
+    {
+        png_set_PLTE(png_ptr, info_ptr, format.palette, format.paletteSize);
+        if (format.transSize > 0)
+        {
+            png_set_tRNS(png_ptr, info_ptr, format.trans, format.transSize, NULL);
+        }
+
+        /* libpng doesn't filter palette images by default, which
+         * makes gradients with 256 colors bigger than RGBA */
+        if (format.bitDepth == 8)
+        {
+            png_set_filter(png_ptr, PNG_FILTER_TYPE_BASE, PNG_ALL_FILTERS);
+        }
+    }
+
     png_write_info(png_ptr, info_ptr);
 
-    if (setjmp(png_jmpbuf(png_ptr))) {
-        png_destroy_write_struct(&png_ptr, &info_ptr);
-        fclose(file);
-        return false;
+    if (format.bitDepth < 8)
+    {
+        png_set_packing(png_ptr);
     }
 
     int pixel_size = 4;
-    int p = 0;
-    png_bytep* row_pointers = malloc(info->height * sizeof(png_bytep));
-    for (int y = 0; y < info->height; y++)
+    if (format.colorType == PNG_COLOR_TYPE_RGB || format.colorType == PNG_COLOR_TYPE_RGBA)
     {
-        row_pointers[y] = malloc(info->width * pixel_size);
-        for (int x = 0; x < info->width; x++)
+        /* libpng drops the alpha byte of RGB itself */
+        if (format.colorType == PNG_COLOR_TYPE_RGB)
         {
-            row_pointers[y][x * pixel_size + 0] = info->data[p++];
-            row_pointers[y][x * pixel_size + 1] = info->data[p++];
-            row_pointers[y][x * pixel_size + 2] = info->data[p++];
-            row_pointers[y][x * pixel_size + 3] = info->data[p++];
+            png_set_filler(png_ptr, 0, PNG_FILLER_AFTER);
+        }
+
+        /* the rows point into the texture data,
+         * so the image isn't copied again */
+        for (int y = 0; y < info->height; y++)
+        {
+            png_write_row(png_ptr, info->data + ((size_t)y * info->width * pixel_size));
+        }
+    }
+    else
+    {
+        for (int y = 0; y < info->height; y++)
+        {
+            convert_png_row(info->data + ((size_t)y * info->width * pixel_size), info->width, &format, row);
+            png_write_row(png_ptr, row);
         }
     }
 
-    png_write_image(png_ptr, row_pointers);
+    png_write_end(png_ptr, NULL);
+    png_output_flush(png_ptr);
+
+    png_destroy_write_struct(&png_ptr, &info_ptr);
+    free(row);
 
-    for (int y = 0; y < info->height; y++)
+    trace_end("encode", start, (uint64_t)info->width * info->height * 4);
+    return !output->error;
+}
+
+static bool write_info_to_png(char* filename, struct GHQTexInfo* info, bool forceRgba)
+{
+    struct PngOutput output = {0};
+
+    output.file = fopen(filename, "wb");
+    if (output.file == NULL)
     {
-        free(row_pointers[y]);
+        perror("fopen");
+        return false;
     }
-    free(row_pointers);
 
-    if (setjmp(png_jmpbuf(png_ptr))) {
-        png_destroy_write_struct(&png_ptr, &info_ptr);
-        fclose(file);
+    bool ret = encode_png(&output, info, forceRgba);
+    if (fclose(output.file) != 0 || !ret)
+    {
+        fprintf(stderr, "Error: %s: failed to write PNG\n", filename);
         return false;
     }
+    return true;
+}
 
-    png_write_end(png_ptr, NULL);
+/* encodes the texture and queues it in the archive as name */
+static bool add_info_to_archive(struct archive* archive, const char* name, struct GHQTexInfo* info, bool forceRgba)
+{
+    struct PngOutput output = {0};
 
-    png_destroy_write_struct(&png_ptr, &info_ptr);
+    if (!encode_png(&output, info, forceRgba))
+    {
+        fprintf(stderr, "Error: %s: failed to encode PNG\n", name);
+        free(output.data);
+        return false;
+    }
+
+    return archive_add_file(archive, name, output.data, output.dataSize);
+}
 
-    fclose(file);
+/* makes the PNGs written so far durable, including their renames */
+static bool sync_directory(const char* path)
+{
+#ifdef __linux__
+    int fd = open(path, O_RDONLY | O_DIRECTORY);
+    if (fd == -1)
+    {
+        return false;
+    }
+    bool ret = syncfs(fd) == 0;
+    close(fd);
+    return ret;
+#else
+    sync();
     return true;
+#endif /* __linux__ */
 }
 
-int main(int argc, char** argv)
+/* adds the texture to the journal, the PNG must've been renamed already */
+static bool checkpoint_texture(struct PackJob* pack, struct TextureJob* texture)
 {
-    if (argc < 2)
+    struct PngRecord record;
+    record.checksum = texture->checksum;
+    record.offset   = texture->offset._data;
+
+    bool ret    = true;
+    bool commit = false;
+    pthread_mutex_lock(&pack->mutex);
+    if (!journal_add(&pack->journal, &record, &commit))
     {
-        printf("Usage: %s [HTS FILE]\n", argv[0]);
-        return 1;
+        fprintf(stderr, "Error: %s: failed to allocate journal record\n", pack->filename);
+        ret = false;
     }
+    else if (commit)
+    {
+        uint64_t start = trace_begin();
+        if (!sync_directory(pack->ident) || !journal_commit(&pack->journal))
+        {
+            fprintf(stderr, "Error: %s: failed to write checkpoint\n", pack->filename);
+            ret = false;
+        }
+        trace_end("checkpoint", start, 0);
+    }
+    pthread_mutex_unlock(&pack->mutex);
+    return ret;
+}
 
+static void close_pack(struct PackJob* pack)
+{
+    if (pack->isOverlay)
+    {
+        overlay_free(&pack->overlay);
+    }
+    else
+    {
+        fclose(pack->file);
+        pack->file = NULL;
+    }
+}
+
+static void finish_pack(struct PackJob* pack)
+{
+    if (pack->checkpoint)
+    {
+        /* keep the journal for --resume when a texture failed */
+        bool done = atomic_load(&pack->failed) == 0;
+        if (!done && sync_directory(pack->ident))
+        {
+            journal_commit(&pack->journal);
+        }
+        journal_close(&pack->journal, pack->journalFilename, done);
+        pthread_mutex_destroy(&pack->mutex);
+    }
+
+    close_pack(pack);
+    free(pack->textures);
+    pack->textures = NULL;
+
+    int skipped = atomic_load(&pack->skipped);
+    if (skipped > 0)
+    {
+        fprintf(logFile, "-> Finished %s, skipped %i textures which were written before\n", pack->filename, skipped);
+    }
+    else
+    {
+        fprintf(logFile, "-> Finished %s\n", pack->filename);
+    }
+}
+
+static void convert_texture(void* arg)
+{
+    struct TextureJob* texture = (struct TextureJob*)arg;
+    struct PackJob* pack = texture->pack;
+    struct GHQTexInfo info = {0};
     char filename[PATH_MAX];
-    char* fname_ptr;
-    char ident[PATH_MAX];
-    char* base_ident;
-    memset(ident, 0, PATH_MAX);
+    char path[PATH_MAX * 2];
+    char partPath[(PATH_MAX * 2) + 8];
+    struct stat st;
+    bool ret = false;
+    uint64_t memorySize = 0;
+    uint64_t start = 0;
+
+    if (!pread_info(texture->fd, texture->offset._offset, pack->oldFormat, &info, false))
+    {
+        fprintf(stderr, "Error: %s: failed to read texture %i\n", pack->filename, texture->index);
+        goto out;
+    }
+
+    get_filename_from_info(texture->checksum, pack->oldFormat, &info, pack->base_ident, filename);
+    snprintf(path, sizeof(path), "%s/%s", pack->archive != NULL ? pack->base_ident : pack->ident, filename);
+
+    /* written before it was interrupted */
+    if (texture->done && stat(path, &st) == 0)
+    {
+        atomic_fetch_add(&pack->skipped, 1);
+        ret = true;
+        goto out;
+    }
+
+    /* the texture data, the inflated data and
+     * the RGBA8 copy can all be alive at once */
+    memorySize = info.dataSize;
+    if (info.format & GL_TEXFMT_GZ)
+    {
+        memorySize += texture_inflated_size(&info);
+    }
+    if (info.pixel_type != GL_UNSIGNED_BYTE)
+    {
+        memorySize += (uint64_t)info.width * info.height * 4;
+    }
+    trace_texture(texture->checksum, info.width, info.height);
+    start = trace_begin();
+    memory_budget_acquire(pack->budget, memorySize);
+    trace_end("wait", start, memorySize);
+
+    start = trace_begin();
+    if (!pread_info_data(texture->fd, texture->offset._offset, pack->oldFormat, &info))
+    {
+        fprintf(stderr, "Error: %s: failed to read texture %i\n", pack->filename, texture->index);
+        goto out;
+    }
+    trace_end("read", start, info.dataSize);
+
+    if (info.format & GL_TEXFMT_GZ)
+    {
+        start = trace_begin();
+        if (!decompress_texture(&info))
+        {
+            fprintf(stderr, "Error: %s: failed to decompress texture %i\n", pack->filename, texture->index);
+            goto out;
+        }
+        trace_end("inflate", start, info.dataSize);
+    }
+
+    if (texture_pixel_size(&info) == 0 ||
+        (size_t)info.width * info.height * texture_pixel_size(&info) > info.dataSize)
+    {
+        fprintf(stderr, "Error: %s: unsupported texture %i\n", pack->filename, texture->index);
+        goto out;
+    }
+
+    /* PNGs are written as RGBA8 */
+    if (info.pixel_type != GL_UNSIGNED_BYTE)
+    {
+        start = trace_begin();
+        uint8_t* data = malloc((size_t)info.width * info.height * 4);
+        if (data == NULL)
+        {
+            goto out;
+        }
+        texture_to_rgba8(&info, data);
+        free(info.data);
+        info.data = data;
+        trace_end("convert", start, (uint64_t)info.width * info.height * 4);
+    }
+
+#ifdef VERBOSE
+    fprintf(logFile, "-> [%i/%i] writing %s\n"
+                     "-> info.width = %i\n"
+                     "-> info.height = %i\n"
+                     "-> info.format = %u\n"
+                     "-> info.texture_format = %i\n"
+                     "-> info.pixel_type = %i\n"
+                     "-> info.is_hires_tex = %i\n"
+                     "-> info.n64_format_size = %i\n", 
+                      (texture->index + 1), pack->mappingSize, path,
+                      info.width,
+                      info.height,
+                      info.format,
+                      info.texture_format,
+                      info.pixel_type,
+                      info.is_hires_tex,
+                      info.n64_format_size._formatsize);
+#endif // VERBOSE
+
+    if (pack->archive != NULL)
+    {
+        if (!add_info_to_archive(pack->archive, path, &info, pack->rgba))
+        {
+            fprintf(stderr, "Error: %s: failed to add %s to the archive!\n", pack->filename, path);
+            goto out;
+        }
+        ret = true;
+        goto out;
+    }
+
+    /* an interrupted run never leaves a partial PNG behind */
+    snprintf(partPath, sizeof(partPath), "%s.part", path);
+    if (!write_info_to_png(partPath, &info, pack->rgba) ||
+        rename(partPath, path) == -1)
+    {
+        fprintf(stderr, "Error: %s: write_info_to_png failed!\n", pack->filename);
+        unlink(partPath);
+        goto out;
+    }
 
-    strcpy(filename, argv[1]);
+    if (pack->checkpoint && !checkpoint_texture(pack, texture))
+    {
+        goto out;
+    }
+
+    ret = true;
+out:
+    free(info.data);
+    memory_budget_release(pack->budget, memorySize);
+    if (!ret)
+    {
+        atomic_fetch_add(&pack->failed, 1);
+    }
+    if (atomic_fetch_sub(&pack->remaining, 1) == 1)
+    {
+        finish_pack(pack);
+    }
+}
+
+/* opens the journal of the pack and marks the
+ * textures it has as done when resuming */
+static bool open_journal(struct PackJob* pack, int32_t mappingSize)
+{
+    struct journal_identity identity;
+    struct hts_index done;
+    struct PngRecord* records;
+    void* journalRecords;
+    size_t count;
+
+    snprintf(pack->journalFilename, sizeof(pack->journalFilename), "%s/.hts2png.journal", pack->ident);
+
+    if (!journal_identity(pack->filename, sizeof(struct PngRecord), (uint64_t)mappingSize, &identity) ||
+        !journal_open(&pack->journal, pack->journalFilename, &identity, pack->resume, &journalRecords, &count))
+    {
+        return false;
+    }
+    records = journalRecords;
+
+    pthread_mutex_init(&pack->mutex, NULL);
+
+    if (count == 0)
+    {
+        free(records);
+        return true;
+    }
+
+    if (!hts_index_init(&done, count))
+    {
+        free(records);
+        journal_close(&pack->journal, pack->journalFilename, false);
+        pthread_mutex_destroy(&pack->mutex);
+        return false;
+    }
+
+    for (size_t i = 0; i < count; i++)
+    {
+        union StorageOffset offset;
+        offset._data = records[i].offset;
+        hts_index_insert(&done, records[i].checksum, offset._formatsize, offset._offset, NULL);
+    }
+
+    /* the offset has to match as well, so a texture
+     * which changed in the pack is written again */
+    for (int32_t i = 0; i < mappingSize; i++)
+    {
+        struct TextureJob* texture = &pack->textures[i];
+        texture->done = hts_index_find(&done, texture->checksum, texture->offset._formatsize) == texture->offset._offset;
+    }
+
+    fprintf(logFile, "-> Resuming %s, %zu textures were written before\n", pack->filename, count);
+
+    hts_index_free(&done);
+    free(records);
+    return true;
+}
+
+static void open_pack(void* arg)
+{
+    struct PackJob* pack = (struct PackJob*)arg;
+    char* fname_ptr;
 
     /* make sure end of filename contains _hirestextures.hts */
-    if ((fname_ptr = strstr(filename, "_HIRESTEXTURES.hts")) == NULL)
+    if ((fname_ptr = strstr(pack->filename, "_HIRESTEXTURES.hts")) == NULL)
     {
-        printf("filename doesn't contain _HIRESTEXTURES.hts!\n");
-        return 1;
+        fprintf(stderr, "Error: %s: filename doesn't contain _HIRESTEXTURES.hts!\n", pack->filename);
+        pack->error = true;
+        return;
     }
 
     /* retrieve ident */
-    strncpy(ident, filename, fname_ptr - filename);
-    base_ident = basename(ident);
+    strncpy(pack->ident, pack->filename, fname_ptr - pack->filename);
+    strcpy(pack->base_ident, pack->ident);
+    fname_ptr = basename(pack->base_ident);
+    memmove(pack->base_ident, fname_ptr, strlen(fname_ptr) + 1);
+
+    if (overlay_filename(pack->filename))
+    {
+        /* every texture is read from the base which has it */
+        if (!overlay_read(&pack->overlay, pack->filename) ||
+            !overlay_open_bases(&pack->overlay))
+        {
+            overlay_free(&pack->overlay);
+            pack->error = true;
+            return;
+        }
+        pack->isOverlay = true;
+        pack->oldFormat = pack->overlay.oldFormat;
+    }
+    else
+    {
+        pack->file = fopen(pack->filename, "rb");
+        if (pack->file == NULL)
+        {
+            fprintf(stderr, "Error: %s: fopen: %s\n", pack->filename, strerror(errno));
+            pack->error = true;
+            return;
+        }
+
+        /* read file header & mapping */
+        if (!check_header(pack->file, &pack->oldFormat, NULL))
+        {
+            fprintf(stderr, "Error: %s: invalid header\n", pack->filename);
+            fclose(pack->file);
+            pack->error = true;
+            return;
+        }
+    }
 
     /* create directory for ident */
     struct stat st;
-    if (stat(ident, &st) == -1 &&
+    if (pack->archive != NULL)
+    {
+        char directory[PATH_MAX + 1];
+        snprintf(directory, sizeof(directory), "%s/", pack->base_ident);
+        archive_add_directory(pack->archive, directory);
+    }
+    else if (stat(pack->ident, &st) == -1 &&
 #ifdef _WIN32
-        mkdir(ident) == -1)
+        mkdir(pack->ident) == -1)
 #else
-        mkdir(ident, 0700) == -1)
+        mkdir(pack->ident, 0700) == -1)
 #endif /* _WIN32 */
     {
-        perror("mkdir");
-        return 1;
+        fprintf(stderr, "Error: %s: mkdir: %s\n", pack->ident, strerror(errno));
+        close_pack(pack);
+        pack->error = true;
+        return;
     }
 
-    FILE* file = fopen(filename, "rb");
-    if (file == NULL)
+    fprintf(logFile, "-> Processing %s...\n", pack->filename);
+
+    FILE*   file          = pack->file;
+    int64_t mappingOffset = -1;
+    int32_t mappingSize   = -1;
+
+#define FREAD(x) fread(&x, sizeof(x), 1, file)
+    if (pack->isOverlay)
     {
-        perror("fopen");
-        return 1;
+        /* the merged mapping is in the manifest */
+        mappingSize = pack->overlay.entryCount <= INT32_MAX ? (int32_t)pack->overlay.entryCount : -1;
     }
+    else
+    {
+        FREAD(mappingOffset);
+
+        /* seek to mapping */
+        FSEEK(file, mappingOffset, SEEK_SET);
 
-    /* change directory to ident */
-    if (chdir(ident) == -1)
+        FREAD(mappingSize);
+    }
+
+    pack->textures = calloc(mappingSize > 0 ? mappingSize : 1, sizeof(struct TextureJob));
+    if (mappingSize < 0 || pack->textures == NULL)
     {
-        perror("chdir");
-        return 1;
+        fprintf(stderr, "Error: %s: invalid mapping\n", pack->filename);
+        close_pack(pack);
+        free(pack->textures);
+        pack->error = true;
+        return;
     }
 
-#define FREAD(x) fread(&x, sizeof(x), 1, file)
-#ifdef _WIN32
-#define FSEEK(x, y, z) _fseeki64(x, y, z)
-#define FTELL(x) _ftelli64(x)
-#else
-#define FSEEK(x, y, z) fseek(x, y, z)
-#define FTELL(x) ftell(x)
-#endif
-    /* read file header & mapping */
-    bool    oldFormat = false;
-    int32_t version   = -1;
-    int32_t header    = -1;
-    int64_t mappingOffset = -1;
-    int32_t mappingSize   = -1;
+    for (int32_t i = 0; i < mappingSize; i++)
+    {
+        struct TextureJob* texture = &pack->textures[i];
+        texture->pack  = pack;
+        texture->index = i;
+        if (pack->isOverlay)
+        {
+            const struct overlay_entry* entry = &pack->overlay.entries[i];
+            texture->checksum     = entry->checksum;
+            texture->offset._data = entry->offset;
+            texture->fd           = pack->overlay.bases[entry->base].fd;
+        }
+        else
+        {
+            FREAD(texture->checksum);
+            FREAD(texture->offset._data);
+            texture->fd = fileno(file);
+        }
+    }
+#undef FREAD
 
-    /* determine HTS format */
-    FREAD(version);
-    if (version == TXCACHE_FORMAT_VERSION)
+    if (pack->checkpoint && !open_journal(pack, mappingSize))
     {
-        FREAD(header);
-        oldFormat = false;
+        fprintf(stderr, "Error: %s: failed to open journal %s\n", pack->filename, pack->journalFilename);
+        close_pack(pack);
+        free(pack->textures);
+        pack->error = true;
+        return;
     }
-    else
+
+    pack->mappingSize = mappingSize;
+    atomic_store(&pack->remaining, mappingSize);
+    if (mappingSize == 0)
     {
-        header = version;
-        oldFormat = true;
+        finish_pack(pack);
+        return;
     }
-    
-    if (/* uncompressed HTS */
-        header != 1075970048 &&
-        /* compressed HTS */
-        header != 1084358656)
+
+    /* every texture is converted on its own,
+     * so big and small packs share the workers */
+    for (int32_t i = 0; i < mappingSize; i++)
     {
-        fprintf(stderr, "expected header = 1075970048 or 1084358656\n");
-        fprintf(stderr, "got header = %i\n", header);
-        return 1;
+        threadpool_submit(pack->pool, convert_texture, &pack->textures[i]);
     }
+}
 
-    printf("-> Processing %s...\n", filename);
+int main(int argc, char** argv)
+{
+    struct batch_inputs inputs = {0};
+    int32_t threads = threadpool_default_threads();
+    uint64_t maxMemory = 0;
+    struct memory_budget budget;
+    const char* traceFilename = NULL;
+    bool rgba = false;
+    bool checkpoint = false;
+    bool resume = false;
+    const char* tarFilename = NULL;
+    char tarPartFilename[PATH_MAX];
+    struct archive archive;
 
-    FREAD(mappingOffset);
+    logFile = stdout;
 
-    /* seek to mapping */
-    FSEEK(file, mappingOffset, SEEK_SET);
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-j") == 0 && (i + 1) < argc)
+        {
+            threads = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--trace") == 0 && (i + 1) < argc)
+        {
+            traceFilename = argv[++i];
+        }
+        else if (strcmp(argv[i], "--tar") == 0 && (i + 1) < argc)
+        {
+            tarFilename = argv[++i];
+        }
+        else if (strcmp(argv[i], "--rgba") == 0)
+        {
+            rgba = true;
+        }
+        else if (strcmp(argv[i], "--checkpoint") == 0)
+        {
+            checkpoint = true;
+        }
+        else if (strcmp(argv[i], "--resume") == 0)
+        {
+            /* resuming needs the journal too */
+            checkpoint = true;
+            resume = true;
+        }
+        else if (strcmp(argv[i], "--max-memory") == 0 && (i + 1) < argc)
+        {
+            if (!memory_budget_parse(argv[++i], &maxMemory))
+            {
+                fprintf(stderr, "Error: invalid memory size: %s\n", argv[i]);
+                batch_inputs_free(&inputs);
+                return 1;
+            }
+        }
+        else if (!batch_inputs_collect(&inputs, argv[i], "_HIRESTEXTURES.hts"))
+        {
+            batch_inputs_free(&inputs);
+            return 1;
+        }
+    }
 
-    FREAD(mappingSize);
+    if (inputs.count == 0)
+    {
+        printf("Usage: %s [HTS FILE|HTSO FILE|DIRECTORY]... [-j THREADS] [--max-memory SIZE] [--trace JSON FILE] [--rgba] [--tar FILE|-] [--checkpoint] [--resume]\n", argv[0]);
+        batch_inputs_free(&inputs);
+        return 1;
+    }
 
-    for (int32_t i = 0; i < mappingSize; i++)
+    /* there's nothing to resume in an archive */
+    if (tarFilename != NULL && checkpoint)
     {
-        /* write each file to PNG */
-        uint64_t checksum = 0;
-        union StorageOffset offset;
-        int64_t currentOffset = 0;
-        struct GHQTexInfo info = {0};
-        char filename[PATH_MAX];
+        fprintf(stderr, "Error: --tar can't be combined with --checkpoint or --resume\n");
+        batch_inputs_free(&inputs);
+        return 1;
+    }
 
-        FREAD(checksum);
-        FREAD(offset._data);
+    struct PackJob* packs = calloc(inputs.count, sizeof(struct PackJob));
+    struct threadpool* pool = threadpool_create(threads);
+    if (packs == NULL || pool == NULL)
+    {
+        fprintf(stderr, "Error: failed to create thread pool\n");
+        free(packs);
+        batch_inputs_free(&inputs);
+        return 1;
+    }
 
-        /* store current offset */
-        currentOffset = FTELL(file);
+    if (traceFilename != NULL && !trace_open(traceFilename, "hts2png"))
+    {
+        free(packs);
+        threadpool_destroy(pool);
+        batch_inputs_free(&inputs);
+        return 1;
+    }
 
-        /* seek to texture */
-        FSEEK(file, offset._offset, SEEK_SET);
+    if (tarFilename != NULL)
+    {
+        FILE* tarFile = stdout;
+        if (strcmp(tarFilename, "-") == 0)
+        {
+            logFile = stderr;
+        }
+        else
+        {
+            /* the archive is renamed into place when it's complete */
+            snprintf(tarPartFilename, sizeof(tarPartFilename), "%s.part", tarFilename);
+            tarFile = fopen(tarPartFilename, "wb");
+        }
 
-        if (!read_info(file, oldFormat, &info))
+        if (tarFile == NULL || !archive_open(&archive, tarFile, tarFile != stdout, time(NULL)))
         {
-            printf("read_info failed!\n");
-            continue;
+            fprintf(stderr, "Error: %s: %s\n", tarFilename, strerror(errno));
+            if (tarFile != NULL && tarFile != stdout)
+            {
+                fclose(tarFile);
+            }
+            trace_close();
+            free(packs);
+            threadpool_destroy(pool);
+            batch_inputs_free(&inputs);
+            return 1;
         }
+    }
 
-        get_filename_from_info(checksum, oldFormat, &info, base_ident, filename);
+    memory_budget_init_malloc(maxMemory);
 
-#ifdef VERBOSE
-        if (oldFormat)
-        {
-            printf("-> [%i/%i] writing %s\n"
-                   "-> info.width = %i\n"
-                   "-> info.height = %i\n"
-                   "-> info.format = %u\n"
-                   "-> info.texture_format = %i\n"
-                   "-> info.pixel_type = %i\n"
-                   "-> info.is_hires_tex = %i\n", 
-                    (i + 1), mappingSize, filename,
-                    info.width,
-                    info.height,
-                    info.format,
-                    info.texture_format,
-                    info.pixel_type,
-                    info.is_hires_tex);
+    memory_budget_init(&budget, maxMemory);
+
+    for (int32_t i = 0; i < inputs.count; i++)
+    {
+        packs[i].pool   = pool;
+        packs[i].budget = &budget;
+        packs[i].archive = tarFilename != NULL ? &archive : NULL;
+        packs[i].rgba = rgba;
+        packs[i].checkpoint = checkpoint;
+        packs[i].resume = resume;
+        snprintf(packs[i].filename, PATH_MAX, "%s", inputs.paths[i]);
+        threadpool_submit(pool, open_pack, &packs[i]);
+    }
+
+    threadpool_wait(pool);
+    threadpool_destroy(pool);
+
+    int ret = 0;
+    if (tarFilename != NULL)
+    {
+        if (!archive_close(&archive) ||
+            (strcmp(tarFilename, "-") != 0 && rename(tarPartFilename, tarFilename) == -1))
+        {
+            fprintf(stderr, "Error: %s: failed to write archive\n", tarFilename);
+            ret = 1;
         }
         else
         {
-            printf("-> [%i/%i] writing %s\n"
-                   "-> info.width = %i\n"
-                   "-> info.height = %i\n"
-                   "-> info.format = %u\n"
-                   "-> info.texture_format = %i\n"
-                   "-> info.pixel_type = %i\n"
-                   "-> info.is_hires_tex = %i\n"
-                   "-> info.n64_format_size = %i\n", 
-                    (i + 1), mappingSize, filename,
-                    info.width,
-                    info.height,
-                    info.format,
-                    info.texture_format,
-                    info.pixel_type,
-                    info.is_hires_tex,
-                    info.n64_format_size._formatsize);
+            fprintf(logFile, "-> Wrote %llu files (%.1f MiB) to %s\n", (unsigned long long)archive.files,
+                    archive.bytes / (1024.0 * 1024.0), strcmp(tarFilename, "-") == 0 ? "stdout" : tarFilename);
         }
-#endif // VERBOSE
+    }
 
-        if (!write_info_to_png(filename, &info))
+    trace_close();
+
+    memory_budget_report(logFile, &budget);
+    memory_budget_destroy(&budget);
+
+    /* report every pack, one bad
+     * pack doesn't stop the others */
+    if (inputs.count > 1)
+    {
+        fprintf(logFile, "-> Summary:\n");
+    }
+    for (int32_t i = 0; i < inputs.count; i++)
+    {
+        struct PackJob* pack = &packs[i];
+        int failed = atomic_load(&pack->failed);
+        if (pack->error || failed > 0)
         {
-            fprintf(stderr, "write_info_to_png failed!\n");
-            free(info.data);
-            return 1;
+            ret = 1;
         }
 
-        free(info.data);
+        if (inputs.count == 1 && !pack->error && failed == 0)
+        {
+            continue;
+        }
 
-        /* restore offset */
-        FSEEK(file, currentOffset, SEEK_SET);
+        if (pack->error)
+        {
+            fprintf(logFile, "   %s: failed\n", pack->filename);
+        }
+        else
+        {
+            fprintf(logFile, "   %s: %i textures, %i failed\n", pack->filename, pack->mappingSize, failed);
+        }
     }
 
-#undef FSEEK
-#undef FREAD
-    
-    fclose(file);
-    return 0;
+    free(packs);
+    batch_inputs_free(&inputs);
+    return ret;
 }
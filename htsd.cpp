@@ -0,0 +1,638 @@
+/*
+ * texturepack_utils - https://github.com/Rosalie241/texturepack_utils
+ *  Copyright (C) 2023 Rosalie Wanders <rosalie@mailbox.org>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 3.
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef _WIN32
+#include <linux/limits.h>
+#endif /* _WIN32 */
+#include "hts.h"
+#include "budget.h"
+#include "index.h"
+#include "htsd.h"
+#include "htsi.h"
+#include <signal.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+struct Pack
+{
+    char                filename[PATH_MAX];
+    bool                oldFormat;
+    const uint8_t*      data;
+    size_t              size;
+    /* (checksum, formatsize) -> offset, from the
+     * sidecar when there's one which matches */
+    struct hts_index    mapping;
+    struct htsi         sidecar;
+    bool                hasSidecar;
+};
+
+/* texture data which was inflated and converted to RGBA8,
+ * it stays alive while a connection is still sending it */
+struct CachedTexture
+{
+    int32_t              refs;
+    struct htsd_response header;
+    uint8_t*             data;
+};
+
+struct CacheEntry
+{
+    uint64_t              key;
+    struct CachedTexture* texture;
+    /* least recently used list, -1 terminated */
+    int32_t               prev;
+    int32_t               next;
+};
+
+struct TextureCache
+{
+    pthread_mutex_t    mutex;
+    /* key -> entry */
+    struct hts_index   index;
+    struct CacheEntry* entries;
+    int32_t            capacity;
+    int32_t            freeEntry;
+    /* most and least recently used entry */
+    int32_t            head;
+    int32_t            tail;
+    uint64_t           limit;
+    uint64_t           used;
+    uint64_t           hits;
+    uint64_t           misses;
+    uint64_t           evictions;
+};
+
+static struct Pack*        packs     = NULL;
+static int32_t             packCount = 0;
+static struct TextureCache cache;
+static volatile sig_atomic_t stop    = 0;
+
+static bool open_pack(struct Pack* pack, const char* filename)
+{
+    snprintf(pack->filename, sizeof(pack->filename), "%s", filename);
+
+    FILE* file = fopen(filename, "rb");
+    if (file == NULL)
+    {
+        perror("fopen");
+        return false;
+    }
+
+    /* read file header & mapping */
+    if (!check_header(file, &pack->oldFormat, NULL))
+    {
+        fprintf(stderr, "Error: %s: invalid header\n", filename);
+        fclose(file);
+        return false;
+    }
+
+    int64_t mappingOffset = -1;
+    int32_t mappingSize   = -1;
+    struct stat st;
+
+    if (fstat(fileno(file), &st) == -1)
+    {
+        perror("fstat");
+        fclose(file);
+        return false;
+    }
+
+    /* a sidecar which matches the pack replaces the mapping */
+    enum htsi_status status = htsi_open(&pack->sidecar, filename, fileno(file));
+    if (status == HTSI_OK)
+    {
+        pack->hasSidecar = true;
+        mappingSize = (int32_t)pack->sidecar.header->keyCount;
+    }
+    else if (status != HTSI_MISSING)
+    {
+        printf("-> %s: index sidecar is %s, reading the mapping\n", filename, htsi_status_string(status));
+    }
+
+#define FREAD(x) fread(&x, sizeof(x), 1, file)
+    if (!pack->hasSidecar &&
+        (FREAD(mappingOffset) != 1 ||
+         mappingOffset < 0 || mappingOffset >= st.st_size ||
+         FSEEK(file, mappingOffset, SEEK_SET) != 0 ||
+         FREAD(mappingSize) != 1 || mappingSize < 0 ||
+         !hts_index_init(&pack->mapping, mappingSize)))
+    {
+        fprintf(stderr, "Error: %s: invalid mapping\n", filename);
+        fclose(file);
+        return false;
+    }
+
+    for (int32_t i = 0; i < mappingSize && !pack->hasSidecar; i++)
+    {
+        uint64_t checksum;
+        union StorageOffset offset;
+        if (FREAD(checksum) != 1 || FREAD(offset._data) != 1)
+        {
+            fprintf(stderr, "Error: %s: truncated mapping\n", filename);
+            hts_index_free(&pack->mapping);
+            fclose(file);
+            return false;
+        }
+        hts_index_insert(&pack->mapping, checksum, (uint16_t)offset._formatsize, offset._offset, NULL);
+    }
+#undef FREAD
+
+    /* the payloads are served straight from the mapping,
+     * the page cache is the cache of the raw data */
+    void* data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fileno(file), 0);
+    fclose(file);
+    if (data == MAP_FAILED)
+    {
+        perror("mmap");
+        hts_index_free(&pack->mapping);
+        htsi_close(&pack->sidecar);
+        return false;
+    }
+    madvise(data, st.st_size, MADV_RANDOM);
+
+    pack->data = (const uint8_t*)data;
+    pack->size = st.st_size;
+
+    printf("-> Serving %s (%i textures%s)\n", filename, mappingSize, pack->hasSidecar ? ", index sidecar" : "");
+    return true;
+}
+
+/* finds the texture, packs given later take precedence,
+ * old format packs don't store the formatsize */
+static bool find_texture(uint64_t checksum, uint16_t formatsize, int32_t* packIndex, int64_t* offset)
+{
+    for (int32_t i = packCount - 1; i >= 0; i--)
+    {
+        uint16_t key = packs[i].oldFormat ? 0 : formatsize;
+        *offset = packs[i].hasSidecar ? htsi_find(&packs[i].sidecar, checksum, key)
+                                      : hts_index_find(&packs[i].mapping, checksum, key);
+        if (*offset != -1)
+        {
+            *packIndex = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool cache_init(struct TextureCache* cache, uint64_t limit)
+{
+    memset(cache, 0, sizeof(struct TextureCache));
+    pthread_mutex_init(&cache->mutex, NULL);
+    cache->limit     = limit;
+    cache->freeEntry = -1;
+    cache->head      = -1;
+    cache->tail      = -1;
+    return hts_index_init(&cache->index, 0);
+}
+
+static void cache_unlink(struct TextureCache* cache, int32_t index)
+{
+    struct CacheEntry* entry = &cache->entries[index];
+    if (entry->prev != -1)
+    {
+        cache->entries[entry->prev].next = entry->next;
+    }
+    else
+    {
+        cache->head = entry->next;
+    }
+    if (entry->next != -1)
+    {
+        cache->entries[entry->next].prev = entry->prev;
+    }
+    else
+    {
+        cache->tail = entry->prev;
+    }
+}
+
+static void cache_push_front(struct TextureCache* cache, int32_t index)
+{
+    struct CacheEntry* entry = &cache->entries[index];
+    entry->prev = -1;
+    entry->next = cache->head;
+    if (cache->head != -1)
+    {
+        cache->entries[cache->head].prev = index;
+    }
+    cache->head = index;
+    if (cache->tail == -1)
+    {
+        cache->tail = index;
+    }
+}
+
+/* has to be called with the mutex held */
+static void cache_unref(struct CachedTexture* texture)
+{
+    if (--texture->refs == 0)
+    {
+        free(texture->data);
+        free(texture);
+    }
+}
+
+static void cache_release(struct TextureCache* cache, struct CachedTexture* texture)
+{
+    pthread_mutex_lock(&cache->mutex);
+    cache_unref(texture);
+    pthread_mutex_unlock(&cache->mutex);
+}
+
+/* returns the cached texture with a reference, or NULL */
+static struct CachedTexture* cache_get(struct TextureCache* cache, uint64_t key)
+{
+    struct CachedTexture* texture = NULL;
+
+    pthread_mutex_lock(&cache->mutex);
+    int64_t index = hts_index_find(&cache->index, key, 0);
+    if (index != -1)
+    {
+        cache_unlink(cache, (int32_t)index);
+        cache_push_front(cache, (int32_t)index);
+        texture = cache->entries[index].texture;
+        texture->refs++;
+        cache->hits++;
+    }
+    else
+    {
+        cache->misses++;
+    }
+    pthread_mutex_unlock(&cache->mutex);
+    return texture;
+}
+
+/* adds the texture, which has a reference of the caller, and returns
+ * the texture to use, which is a different one when another connection
+ * added the same texture in the meantime */
+static struct CachedTexture* cache_put(struct TextureCache* cache, uint64_t key, struct CachedTexture* texture)
+{
+    /* textures which don't fit aren't cached at all */
+    if (texture->header.dataSize > cache->limit)
+    {
+        return texture;
+    }
+
+    pthread_mutex_lock(&cache->mutex);
+
+    int64_t existing = hts_index_find(&cache->index, key, 0);
+    if (existing != -1)
+    {
+        cache_unref(texture);
+        texture = cache->entries[existing].texture;
+        texture->refs++;
+        pthread_mutex_unlock(&cache->mutex);
+        return texture;
+    }
+
+    /* evict the least recently used textures until it fits */
+    while (cache->tail != -1 && (cache->used + texture->header.dataSize) > cache->limit)
+    {
+        int32_t index = cache->tail;
+        struct CacheEntry* entry = &cache->entries[index];
+        cache_unlink(cache, index);
+        hts_index_remove(&cache->index, entry->key, 0);
+        cache->used -= entry->texture->header.dataSize;
+        cache_unref(entry->texture);
+        entry->texture = NULL;
+        entry->next = cache->freeEntry;
+        cache->freeEntry = index;
+        cache->evictions++;
+    }
+
+    if (cache->freeEntry == -1)
+    {
+        int32_t capacity = cache->capacity == 0 ? 1024 : cache->capacity * 2;
+        struct CacheEntry* entries = (struct CacheEntry*)realloc(cache->entries, capacity * sizeof(struct CacheEntry));
+        if (entries == NULL)
+        {
+            pthread_mutex_unlock(&cache->mutex);
+            return texture;
+        }
+        for (int32_t i = capacity - 1; i >= cache->capacity; i--)
+        {
+            entries[i].texture = NULL;
+            entries[i].next = cache->freeEntry;
+            cache->freeEntry = i;
+        }
+        cache->entries  = entries;
+        cache->capacity = capacity;
+    }
+
+    int32_t index = cache->freeEntry;
+    if (!hts_index_insert(&cache->index, key, 0, index, NULL))
+    {
+        pthread_mutex_unlock(&cache->mutex);
+        return texture;
+    }
+    cache->freeEntry = cache->entries[index].next;
+
+    cache->entries[index].key     = key;
+    cache->entries[index].texture = texture;
+    cache_push_front(cache, index);
+    cache->used += texture->header.dataSize;
+    /* one reference for the cache, one for the caller */
+    texture->refs++;
+
+    pthread_mutex_unlock(&cache->mutex);
+    return texture;
+}
+
+/* inflates the texture at offset and converts it to RGBA8 */
+static struct CachedTexture* load_texture(struct Pack* pack, int64_t offset, const struct GHQTexInfo* info)
+{
+    const uint8_t* payload = pack->data + offset + info_header_size(pack->oldFormat);
+    struct GHQTexInfo texture = *info;
+    uint8_t* inflated = NULL;
+
+    size_t inflatedSize = texture_inflated_size(&texture);
+    if (inflatedSize == 0)
+    {
+        return NULL;
+    }
+
+    if (texture.format & GL_TEXFMT_GZ)
+    {
+        uLongf destLen = inflatedSize;
+        inflated = (uint8_t*)malloc(inflatedSize);
+        if (inflated == NULL ||
+            uncompress(inflated, &destLen, payload, texture.dataSize) != Z_OK ||
+            destLen != inflatedSize)
+        {
+            free(inflated);
+            return NULL;
+        }
+        texture.data = inflated;
+    }
+    else if (texture.dataSize >= inflatedSize)
+    {
+        texture.data = (uint8_t*)payload;
+    }
+    else
+    {
+        return NULL;
+    }
+
+    struct CachedTexture* cached = (struct CachedTexture*)calloc(1, sizeof(struct CachedTexture));
+    uint8_t* rgba = (uint8_t*)malloc((size_t)texture.width * texture.height * 4);
+    if (cached == NULL || rgba == NULL)
+    {
+        free(cached);
+        free(rgba);
+        free(inflated);
+        return NULL;
+    }
+
+    texture_to_rgba8(&texture, rgba);
+    free(inflated);
+
+    cached->refs                  = 1;
+    cached->data                  = rgba;
+    cached->header.status         = HTSD_STATUS_OK;
+    cached->header.width          = texture.width;
+    cached->header.height         = texture.height;
+    cached->header.format         = GL_RGBA8;
+    cached->header.texture_format = GL_RGBA;
+    cached->header.pixel_type     = GL_UNSIGNED_BYTE;
+    cached->header.formatsize     = (uint16_t)texture.n64_format_size._formatsize;
+    cached->header.is_hires_tex   = texture.is_hires_tex;
+    cached->header.dataSize       = (uint32_t)((size_t)texture.width * texture.height * 4);
+    return cached;
+}
+
+static bool send_status(int fd, uint32_t status)
+{
+    struct htsd_response response;
+    memset(&response, 0, sizeof(response));
+    response.status = status;
+    return htsd_write_full(fd, &response, sizeof(response));
+}
+
+static bool serve_request(int fd, const struct htsd_request* request)
+{
+    if (request->magic != HTSD_MAGIC ||
+        (request->mode != HTSD_MODE_RAW && request->mode != HTSD_MODE_RGBA))
+    {
+        send_status(fd, HTSD_STATUS_BAD_REQUEST);
+        /* the stream can't be trusted anymore */
+        return false;
+    }
+
+    int32_t packIndex;
+    int64_t offset;
+    if (!find_texture(request->checksum, request->formatsize, &packIndex, &offset))
+    {
+        return send_status(fd, HTSD_STATUS_NOT_FOUND);
+    }
+
+    struct Pack* pack = &packs[packIndex];
+    struct GHQTexInfo info;
+    memset(&info, 0, sizeof(info));
+    int32_t headerSize = info_header_size(pack->oldFormat);
+    if ((uint64_t)offset + headerSize > pack->size)
+    {
+        return send_status(fd, HTSD_STATUS_ERROR);
+    }
+    parse_info_header(pack->data + offset, pack->oldFormat, &info);
+    if ((uint64_t)offset + headerSize + info.dataSize > pack->size)
+    {
+        return send_status(fd, HTSD_STATUS_ERROR);
+    }
+
+    if (request->mode == HTSD_MODE_RAW)
+    {
+        struct htsd_response response;
+        memset(&response, 0, sizeof(response));
+        response.status         = HTSD_STATUS_OK;
+        response.width          = info.width;
+        response.height         = info.height;
+        response.format         = info.format;
+        response.texture_format = info.texture_format;
+        response.pixel_type     = info.pixel_type;
+        response.formatsize     = (uint16_t)info.n64_format_size._formatsize;
+        response.is_hires_tex   = info.is_hires_tex;
+        response.dataSize       = info.dataSize;
+        return htsd_write_full(fd, &response, sizeof(response)) &&
+               htsd_write_full(fd, pack->data + offset + headerSize, info.dataSize);
+    }
+
+    /* the pack and the offset identify the payload, so textures
+     * which are found through different keys share the entry */
+    uint64_t key = ((uint64_t)packIndex << 48) | (uint64_t)offset;
+    struct CachedTexture* texture = cache_get(&cache, key);
+    if (texture == NULL)
+    {
+        texture = load_texture(pack, offset, &info);
+        if (texture == NULL)
+        {
+            return send_status(fd, HTSD_STATUS_ERROR);
+        }
+        texture = cache_put(&cache, key, texture);
+    }
+
+    bool ret = htsd_write_full(fd, &texture->header, sizeof(texture->header)) &&
+               htsd_write_full(fd, texture->data, texture->header.dataSize);
+    cache_release(&cache, texture);
+    return ret;
+}
+
+static void* serve_connection(void* arg)
+{
+    int fd = (int)(intptr_t)arg;
+    struct htsd_request request;
+
+    while (htsd_read_full(fd, &request, sizeof(request)))
+    {
+        if (!serve_request(fd, &request))
+        {
+            break;
+        }
+    }
+
+    close(fd);
+    return NULL;
+}
+
+static void handle_signal(int signal)
+{
+    (void)signal;
+    stop = 1;
+}
+
+int main(int argc, char** argv)
+{
+    const char* socketPath = HTSD_DEFAULT_SOCKET;
+    uint64_t cacheSize = 256 * 1024 * 1024;
+
+    packs = (struct Pack*)calloc(argc, sizeof(struct Pack));
+    if (packs == NULL)
+    {
+        return 1;
+    }
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--socket") == 0 && (i + 1) < argc)
+        {
+            socketPath = argv[++i];
+        }
+        else if (strcmp(argv[i], "--cache") == 0 && (i + 1) < argc)
+        {
+            if (!memory_budget_parse(argv[++i], &cacheSize))
+            {
+                fprintf(stderr, "Error: invalid cache size: %s\n", argv[i]);
+                return 1;
+            }
+        }
+        else
+        {
+            if (!open_pack(&packs[packCount], argv[i]))
+            {
+                return 1;
+            }
+            packCount++;
+        }
+    }
+
+    if (packCount == 0)
+    {
+        printf("Usage: %s [HTS FILE]... [--socket PATH] [--cache SIZE]\n", argv[0]);
+        return 1;
+    }
+
+    struct sockaddr_un address;
+    if (!htsd_address(socketPath, &address))
+    {
+        fprintf(stderr, "Error: socket path too long: %s\n", socketPath);
+        return 1;
+    }
+
+    if (!cache_init(&cache, cacheSize))
+    {
+        fprintf(stderr, "Error: failed to allocate cache\n");
+        return 1;
+    }
+
+    int listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listenFd == -1)
+    {
+        perror("socket");
+        return 1;
+    }
+
+    /* a socket left behind by a previous run */
+    unlink(socketPath);
+    if (bind(listenFd, (struct sockaddr*)&address, sizeof(address)) == -1 ||
+        listen(listenFd, 64) == -1)
+    {
+        perror(socketPath);
+        close(listenFd);
+        return 1;
+    }
+
+    /* no SA_RESTART, so accept() returns when stopping */
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handle_signal;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    /* blocked in the connection threads, so they're
+     * always delivered to the thread in accept() */
+    sigset_t stopSignals;
+    sigemptyset(&stopSignals);
+    sigaddset(&stopSignals, SIGINT);
+    sigaddset(&stopSignals, SIGTERM);
+
+    printf("-> Listening on %s, cache size %.1f MiB\n", socketPath, cacheSize / (1024.0 * 1024.0));
+    fflush(stdout);
+
+    while (!stop)
+    {
+        int fd = accept(listenFd, NULL, NULL);
+        if (fd == -1)
+        {
+            if (errno != EINTR && errno != ECONNABORTED)
+            {
+                perror("accept");
+                break;
+            }
+            continue;
+        }
+
+        /* every connection has its own thread, so a slow
+         * inflate only holds up its own connection */
+        pthread_t thread;
+        pthread_attr_t attr;
+        sigset_t signalMask;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        pthread_sigmask(SIG_BLOCK, &stopSignals, &signalMask);
+        if (pthread_create(&thread, &attr, serve_connection, (void*)(intptr_t)fd) != 0)
+        {
+            fprintf(stderr, "Error: failed to create thread\n");
+            close(fd);
+        }
+        pthread_sigmask(SIG_SETMASK, &signalMask, NULL);
+        pthread_attr_destroy(&attr);
+    }
+
+    close(listenFd);
+    unlink(socketPath);
+
+    pthread_mutex_lock(&cache.mutex);
+    printf("-> Cache: %llu hits, %llu misses, %llu evictions, %.1f MiB in use\n",
+           (unsigned long long)cache.hits, (unsigned long long)cache.misses,
+           (unsigned long long)cache.evictions, cache.used / (1024.0 * 1024.0));
+    pthread_mutex_unlock(&cache.mutex);
+    return 0;
+}
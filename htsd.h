@@ -0,0 +1,119 @@
+/*
+ * texturepack_utils - https://github.com/Rosalie241/texturepack_utils
+ *  Copyright (C) 2023 Rosalie Wanders <rosalie@mailbox.org>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 3.
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef HTSD_H
+#define HTSD_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/*
+ * htsd protocol
+ *
+ * A client sends fixed size requests over a Unix-domain stream socket
+ * and gets a fixed size response for each of them, followed by
+ * dataSize bytes of texture data when the status is HTSD_STATUS_OK.
+ * Everything is in host byte order, both ends are on the same machine.
+ */
+
+#define HTSD_MAGIC          0x44535448 /* HTSD */
+#define HTSD_DEFAULT_SOCKET "/tmp/htsd.sock"
+
+/* the texture data as it's stored in the pack, which can be compressed */
+#define HTSD_MODE_RAW  0
+/* the texture data inflated and converted to RGBA8 */
+#define HTSD_MODE_RGBA 1
+
+#define HTSD_STATUS_OK          0
+#define HTSD_STATUS_NOT_FOUND   1
+#define HTSD_STATUS_BAD_REQUEST 2
+#define HTSD_STATUS_ERROR       3
+
+struct htsd_request
+{
+    uint32_t magic;
+    uint32_t mode;
+    uint64_t checksum;
+    uint16_t formatsize;
+    uint16_t reserved[3];
+};
+
+struct htsd_response
+{
+    uint32_t status;
+    int32_t  width;
+    int32_t  height;
+    uint32_t format;
+    uint16_t texture_format;
+    uint16_t pixel_type;
+    uint16_t formatsize;
+    uint8_t  is_hires_tex;
+    uint8_t  reserved;
+    uint32_t dataSize;
+};
+
+static bool htsd_read_full(int fd, void* buffer, size_t size)
+{
+    uint8_t* data = (uint8_t*)buffer;
+    while (size > 0)
+    {
+        ssize_t ret = read(fd, data, size);
+        if (ret == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (ret <= 0)
+        {
+            return false;
+        }
+        data += ret;
+        size -= ret;
+    }
+    return true;
+}
+
+static bool htsd_write_full(int fd, const void* buffer, size_t size)
+{
+    const uint8_t* data = (const uint8_t*)buffer;
+    while (size > 0)
+    {
+        ssize_t ret = send(fd, data, size, MSG_NOSIGNAL);
+        if (ret == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (ret <= 0)
+        {
+            return false;
+        }
+        data += ret;
+        size -= ret;
+    }
+    return true;
+}
+
+/* fills in the address of the socket at path */
+static bool htsd_address(const char* path, struct sockaddr_un* address)
+{
+    memset(address, 0, sizeof(struct sockaddr_un));
+    address->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address->sun_path))
+    {
+        return false;
+    }
+    strcpy(address->sun_path, path);
+    return true;
+}
+
+#endif /* HTSD_H */
@@ -0,0 +1,621 @@
+/*
+ * texturepack_utils - https://github.com/Rosalie241/texturepack_utils
+ *  Copyright (C) 2023 Rosalie Wanders <rosalie@mailbox.org>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 3.
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef HTSI_H
+#define HTSI_H
+
+#include "hts.h"
+#include "index.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+ * Index sidecar (.htsi)
+ *
+ * A minimal perfect hash over the (checksum, formatsize) keys of a
+ * HTS file, next to it as NAME.htsi, so a reader can map it and look
+ * textures up without reading the mapping or building a hash table.
+ *
+ * The keys are hashed into buckets of about 3 keys. Every bucket has
+ * a pilot, which is searched for when building so the keys of every
+ * bucket end up in distinct slots of an array with exactly one slot
+ * per key (hash and displace). A slot holds the key and its offset,
+ * so a lookup hashes once, reads a pilot and compares one slot.
+ *
+ * Layout, everything little endian:
+ *
+ *   header    magic, version, seed, key count, bucket count, stamp
+ *   pilots    one uint32_t per bucket, padded to 16 bytes
+ *   slots     checksum, offset:48 formatsize:16, one per key
+ *
+ * The stamp is the size, inode and modification time of the HTS file,
+ * its mapping offset and size and a hash of the first and last 4 KiB
+ * of the mapping. A sidecar which doesn't match its HTS file is stale
+ * and has to be ignored, readers then fall back to reading the mapping.
+ */
+
+#define HTSI_MAGIC   0x49535448 /* HTSI */
+#define HTSI_VERSION 2
+
+/* keys per bucket */
+#define HTSI_BUCKET_SIZE 3
+/* bytes at either end of the mapping which are hashed for the stamp */
+#define HTSI_STAMP_BYTES 4096
+/* seeds tried before giving up on building */
+#define HTSI_SEEDS 8
+
+struct htsi_stamp
+{
+    int64_t  size;
+    uint64_t inode;
+    int64_t  mtime;
+    int64_t  mtimeNsec;
+    int64_t  mappingOffset;
+    int64_t  mappingSize;
+    uint64_t mappingHash;
+};
+
+struct htsi_header
+{
+    uint32_t          magic;
+    uint32_t          version;
+    uint64_t          seed;
+    uint64_t          keyCount;
+    uint64_t          bucketCount;
+    struct htsi_stamp stamp;
+};
+
+struct htsi
+{
+    void*                        data;
+    size_t                       size;
+    const struct htsi_header*    header;
+    const uint32_t*              pilots;
+    const struct hts_index_slot* slots;
+};
+
+enum htsi_status
+{
+    HTSI_OK,
+    HTSI_MISSING,
+    HTSI_STALE,
+    HTSI_INVALID
+};
+
+static inline uint64_t htsi_mix(uint64_t x)
+{
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+static inline uint64_t htsi_hash(uint64_t seed, uint64_t checksum, uint16_t formatsize)
+{
+    return htsi_mix(htsi_mix(checksum ^ seed) + formatsize);
+}
+
+static inline uint64_t htsi_bucket(uint64_t hash, uint64_t bucketCount)
+{
+    /* the high bits pick the bucket, the pilot mixes all of them */
+    return ((hash >> 32) * bucketCount) >> 32;
+}
+
+static inline uint64_t htsi_position(uint64_t hash, uint32_t pilot, uint64_t keyCount)
+{
+    return htsi_mix(hash + (pilot * 0x9e3779b97f4a7c15ULL)) % keyCount;
+}
+
+static uint64_t htsi_bucket_count(uint64_t keyCount)
+{
+    return (keyCount / HTSI_BUCKET_SIZE) + 1;
+}
+
+static uint64_t htsi_slots_offset(uint64_t bucketCount)
+{
+    return sizeof(struct htsi_header) + (((bucketCount * sizeof(uint32_t)) + 15) & ~(uint64_t)15);
+}
+
+/* NAME.hts becomes NAME.htsi, anything else gets .htsi appended */
+static bool htsi_filename(const char* htsFilename, char* filename, size_t size)
+{
+    size_t length = strlen(htsFilename);
+    int ret;
+
+    if (length >= 4 && strcasecmp(htsFilename + length - 4, ".hts") == 0)
+    {
+        ret = snprintf(filename, size, "%si", htsFilename);
+    }
+    else
+    {
+        ret = snprintf(filename, size, "%s.htsi", htsFilename);
+    }
+
+    return ret > 0 && (size_t)ret < size;
+}
+
+static uint64_t htsi_fnv1a(uint64_t hash, const uint8_t* data, size_t size)
+{
+    for (size_t i = 0; i < size; i++)
+    {
+        hash ^= data[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/* computes the stamp of the HTS file, only the header and
+ * both ends of the mapping are read, a change which keeps
+ * those is still caught by the modification time */
+static bool htsi_stamp(int fd, struct htsi_stamp* stamp)
+{
+    uint8_t buffer[HTSI_STAMP_BYTES];
+    int32_t version       = 0;
+    int32_t mappingSize   = -1;
+    int64_t mappingOffset = -1;
+    struct stat st;
+
+    if (fstat(fd, &st) == -1 ||
+        !pread_full(fd, &version, sizeof(version), 0) ||
+        !pread_full(fd, &mappingOffset, sizeof(mappingOffset), version == TXCACHE_FORMAT_VERSION ? 8 : 4) ||
+        mappingOffset < 0 || mappingOffset >= st.st_size ||
+        !pread_full(fd, &mappingSize, sizeof(mappingSize), mappingOffset) ||
+        mappingSize < 0)
+    {
+        return false;
+    }
+
+    int64_t mappingBytes = sizeof(mappingSize) + ((int64_t)mappingSize * (sizeof(uint64_t) * 2));
+    if (mappingOffset + mappingBytes > st.st_size)
+    {
+        return false;
+    }
+
+    memset(stamp, 0, sizeof(struct htsi_stamp));
+    stamp->size          = st.st_size;
+    stamp->inode         = st.st_ino;
+    stamp->mtime         = st.st_mtime;
+#ifdef __linux__
+    stamp->mtimeNsec     = st.st_mtim.tv_nsec;
+#endif /* __linux__ */
+    stamp->mappingOffset = mappingOffset;
+    stamp->mappingSize   = mappingSize;
+    stamp->mappingHash   = 0xcbf29ce484222325ULL;
+
+    /* the front of the mapping, and the back
+     * when it doesn't fit in one buffer */
+    size_t headSize = mappingBytes < HTSI_STAMP_BYTES ? (size_t)mappingBytes : HTSI_STAMP_BYTES;
+    if (!pread_full(fd, buffer, headSize, mappingOffset))
+    {
+        return false;
+    }
+    stamp->mappingHash = htsi_fnv1a(stamp->mappingHash, buffer, headSize);
+
+    if (mappingBytes > HTSI_STAMP_BYTES)
+    {
+        if (!pread_full(fd, buffer, HTSI_STAMP_BYTES, mappingOffset + mappingBytes - HTSI_STAMP_BYTES))
+        {
+            return false;
+        }
+        stamp->mappingHash = htsi_fnv1a(stamp->mappingHash, buffer, HTSI_STAMP_BYTES);
+    }
+
+    return true;
+}
+
+/* searches a pilot for every bucket, returns false when
+ * a bucket can't be placed with this seed */
+static bool htsi_place(const uint64_t* hashes, uint64_t keyCount, uint64_t bucketCount,
+                       uint32_t* pilots, uint64_t* positions)
+{
+    uint32_t* bucketStart = (uint32_t*)calloc(bucketCount + 1, sizeof(uint32_t));
+    uint32_t* bucketKeys  = (uint32_t*)malloc((keyCount + 1) * sizeof(uint32_t));
+    uint32_t* order       = (uint32_t*)calloc(bucketCount, sizeof(uint32_t));
+    uint64_t* taken       = (uint64_t*)calloc((keyCount + 63) / 64, sizeof(uint64_t));
+    uint64_t* candidates  = NULL;
+    uint32_t* sizeStart   = NULL;
+    uint32_t  maxSize     = 0;
+    bool      ret         = false;
+
+    if (bucketStart == NULL || bucketKeys == NULL || order == NULL || taken == NULL)
+    {
+        goto out;
+    }
+
+    /* group the keys by bucket */
+    for (uint64_t i = 0; i < keyCount; i++)
+    {
+        bucketStart[htsi_bucket(hashes[i], bucketCount) + 1]++;
+    }
+    for (uint64_t i = 0; i < bucketCount; i++)
+    {
+        uint32_t size = bucketStart[i + 1];
+        maxSize = size > maxSize ? size : maxSize;
+        bucketStart[i + 1] += bucketStart[i];
+    }
+    /* order counts the keys of every bucket until it's sorted */
+    for (uint64_t i = 0; i < keyCount; i++)
+    {
+        uint64_t bucket = htsi_bucket(hashes[i], bucketCount);
+        bucketKeys[bucketStart[bucket] + (order[bucket]++)] = (uint32_t)i;
+    }
+
+    /* the largest buckets first, while most slots are free */
+    sizeStart  = (uint32_t*)calloc(maxSize + 2, sizeof(uint32_t));
+    candidates = (uint64_t*)malloc((maxSize + 1) * sizeof(uint64_t));
+    if (sizeStart == NULL || candidates == NULL)
+    {
+        goto out;
+    }
+    for (uint64_t i = 0; i < bucketCount; i++)
+    {
+        sizeStart[maxSize - (bucketStart[i + 1] - bucketStart[i]) + 1]++;
+    }
+    for (uint32_t i = 0; i <= maxSize; i++)
+    {
+        sizeStart[i + 1] += sizeStart[i];
+    }
+    for (uint64_t i = 0; i < bucketCount; i++)
+    {
+        order[sizeStart[maxSize - (bucketStart[i + 1] - bucketStart[i])]++] = (uint32_t)i;
+    }
+
+    for (uint64_t i = 0; i < bucketCount; i++)
+    {
+        uint32_t bucket = order[i];
+        uint32_t start  = bucketStart[bucket];
+        uint32_t size   = bucketStart[bucket + 1] - start;
+        bool     placed = false;
+
+        if (size == 0)
+        {
+            /* the rest is empty too */
+            break;
+        }
+
+        /* two keys with the same hash never end up in
+         * different slots, that needs another seed */
+        for (uint32_t a = 0; a < size; a++)
+        {
+            for (uint32_t b = a + 1; b < size; b++)
+            {
+                if (hashes[bucketKeys[start + a]] == hashes[bucketKeys[start + b]])
+                {
+                    goto out;
+                }
+            }
+        }
+
+        for (uint32_t pilot = 0; pilot < UINT32_MAX && !placed; pilot++)
+        {
+            placed = true;
+            for (uint32_t j = 0; j < size && placed; j++)
+            {
+                uint64_t position = htsi_position(hashes[bucketKeys[start + j]], pilot, keyCount);
+                if (taken[position / 64] & (1ULL << (position % 64)))
+                {
+                    placed = false;
+                }
+                for (uint32_t k = 0; k < j && placed; k++)
+                {
+                    placed = candidates[k] != position;
+                }
+                candidates[j] = position;
+            }
+
+            if (placed)
+            {
+                pilots[bucket] = pilot;
+            }
+        }
+
+        if (!placed)
+        {
+            goto out;
+        }
+
+        for (uint32_t j = 0; j < size; j++)
+        {
+            taken[candidates[j] / 64] |= 1ULL << (candidates[j] % 64);
+            positions[bucketKeys[start + j]] = candidates[j];
+        }
+    }
+
+    ret = true;
+out:
+    free(bucketStart);
+    free(bucketKeys);
+    free(order);
+    free(taken);
+    free(candidates);
+    free(sizeStart);
+    return ret;
+}
+
+/* writes the sidecar of the keys in index, the values
+ * of which have to be the offsets in the HTS file */
+static bool htsi_write(const char* filename, const struct htsi_stamp* stamp, const struct hts_index* index)
+{
+    struct htsi_header header;
+    struct hts_index_slot* slots = NULL;
+    uint32_t* pilots    = NULL;
+    uint64_t* hashes    = NULL;
+    uint64_t* positions = NULL;
+    uint64_t  keyCount  = index->count;
+    uint64_t  bucketCount = htsi_bucket_count(keyCount);
+    char partFilename[PATH_MAX + 8];
+    /* nothing to place without keys */
+    bool placed = keyCount == 0;
+    bool ret    = false;
+    FILE* file  = NULL;
+
+    memset(&header, 0, sizeof(header));
+    slots     = (struct hts_index_slot*)malloc((keyCount + 1) * sizeof(struct hts_index_slot));
+    pilots    = (uint32_t*)calloc(bucketCount, sizeof(uint32_t));
+    hashes    = (uint64_t*)malloc((keyCount + 1) * sizeof(uint64_t));
+    positions = (uint64_t*)malloc((keyCount + 1) * sizeof(uint64_t));
+    if (slots == NULL || pilots == NULL || hashes == NULL || positions == NULL)
+    {
+        fprintf(stderr, "Error: %s: failed to allocate memory\n", filename);
+        goto out;
+    }
+
+    for (uint32_t seed = 0; seed < HTSI_SEEDS && !placed; seed++)
+    {
+        header.seed = htsi_mix(seed + 1);
+
+        size_t count = 0;
+        for (size_t i = 0; i <= index->mask; i++)
+        {
+            const struct hts_index_slot* slot = &index->slots[i];
+            if (slot->data != HTS_INDEX_EMPTY)
+            {
+                hashes[count++] = htsi_hash(header.seed, slot->checksum, hts_index_formatsize(slot->data));
+            }
+        }
+
+        memset(pilots, 0, bucketCount * sizeof(uint32_t));
+        placed = htsi_place(hashes, keyCount, bucketCount, pilots, positions);
+    }
+
+    if (!placed)
+    {
+        fprintf(stderr, "Error: %s: failed to build index\n", filename);
+        goto out;
+    }
+
+    {
+        size_t count = 0;
+        for (size_t i = 0; i <= index->mask; i++)
+        {
+            if (index->slots[i].data != HTS_INDEX_EMPTY)
+            {
+                slots[positions[count++]] = index->slots[i];
+            }
+        }
+    }
+
+    header.magic       = HTSI_MAGIC;
+    header.version     = HTSI_VERSION;
+    header.keyCount    = keyCount;
+    header.bucketCount = bucketCount;
+    header.stamp       = *stamp;
+
+    snprintf(partFilename, sizeof(partFilename), "%s.part", filename);
+    file = fopen(partFilename, "wb");
+    if (file == NULL)
+    {
+        fprintf(stderr, "Error: %s: fopen: %s\n", partFilename, strerror(errno));
+        goto out;
+    }
+
+    {
+        static const uint8_t padding[16] = {0};
+        size_t paddingSize = htsi_slots_offset(bucketCount) - sizeof(header) - (bucketCount * sizeof(uint32_t));
+
+        ret = fwrite(&header, sizeof(header), 1, file) == 1 &&
+              fwrite(pilots, sizeof(uint32_t), bucketCount, file) == bucketCount &&
+              fwrite(padding, 1, paddingSize, file) == paddingSize &&
+              fwrite(slots, sizeof(struct hts_index_slot), keyCount, file) == keyCount;
+    }
+
+    ret &= fflush(file) == 0 && fsync(fileno(file)) == 0;
+    ret &= fclose(file) == 0;
+    if (!ret || rename(partFilename, filename) == -1)
+    {
+        fprintf(stderr, "Error: %s: failed to write index\n", filename);
+        unlink(partFilename);
+        ret = false;
+    }
+out:
+    free(slots);
+    free(pilots);
+    free(hashes);
+    free(positions);
+    return ret;
+}
+
+/* reads the mapping the stamp was computed for into index,
+ * like every reader the last of duplicate keys wins */
+static bool htsi_read_mapping(int fd, const struct htsi_stamp* stamp, struct hts_index* index)
+{
+    size_t size = stamp->mappingSize * (sizeof(uint64_t) * 2);
+    uint8_t* mapping = (uint8_t*)malloc(size + 1);
+
+    if (mapping == NULL ||
+        !pread_full(fd, mapping, size, stamp->mappingOffset + sizeof(int32_t)) ||
+        !hts_index_init(index, stamp->mappingSize))
+    {
+        free(mapping);
+        return false;
+    }
+
+    for (int64_t i = 0; i < stamp->mappingSize; i++)
+    {
+        uint64_t checksum;
+        union StorageOffset offset;
+        memcpy(&checksum, mapping + (i * 16), sizeof(checksum));
+        memcpy(&offset._data, mapping + (i * 16) + 8, sizeof(offset._data));
+        hts_index_insert(index, checksum, (uint16_t)offset._formatsize, offset._offset, NULL);
+    }
+
+    free(mapping);
+    return true;
+}
+
+/* reads the mapping of the HTS file and writes its sidecar */
+static bool htsi_generate(const char* htsFilename)
+{
+    struct htsi_stamp stamp;
+    struct hts_index index;
+    char filename[PATH_MAX];
+    bool ret = false;
+
+    memset(&index, 0, sizeof(index));
+    int fd = open(htsFilename, O_RDONLY);
+    if (fd == -1)
+    {
+        fprintf(stderr, "Error: %s: %s\n", htsFilename, strerror(errno));
+        return false;
+    }
+
+    if (!htsi_filename(htsFilename, filename, sizeof(filename)) ||
+        !htsi_stamp(fd, &stamp))
+    {
+        fprintf(stderr, "Error: %s: invalid mapping\n", htsFilename);
+        goto out;
+    }
+
+    if (!htsi_read_mapping(fd, &stamp, &index))
+    {
+        fprintf(stderr, "Error: %s: failed to read mapping\n", htsFilename);
+        goto out;
+    }
+
+    ret = htsi_write(filename, &stamp, &index);
+out:
+    hts_index_free(&index);
+    close(fd);
+    return ret;
+}
+
+/* maps the sidecar of the HTS file, htsFd is the opened HTS file
+ * which the sidecar has to match, when anything but HTSI_OK is
+ * returned the mapping has to be read instead */
+static enum htsi_status htsi_open(struct htsi* htsi, const char* htsFilename, int htsFd)
+{
+    struct htsi_stamp stamp;
+    char filename[PATH_MAX];
+    struct stat st;
+
+    memset(htsi, 0, sizeof(struct htsi));
+
+    if (!htsi_filename(htsFilename, filename, sizeof(filename)))
+    {
+        return HTSI_MISSING;
+    }
+
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1)
+    {
+        return errno == ENOENT ? HTSI_MISSING : HTSI_INVALID;
+    }
+
+    if (fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof(struct htsi_header))
+    {
+        close(fd);
+        return HTSI_INVALID;
+    }
+
+    void* data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        return HTSI_INVALID;
+    }
+
+    const struct htsi_header* header = (const struct htsi_header*)data;
+    if (header->magic != HTSI_MAGIC ||
+        header->version != HTSI_VERSION ||
+        header->bucketCount != htsi_bucket_count(header->keyCount) ||
+        header->keyCount > (uint64_t)INT32_MAX ||
+        (uint64_t)st.st_size != htsi_slots_offset(header->bucketCount) + (header->keyCount * sizeof(struct hts_index_slot)))
+    {
+        munmap(data, st.st_size);
+        return HTSI_INVALID;
+    }
+
+    if (!htsi_stamp(htsFd, &stamp) ||
+        memcmp(&stamp, &header->stamp, sizeof(stamp)) != 0)
+    {
+        munmap(data, st.st_size);
+        return HTSI_STALE;
+    }
+
+    madvise(data, st.st_size, MADV_RANDOM);
+    htsi->data   = data;
+    htsi->size   = st.st_size;
+    htsi->header = header;
+    htsi->pilots = (const uint32_t*)((const uint8_t*)data + sizeof(struct htsi_header));
+    htsi->slots  = (const struct hts_index_slot*)((const uint8_t*)data + htsi_slots_offset(header->bucketCount));
+    return HTSI_OK;
+}
+
+static void htsi_close(struct htsi* htsi)
+{
+    if (htsi->data != NULL)
+    {
+        munmap(htsi->data, htsi->size);
+    }
+    memset(htsi, 0, sizeof(struct htsi));
+}
+
+/* returns the offset of the key, or -1 when it isn't in the HTS file */
+static inline int64_t htsi_find(const struct htsi* htsi, uint64_t checksum, uint16_t formatsize)
+{
+    uint64_t keyCount = htsi->header->keyCount;
+    if (keyCount == 0)
+    {
+        return -1;
+    }
+
+    uint64_t hash  = htsi_hash(htsi->header->seed, checksum, formatsize);
+    uint32_t pilot = htsi->pilots[htsi_bucket(hash, htsi->header->bucketCount)];
+    const struct hts_index_slot* slot = &htsi->slots[htsi_position(hash, pilot, keyCount)];
+
+    /* every key hashes to some slot, only the right one matches */
+    if (slot->checksum != checksum || hts_index_formatsize(slot->data) != formatsize)
+    {
+        return -1;
+    }
+    return hts_index_value(slot->data);
+}
+
+static const char* htsi_status_string(enum htsi_status status)
+{
+    switch (status)
+    {
+        case HTSI_OK:
+            return "ok";
+        case HTSI_MISSING:
+            return "missing";
+        case HTSI_STALE:
+            return "stale";
+        default:
+            return "invalid";
+    }
+}
+
+#endif /* HTSI_H */
@@ -0,0 +1,141 @@
+/*
+ * texturepack_utils - https://github.com/Rosalie241/texturepack_utils
+ *  Copyright (C) 2023 Rosalie Wanders <rosalie@mailbox.org>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 3.
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "hts.h"
+#include "index.h"
+#include "htsi.h"
+#include <time.h>
+
+/*
+ * Writes and checks index sidecars,
+ * see htsi.h for what a sidecar is
+ */
+
+static uint64_t now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+}
+
+/* compares every key of the mapping with the sidecar */
+static bool check_index(const char* filename)
+{
+    struct htsi_stamp stamp;
+    struct hts_index index;
+    struct htsi htsi;
+    bool ret = false;
+
+    memset(&index, 0, sizeof(index));
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1)
+    {
+        fprintf(stderr, "Error: %s: %s\n", filename, strerror(errno));
+        return false;
+    }
+
+    uint64_t start = now_us();
+    enum htsi_status status = htsi_open(&htsi, filename, fd);
+    uint64_t openTime = now_us() - start;
+    if (status != HTSI_OK)
+    {
+        printf("-> %s: index sidecar is %s\n", filename, htsi_status_string(status));
+        close(fd);
+        return false;
+    }
+
+    start = now_us();
+    if (!htsi_stamp(fd, &stamp) || !htsi_read_mapping(fd, &stamp, &index))
+    {
+        fprintf(stderr, "Error: %s: failed to read mapping\n", filename);
+        goto out;
+    }
+    uint64_t readTime;
+    readTime = now_us() - start;
+
+    if (index.count != htsi.header->keyCount)
+    {
+        fprintf(stderr, "Error: %s: index sidecar has %llu keys, mapping has %zu\n", filename,
+                (unsigned long long)htsi.header->keyCount, index.count);
+        goto out;
+    }
+
+    for (size_t i = 0; i <= index.mask; i++)
+    {
+        const struct hts_index_slot* slot = &index.slots[i];
+        if (slot->data != HTS_INDEX_EMPTY &&
+            htsi_find(&htsi, slot->checksum, hts_index_formatsize(slot->data)) != hts_index_value(slot->data))
+        {
+            fprintf(stderr, "Error: %s: index sidecar doesn't match %016llX\n", filename,
+                    (unsigned long long)slot->checksum);
+            goto out;
+        }
+    }
+
+    printf("-> %s: index sidecar is ok, %llu textures, opened in %llu us instead of %llu us\n", filename,
+           (unsigned long long)htsi.header->keyCount, (unsigned long long)openTime, (unsigned long long)readTime);
+    ret = true;
+out:
+    hts_index_free(&index);
+    htsi_close(&htsi);
+    close(fd);
+    return ret;
+}
+
+int main(int argc, char** argv)
+{
+    bool check = false;
+    int  count = 0;
+    int  ret   = 0;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--check") == 0)
+        {
+            check = true;
+        }
+        else
+        {
+            count++;
+        }
+    }
+
+    if (count == 0)
+    {
+        printf("Usage: %s [HTS FILE]... [--check]\n", argv[0]);
+        printf("\n");
+        printf("Writes a NAME.htsi index sidecar next to every HTS file, --check compares\n");
+        printf("the sidecars with the mappings instead\n");
+        return 1;
+    }
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--check") == 0)
+        {
+            continue;
+        }
+
+        if (check)
+        {
+            ret |= check_index(argv[i]) ? 0 : 1;
+            continue;
+        }
+
+        uint64_t start = now_us();
+        if (!htsi_generate(argv[i]))
+        {
+            ret = 1;
+            continue;
+        }
+        printf("-> %s: wrote index sidecar in %llu ms\n", argv[i], (unsigned long long)((now_us() - start) / 1000));
+    }
+
+    return ret;
+}
@@ -0,0 +1,407 @@
+/*
+ * texturepack_utils - https://github.com/Rosalie241/texturepack_utils
+ *  Copyright (C) 2023 Rosalie Wanders <rosalie@mailbox.org>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 3.
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef _WIN32
+#include <linux/limits.h>
+#endif /* _WIN32 */
+#include "hts.h"
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <vector>
+#include <map>
+#include <algorithm>
+
+/* amount of histogram entries shown in text mode */
+#define TOP_COUNT 10
+
+struct InfoEntry
+{
+    uint64_t            checksum;
+    union StorageOffset offset;
+};
+
+struct PackInfo
+{
+    bool    oldFormat;
+    bool    compressed;
+    int64_t fileSize;
+    int64_t mappingOffset;
+    int32_t mappingSize;
+
+    int32_t textures;
+    int32_t gzTextures;
+    int32_t badTextures;
+    /* mapping entries sharing a payload */
+    int32_t sharedTextures;
+    int64_t payloadBytes;
+    uint32_t minPayload;
+    uint32_t maxPayload;
+
+    /* locality of the mapping order */
+    int32_t forwardSteps;
+    int64_t totalJump;
+    /* textures which directly follow each other */
+    int32_t sequentialSteps;
+
+    int32_t duplicateKeys;
+    int32_t duplicateChecksums;
+
+    std::map<std::pair<int32_t, int32_t>, int32_t> dimensions;
+    std::map<std::pair<uint32_t, uint32_t>, int32_t> pixelFormats;
+    std::map<uint32_t, int32_t> glFormats;
+    std::map<uint16_t, int32_t> formatSizes;
+};
+
+static bool read_pack_info(const char* filename, struct PackInfo* info)
+{
+    FILE* file = fopen(filename, "rb");
+    if (file == NULL)
+    {
+        perror("fopen");
+        return false;
+    }
+
+    if (!check_header(file, &info->oldFormat, &info->compressed))
+    {
+        fclose(file);
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fileno(file), &st) == -1)
+    {
+        perror("fstat");
+        fclose(file);
+        return false;
+    }
+    info->fileSize = st.st_size;
+
+#define FREAD(x) fread(&x, sizeof(x), 1, file)
+    FREAD(info->mappingOffset);
+
+    /* seek to mapping */
+    FSEEK(file, info->mappingOffset, SEEK_SET);
+
+    FREAD(info->mappingSize);
+
+    if (info->mappingOffset < 0 || info->mappingOffset >= info->fileSize ||
+        info->mappingSize < 0 ||
+        (info->fileSize - info->mappingOffset - 4) / 16 < info->mappingSize)
+    {
+        fprintf(stderr, "Error: invalid mapping offset or size\n");
+        fclose(file);
+        return false;
+    }
+
+    std::vector<InfoEntry> entries(info->mappingSize);
+    for (int32_t i = 0; i < info->mappingSize; i++)
+    {
+        FREAD(entries[i].checksum);
+        FREAD(entries[i].offset._data);
+    }
+#undef FREAD
+
+    /* locality of the mapping order, this is the
+     * order in which the textures would be read */
+    int32_t headerSize = info_header_size(info->oldFormat);
+    for (int32_t i = 1; i < info->mappingSize; i++)
+    {
+        int64_t previous = entries[i - 1].offset._offset;
+        int64_t current  = entries[i].offset._offset;
+
+        if (current > previous)
+        {
+            info->forwardSteps++;
+        }
+        info->totalJump += (current > previous) ? (current - previous) : (previous - current);
+    }
+
+    /* duplicates, sort by key */
+    std::sort(entries.begin(), entries.end(), [](const InfoEntry& a, const InfoEntry& b)
+    {
+        if (a.checksum != b.checksum)
+        {
+            return a.checksum < b.checksum;
+        }
+        return a.offset._formatsize < b.offset._formatsize;
+    });
+    for (int32_t i = 1; i < info->mappingSize; i++)
+    {
+        if (entries[i].checksum == entries[i - 1].checksum)
+        {
+            info->duplicateChecksums++;
+            if (entries[i].offset._formatsize == entries[i - 1].offset._formatsize)
+            {
+                info->duplicateKeys++;
+            }
+        }
+    }
+
+    /* read the texture headers front to back,
+     * payloads are never touched */
+    std::sort(entries.begin(), entries.end(), [](const InfoEntry& a, const InfoEntry& b)
+    {
+        return a.offset._offset < b.offset._offset;
+    });
+
+    int fd = fileno(file);
+#ifdef POSIX_FADV_RANDOM
+    /* we only read a few bytes per texture,
+     * readahead would pull in the payloads */
+    posix_fadvise(fd, 0, 0, POSIX_FADV_RANDOM);
+#endif /* POSIX_FADV_RANDOM */
+
+    int64_t previousOffset = -1;
+    int64_t previousEnd    = -1;
+    info->minPayload = UINT32_MAX;
+    for (auto& entry : entries)
+    {
+        struct GHQTexInfo texInfo = {0};
+        int64_t offset = entry.offset._offset;
+
+        if (offset == previousOffset)
+        {
+            info->sharedTextures++;
+            continue;
+        }
+        previousOffset = offset;
+
+        if (offset < 0 || offset + headerSize > info->mappingOffset ||
+            !pread_info(fd, offset, info->oldFormat, &texInfo, false) ||
+            offset + headerSize + (int64_t)texInfo.dataSize > info->mappingOffset)
+        {
+            info->badTextures++;
+            continue;
+        }
+
+        /* textures which directly follow each other */
+        if (offset == previousEnd)
+        {
+            info->sequentialSteps++;
+        }
+        previousEnd = offset + headerSize + texInfo.dataSize;
+
+        info->textures++;
+        info->payloadBytes += texInfo.dataSize;
+        info->minPayload = std::min(info->minPayload, texInfo.dataSize);
+        info->maxPayload = std::max(info->maxPayload, texInfo.dataSize);
+        if (texInfo.format & GL_TEXFMT_GZ)
+        {
+            info->gzTextures++;
+        }
+
+        info->dimensions[{texInfo.width, texInfo.height}]++;
+        info->pixelFormats[{texInfo.texture_format, texInfo.pixel_type}]++;
+        info->glFormats[texInfo.format & ~GL_TEXFMT_GZ]++;
+        if (!info->oldFormat)
+        {
+            info->formatSizes[texInfo.n64_format_size._formatsize]++;
+        }
+    }
+
+    if (info->textures == 0)
+    {
+        info->minPayload = 0;
+    }
+
+    fclose(file);
+    return true;
+}
+
+/* returns the histogram entries sorted by count, highest first */
+template <typename T>
+static std::vector<std::pair<T, int32_t>> sort_histogram(const std::map<T, int32_t>& histogram)
+{
+    std::vector<std::pair<T, int32_t>> sorted(histogram.begin(), histogram.end());
+    std::stable_sort(sorted.begin(), sorted.end(), [](const std::pair<T, int32_t>& a, const std::pair<T, int32_t>& b)
+    {
+        return a.second > b.second;
+    });
+    return sorted;
+}
+
+static void print_text(const char* filename, struct PackInfo* info)
+{
+    int32_t steps = std::max(info->mappingSize - 1, 1);
+
+    printf("file:                %s\n", filename);
+    printf("file size:           %lld\n", (long long)info->fileSize);
+    printf("format:              %s\n", info->oldFormat ? "old" : "new (N64FormatSize)");
+    printf("compression:         %s\n", info->compressed ? "compressed" : "uncompressed");
+    printf("mapping offset:      %lld\n", (long long)info->mappingOffset);
+    printf("mapping entries:     %i\n", info->mappingSize);
+    printf("textures:            %i (%i compressed, %i shared, %i invalid)\n", info->textures, info->gzTextures,
+           info->sharedTextures, info->badTextures);
+    printf("payload bytes:       %lld total, %lld average, %u min, %u max\n",
+           (long long)info->payloadBytes,
+           (long long)(info->textures > 0 ? info->payloadBytes / info->textures : 0),
+           info->minPayload, info->maxPayload);
+    printf("dead space:          %lld\n", (long long)(info->mappingOffset -
+           (info->oldFormat ? 12 : 16) - info->payloadBytes -
+           (int64_t)info->textures * info_header_size(info->oldFormat)));
+    printf("duplicate keys:      %i (%i duplicate checksums)\n", info->duplicateKeys, info->duplicateChecksums);
+    printf("mapping locality:    %.1f%% forward, %lld average jump\n",
+           (100.0 * info->forwardSteps) / steps,
+           (long long)(info->totalJump / steps));
+    printf("contiguous textures: %.1f%%\n", (100.0 * info->sequentialSteps) / steps);
+
+    printf("dimensions:\n");
+    auto dimensions = sort_histogram(info->dimensions);
+    for (size_t i = 0; i < dimensions.size() && i < TOP_COUNT; i++)
+    {
+        printf("  %5ix%-5i %i\n", dimensions[i].first.first, dimensions[i].first.second, dimensions[i].second);
+    }
+    if (dimensions.size() > TOP_COUNT)
+    {
+        printf("  (%zu more)\n", dimensions.size() - TOP_COUNT);
+    }
+
+    printf("GL formats:\n");
+    for (auto& format : sort_histogram(info->glFormats))
+    {
+        printf("  0x%04X      %i\n", format.first, format.second);
+    }
+
+    printf("pixel formats:\n");
+    for (auto& format : sort_histogram(info->pixelFormats))
+    {
+        printf("  0x%04X/0x%04X %i\n", format.first.first, format.first.second, format.second);
+    }
+
+    if (!info->oldFormat)
+    {
+        printf("N64FormatSize:\n");
+        for (auto& formatSize : sort_histogram(info->formatSizes))
+        {
+            printf("  0x%04X      %i\n", formatSize.first, formatSize.second);
+        }
+    }
+}
+
+static void print_json(const char* filename, struct PackInfo* info)
+{
+    int32_t steps = std::max(info->mappingSize - 1, 1);
+    bool first;
+
+    printf("{\n");
+    printf("  \"file\": \"");
+    for (const char* c = filename; *c != '\0'; c++)
+    {
+        if (*c == '"' || *c == '\\')
+        {
+            putchar('\\');
+        }
+        else if ((unsigned char)*c < 0x20)
+        {
+            printf("\\u%04X", (unsigned char)*c);
+            continue;
+        }
+        putchar(*c);
+    }
+    printf("\",\n");
+    printf("  \"file_size\": %lld,\n", (long long)info->fileSize);
+    printf("  \"format_version\": %s,\n", info->oldFormat ? "\"old\"" : "\"new\"");
+    printf("  \"compressed\": %s,\n", info->compressed ? "true" : "false");
+    printf("  \"mapping_offset\": %lld,\n", (long long)info->mappingOffset);
+    printf("  \"mapping_entries\": %i,\n", info->mappingSize);
+    printf("  \"textures\": %i,\n", info->textures);
+    printf("  \"compressed_textures\": %i,\n", info->gzTextures);
+    printf("  \"shared_textures\": %i,\n", info->sharedTextures);
+    printf("  \"invalid_textures\": %i,\n", info->badTextures);
+    printf("  \"payload_bytes\": %lld,\n", (long long)info->payloadBytes);
+    printf("  \"payload_average\": %lld,\n", (long long)(info->textures > 0 ? info->payloadBytes / info->textures : 0));
+    printf("  \"payload_min\": %u,\n", info->minPayload);
+    printf("  \"payload_max\": %u,\n", info->maxPayload);
+    printf("  \"duplicate_keys\": %i,\n", info->duplicateKeys);
+    printf("  \"duplicate_checksums\": %i,\n", info->duplicateChecksums);
+    printf("  \"locality\": { \"forward\": %.4f, \"average_jump\": %lld },\n",
+           (double)info->forwardSteps / steps, (long long)(info->totalJump / steps));
+    printf("  \"contiguous\": %.4f,\n", (double)info->sequentialSteps / steps);
+
+    printf("  \"dimensions\": [");
+    first = true;
+    for (auto& dimension : sort_histogram(info->dimensions))
+    {
+        printf("%s\n    { \"width\": %i, \"height\": %i, \"count\": %i }", first ? "" : ",",
+               dimension.first.first, dimension.first.second, dimension.second);
+        first = false;
+    }
+    printf("\n  ],\n");
+
+    printf("  \"gl_formats\": [");
+    first = true;
+    for (auto& format : sort_histogram(info->glFormats))
+    {
+        printf("%s\n    { \"format\": %u, \"count\": %i }", first ? "" : ",", format.first, format.second);
+        first = false;
+    }
+    printf("\n  ],\n");
+
+    printf("  \"pixel_formats\": [");
+    first = true;
+    for (auto& format : sort_histogram(info->pixelFormats))
+    {
+        printf("%s\n    { \"texture_format\": %u, \"pixel_type\": %u, \"count\": %i }", first ? "" : ",",
+               format.first.first, format.first.second, format.second);
+        first = false;
+    }
+    printf("\n  ],\n");
+
+    printf("  \"n64_format_sizes\": [");
+    first = true;
+    for (auto& formatSize : sort_histogram(info->formatSizes))
+    {
+        printf("%s\n    { \"format\": %u, \"size\": %u, \"count\": %i }", first ? "" : ",",
+               formatSize.first & 0xff, formatSize.first >> 8, formatSize.second);
+        first = false;
+    }
+    printf("\n  ]\n");
+    printf("}\n");
+}
+
+int main(int argc, char** argv)
+{
+    const char* filename = NULL;
+    bool json = false;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--json") == 0)
+        {
+            json = true;
+        }
+        else if (filename == NULL)
+        {
+            filename = argv[i];
+        }
+    }
+
+    if (filename == NULL)
+    {
+        printf("Usage: %s [HTS FILE] [--json]\n", argv[0]);
+        return 1;
+    }
+
+    struct PackInfo info = {};
+    if (!read_pack_info(filename, &info))
+    {
+        return 1;
+    }
+
+    if (json)
+    {
+        print_json(filename, &info);
+    }
+    else
+    {
+        print_text(filename, &info);
+    }
+
+    return info.badTextures == 0 ? 0 : 1;
+}
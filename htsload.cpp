@@ -0,0 +1,320 @@
+/*
+ * texturepack_utils - https://github.com/Rosalie241/texturepack_utils
+ *  Copyright (C) 2023 Rosalie Wanders <rosalie@mailbox.org>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 3.
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "hts.h"
+#include "htsd.h"
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <vector>
+#include <algorithm>
+
+/*
+ * Load generator for htsd, requests the textures of a pack
+ * from a number of connections and reports the latencies
+ */
+
+struct LoadKey
+{
+    uint64_t checksum;
+    uint16_t formatsize;
+};
+
+struct LoadWorker
+{
+    pthread_t              thread;
+    const char*            socketPath;
+    const LoadKey*         keys;
+    /* cumulative distribution of the keys when skewed */
+    const double*          weights;
+    size_t                 keyCount;
+    int64_t                requests;
+    uint32_t               mode;
+    uint64_t               seed;
+    std::vector<uint64_t>  latencies;
+    uint64_t               bytes;
+    int64_t                notFound;
+    bool                   error;
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000000) + ts.tv_nsec;
+}
+
+static uint64_t next_random(uint64_t* state)
+{
+    /* splitmix64 */
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static bool read_keys(const char* filename, std::vector<LoadKey>& keys)
+{
+    FILE* file = fopen(filename, "rb");
+    if (file == NULL)
+    {
+        perror("fopen");
+        return false;
+    }
+
+    bool oldFormat;
+    int64_t mappingOffset = -1;
+    int32_t mappingSize   = -1;
+
+    if (!check_header(file, &oldFormat, NULL))
+    {
+        fprintf(stderr, "Error: %s: invalid header\n", filename);
+        fclose(file);
+        return false;
+    }
+
+#define FREAD(x) fread(&x, sizeof(x), 1, file)
+    if (FREAD(mappingOffset) != 1 ||
+        FSEEK(file, mappingOffset, SEEK_SET) != 0 ||
+        FREAD(mappingSize) != 1 || mappingSize < 0)
+    {
+        fprintf(stderr, "Error: %s: invalid mapping\n", filename);
+        fclose(file);
+        return false;
+    }
+
+    keys.resize(mappingSize);
+    for (int32_t i = 0; i < mappingSize; i++)
+    {
+        union StorageOffset offset;
+        if (FREAD(keys[i].checksum) != 1 || FREAD(offset._data) != 1)
+        {
+            fprintf(stderr, "Error: %s: truncated mapping\n", filename);
+            fclose(file);
+            return false;
+        }
+        keys[i].formatsize = (uint16_t)offset._formatsize;
+    }
+#undef FREAD
+
+    fclose(file);
+    return true;
+}
+
+static size_t pick_key(struct LoadWorker* worker)
+{
+    uint64_t random = next_random(&worker->seed);
+    if (worker->weights == NULL)
+    {
+        return random % worker->keyCount;
+    }
+
+    double value = (random >> 11) * (1.0 / 9007199254740992.0);
+    const double* weight = std::lower_bound(worker->weights, worker->weights + worker->keyCount, value);
+    return std::min((size_t)(weight - worker->weights), worker->keyCount - 1);
+}
+
+static void* run_worker(void* arg)
+{
+    struct LoadWorker* worker = (struct LoadWorker*)arg;
+    struct sockaddr_un address;
+    std::vector<uint8_t> buffer;
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    htsd_address(worker->socketPath, &address);
+    if (fd == -1 || connect(fd, (struct sockaddr*)&address, sizeof(address)) == -1)
+    {
+        perror(worker->socketPath);
+        worker->error = true;
+        if (fd != -1)
+        {
+            close(fd);
+        }
+        return NULL;
+    }
+
+    worker->latencies.reserve(worker->requests);
+    for (int64_t i = 0; i < worker->requests; i++)
+    {
+        const LoadKey* key = &worker->keys[pick_key(worker)];
+        struct htsd_request request = {0};
+        struct htsd_response response;
+
+        request.magic      = HTSD_MAGIC;
+        request.mode       = worker->mode;
+        request.checksum   = key->checksum;
+        request.formatsize = key->formatsize;
+
+        uint64_t start = now_ns();
+        if (!htsd_write_full(fd, &request, sizeof(request)) ||
+            !htsd_read_full(fd, &response, sizeof(response)))
+        {
+            worker->error = true;
+            break;
+        }
+
+        if (response.status == HTSD_STATUS_OK)
+        {
+            buffer.resize(response.dataSize);
+            if (!htsd_read_full(fd, buffer.data(), response.dataSize))
+            {
+                worker->error = true;
+                break;
+            }
+            worker->bytes += response.dataSize;
+        }
+        else if (response.status == HTSD_STATUS_NOT_FOUND)
+        {
+            worker->notFound++;
+        }
+        else
+        {
+            fprintf(stderr, "Error: request for %016llX failed with status %u\n",
+                    (unsigned long long)key->checksum, response.status);
+            worker->error = true;
+            break;
+        }
+        worker->latencies.push_back(now_ns() - start);
+    }
+
+    close(fd);
+    return NULL;
+}
+
+static double percentile(const std::vector<uint64_t>& sorted, double p)
+{
+    size_t index = (size_t)ceil((p / 100.0) * sorted.size());
+    index = index == 0 ? 0 : index - 1;
+    return sorted[std::min(index, sorted.size() - 1)] / 1000.0;
+}
+
+int main(int argc, char** argv)
+{
+    const char* socketPath = HTSD_DEFAULT_SOCKET;
+    const char* filename = NULL;
+    int64_t requests = 100000;
+    int32_t connections = 4;
+    uint32_t mode = HTSD_MODE_RAW;
+    double skew = 0;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--socket") == 0 && (i + 1) < argc)
+        {
+            socketPath = argv[++i];
+        }
+        else if (strcmp(argv[i], "-n") == 0 && (i + 1) < argc)
+        {
+            requests = strtoll(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "-c") == 0 && (i + 1) < argc)
+        {
+            connections = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--zipf") == 0 && (i + 1) < argc)
+        {
+            skew = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--rgba") == 0)
+        {
+            mode = HTSD_MODE_RGBA;
+        }
+        else if (filename == NULL)
+        {
+            filename = argv[i];
+        }
+    }
+
+    if (filename == NULL || requests <= 0 || connections <= 0)
+    {
+        printf("Usage: %s [HTS FILE] [--socket PATH] [-n REQUESTS] [-c CONNECTIONS] [--zipf SKEW] [--rgba]\n", argv[0]);
+        return 1;
+    }
+
+    std::vector<LoadKey> keys;
+    if (!read_keys(filename, keys))
+    {
+        return 1;
+    }
+    if (keys.empty())
+    {
+        fprintf(stderr, "Error: %s: no textures\n", filename);
+        return 1;
+    }
+
+    /* a few textures being requested far more often than
+     * the rest is closer to a game than picking uniformly */
+    std::vector<double> weights;
+    if (skew > 0)
+    {
+        double total = 0;
+        weights.resize(keys.size());
+        for (size_t i = 0; i < keys.size(); i++)
+        {
+            total += 1.0 / pow((double)(i + 1), skew);
+            weights[i] = total;
+        }
+        for (size_t i = 0; i < keys.size(); i++)
+        {
+            weights[i] /= total;
+        }
+    }
+
+    std::vector<LoadWorker> workers(connections);
+    uint64_t start = now_ns();
+    for (int32_t i = 0; i < connections; i++)
+    {
+        LoadWorker* worker = &workers[i];
+        worker->socketPath = socketPath;
+        worker->keys       = keys.data();
+        worker->weights    = weights.empty() ? NULL : weights.data();
+        worker->keyCount   = keys.size();
+        worker->requests   = (requests / connections) + (i < (requests % connections) ? 1 : 0);
+        worker->mode       = mode;
+        worker->seed       = 0x48545344 + i;
+        worker->bytes      = 0;
+        worker->notFound   = 0;
+        worker->error      = false;
+        if (pthread_create(&worker->thread, NULL, run_worker, worker) != 0)
+        {
+            fprintf(stderr, "Error: failed to create thread\n");
+            return 1;
+        }
+    }
+
+    std::vector<uint64_t> latencies;
+    uint64_t bytes = 0;
+    int64_t notFound = 0;
+    bool error = false;
+    for (int32_t i = 0; i < connections; i++)
+    {
+        pthread_join(workers[i].thread, NULL);
+        latencies.insert(latencies.end(), workers[i].latencies.begin(), workers[i].latencies.end());
+        bytes    += workers[i].bytes;
+        notFound += workers[i].notFound;
+        error    |= workers[i].error;
+    }
+    double seconds = (now_ns() - start) / 1e9;
+
+    if (latencies.empty())
+    {
+        fprintf(stderr, "Error: no requests completed\n");
+        return 1;
+    }
+
+    std::sort(latencies.begin(), latencies.end());
+    printf("-> %zu requests (%s) over %i connections in %.2f s\n",
+           latencies.size(), mode == HTSD_MODE_RGBA ? "rgba" : "raw", connections, seconds);
+    printf("-> %.0f requests/s, %.1f MiB/s, %lli not found\n",
+           latencies.size() / seconds, (bytes / (1024.0 * 1024.0)) / seconds, (long long)notFound);
+    printf("-> latency p50 %.1f us, p90 %.1f us, p99 %.1f us, max %.1f us\n",
+           percentile(latencies, 50), percentile(latencies, 90), percentile(latencies, 99),
+           latencies.back() / 1000.0);
+    return error ? 1 : 0;
+}
@@ -0,0 +1,326 @@
+/*
+ * texturepack_utils - https://github.com/Rosalie241/texturepack_utils
+ *  Copyright (C) 2023 Rosalie Wanders <rosalie@mailbox.org>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 3.
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "hts.h"
+#include "overlay.h"
+#include <time.h>
+#include <vector>
+#include <map>
+
+/*
+ * Builds, queries and flattens overlay manifests,
+ * see overlay.h for what an overlay is
+ */
+
+static uint64_t now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+static int build_overlay(const char* outputFilename, const char* const* filenames, int count)
+{
+    struct overlay overlay;
+    uint64_t start = now_ms();
+
+    if (!overlay_build(&overlay, filenames, (uint32_t)count))
+    {
+        return 1;
+    }
+
+    /* how many textures of every base are still visible */
+    std::vector<uint64_t> visible(overlay.baseCount, 0);
+    for (uint64_t i = 0; i < overlay.entryCount; i++)
+    {
+        visible[overlay.entries[i].base]++;
+    }
+    for (uint32_t i = 0; i < overlay.baseCount; i++)
+    {
+        printf("-> %s: %llu textures\n", overlay.bases[i].path, (unsigned long long)visible[i]);
+    }
+
+    bool ret = overlay_write(&overlay, outputFilename);
+    if (ret)
+    {
+        printf("-> Wrote %llu textures of %u packs to %s in %llu ms\n",
+               (unsigned long long)overlay.entryCount, overlay.baseCount, outputFilename,
+               (unsigned long long)(now_ms() - start));
+    }
+
+    overlay_free(&overlay);
+    return ret ? 0 : 1;
+}
+
+static void print_texture(const struct overlay* overlay, const struct overlay_entry* entry)
+{
+    const struct overlay_base* base = &overlay->bases[entry->base];
+    struct GHQTexInfo info = {0};
+    union StorageOffset offset;
+
+    offset._data = entry->offset;
+    if (!pread_info(base->fd, offset._offset, overlay->oldFormat, &info, false))
+    {
+        fprintf(stderr, "Error: %s: failed to read texture at %lld\n", base->path, (long long)offset._offset);
+        return;
+    }
+
+    printf("%016llX formatsize %04X: %s at %lld, %ix%i, format 0x%X, pixel type 0x%X, %u bytes%s\n",
+           (unsigned long long)entry->checksum, (unsigned int)offset._formatsize, base->path,
+           (long long)offset._offset, info.width, info.height, info.texture_format, info.pixel_type,
+           info.dataSize, (info.format & GL_TEXFMT_GZ) ? " (compressed)" : "");
+}
+
+static int query_overlay(const char* filename, const char* checksumString, const char* formatsizeString)
+{
+    struct overlay overlay;
+    uint64_t checksum = strtoull(checksumString, NULL, 16);
+    int ret = 0;
+
+    if (!overlay_read(&overlay, filename) ||
+        !overlay_open_bases(&overlay))
+    {
+        overlay_free(&overlay);
+        return 1;
+    }
+
+    if (formatsizeString != NULL)
+    {
+        const struct overlay_entry* entry = overlay_find(&overlay, checksum, (uint16_t)strtoul(formatsizeString, NULL, 16));
+        if (entry != NULL)
+        {
+            print_texture(&overlay, entry);
+        }
+        else
+        {
+            ret = 1;
+        }
+    }
+    else
+    {
+        /* every format size of the checksum */
+        size_t   position = 0;
+        uint16_t formatsize;
+        int64_t  index;
+
+        ret = 1;
+        while (hts_index_find_next(&overlay.index, checksum, &position, &formatsize, &index))
+        {
+            print_texture(&overlay, &overlay.entries[index]);
+            ret = 0;
+        }
+    }
+
+    if (ret != 0)
+    {
+        fprintf(stderr, "Error: %s: %016llX not found\n", filename, (unsigned long long)checksum);
+    }
+
+    overlay_free(&overlay);
+    return ret;
+}
+
+static int flatten_overlay(const char* filename, const char* outputFilename)
+{
+    struct overlay overlay;
+    bool  toStdout   = (strcmp(outputFilename, "-") == 0);
+    FILE* log        = toStdout ? stderr : stdout;
+    FILE* outputFile = NULL;
+    bool  ret        = false;
+    char  partFilename[PATH_MAX + 8];
+    std::vector<FILE*>   files;
+    std::vector<int64_t> sizes;
+    std::vector<int64_t> outputOffsets;
+    /* the output offset of every payload which was laid out,
+     * keyed on its base and offset in there */
+    std::map<std::pair<uint32_t, int64_t>, int64_t> layout;
+    int32_t sharedCount = 0;
+
+    int     header        = TXCACHE_FORMAT_VERSION;
+    int     config        = 0;
+    int64_t mappingOffset = 0;
+    int32_t mappingSize   = 0;
+
+    if (!overlay_read(&overlay, filename) ||
+        !overlay_open_bases(&overlay))
+    {
+        overlay_free(&overlay);
+        return 1;
+    }
+
+    if (overlay.entryCount > INT32_MAX)
+    {
+        fprintf(stderr, "Error: %s: too many textures for one pack\n", filename);
+        goto out;
+    }
+
+    files.resize(overlay.baseCount, NULL);
+    for (uint32_t i = 0; i < overlay.baseCount; i++)
+    {
+        files[i] = fopen(overlay.bases[i].path, "rb");
+        if (files[i] == NULL)
+        {
+            fprintf(stderr, "Error: %s: %s\n", overlay.bases[i].path, strerror(errno));
+            goto out;
+        }
+    }
+
+    fprintf(log, "-> Reading %llu texture headers of %s...\n", (unsigned long long)overlay.entryCount, filename);
+
+    /* the payloads are copied with their header, so
+     * only their size is needed to lay out the file,
+     * entries sharing a payload keep sharing it */
+    config        = overlay.compressed ? HTS_CONFIG_COMPRESSED : HTS_CONFIG_UNCOMPRESSED;
+    mappingSize   = (int32_t)overlay.entryCount;
+    mappingOffset = overlay.oldFormat ? sizeof(config) : sizeof(header) + sizeof(config);
+    mappingOffset += sizeof(mappingOffset);
+    sizes.resize(overlay.entryCount, 0);
+    outputOffsets.resize(overlay.entryCount);
+    for (uint64_t i = 0; i < overlay.entryCount; i++)
+    {
+        const struct overlay_entry* entry = &overlay.entries[i];
+        struct GHQTexInfo info = {0};
+        union StorageOffset offset;
+
+        offset._data = entry->offset;
+        auto it = layout.find(std::make_pair(entry->base, (int64_t)offset._offset));
+        if (it != layout.end())
+        {
+            /* a size of 0 means it's written by an earlier entry */
+            outputOffsets[i] = it->second;
+            sharedCount++;
+            continue;
+        }
+
+        if (!pread_info(overlay.bases[entry->base].fd, offset._offset, overlay.oldFormat, &info, false))
+        {
+            fprintf(stderr, "Error: %s: failed to read texture at %lld\n",
+                    overlay.bases[entry->base].path, (long long)offset._offset);
+            goto out;
+        }
+        sizes[i]         = info_header_size(overlay.oldFormat) + info.dataSize;
+        outputOffsets[i] = mappingOffset;
+        layout[std::make_pair(entry->base, (int64_t)offset._offset)] = mappingOffset;
+        mappingOffset += sizes[i];
+    }
+
+    /* written next to the output and renamed once it's
+     * complete, so a failure doesn't leave a truncated pack */
+    snprintf(partFilename, sizeof(partFilename), "%s.part", outputFilename);
+    outputFile = toStdout ? stdout : fopen(partFilename, "wb");
+    if (outputFile == NULL)
+    {
+        fprintf(stderr, "Error: %s: %s\n", partFilename, strerror(errno));
+        goto out;
+    }
+
+    fprintf(log, "-> Writing %i textures, %i shared, header and mappings to %s...\n", mappingSize, sharedCount,
+            outputFilename);
+
+#define FWRITE_OUTPUT(x) (fwrite(&x, sizeof(x), 1, outputFile) == 1)
+    if ((!overlay.oldFormat && !FWRITE_OUTPUT(header)) ||
+        !FWRITE_OUTPUT(config) ||
+        !FWRITE_OUTPUT(mappingOffset))
+    {
+        fprintf(stderr, "Error: %s: failed to write header\n", outputFilename);
+        goto out;
+    }
+
+    /* the entries are in the order of the bases, so
+     * every base is read from front to back */
+    for (uint64_t i = 0; i < overlay.entryCount; i++)
+    {
+        const struct overlay_entry* entry = &overlay.entries[i];
+        union StorageOffset offset;
+
+        offset._data = entry->offset;
+        if (sizes[i] == 0)
+        {
+            continue;
+        }
+        if (!copy_payload(files[entry->base], offset._offset, outputFile, sizes[i]))
+        {
+            fprintf(stderr, "Error: %s: failed to copy texture data\n", outputFilename);
+            goto out;
+        }
+    }
+
+    if (!FWRITE_OUTPUT(mappingSize))
+    {
+        fprintf(stderr, "Error: %s: failed to write mapping\n", outputFilename);
+        goto out;
+    }
+    for (uint64_t i = 0; i < overlay.entryCount; i++)
+    {
+        union StorageOffset offset;
+        offset._data   = overlay.entries[i].offset;
+        offset._offset = outputOffsets[i];
+
+        if (!FWRITE_OUTPUT(overlay.entries[i].checksum) ||
+            !FWRITE_OUTPUT(offset._data))
+        {
+            fprintf(stderr, "Error: %s: failed to write mapping\n", outputFilename);
+            goto out;
+        }
+    }
+#undef FWRITE_OUTPUT
+
+    ret = fflush(outputFile) == 0 && (toStdout || fsync(fileno(outputFile)) == 0);
+out:
+    if (outputFile != NULL && !toStdout)
+    {
+        if (fclose(outputFile) != 0)
+        {
+            ret = false;
+        }
+        if (ret && rename(partFilename, outputFilename) == -1)
+        {
+            fprintf(stderr, "Error: %s: rename: %s\n", partFilename, strerror(errno));
+            ret = false;
+        }
+        if (!ret)
+        {
+            unlink(partFilename);
+        }
+    }
+    for (FILE* file : files)
+    {
+        if (file != NULL)
+        {
+            fclose(file);
+        }
+    }
+    overlay_free(&overlay);
+    return ret ? 0 : 1;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc >= 4 && strcmp(argv[1], "build") == 0)
+    {
+        return build_overlay(argv[2], argv + 3, argc - 3);
+    }
+    else if ((argc == 4 || argc == 5) && strcmp(argv[1], "query") == 0)
+    {
+        return query_overlay(argv[2], argv[3], argc == 5 ? argv[4] : NULL);
+    }
+    else if (argc == 4 && strcmp(argv[1], "flatten") == 0)
+    {
+        return flatten_overlay(argv[2], argv[3]);
+    }
+
+    printf("Usage: %s build [OUTPUT HTSO FILE] [HTS FILE]...\n", argv[0]);
+    printf("       %s query [HTSO FILE] [CHECKSUM] [FORMATSIZE]\n", argv[0]);
+    printf("       %s flatten [HTSO FILE] [OUTPUT HTS FILE]\n", argv[0]);
+    printf("\n");
+    printf("Textures of later HTS files replace the same textures of earlier ones\n");
+    printf("The checksum and format size are hexadecimal, without a format size every format size is printed\n");
+    printf("Use - as output file to write to stdout\n");
+    return 1;
+}
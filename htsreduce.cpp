@@ -0,0 +1,562 @@
+/*
+ * texturepack_utils - https://github.com/Rosalie241/texturepack_utils
+ *  Copyright (C) 2023 Rosalie Wanders <rosalie@mailbox.org>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 3.
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef _WIN32
+#include <linux/limits.h>
+#endif /* _WIN32 */
+#include "hts.h"
+#include "batch.h"
+#include "budget.h"
+#include "trace.h"
+#include <vector>
+#include <algorithm>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif /* __SSE2__ */
+
+/* maximum amount of textures processed in parallel
+ * before they're written to the output file */
+#define BATCH_SIZE 256
+
+/* which 16-bit formats can represent a texture exactly */
+#define REDUCE_RGBA4  0x1
+#define REDUCE_RGB5A1 0x2
+#define REDUCE_RGB565 0x4
+
+struct ReduceJob
+{
+    int                   fd;
+    bool                  oldFormat;
+    bool                  dryRun;
+    struct memory_budget* budget;
+};
+
+struct ReduceEntry
+{
+    const struct ReduceJob* job;
+    uint64_t            checksum;
+    union StorageOffset offset;
+    struct GHQTexInfo   info;
+    uint32_t            inputSize;
+    /* pixel type the texture ended up with */
+    uint16_t            pixelType;
+    /* memory taken from the budget */
+    uint64_t            memorySize;
+    bool                failed;
+};
+
+struct ReduceStats
+{
+    int32_t count;
+    int64_t inputBytes;
+    int64_t outputBytes;
+};
+
+/* returns the REDUCE_* formats which can represent
+ * the RGBA8 pixels without any loss */
+static uint32_t scan_rgba8(const uint8_t* data, int32_t pixels)
+{
+    /* an 8-bit channel survives a round trip through n bits
+     * when it equals its top n bits replicated, so the bits
+     * below them have to match the top bits of the channel */
+    uint32_t mismatch4 = 0, mismatch5 = 0, mismatch6 = 0;
+    uint32_t alphaNotOpaque = 0, alphaNotBinary = 0;
+    int32_t i = 0;
+
+#ifdef __SSE2__
+    const __m128i mask0f    = _mm_set1_epi8(0x0f);
+    const __m128i mask07    = _mm_set1_epi8(0x07);
+    const __m128i mask03    = _mm_set1_epi8(0x03);
+    const __m128i alphaMask = _mm_set1_epi32((int)0xff000000);
+    const __m128i greenMask = _mm_set1_epi32(0x0000ff00);
+    const __m128i ones      = _mm_set1_epi8((char)0xff);
+    const __m128i zero      = _mm_setzero_si128();
+    __m128i acc4 = zero, acc5 = zero, acc6 = zero;
+    __m128i accOpaque = zero, accBinary = zero;
+
+    for (; i + 4 <= pixels; i += 4)
+    {
+        __m128i p = _mm_loadu_si128((const __m128i*)(data + (i * 4)));
+
+        /* low nibble has to equal the high nibble */
+        acc4 = _mm_or_si128(acc4, _mm_xor_si128(_mm_and_si128(p, mask0f),
+                                                _mm_and_si128(_mm_srli_epi16(p, 4), mask0f)));
+        /* low 3 bits have to equal the top 3 bits */
+        acc5 = _mm_or_si128(acc5, _mm_xor_si128(_mm_and_si128(p, mask07),
+                                                _mm_and_si128(_mm_srli_epi16(p, 5), mask07)));
+        /* low 2 bits have to equal the top 2 bits */
+        acc6 = _mm_or_si128(acc6, _mm_xor_si128(_mm_and_si128(p, mask03),
+                                                _mm_and_si128(_mm_srli_epi16(p, 6), mask03)));
+
+        __m128i alpha = _mm_and_si128(p, alphaMask);
+        accOpaque = _mm_or_si128(accOpaque, _mm_xor_si128(alpha, alphaMask));
+        /* alpha has to be either 0x00 or 0xff */
+        __m128i isZero = _mm_cmpeq_epi32(alpha, zero);
+        __m128i isFull = _mm_cmpeq_epi32(alpha, alphaMask);
+        accBinary = _mm_or_si128(accBinary, _mm_xor_si128(_mm_or_si128(isZero, isFull), ones));
+    }
+
+    /* the green channel is the only one that matters for 6 bits */
+    acc6 = _mm_and_si128(acc6, greenMask);
+
+    uint32_t lanes[4];
+    _mm_storeu_si128((__m128i*)lanes, _mm_or_si128(acc4, _mm_unpackhi_epi64(acc4, acc4)));
+    mismatch4 = lanes[0] | lanes[1];
+    _mm_storeu_si128((__m128i*)lanes, _mm_or_si128(acc5, _mm_unpackhi_epi64(acc5, acc5)));
+    mismatch5 = lanes[0] | lanes[1];
+    _mm_storeu_si128((__m128i*)lanes, _mm_or_si128(acc6, _mm_unpackhi_epi64(acc6, acc6)));
+    mismatch6 = lanes[0] | lanes[1];
+    _mm_storeu_si128((__m128i*)lanes, _mm_or_si128(accOpaque, _mm_unpackhi_epi64(accOpaque, accOpaque)));
+    alphaNotOpaque = lanes[0] | lanes[1];
+    _mm_storeu_si128((__m128i*)lanes, _mm_or_si128(accBinary, _mm_unpackhi_epi64(accBinary, accBinary)));
+    alphaNotBinary = lanes[0] | lanes[1];
+#endif /* __SSE2__ */
+
+    for (; i < pixels; i++)
+    {
+        uint32_t p;
+        memcpy(&p, data + (i * 4), sizeof(p));
+
+        mismatch4 |= (p & 0x0f0f0f0f) ^ ((p >> 4) & 0x0f0f0f0f);
+        mismatch5 |= (p & 0x07070707) ^ ((p >> 5) & 0x07070707);
+        mismatch6 |= ((p & 0x03030303) ^ ((p >> 6) & 0x03030303)) & 0x0000ff00;
+
+        uint32_t alpha = p >> 24;
+        alphaNotOpaque |= (alpha != 0xff);
+        alphaNotBinary |= (alpha != 0xff && alpha != 0x00);
+    }
+
+    uint32_t formats = 0;
+    if (mismatch4 == 0)
+    {
+        formats |= REDUCE_RGBA4;
+    }
+    /* alpha only needs 1 bit, RGB needs 5 bits */
+    if ((mismatch5 & 0x00ffffff) == 0 && alphaNotBinary == 0)
+    {
+        formats |= REDUCE_RGB5A1;
+    }
+    /* no alpha, green gets 6 bits */
+    if ((mismatch5 & 0x00ff00ff) == 0 && mismatch6 == 0 && alphaNotOpaque == 0)
+    {
+        formats |= REDUCE_RGB565;
+    }
+    return formats;
+}
+
+static void set_texture_format(struct GHQTexInfo* info, uint16_t pixelType)
+{
+    uint32_t gz = info->format & GL_TEXFMT_GZ;
+
+    switch (pixelType)
+    {
+    case GL_UNSIGNED_SHORT_5_6_5:
+        info->format         = GL_RGB565;
+        info->texture_format = GL_RGB;
+        break;
+    case GL_UNSIGNED_SHORT_5_5_5_1:
+        info->format         = GL_RGB5_A1;
+        info->texture_format = GL_RGBA;
+        break;
+    case GL_UNSIGNED_SHORT_4_4_4_4:
+        info->format         = GL_RGBA4;
+        info->texture_format = GL_RGBA;
+        break;
+    }
+
+    info->format    |= gz;
+    info->pixel_type = pixelType;
+}
+
+/* rewrites the texture in the smallest format which is lossless,
+ * returns the pixel type it ended up with */
+static bool reduce_texture(struct GHQTexInfo* info, uint16_t* pixelType)
+{
+    bool compressed = (info->format & GL_TEXFMT_GZ) != 0;
+    int32_t pixels  = info->width * info->height;
+
+    *pixelType = info->pixel_type;
+
+    /* only RGBA8 textures can be reduced */
+    if (info->pixel_type != GL_UNSIGNED_BYTE ||
+        info->texture_format != GL_RGBA)
+    {
+        return true;
+    }
+
+    uint64_t start = 0;
+    if (compressed)
+    {
+        start = trace_begin();
+        if (!decompress_texture(info))
+        {
+            return false;
+        }
+        trace_end("inflate", start, info->dataSize);
+    }
+
+    if ((size_t)pixels * 4 > info->dataSize)
+    {
+        fprintf(stderr, "Error: texture data is smaller than its dimensions\n");
+        return false;
+    }
+
+    start = trace_begin();
+
+    uint32_t formats = scan_rgba8(info->data, pixels);
+    if (formats & REDUCE_RGB565)
+    {
+        *pixelType = GL_UNSIGNED_SHORT_5_6_5;
+    }
+    else if (formats & REDUCE_RGB5A1)
+    {
+        *pixelType = GL_UNSIGNED_SHORT_5_5_5_1;
+    }
+    else if (formats & REDUCE_RGBA4)
+    {
+        *pixelType = GL_UNSIGNED_SHORT_4_4_4_4;
+    }
+
+    if (*pixelType != GL_UNSIGNED_BYTE)
+    {
+        /* converting in place is fine, the
+         * output is never ahead of the input */
+        texture_from_rgba8(info->data, pixels, *pixelType, info->data);
+        set_texture_format(info, *pixelType);
+        info->dataSize = pixels * 2;
+    }
+
+    trace_end("convert", start, info->dataSize);
+
+    /* the report of a dry run has to show the compressed size */
+    if (compressed)
+    {
+        start = trace_begin();
+        /* textures which don't get smaller are stored uncompressed */
+        compress_texture(info, 1);
+        trace_end("deflate", start, info->dataSize);
+    }
+
+    return true;
+}
+
+/* returns how much memory reduce_texture() needs at most */
+static uint64_t texture_memory_size(struct GHQTexInfo* info)
+{
+    /* compressed textures are inflated and compressed again */
+    if (info->format & GL_TEXFMT_GZ)
+    {
+        return info->dataSize + (2 * texture_inflated_size(info));
+    }
+    return info->dataSize;
+}
+
+static void process_entry(void* arg)
+{
+    struct ReduceEntry* entry = (struct ReduceEntry*)arg;
+    const struct ReduceJob* job = entry->job;
+
+    trace_texture(entry->checksum, entry->info.width, entry->info.height);
+    uint64_t start = trace_begin();
+    entry->inputSize = entry->info.dataSize;
+    entry->failed    = !pread_info_data(job->fd, entry->offset._offset, job->oldFormat, &entry->info);
+    trace_end("read", start, entry->info.dataSize);
+
+    entry->failed = entry->failed || !reduce_texture(&entry->info, &entry->pixelType);
+
+    /* only the output stays around until it's written */
+    uint64_t kept = entry->failed ? 0 : std::min<uint64_t>(entry->info.dataSize, entry->memorySize);
+    memory_budget_release(job->budget, entry->memorySize - kept);
+    entry->memorySize = kept;
+}
+
+static const char* pixel_type_name(uint16_t pixelType)
+{
+    switch (pixelType)
+    {
+    case GL_UNSIGNED_BYTE:
+        return "RGBA8";
+    case GL_UNSIGNED_SHORT_5_6_5:
+        return "RGB565";
+    case GL_UNSIGNED_SHORT_5_5_5_1:
+        return "RGB5_A1";
+    case GL_UNSIGNED_SHORT_4_4_4_4:
+        return "RGBA4";
+    default:
+        return "other";
+    }
+}
+
+int main(int argc, char** argv)
+{
+    const char* inputFilename  = NULL;
+    const char* outputFilename = NULL;
+    bool    dryRun  = false;
+    int32_t threads = threadpool_default_threads();
+    uint64_t maxMemory = 0;
+    const char* traceFilename = NULL;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--dry-run") == 0)
+        {
+            dryRun = true;
+        }
+        else if (strcmp(argv[i], "-j") == 0 && (i + 1) < argc)
+        {
+            threads = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--trace") == 0 && (i + 1) < argc)
+        {
+            traceFilename = argv[++i];
+        }
+        else if (strcmp(argv[i], "--max-memory") == 0 && (i + 1) < argc)
+        {
+            if (!memory_budget_parse(argv[++i], &maxMemory))
+            {
+                fprintf(stderr, "Error: invalid memory size: %s\n", argv[i]);
+                return 1;
+            }
+        }
+        else if (inputFilename == NULL)
+        {
+            inputFilename = argv[i];
+        }
+        else if (outputFilename == NULL)
+        {
+            outputFilename = argv[i];
+        }
+    }
+
+    if (inputFilename == NULL || (outputFilename == NULL && !dryRun))
+    {
+        printf("Usage: %s [HTS FILE] [OUTPUT HTS FILE] [-j THREADS] [--max-memory SIZE] [--trace JSON FILE]\n", argv[0]);
+        printf("       %s [HTS FILE] --dry-run [-j THREADS] [--max-memory SIZE] [--trace JSON FILE]\n", argv[0]);
+        return 1;
+    }
+
+    FILE* file = fopen(inputFilename, "rb");
+    if (file == NULL)
+    {
+        perror("fopen");
+        return 1;
+    }
+
+    bool oldFormat   = false;
+    bool compression = false;
+    if (!check_header(file, &oldFormat, &compression))
+    {
+        fclose(file);
+        return 1;
+    }
+
+    int64_t mappingOffset = -1;
+    int32_t mappingSize   = -1;
+    struct HtsMappingEntry* mapping = NULL;
+    if (!read_hts_mapping(file, &mappingOffset, &mapping, &mappingSize))
+    {
+        fclose(file);
+        return 1;
+    }
+
+    std::vector<ReduceEntry> entries(mappingSize);
+    for (int32_t i = 0; i < mappingSize; i++)
+    {
+        entries[i].checksum = mapping[i].checksum;
+        entries[i].offset   = mapping[i].offset;
+    }
+    free(mapping);
+
+    /* read the input front to back */
+    std::sort(entries.begin(), entries.end(), [](const ReduceEntry& a, const ReduceEntry& b)
+    {
+        return a.offset._offset < b.offset._offset;
+    });
+
+    FILE* outputFile = NULL;
+    if (!dryRun)
+    {
+        outputFile = fopen(outputFilename, "wb");
+        if (outputFile == NULL)
+        {
+            perror("fopen");
+            fclose(file);
+            return 1;
+        }
+    }
+
+    int header = TXCACHE_FORMAT_VERSION;
+    int config = compression ? HTS_CONFIG_COMPRESSED : HTS_CONFIG_UNCOMPRESSED;
+    int32_t failed = 0;
+    /* indexed by the pixel type we ended up with */
+    struct ReduceStats stats[5];
+    const uint16_t statTypes[5] = { GL_UNSIGNED_BYTE, GL_UNSIGNED_SHORT_5_6_5,
+                                    GL_UNSIGNED_SHORT_5_5_5_1, GL_UNSIGNED_SHORT_4_4_4_4, 0 };
+    memset(stats, 0, sizeof(stats));
+
+#define FWRITE(x) fwrite(&x, sizeof(x), 1, outputFile);
+    // write header and dummy mapping offset
+    if (!dryRun)
+    {
+        if (!oldFormat)
+        {
+            FWRITE(header);
+        }
+        FWRITE(config);
+        mappingOffset = 0;
+        FWRITE(mappingOffset);
+    }
+
+    if (traceFilename != NULL && !trace_open(traceFilename, "htsreduce"))
+    {
+        fclose(file);
+        if (outputFile != NULL)
+        {
+            fclose(outputFile);
+            remove(outputFilename);
+        }
+        return 1;
+    }
+
+    memory_budget_init_malloc(maxMemory);
+
+    struct memory_budget budget;
+    memory_budget_init(&budget, maxMemory);
+
+    struct ReduceJob job = { fileno(file), oldFormat, dryRun, &budget };
+    struct threadpool* pool = threadpool_create(threads);
+    if (pool == NULL)
+    {
+        fprintf(stderr, "Error: failed to create thread pool\n");
+        trace_close();
+        fclose(file);
+        if (outputFile != NULL)
+        {
+            fclose(outputFile);
+            remove(outputFilename);
+        }
+        return 1;
+    }
+
+    printf("-> Processing %s...\n", inputFilename);
+
+    for (size_t start = 0, end = 0; start < entries.size(); start = end)
+    {
+        /* admit textures until the batch is full or the memory
+         * budget is used up, the batch has to be written out
+         * before its memory can be used again */
+        for (end = start; end < entries.size() && (end - start) < BATCH_SIZE; end++)
+        {
+            struct ReduceEntry* entry = &entries[end];
+            entry->job        = &job;
+            entry->memorySize = 0;
+            if (!pread_info(job.fd, entry->offset._offset, oldFormat, &entry->info, false))
+            {
+                entry->failed = true;
+                continue;
+            }
+
+            entry->memorySize = texture_memory_size(&entry->info);
+            if (!memory_budget_try_acquire(&budget, entry->memorySize))
+            {
+                break;
+            }
+            threadpool_submit(pool, process_entry, entry);
+        }
+        threadpool_wait(pool);
+
+        for (size_t i = start; i < end; i++)
+        {
+            struct ReduceEntry* entry = &entries[i];
+            if (entry->failed)
+            {
+                fprintf(stderr, "Error: failed to reduce texture %016llX\n", (unsigned long long)entry->checksum);
+                free(entry->info.data);
+                failed++;
+                continue;
+            }
+
+            int32_t stat = 0;
+            while (statTypes[stat] != 0 && statTypes[stat] != entry->pixelType)
+            {
+                stat++;
+            }
+            stats[stat].count++;
+            stats[stat].inputBytes  += entry->inputSize;
+            stats[stat].outputBytes += entry->info.dataSize;
+
+            if (!dryRun)
+            {
+                trace_texture(entry->checksum, entry->info.width, entry->info.height);
+                uint64_t start = trace_begin();
+
+                entry->offset._offset = FTELL(outputFile);
+                write_info_header(outputFile, oldFormat, &entry->info);
+                fwrite(entry->info.data, entry->info.dataSize, 1, outputFile);
+
+                trace_end("write", start, entry->info.dataSize);
+            }
+
+            free(entry->info.data);
+            entry->info.data = NULL;
+            memory_budget_release(&budget, entry->memorySize);
+        }
+    }
+
+    threadpool_destroy(pool);
+    trace_close();
+    memory_budget_report(stdout, &budget);
+    memory_budget_destroy(&budget);
+
+    if (!dryRun)
+    {
+        printf("-> Writing header and mappings...\n");
+
+        mappingOffset = FTELL(outputFile);
+        mappingSize   = (int32_t)(entries.size() - failed);
+
+        FWRITE(mappingSize);
+        for (auto& entry : entries)
+        {
+            if (!entry.failed)
+            {
+                FWRITE(entry.checksum);
+                FWRITE(entry.offset._data);
+            }
+        }
+
+        // write correct mapping offset
+        FSEEK(outputFile, oldFormat ? sizeof(config) : sizeof(header) + sizeof(config), SEEK_SET);
+        FWRITE(mappingOffset);
+        fclose(outputFile);
+    }
+#undef FWRITE
+
+    int64_t totalInput  = 0;
+    int64_t totalOutput = 0;
+
+    printf("%-8s %10s %14s %14s\n", "format", "textures", "input bytes", "output bytes");
+    for (int32_t i = 0; i < 5; i++)
+    {
+        if (stats[i].count == 0)
+        {
+            continue;
+        }
+        printf("%-8s %10i %14lld %14lld\n", pixel_type_name(statTypes[i]), stats[i].count,
+               (long long)stats[i].inputBytes, (long long)stats[i].outputBytes);
+        totalInput  += stats[i].inputBytes;
+        totalOutput += stats[i].outputBytes;
+    }
+    printf("%-8s %10zu %14lld %14lld (%.1f%%)\n", "total", entries.size() - failed,
+           (long long)totalInput, (long long)totalOutput,
+           totalInput > 0 ? (100.0 * totalOutput) / totalInput : 100.0);
+
+    fclose(file);
+    return failed == 0 ? 0 : 1;
+}
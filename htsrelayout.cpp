@@ -0,0 +1,317 @@
+/*
+ * texturepack_utils - https://github.com/Rosalie241/texturepack_utils
+ *  Copyright (C) 2023 Rosalie Wanders <rosalie@mailbox.org>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 3.
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef _WIN32
+#include <linux/limits.h>
+#endif /* _WIN32 */
+#include "hts.h"
+#include "index.h"
+#include <ctype.h>
+#include <vector>
+#include <map>
+#include <algorithm>
+
+struct RelayoutEntry
+{
+    uint64_t            checksum;
+    union StorageOffset offset;
+    int64_t             payloadOffset;
+    int64_t             outputOffset;
+    /* payload already written by an earlier entry */
+    bool                shared;
+    /* position in the access log, INT32_MAX when cold */
+    int32_t             order;
+    struct GHQTexInfo   info;
+};
+
+/* reads the access log, every line contains a checksum and optionally
+ * the N64FormatSize, both in hexadecimal, in first-use order */
+static bool read_access_log(const char* filename, std::vector<RelayoutEntry>& entries, int32_t* hotCount)
+{
+    FILE* file = fopen(filename, "r");
+    if (file == NULL)
+    {
+        perror("fopen");
+        return false;
+    }
+
+    struct hts_index mapping;
+    if (!hts_index_init(&mapping, entries.size()))
+    {
+        fclose(file);
+        return false;
+    }
+    /* a key which is in the mapping more than once is
+     * looked up as its first entry, the rest stay cold */
+    for (size_t i = 0; i < entries.size(); i++)
+    {
+        uint16_t formatSize = (uint16_t)entries[i].offset._formatsize;
+        if (hts_index_find(&mapping, entries[i].checksum, formatSize) == -1 &&
+            !hts_index_insert(&mapping, entries[i].checksum, formatSize, i, NULL))
+        {
+            fprintf(stderr, "Error: failed to allocate memory\n");
+            hts_index_free(&mapping);
+            fclose(file);
+            return false;
+        }
+    }
+
+    char line[256];
+    int32_t order   = 0;
+    int32_t unknown = 0;
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        char* ptr = line;
+        char* end = NULL;
+
+        while (isspace((unsigned char)*ptr))
+        {
+            ptr++;
+        }
+        if (*ptr == '\0' || *ptr == '#')
+        {
+            continue;
+        }
+
+        uint64_t checksum = strtoull(ptr, &end, 16);
+        if (end == ptr)
+        {
+            fprintf(stderr, "Warning: ignoring invalid line in access log: %s", line);
+            continue;
+        }
+
+        ptr = end;
+        int32_t formatSize = (int32_t)strtol(ptr, &end, 16);
+        if (end == ptr)
+        {
+            formatSize = -1;
+        }
+
+        bool     found    = false;
+        size_t   position = 0;
+        uint16_t entryFormatSize;
+        int64_t  value;
+        while (hts_index_find_next(&mapping, checksum, &position, &entryFormatSize, &value))
+        {
+            struct RelayoutEntry* entry = &entries[value];
+            if (formatSize != -1 && entryFormatSize != formatSize)
+            {
+                continue;
+            }
+
+            found = true;
+            /* only the first use counts */
+            if (entry->order == INT32_MAX)
+            {
+                entry->order = order++;
+            }
+        }
+
+        if (!found)
+        {
+            unknown++;
+        }
+    }
+
+    if (unknown > 0)
+    {
+        fprintf(stderr, "Warning: %i textures in the access log aren't in the texture pack\n", unknown);
+    }
+
+    *hotCount = order;
+    hts_index_free(&mapping);
+    fclose(file);
+    return true;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 4)
+    {
+        printf("Usage: %s [HTS FILE] [ACCESS LOG] [OUTPUT HTS FILE]\n", argv[0]);
+        return 1;
+    }
+
+    const char* filename       = argv[1];
+    const char* logFilename    = argv[2];
+    const char* outputFilename = argv[3];
+
+    FILE* file = fopen(filename, "rb");
+    if (file == NULL)
+    {
+        perror("fopen");
+        return 1;
+    }
+
+    bool oldFormat   = false;
+    bool compression = false;
+    if (!check_header(file, &oldFormat, &compression))
+    {
+        fclose(file);
+        return 1;
+    }
+
+    int64_t mappingOffset = -1;
+    int32_t mappingSize   = -1;
+    struct HtsMappingEntry* mapping = NULL;
+    if (!read_hts_mapping(file, &mappingOffset, &mapping, &mappingSize))
+    {
+        fclose(file);
+        return 1;
+    }
+
+    std::vector<RelayoutEntry> entries(mappingSize);
+    for (int32_t i = 0; i < mappingSize; i++)
+    {
+        entries[i].checksum = mapping[i].checksum;
+        entries[i].offset   = mapping[i].offset;
+        entries[i].order    = INT32_MAX;
+        entries[i].shared   = false;
+    }
+    free(mapping);
+
+    int32_t hotCount = 0;
+    if (!read_access_log(logFilename, entries, &hotCount))
+    {
+        fclose(file);
+        return 1;
+    }
+
+    printf("-> Processing %s...\n", filename);
+
+    /* read the texture headers front to back */
+    std::sort(entries.begin(), entries.end(), [](const RelayoutEntry& a, const RelayoutEntry& b)
+    {
+        return a.offset._offset < b.offset._offset;
+    });
+
+    for (auto& entry : entries)
+    {
+        if (!pread_info(fileno(file), entry.offset._offset, oldFormat, &entry.info, false))
+        {
+            fprintf(stderr, "Error: failed to read texture info\n");
+            fclose(file);
+            return 1;
+        }
+        entry.payloadOffset = entry.offset._offset + info_header_size(oldFormat);
+    }
+
+    /* hot textures in first-use order,
+     * followed by the rest grouped by checksum */
+    std::sort(entries.begin(), entries.end(), [](const RelayoutEntry& a, const RelayoutEntry& b)
+    {
+        if (a.order != b.order)
+        {
+            return a.order < b.order;
+        }
+        if (a.checksum != b.checksum)
+        {
+            return a.checksum < b.checksum;
+        }
+        return (uint16_t)a.offset._formatsize < (uint16_t)b.offset._formatsize;
+    });
+
+    int header = TXCACHE_FORMAT_VERSION;
+    int config = compression ? HTS_CONFIG_COMPRESSED : HTS_CONFIG_UNCOMPRESSED;
+
+    /* every payload size is known, so
+     * lay out the whole file up front,
+     * entries sharing a payload keep sharing it
+     * at the position of its first use */
+    std::map<int64_t, int64_t> layout;
+    int32_t sharedCount = 0;
+    mappingOffset = oldFormat ? sizeof(config) : sizeof(header) + sizeof(config);
+    mappingOffset += sizeof(mappingOffset);
+    for (auto& entry : entries)
+    {
+        auto it = layout.find(entry.offset._offset);
+        if (it != layout.end())
+        {
+            entry.outputOffset = it->second;
+            entry.shared = true;
+            sharedCount++;
+            continue;
+        }
+
+        layout[entry.offset._offset] = mappingOffset;
+        entry.outputOffset = mappingOffset;
+        mappingOffset += info_header_size(oldFormat) + entry.info.dataSize;
+    }
+
+    /* written next to the output and renamed once it's complete,
+     * so a failure doesn't leave a truncated pack behind */
+    char partFilename[PATH_MAX + 8];
+    snprintf(partFilename, sizeof(partFilename), "%s.part", outputFilename);
+    FILE* outputFile = fopen(partFilename, "wb");
+    if (outputFile == NULL)
+    {
+        perror("fopen");
+        fclose(file);
+        return 1;
+    }
+
+    printf("-> Writing %i hot and %zu cold textures, %i shared...\n", hotCount, entries.size() - hotCount, sharedCount);
+
+    bool ret = true;
+#define FWRITE(x) fwrite(&x, sizeof(x), 1, outputFile)
+    if (!oldFormat)
+    {
+        ret &= FWRITE(header) == 1;
+    }
+    ret &= FWRITE(config) == 1;
+    ret &= FWRITE(mappingOffset) == 1;
+
+    for (auto& entry : entries)
+    {
+        if (!ret)
+        {
+            break;
+        }
+        if (entry.shared)
+        {
+            continue;
+        }
+
+        write_info_header(outputFile, oldFormat, &entry.info);
+        if (!copy_payload(file, entry.payloadOffset, outputFile, entry.info.dataSize))
+        {
+            fprintf(stderr, "Error: failed to copy texture data\n");
+            ret = false;
+        }
+    }
+
+    if (ret)
+    {
+        printf("-> Writing mappings...\n");
+
+        /* the mapping follows the layout */
+        ret &= FWRITE(mappingSize) == 1;
+        for (auto& entry : entries)
+        {
+            union StorageOffset offset = entry.offset;
+            offset._offset = entry.outputOffset;
+            ret &= FWRITE(entry.checksum) == 1;
+            ret &= FWRITE(offset._data) == 1;
+        }
+    }
+#undef FWRITE
+
+    /* write_info_header() doesn't return errors, the stream keeps them */
+    ret &= ferror(outputFile) == 0;
+    ret &= fflush(outputFile) == 0 && fsync(fileno(outputFile)) == 0;
+    ret &= fclose(outputFile) == 0;
+    fclose(file);
+    if (!ret || rename(partFilename, outputFilename) == -1)
+    {
+        fprintf(stderr, "Error: failed to write %s\n", outputFilename);
+        unlink(partFilename);
+        return 1;
+    }
+    return 0;
+}
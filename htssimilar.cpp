@@ -0,0 +1,788 @@
+/*
+ * texturepack_utils - https://github.com/Rosalie241/texturepack_utils
+ *  Copyright (C) 2023 Rosalie Wanders <rosalie@mailbox.org>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 3.
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "hts.h"
+#include "batch.h"
+#include "budget.h"
+#include "trace.h"
+#include <time.h>
+#include <vector>
+#include <algorithm>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif /* __SSE2__ */
+
+/*
+ * Finds textures which only differ by noise or compression artifacts
+ *
+ * Every payload gets a 64 bit difference hash of its luminance. The
+ * hash is split into bands and payloads which share a band, the same
+ * size, format and format size are compared, the ones whose hashes
+ * are close enough are confirmed pixel by pixel. Payloads which are
+ * confirmed can share one payload, which --rewrite does.
+ */
+
+/* the hash compares neighbours in a 9x8 grid */
+#define HASH_GRID_WIDTH  9
+#define HASH_GRID_HEIGHT 8
+#define HASH_BANDS       4
+/* every payload is compared with this many earlier ones of a bucket */
+#define BUCKET_WINDOW    16
+/* payloads which are kept in memory to confirm the others against */
+#define MAX_REPRESENTATIVES 8
+
+struct SimilarJob
+{
+    int                   fd;
+    bool                  oldFormat;
+    struct memory_budget* budget;
+    int32_t               maxError;
+};
+
+struct SimilarPayload
+{
+    struct SimilarJob* job;
+    int64_t            offset;
+    /* texture header */
+    struct GHQTexInfo  info;
+    uint64_t           checksum;
+    uint64_t           hash;
+    bool               failed;
+    /* the payload which replaces this one, -1 when it's kept */
+    int32_t            target;
+    /* largest difference of a channel to the target */
+    int32_t            error;
+};
+
+struct SimilarGroup
+{
+    struct SimilarJob*      job;
+    struct SimilarPayload*  payloads;
+    std::vector<int32_t>    members;
+};
+
+struct SimilarEntry
+{
+    uint64_t            checksum;
+    union StorageOffset offset;
+};
+
+static uint64_t now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+/* reads the texture as RGBA8 into info, returns false when that fails */
+static bool read_rgba8(int fd, int64_t offset, bool oldFormat, struct GHQTexInfo* info)
+{
+    if (!pread_info(fd, offset, oldFormat, info, true))
+    {
+        return false;
+    }
+
+    if ((info->format & GL_TEXFMT_GZ) && !decompress_texture(info))
+    {
+        goto error;
+    }
+
+    if (info->width <= 0 || info->height <= 0 || texture_pixel_size(info) == 0 ||
+        texture_inflated_size(info) > info->dataSize)
+    {
+        goto error;
+    }
+
+    if (info->pixel_type != GL_UNSIGNED_BYTE)
+    {
+        uint8_t* data = (uint8_t*)malloc((size_t)info->width * info->height * 4);
+        if (data == NULL)
+        {
+            goto error;
+        }
+        texture_to_rgba8(info, data);
+        free(info->data);
+        info->data = data;
+    }
+    return true;
+
+error:
+    free(info->data);
+    info->data = NULL;
+    return false;
+}
+
+/* sum of the luminance (times 256) of count RGBA8 pixels */
+static uint64_t sum_luminance(const uint8_t* pixels, int32_t count)
+{
+    uint64_t sum = 0;
+    int32_t  i   = 0;
+
+#ifdef __SSE2__
+    /* 77 R + 150 G + 29 B of 4 pixels at once, the lanes
+     * are flushed before they could overflow */
+    const __m128i weights = _mm_setr_epi16(77, 150, 29, 0, 77, 150, 29, 0);
+    const __m128i zero    = _mm_setzero_si128();
+    while (i + 4 <= count)
+    {
+        __m128i acc = zero;
+        for (int32_t end = std::min(count - 3, i + 4096 * 4); i < end; i += 4)
+        {
+            __m128i rgba = _mm_loadu_si128((const __m128i*)(pixels + (i * 4)));
+            acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_unpacklo_epi8(rgba, zero), weights));
+            acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_unpackhi_epi8(rgba, zero), weights));
+        }
+
+        uint32_t lanes[4];
+        _mm_storeu_si128((__m128i*)lanes, acc);
+        sum += (uint64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    }
+#endif /* __SSE2__ */
+
+    for (; i < count; i++)
+    {
+        const uint8_t* pixel = pixels + (i * 4);
+        sum += (pixel[0] * 77) + (pixel[1] * 150) + (pixel[2] * 29);
+    }
+    return sum;
+}
+
+/* difference hash, every bit says whether a cell of
+ * the grid is darker than its right neighbour */
+static uint64_t hash_rgba8(const uint8_t* data, int32_t width, int32_t height)
+{
+    uint64_t grid[HASH_GRID_HEIGHT][HASH_GRID_WIDTH] = {{0}};
+    int32_t  columns[HASH_GRID_WIDTH + 1];
+    uint64_t hash = 0;
+
+    /* textures smaller than the grid repeat columns and rows */
+    for (int32_t x = 0; x <= HASH_GRID_WIDTH; x++)
+    {
+        columns[x] = (x * width) / HASH_GRID_WIDTH;
+    }
+
+    for (int32_t cellY = 0; cellY < HASH_GRID_HEIGHT; cellY++)
+    {
+        int32_t startY = (cellY * height) / HASH_GRID_HEIGHT;
+        int32_t endY   = std::max(((cellY + 1) * height) / HASH_GRID_HEIGHT, startY + 1);
+
+        for (int32_t y = startY; y < endY; y++)
+        {
+            const uint8_t* row = data + ((size_t)y * width * 4);
+            for (int32_t cellX = 0; cellX < HASH_GRID_WIDTH; cellX++)
+            {
+                int32_t startX = std::min(columns[cellX], width - 1);
+                int32_t endX   = std::max(columns[cellX + 1], startX + 1);
+                grid[cellY][cellX] += sum_luminance(row + (startX * 4), endX - startX) / (endX - startX);
+            }
+        }
+
+        for (int32_t cellX = 0; cellX < HASH_GRID_WIDTH; cellX++)
+        {
+            grid[cellY][cellX] /= (endY - startY);
+        }
+    }
+
+    for (int32_t y = 0; y < HASH_GRID_HEIGHT; y++)
+    {
+        for (int32_t x = 0; x < HASH_GRID_WIDTH - 1; x++)
+        {
+            hash = (hash << 1) | (grid[y][x] < grid[y][x + 1] ? 1 : 0);
+        }
+    }
+    return hash;
+}
+
+/* returns the largest difference of a channel, pixels which are
+ * transparent in both textures don't count, stops at limit */
+static int32_t compare_rgba8(const uint8_t* a, const uint8_t* b, size_t pixels, int32_t limit)
+{
+    int32_t error = 0;
+
+    for (size_t i = 0; i < pixels && error <= limit; i++)
+    {
+        const uint8_t* pixelA = a + (i * 4);
+        const uint8_t* pixelB = b + (i * 4);
+
+        if (memcmp(pixelA, pixelB, 4) == 0 ||
+            (pixelA[3] == 0 && pixelB[3] == 0))
+        {
+            continue;
+        }
+
+        for (int32_t channel = 0; channel < 4; channel++)
+        {
+            error = std::max(error, abs(pixelA[channel] - pixelB[channel]));
+        }
+    }
+    return error;
+}
+
+static bool same_kind(const struct SimilarPayload* a, const struct SimilarPayload* b)
+{
+    return a->info.width == b->info.width && a->info.height == b->info.height &&
+           (a->info.format & ~GL_TEXFMT_GZ) == (b->info.format & ~GL_TEXFMT_GZ) &&
+           a->info.texture_format == b->info.texture_format &&
+           a->info.pixel_type == b->info.pixel_type &&
+           a->info.n64_format_size._formatsize == b->info.n64_format_size._formatsize;
+}
+
+static uint64_t payload_size(const struct SimilarPayload* payload)
+{
+    return info_header_size(payload->job->oldFormat) + (uint64_t)payload->info.dataSize;
+}
+
+/* returns how much memory read_rgba8() needs at most, a compressed
+ * payload is inflated before it's converted */
+static uint64_t read_memory_size(struct SimilarPayload* payload)
+{
+    uint64_t size = payload->info.dataSize + ((uint64_t)payload->info.width * payload->info.height * 4);
+    if (payload->info.format & GL_TEXFMT_GZ)
+    {
+        size += texture_inflated_size(&payload->info);
+    }
+    return size;
+}
+
+static void hash_payload(void* arg)
+{
+    struct SimilarPayload* payload = (struct SimilarPayload*)arg;
+    struct SimilarJob* job = payload->job;
+    uint64_t memorySize = read_memory_size(payload);
+
+    memory_budget_acquire(job->budget, memorySize);
+    trace_texture(payload->checksum, payload->info.width, payload->info.height);
+
+    uint64_t start = trace_begin();
+    struct GHQTexInfo info = {0};
+    if (!read_rgba8(job->fd, payload->offset, job->oldFormat, &info))
+    {
+        payload->failed = true;
+    }
+    else
+    {
+        payload->hash = hash_rgba8(info.data, info.width, info.height);
+    }
+    trace_end("hash", start, memorySize);
+
+    free(info.data);
+    memory_budget_release(job->budget, memorySize);
+}
+
+/* confirms the members of a group against each other, every member is
+ * compared with the representatives found so far and either joins the
+ * first one which is close enough or becomes a representative */
+static void confirm_group(void* arg)
+{
+    struct SimilarGroup* group = (struct SimilarGroup*)arg;
+    struct SimilarJob* job = group->job;
+    struct SimilarPayload* payloads = group->payloads;
+    std::vector<std::pair<int32_t, uint8_t*>> representatives;
+
+    /* the smallest payload is the one which is kept */
+    std::sort(group->members.begin(), group->members.end(), [payloads](int32_t a, int32_t b)
+    {
+        return payloads[a].info.dataSize < payloads[b].info.dataSize;
+    });
+
+    /* the representatives and the member which is being read */
+    uint64_t textureSize = (uint64_t)payloads[group->members[0]].info.width * payloads[group->members[0]].info.height * 4;
+    uint64_t readSize    = 0;
+    for (int32_t member : group->members)
+    {
+        readSize = std::max(readSize, read_memory_size(&payloads[member]));
+    }
+    uint64_t memorySize  = (std::min<uint64_t>(group->members.size(), MAX_REPRESENTATIVES) * textureSize) + readSize;
+    memory_budget_acquire(job->budget, memorySize);
+
+    for (int32_t member : group->members)
+    {
+        struct SimilarPayload* payload = &payloads[member];
+        struct GHQTexInfo info = {0};
+
+        trace_texture(payload->checksum, payload->info.width, payload->info.height);
+        uint64_t start = trace_begin();
+        if (!read_rgba8(job->fd, payload->offset, job->oldFormat, &info))
+        {
+            payload->failed = true;
+            continue;
+        }
+
+        for (auto& representative : representatives)
+        {
+            int32_t error = compare_rgba8(representative.second, info.data,
+                                          (size_t)info.width * info.height, job->maxError);
+            if (error <= job->maxError)
+            {
+                payload->target = representative.first;
+                payload->error  = error;
+                break;
+            }
+        }
+
+        if (payload->target == -1 && representatives.size() < MAX_REPRESENTATIVES)
+        {
+            representatives.push_back(std::make_pair(member, info.data));
+            info.data = NULL;
+        }
+        trace_end("confirm", start, textureSize);
+        free(info.data);
+    }
+
+    for (auto& representative : representatives)
+    {
+        free(representative.second);
+    }
+    memory_budget_release(job->budget, memorySize);
+}
+
+static int32_t find_root(std::vector<int32_t>& parents, int32_t index)
+{
+    while (parents[index] != index)
+    {
+        parents[index] = parents[parents[index]];
+        index = parents[index];
+    }
+    return index;
+}
+
+/* groups the payloads whose hashes are at most maxDistance bits apart,
+ * two hashes which are at most HASH_BANDS - 1 bits apart always share a
+ * band, so they always end up in the same bucket of that band */
+static std::vector<std::vector<int32_t>> find_candidates(std::vector<SimilarPayload>& payloads, int32_t maxDistance)
+{
+    std::vector<int32_t> parents(payloads.size());
+    std::vector<std::pair<uint64_t, int32_t>> bucket;
+
+    for (size_t i = 0; i < payloads.size(); i++)
+    {
+        parents[i] = (int32_t)i;
+    }
+
+    for (int32_t band = 0; band < HASH_BANDS; band++)
+    {
+        const int32_t bandBits = 64 / HASH_BANDS;
+
+        /* buckets are runs of the same key after sorting */
+        bucket.clear();
+        for (size_t i = 0; i < payloads.size(); i++)
+        {
+            struct SimilarPayload* payload = &payloads[i];
+            if (payload->failed)
+            {
+                continue;
+            }
+
+            uint64_t key = (payload->hash >> (band * bandBits)) & ((1ULL << bandBits) - 1);
+            key |= (uint64_t)band << bandBits;
+            key ^= ((uint64_t)payload->info.width << 24) ^ ((uint64_t)payload->info.height << 40) ^
+                   ((uint64_t)payload->info.n64_format_size._formatsize << 48);
+            bucket.push_back(std::make_pair(key, (int32_t)i));
+        }
+        std::sort(bucket.begin(), bucket.end());
+
+        for (size_t start = 0, end = 0; start < bucket.size(); start = end)
+        {
+            for (end = start + 1; end < bucket.size() && bucket[end].first == bucket[start].first; end++)
+            {
+                size_t window = std::max(start, end > BUCKET_WINDOW ? end - BUCKET_WINDOW : 0);
+                struct SimilarPayload* payload = &payloads[bucket[end].second];
+
+                for (size_t other = window; other < end; other++)
+                {
+                    struct SimilarPayload* otherPayload = &payloads[bucket[other].second];
+                    if (same_kind(payload, otherPayload) &&
+                        __builtin_popcountll(payload->hash ^ otherPayload->hash) <= maxDistance)
+                    {
+                        parents[find_root(parents, bucket[end].second)] = find_root(parents, bucket[other].second);
+                    }
+                }
+            }
+        }
+    }
+
+    std::vector<std::vector<int32_t>> groups;
+    std::vector<int32_t> groupIndex(payloads.size(), -1);
+    std::vector<int32_t> sizes(payloads.size(), 0);
+    for (size_t i = 0; i < payloads.size(); i++)
+    {
+        sizes[find_root(parents, (int32_t)i)]++;
+    }
+    for (size_t i = 0; i < payloads.size(); i++)
+    {
+        int32_t root = find_root(parents, (int32_t)i);
+        if (sizes[root] < 2)
+        {
+            continue;
+        }
+        if (groupIndex[root] == -1)
+        {
+            groupIndex[root] = (int32_t)groups.size();
+            groups.emplace_back();
+        }
+        groups[groupIndex[root]].push_back((int32_t)i);
+    }
+    return groups;
+}
+
+static bool write_rewrite(FILE* file, const char* outputFilename, bool oldFormat, bool compression,
+                          std::vector<SimilarEntry>& entries, std::vector<SimilarPayload>& payloads)
+{
+    int header = TXCACHE_FORMAT_VERSION;
+    int config = compression ? HTS_CONFIG_COMPRESSED : HTS_CONFIG_UNCOMPRESSED;
+    int64_t mappingOffset = 0;
+    int32_t mappingSize   = (int32_t)entries.size();
+    std::vector<int64_t> outputOffsets(payloads.size(), -1);
+    bool ret = false;
+
+    /* renamed once it's complete, so a failure
+     * doesn't leave a truncated pack behind */
+    char partFilename[PATH_MAX + 8];
+    snprintf(partFilename, sizeof(partFilename), "%s.part", outputFilename);
+    FILE* outputFile = fopen(partFilename, "wb");
+    if (outputFile == NULL)
+    {
+        perror("fopen");
+        return false;
+    }
+
+    /* only the payloads which are kept are written */
+    mappingOffset = oldFormat ? sizeof(config) : sizeof(header) + sizeof(config);
+    mappingOffset += sizeof(mappingOffset);
+    for (size_t i = 0; i < payloads.size(); i++)
+    {
+        if (payloads[i].target == -1)
+        {
+            outputOffsets[i] = mappingOffset;
+            mappingOffset += payload_size(&payloads[i]);
+        }
+    }
+
+#define FWRITE_OUTPUT(x) (fwrite(&x, sizeof(x), 1, outputFile) == 1)
+    if ((!oldFormat && !FWRITE_OUTPUT(header)) ||
+        !FWRITE_OUTPUT(config) ||
+        !FWRITE_OUTPUT(mappingOffset))
+    {
+        fprintf(stderr, "Error: %s: failed to write header\n", outputFilename);
+        goto out;
+    }
+
+    for (size_t i = 0; i < payloads.size(); i++)
+    {
+        if (payloads[i].target == -1 &&
+            !copy_payload(file, payloads[i].offset, outputFile, payload_size(&payloads[i])))
+        {
+            fprintf(stderr, "Error: %s: failed to copy texture data\n", outputFilename);
+            goto out;
+        }
+    }
+
+    if (!FWRITE_OUTPUT(mappingSize))
+    {
+        fprintf(stderr, "Error: %s: failed to write mapping\n", outputFilename);
+        goto out;
+    }
+
+    /* the payloads are sorted by their offset in the input */
+    for (auto& entry : entries)
+    {
+        auto payload = std::lower_bound(payloads.begin(), payloads.end(), entry.offset._offset,
+                                        [](const SimilarPayload& a, int64_t offset)
+        {
+            return a.offset < offset;
+        });
+        size_t index = payload - payloads.begin();
+        union StorageOffset offset = entry.offset;
+
+        offset._offset = outputOffsets[payload->target == -1 ? index : payload->target];
+        if (!FWRITE_OUTPUT(entry.checksum) ||
+            !FWRITE_OUTPUT(offset._data))
+        {
+            fprintf(stderr, "Error: %s: failed to write mapping\n", outputFilename);
+            goto out;
+        }
+    }
+#undef FWRITE_OUTPUT
+
+    ret = fflush(outputFile) == 0 && fsync(fileno(outputFile)) == 0;
+out:
+    if (fclose(outputFile) != 0)
+    {
+        ret = false;
+    }
+    if (ret && rename(partFilename, outputFilename) == -1)
+    {
+        fprintf(stderr, "Error: %s: rename: %s\n", partFilename, strerror(errno));
+        ret = false;
+    }
+    if (!ret)
+    {
+        unlink(partFilename);
+    }
+    return ret;
+}
+
+int main(int argc, char** argv)
+{
+    const char* inputFilename  = NULL;
+    const char* outputFilename = NULL;
+    int32_t threads     = threadpool_default_threads();
+    int32_t maxDistance = 4;
+    int32_t maxError    = 4;
+    int32_t top         = 10;
+    uint64_t maxMemory  = 0;
+    const char* traceFilename = NULL;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--rewrite") == 0 && (i + 1) < argc)
+        {
+            outputFilename = argv[++i];
+        }
+        else if (strcmp(argv[i], "--max-distance") == 0 && (i + 1) < argc)
+        {
+            maxDistance = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--max-error") == 0 && (i + 1) < argc)
+        {
+            maxError = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--top") == 0 && (i + 1) < argc)
+        {
+            top = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-j") == 0 && (i + 1) < argc)
+        {
+            threads = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--trace") == 0 && (i + 1) < argc)
+        {
+            traceFilename = argv[++i];
+        }
+        else if (strcmp(argv[i], "--max-memory") == 0 && (i + 1) < argc)
+        {
+            if (!memory_budget_parse(argv[++i], &maxMemory))
+            {
+                fprintf(stderr, "Error: invalid memory size: %s\n", argv[i]);
+                return 1;
+            }
+        }
+        else if (inputFilename == NULL)
+        {
+            inputFilename = argv[i];
+        }
+    }
+
+    if (inputFilename == NULL || maxDistance < 0 || maxDistance > 64 || maxError < 0 || maxError > 255)
+    {
+        printf("Usage: %s [HTS FILE] [--rewrite OUTPUT HTS FILE] [--max-distance BITS] [--max-error VALUE] [--top CLUSTERS]\n", argv[0]);
+        printf("       %*s [-j THREADS] [--max-memory SIZE] [--trace JSON FILE]\n", (int)strlen(argv[0]), "");
+        printf("\n");
+        printf("Textures are candidates when their hashes differ by at most BITS bits (default 4), and\n");
+        printf("similar when no channel of a pixel differs by more than VALUE (default 4)\n");
+        printf("--rewrite writes a copy where similar textures share one payload\n");
+        return 1;
+    }
+
+    FILE* file = fopen(inputFilename, "rb");
+    if (file == NULL)
+    {
+        perror("fopen");
+        return 1;
+    }
+
+    bool oldFormat   = false;
+    bool compression = false;
+    if (!check_header(file, &oldFormat, &compression))
+    {
+        fclose(file);
+        return 1;
+    }
+
+    int64_t mappingOffset = -1;
+    int32_t mappingSize   = -1;
+    struct HtsMappingEntry* mapping = NULL;
+    if (!read_hts_mapping(file, &mappingOffset, &mapping, &mappingSize))
+    {
+        fclose(file);
+        return 1;
+    }
+
+    std::vector<SimilarEntry> entries(mappingSize);
+    for (int32_t i = 0; i < mappingSize; i++)
+    {
+        entries[i].checksum = mapping[i].checksum;
+        entries[i].offset   = mapping[i].offset;
+    }
+    free(mapping);
+
+    if (traceFilename != NULL && !trace_open(traceFilename, "htssimilar"))
+    {
+        fclose(file);
+        return 1;
+    }
+
+    memory_budget_init_malloc(maxMemory);
+
+    struct memory_budget budget;
+    memory_budget_init(&budget, maxMemory);
+
+    struct SimilarJob job = { fileno(file), oldFormat, &budget, maxError };
+
+    /* textures which already share a payload are hashed once */
+    std::vector<SimilarPayload> payloads;
+    payloads.reserve(entries.size());
+    std::vector<SimilarEntry> sortedEntries = entries;
+    std::sort(sortedEntries.begin(), sortedEntries.end(), [](const SimilarEntry& a, const SimilarEntry& b)
+    {
+        return a.offset._offset < b.offset._offset;
+    });
+    for (auto& entry : sortedEntries)
+    {
+        if (!payloads.empty() && payloads.back().offset == entry.offset._offset)
+        {
+            continue;
+        }
+
+        struct SimilarPayload payload = {0};
+        payload.job      = &job;
+        payload.offset   = entry.offset._offset;
+        payload.checksum = entry.checksum;
+        payload.target   = -1;
+        payload.failed   = !pread_info(job.fd, payload.offset, oldFormat, &payload.info, false);
+        payloads.push_back(payload);
+    }
+
+    struct threadpool* pool = threadpool_create(threads);
+    if (pool == NULL)
+    {
+        fprintf(stderr, "Error: failed to create thread pool\n");
+        trace_close();
+        memory_budget_destroy(&budget);
+        fclose(file);
+        return 1;
+    }
+
+    printf("-> Hashing %zu textures of %s...\n", payloads.size(), inputFilename);
+
+    uint64_t start = now_ms();
+    for (auto& payload : payloads)
+    {
+        if (!payload.failed)
+        {
+            threadpool_submit(pool, hash_payload, &payload);
+        }
+    }
+    threadpool_wait(pool);
+    uint64_t hashTime = now_ms() - start;
+
+    start = now_ms();
+    std::vector<std::vector<int32_t>> candidates = find_candidates(payloads, maxDistance);
+    uint64_t bucketTime = now_ms() - start;
+
+    size_t candidateCount = 0;
+    std::vector<SimilarGroup> groups(candidates.size());
+    start = now_ms();
+    for (size_t i = 0; i < candidates.size(); i++)
+    {
+        groups[i].job      = &job;
+        groups[i].payloads = payloads.data();
+        groups[i].members  = std::move(candidates[i]);
+        candidateCount    += groups[i].members.size();
+        threadpool_submit(pool, confirm_group, &groups[i]);
+    }
+    threadpool_wait(pool);
+    uint64_t confirmTime = now_ms() - start;
+
+    threadpool_destroy(pool);
+    trace_close();
+
+    /* clusters are the payloads which are kept and what replaces them */
+    struct Cluster
+    {
+        int32_t  representative;
+        int32_t  count;
+        int32_t  error;
+        uint64_t savedBytes;
+    };
+    std::vector<Cluster> clusters;
+    std::vector<int32_t> clusterIndex(payloads.size(), -1);
+    uint64_t totalBytes = 0;
+    uint64_t savedBytes = 0;
+    int32_t  failed     = 0;
+    int32_t  replaced   = 0;
+
+    for (size_t i = 0; i < payloads.size(); i++)
+    {
+        struct SimilarPayload* payload = &payloads[i];
+        totalBytes += payload_size(payload);
+        if (payload->failed)
+        {
+            fprintf(stderr, "Error: failed to read texture %016llX\n", (unsigned long long)payload->checksum);
+            failed++;
+            continue;
+        }
+        if (payload->target == -1)
+        {
+            continue;
+        }
+
+        int32_t target = payload->target;
+        if (clusterIndex[target] == -1)
+        {
+            clusterIndex[target] = (int32_t)clusters.size();
+            clusters.push_back({ target, 1, 0, 0 });
+        }
+
+        struct Cluster* cluster = &clusters[clusterIndex[target]];
+        cluster->count++;
+        cluster->error       = std::max(cluster->error, payload->error);
+        cluster->savedBytes += payload_size(payload);
+        savedBytes          += payload_size(payload);
+        replaced++;
+    }
+
+    std::sort(clusters.begin(), clusters.end(), [](const Cluster& a, const Cluster& b)
+    {
+        return a.savedBytes > b.savedBytes;
+    });
+
+    printf("-> Hashed in %llu ms, bucketed in %llu ms, confirmed %zu candidates in %llu ms\n",
+           (unsigned long long)hashTime, (unsigned long long)bucketTime, candidateCount,
+           (unsigned long long)confirmTime);
+    printf("-> %zu clusters, %i of %zu textures can share a payload\n", clusters.size(), replaced, payloads.size());
+    printf("-> Potential savings: %.1f MiB of %.1f MiB (%.1f%%)\n", savedBytes / (1024.0 * 1024.0),
+           totalBytes / (1024.0 * 1024.0), totalBytes > 0 ? (100.0 * savedBytes) / totalBytes : 0.0);
+
+    if (!clusters.empty() && top > 0)
+    {
+        printf("%-18s %11s %10s %10s %12s\n", "checksum", "size", "textures", "max error", "saved bytes");
+        for (size_t i = 0; i < clusters.size() && i < (size_t)top; i++)
+        {
+            const struct SimilarPayload* payload = &payloads[clusters[i].representative];
+            char size[32];
+            snprintf(size, sizeof(size), "%ix%i", payload->info.width, payload->info.height);
+            printf("%016llX   %11s %10i %10i %12llu\n", (unsigned long long)payload->checksum, size,
+                   clusters[i].count, clusters[i].error, (unsigned long long)clusters[i].savedBytes);
+        }
+    }
+
+    /* a payload which couldn't be read can't be copied either */
+    bool ret = failed == 0;
+    if (outputFilename != NULL && ret)
+    {
+        printf("-> Writing %zu textures to %s...\n", entries.size(), outputFilename);
+        ret &= write_rewrite(file, outputFilename, oldFormat, compression, entries, payloads);
+    }
+
+    memory_budget_report(stdout, &budget);
+    memory_budget_destroy(&budget);
+    fclose(file);
+    return ret ? 0 : 1;
+}
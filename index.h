@@ -0,0 +1,310 @@
+/*
+ * texturepack_utils - https://github.com/Rosalie241/texturepack_utils
+ *  Copyright (C) 2023 Rosalie Wanders <rosalie@mailbox.org>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 3.
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef INDEX_H
+#define INDEX_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Texture index
+ *
+ * Open addressing hash table keyed on (checksum, formatsize), with
+ * linear probing in one flat array of 16 byte slots. The value and
+ * the formatsize share 64 bits the same way StorageOffset does, so
+ * values are limited to 48 bits, which covers every offset in a HTS
+ * file and every entry index.
+ *
+ * The slot is picked by the checksum only, so every formatsize of a
+ * checksum is in the same probe sequence, which makes looking up a
+ * checksum with any formatsize as cheap as an exact lookup.
+ */
+
+#define HTS_INDEX_MAX_VALUE ((int64_t)0xFFFFFFFFFFFE)
+/* value 0xFFFFFFFFFFFF with formatsize 0xFFFF marks an empty slot */
+#define HTS_INDEX_EMPTY     UINT64_MAX
+
+struct hts_index_slot
+{
+    uint64_t checksum;
+    /* value:48, formatsize:16 */
+    uint64_t data;
+};
+
+struct hts_index
+{
+    struct hts_index_slot* slots;
+    /* capacity - 1, the capacity is a power of two */
+    size_t                 mask;
+    size_t                 count;
+};
+
+struct hts_index_entry
+{
+    uint64_t checksum;
+    uint16_t formatsize;
+    int64_t  value;
+};
+
+static inline size_t hts_index_hash(uint64_t checksum)
+{
+    /* the checksums aren't evenly distributed
+     * in the low bits, so mix them first */
+    checksum ^= checksum >> 33;
+    checksum *= 0xff51afd7ed558ccdULL;
+    checksum ^= checksum >> 33;
+    return (size_t)checksum;
+}
+
+static inline uint64_t hts_index_pack(uint16_t formatsize, int64_t value)
+{
+    return ((uint64_t)value & 0xFFFFFFFFFFFFULL) | ((uint64_t)formatsize << 48);
+}
+
+static inline uint16_t hts_index_formatsize(uint64_t data)
+{
+    return (uint16_t)(data >> 48);
+}
+
+static inline int64_t hts_index_value(uint64_t data)
+{
+    return (int64_t)(data & 0xFFFFFFFFFFFFULL);
+}
+
+static bool hts_index_alloc(struct hts_index* index, size_t capacity)
+{
+    index->slots = (struct hts_index_slot*)malloc(capacity * sizeof(struct hts_index_slot));
+    if (index->slots == NULL)
+    {
+        return false;
+    }
+
+    /* all bits set marks a slot as empty */
+    memset(index->slots, 0xff, capacity * sizeof(struct hts_index_slot));
+    index->mask  = capacity - 1;
+    index->count = 0;
+    return true;
+}
+
+/* creates an index which can hold expected entries without growing */
+static bool hts_index_init(struct hts_index* index, size_t expected)
+{
+    size_t capacity = 16;
+
+    /* stay below a load factor of 3/4 */
+    while ((capacity / 4) * 3 < expected)
+    {
+        capacity *= 2;
+    }
+
+    return hts_index_alloc(index, capacity);
+}
+
+static void hts_index_free(struct hts_index* index)
+{
+    free(index->slots);
+    index->slots = NULL;
+    index->mask  = 0;
+    index->count = 0;
+}
+
+/* returns the slot of the key, or the empty slot where it belongs */
+static inline struct hts_index_slot* hts_index_slot(const struct hts_index* index, uint64_t checksum, uint16_t formatsize)
+{
+    size_t position = hts_index_hash(checksum) & index->mask;
+    while (true)
+    {
+        struct hts_index_slot* slot = &index->slots[position];
+        if (slot->data == HTS_INDEX_EMPTY ||
+            (slot->checksum == checksum && hts_index_formatsize(slot->data) == formatsize))
+        {
+            return slot;
+        }
+        position = (position + 1) & index->mask;
+    }
+}
+
+static bool hts_index_grow(struct hts_index* index)
+{
+    struct hts_index old = *index;
+
+    if (!hts_index_alloc(index, (old.mask + 1) * 2))
+    {
+        *index = old;
+        return false;
+    }
+
+    for (size_t i = 0; i <= old.mask; i++)
+    {
+        if (old.slots[i].data != HTS_INDEX_EMPTY)
+        {
+            *hts_index_slot(index, old.slots[i].checksum, hts_index_formatsize(old.slots[i].data)) = old.slots[i];
+        }
+    }
+
+    index->count = old.count;
+    free(old.slots);
+    return true;
+}
+
+/* makes sure count more entries can be added without growing again */
+static bool hts_index_reserve(struct hts_index* index, size_t count)
+{
+    while ((index->count + count) > ((index->mask + 1) / 4) * 3)
+    {
+        if (!hts_index_grow(index))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* returns the value of the key, or -1 when it isn't in the index */
+static inline int64_t hts_index_find(const struct hts_index* index, uint64_t checksum, uint16_t formatsize)
+{
+    struct hts_index_slot* slot = hts_index_slot(index, checksum, formatsize);
+    return slot->data == HTS_INDEX_EMPTY ? -1 : hts_index_value(slot->data);
+}
+
+/* finds the entries with checksum regardless of their formatsize,
+ * position has to be 0 for the first call, returns false when
+ * there are no more entries */
+static bool hts_index_find_next(const struct hts_index* index, uint64_t checksum, size_t* position,
+                                uint16_t* formatsize, int64_t* value)
+{
+    size_t start = hts_index_hash(checksum) & index->mask;
+    while (true)
+    {
+        struct hts_index_slot* slot = &index->slots[(start + *position) & index->mask];
+        if (slot->data == HTS_INDEX_EMPTY)
+        {
+            return false;
+        }
+
+        (*position)++;
+        if (slot->checksum == checksum)
+        {
+            *formatsize = hts_index_formatsize(slot->data);
+            *value      = hts_index_value(slot->data);
+            return true;
+        }
+    }
+}
+
+/* adds the key or replaces its value, previous (when not NULL) is set
+ * to the value it replaced or -1, returns false when out of memory */
+static bool hts_index_insert(struct hts_index* index, uint64_t checksum, uint16_t formatsize,
+                             int64_t value, int64_t* previous)
+{
+    struct hts_index_slot* slot = hts_index_slot(index, checksum, formatsize);
+
+    if (slot->data == HTS_INDEX_EMPTY)
+    {
+        if ((index->count + 1) > ((index->mask + 1) / 4) * 3)
+        {
+            if (!hts_index_grow(index))
+            {
+                return false;
+            }
+            slot = hts_index_slot(index, checksum, formatsize);
+        }
+
+        index->count++;
+        if (previous != NULL)
+        {
+            *previous = -1;
+        }
+    }
+    else if (previous != NULL)
+    {
+        *previous = hts_index_value(slot->data);
+    }
+
+    slot->checksum = checksum;
+    slot->data     = hts_index_pack(formatsize, value);
+    return true;
+}
+
+/* removes the key, returns false when it isn't in the index */
+static bool hts_index_remove(struct hts_index* index, uint64_t checksum, uint16_t formatsize)
+{
+    struct hts_index_slot* slot = hts_index_slot(index, checksum, formatsize);
+    if (slot->data == HTS_INDEX_EMPTY)
+    {
+        return false;
+    }
+
+    /* move the following entries of the probe sequence
+     * back, so no lookup runs into the hole */
+    size_t hole     = slot - index->slots;
+    size_t position = hole;
+    while (true)
+    {
+        position = (position + 1) & index->mask;
+        struct hts_index_slot* next = &index->slots[position];
+        if (next->data == HTS_INDEX_EMPTY)
+        {
+            break;
+        }
+
+        /* only when the hole is between its home slot and itself */
+        size_t home = hts_index_hash(next->checksum) & index->mask;
+        if (((position - home) & index->mask) >= ((position - hole) & index->mask))
+        {
+            index->slots[hole] = *next;
+            hole = position;
+        }
+    }
+
+    index->slots[hole].checksum = HTS_INDEX_EMPTY;
+    index->slots[hole].data     = HTS_INDEX_EMPTY;
+    index->count--;
+    return true;
+}
+
+static int hts_index_compare_value(const void* a, const void* b)
+{
+    int64_t valueA = ((const struct hts_index_entry*)a)->value;
+    int64_t valueB = ((const struct hts_index_entry*)b)->value;
+    return (valueA > valueB) - (valueA < valueB);
+}
+
+/* returns every entry sorted by value, which is the order of the
+ * textures in the file when the values are offsets, the result
+ * has index->count entries and has to be freed */
+static struct hts_index_entry* hts_index_sorted(const struct hts_index* index)
+{
+    struct hts_index_entry* entries = (struct hts_index_entry*)malloc((index->count + 1) * sizeof(struct hts_index_entry));
+    if (entries == NULL)
+    {
+        return NULL;
+    }
+
+    size_t count = 0;
+    for (size_t i = 0; i <= index->mask; i++)
+    {
+        struct hts_index_slot* slot = &index->slots[i];
+        if (slot->data != HTS_INDEX_EMPTY)
+        {
+            entries[count].checksum   = slot->checksum;
+            entries[count].formatsize = hts_index_formatsize(slot->data);
+            entries[count].value      = hts_index_value(slot->data);
+            count++;
+        }
+    }
+
+    qsort(entries, count, sizeof(struct hts_index_entry), hts_index_compare_value);
+    return entries;
+}
+
+#endif /* INDEX_H */
@@ -0,0 +1,252 @@
+/*
+ * texturepack_utils - https://github.com/Rosalie241/texturepack_utils
+ *  Copyright (C) 2023 Rosalie Wanders <rosalie@mailbox.org>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 3.
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "index.h"
+#include <stdio.h>
+#include <time.h>
+#include <unordered_map>
+#include <vector>
+#include <algorithm>
+
+/*
+ * Microbenchmark of index.h against the containers
+ * hts2merge and htc2uhts used before
+ */
+
+struct BenchKey
+{
+    uint64_t checksum;
+    uint16_t formatSize;
+};
+
+/* counts what the std containers allocate, malloc's
+ * own overhead per allocation isn't included */
+static size_t allocatedBytes = 0;
+static size_t allocations    = 0;
+
+template <typename T>
+struct CountingAllocator
+{
+    typedef T value_type;
+
+    CountingAllocator() {}
+    template <typename U>
+    CountingAllocator(const CountingAllocator<U>&) {}
+
+    T* allocate(size_t count)
+    {
+        allocatedBytes += count * sizeof(T);
+        allocations++;
+        return (T*)malloc(count * sizeof(T));
+    }
+
+    void deallocate(T* ptr, size_t count)
+    {
+        allocatedBytes -= count * sizeof(T);
+        allocations--;
+        free(ptr);
+    }
+
+    template <typename U>
+    bool operator==(const CountingAllocator<U>&) const { return true; }
+    template <typename U>
+    bool operator!=(const CountingAllocator<U>&) const { return false; }
+};
+
+typedef std::unordered_multimap<uint64_t, size_t, std::hash<uint64_t>, std::equal_to<uint64_t>,
+                                CountingAllocator<std::pair<const uint64_t, size_t>>> MultiMap;
+typedef std::unordered_map<uint64_t, int64_t, std::hash<uint64_t>, std::equal_to<uint64_t>,
+                           CountingAllocator<std::pair<const uint64_t, int64_t>>> Map;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+static uint64_t next_random(uint64_t* state)
+{
+    /* splitmix64 */
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static void report(const char* name, const char* operation, double seconds, size_t count,
+                   size_t bytes, size_t allocs)
+{
+    printf("%-20s %-8s %8.1f ns/op", name, operation, (seconds * 1e9) / count);
+    if (bytes != 0)
+    {
+        printf(" %8.1f bytes/entry %9zu allocations", (double)bytes / count, allocs);
+    }
+    printf("\n");
+}
+
+int main(int argc, char** argv)
+{
+    size_t   count = argc > 1 ? strtoull(argv[1], NULL, 10) : 1000000;
+    uint64_t state = 0x48545321;
+    uint64_t sink  = 0;
+
+    if (count == 0)
+    {
+        printf("Usage: %s [ENTRIES]\n", argv[0]);
+        return 1;
+    }
+
+    /* like a real pack, a few checksums
+     * exist with multiple format sizes */
+    std::vector<BenchKey> keys(count);
+    for (size_t i = 0; i < count; i++)
+    {
+        if (i > 0 && (next_random(&state) % 20) == 0)
+        {
+            keys[i].checksum   = keys[i - 1].checksum;
+            keys[i].formatSize = keys[i - 1].formatSize + 1;
+        }
+        else
+        {
+            keys[i].checksum   = next_random(&state);
+            keys[i].formatSize = 0x0302;
+        }
+    }
+
+    /* look the keys up in a different order than they were added */
+    std::vector<BenchKey> lookups(keys);
+    for (size_t i = count - 1; i > 0; i--)
+    {
+        std::swap(lookups[i], lookups[next_random(&state) % (i + 1)]);
+    }
+
+    std::vector<uint64_t> misses(count);
+    for (size_t i = 0; i < count; i++)
+    {
+        misses[i] = next_random(&state);
+    }
+
+    printf("%zu entries\n", count);
+
+    /* what hts2merge did, match the format size in the bucket */
+    {
+        MultiMap mapping;
+        double start = now();
+        mapping.reserve(count);
+        for (size_t i = 0; i < count; i++)
+        {
+            bool found = false;
+            auto range = mapping.equal_range(keys[i].checksum);
+            for (auto iter = range.first; iter != range.second; iter++)
+            {
+                if (keys[iter->second].formatSize == keys[i].formatSize)
+                {
+                    iter->second = i;
+                    found = true;
+                    break;
+                }
+            }
+            if (!found)
+            {
+                mapping.insert({keys[i].checksum, i});
+            }
+        }
+        report("unordered_multimap", "insert", now() - start, count, allocatedBytes, allocations);
+
+        start = now();
+        for (size_t i = 0; i < count; i++)
+        {
+            auto range = mapping.equal_range(lookups[i].checksum);
+            for (auto iter = range.first; iter != range.second; iter++)
+            {
+                if (keys[iter->second].formatSize == lookups[i].formatSize)
+                {
+                    sink += iter->second;
+                    break;
+                }
+            }
+        }
+        report("unordered_multimap", "hit", now() - start, count, 0, 0);
+
+        start = now();
+        for (size_t i = 0; i < count; i++)
+        {
+            sink += mapping.count(misses[i]);
+        }
+        report("unordered_multimap", "miss", now() - start, count, 0, 0);
+    }
+
+    /* what htc2uhts did, checksum only */
+    {
+        Map mapping;
+        double start = now();
+        mapping.reserve(count);
+        for (size_t i = 0; i < count; i++)
+        {
+            mapping.insert({keys[i].checksum, (int64_t)i});
+        }
+        report("unordered_map", "insert", now() - start, count, allocatedBytes, allocations);
+
+        start = now();
+        for (size_t i = 0; i < count; i++)
+        {
+            auto iter = mapping.find(lookups[i].checksum);
+            sink += iter->second;
+        }
+        report("unordered_map", "hit", now() - start, count, 0, 0);
+
+        start = now();
+        for (size_t i = 0; i < count; i++)
+        {
+            sink += mapping.count(misses[i]);
+        }
+        report("unordered_map", "miss", now() - start, count, 0, 0);
+    }
+
+    {
+        struct hts_index mapping;
+        double start = now();
+        if (!hts_index_init(&mapping, count))
+        {
+            fprintf(stderr, "Error: failed to allocate index\n");
+            return 1;
+        }
+        for (size_t i = 0; i < count; i++)
+        {
+            hts_index_insert(&mapping, keys[i].checksum, keys[i].formatSize, i, NULL);
+        }
+        report("hts_index", "insert", now() - start, count, (mapping.mask + 1) * sizeof(struct hts_index_slot), 1);
+
+        start = now();
+        for (size_t i = 0; i < count; i++)
+        {
+            sink += hts_index_find(&mapping, lookups[i].checksum, lookups[i].formatSize);
+        }
+        report("hts_index", "hit", now() - start, count, 0, 0);
+
+        start = now();
+        for (size_t i = 0; i < count; i++)
+        {
+            sink += hts_index_find(&mapping, misses[i], 0x0302);
+        }
+        report("hts_index", "miss", now() - start, count, 0, 0);
+
+        start = now();
+        struct hts_index_entry* entries = hts_index_sorted(&mapping);
+        report("hts_index", "sorted", now() - start, count, 0, 0);
+
+        free(entries);
+        hts_index_free(&mapping);
+    }
+
+    /* keeps the lookups from being optimized away */
+    printf("(%llu)\n", (unsigned long long)(sink & 0xff));
+    return 0;
+}
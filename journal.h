@@ -0,0 +1,224 @@
+/*
+ * texturepack_utils - https://github.com/Rosalie241/texturepack_utils
+ *  Copyright (C) 2023 Rosalie Wanders <rosalie@mailbox.org>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 3.
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/*
+ * Checkpoint journal
+ *
+ * An append-only file of fixed size records, one for every finished
+ * texture. Records are kept in memory until the caller has made the
+ * output they describe durable and commits them, so the journal never
+ * points at output which could still be lost. A torn record at the
+ * end, from being killed while committing, is ignored on resume.
+ *
+ * The journal starts with an identity of the input (size, mtime and
+ * whatever the tool adds), a journal for a different input or with
+ * different options is never resumed.
+ */
+
+#define JOURNAL_MAGIC   0x4A535448 /* HTSJ */
+#define JOURNAL_VERSION 1
+
+/* textures between checkpoints */
+#define JOURNAL_CHECKPOINT_RECORDS 256
+
+struct journal_identity
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t recordSize;
+    uint32_t reserved;
+    int64_t  inputSize;
+    int64_t  inputMtime;
+    int64_t  inputMtimeNsec;
+    /* tool specific, e.g. options which change the output */
+    uint64_t extra;
+};
+
+struct journal
+{
+    FILE*    file;
+    size_t   recordSize;
+    uint8_t* pending;
+    size_t   pendingCount;
+    size_t   pendingCapacity;
+};
+
+/* fills in the identity of the input file */
+static bool journal_identity(const char* inputFilename, size_t recordSize, uint64_t extra,
+                             struct journal_identity* identity)
+{
+    struct stat st;
+    if (stat(inputFilename, &st) == -1)
+    {
+        return false;
+    }
+
+    memset(identity, 0, sizeof(struct journal_identity));
+    identity->magic          = JOURNAL_MAGIC;
+    identity->version        = JOURNAL_VERSION;
+    identity->recordSize     = (uint32_t)recordSize;
+    identity->inputSize      = st.st_size;
+    identity->inputMtime     = st.st_mtime;
+#ifdef __linux__
+    identity->inputMtimeNsec = st.st_mtim.tv_nsec;
+#endif /* __linux__ */
+    identity->extra          = extra;
+    return true;
+}
+
+/* drops every record after the first count records */
+static bool journal_truncate(struct journal* journal, size_t count)
+{
+    fflush(journal->file);
+    if (ftruncate(fileno(journal->file), sizeof(struct journal_identity) + (count * journal->recordSize)) == -1)
+    {
+        return false;
+    }
+    return fseek(journal->file, 0, SEEK_END) == 0;
+}
+
+/* opens the journal, when resume is set and the journal belongs to the
+ * same input, the records in it are returned in records (which has to be
+ * freed) and count, otherwise a new journal is started and count is 0 */
+static bool journal_open(struct journal* journal, const char* filename, const struct journal_identity* identity,
+                         bool resume, void** records, size_t* count)
+{
+    memset(journal, 0, sizeof(struct journal));
+    journal->recordSize = identity->recordSize;
+    *records = NULL;
+    *count   = 0;
+
+    if (resume)
+    {
+        FILE* file = fopen(filename, "r+b");
+        struct journal_identity fileIdentity;
+        if (file != NULL &&
+            fread(&fileIdentity, sizeof(fileIdentity), 1, file) == 1 &&
+            memcmp(&fileIdentity, identity, sizeof(fileIdentity)) == 0)
+        {
+            fseek(file, 0, SEEK_END);
+            long size = ftell(file) - (long)sizeof(fileIdentity);
+            size_t recordCount = size / journal->recordSize;
+
+            *records = malloc(recordCount * journal->recordSize + 1);
+            fseek(file, sizeof(fileIdentity), SEEK_SET);
+            if (*records == NULL ||
+                fread(*records, journal->recordSize, recordCount, file) != recordCount)
+            {
+                free(*records);
+                *records = NULL;
+                fclose(file);
+                return false;
+            }
+
+            /* drop a torn record, so new records line up again */
+            journal->file = file;
+            if (!journal_truncate(journal, recordCount))
+            {
+                free(*records);
+                *records = NULL;
+                fclose(file);
+                journal->file = NULL;
+                return false;
+            }
+
+            *count = recordCount;
+            return true;
+        }
+
+        if (file != NULL)
+        {
+            fprintf(stderr, "Warning: %s doesn't belong to this input, starting over\n", filename);
+            fclose(file);
+        }
+    }
+
+    journal->file = fopen(filename, "wb");
+    if (journal->file == NULL)
+    {
+        perror("fopen");
+        return false;
+    }
+
+    if (fwrite(identity, sizeof(struct journal_identity), 1, journal->file) != 1 ||
+        fflush(journal->file) != 0)
+    {
+        fclose(journal->file);
+        journal->file = NULL;
+        return false;
+    }
+    return true;
+}
+
+/* queues a record until the next commit, sets checkpoint
+ * when it's time for one, returns false when out of memory */
+static bool journal_add(struct journal* journal, const void* record, bool* checkpoint)
+{
+    if (journal->pendingCount == journal->pendingCapacity)
+    {
+        size_t capacity = journal->pendingCapacity == 0 ? JOURNAL_CHECKPOINT_RECORDS : journal->pendingCapacity * 2;
+        uint8_t* pending = (uint8_t*)realloc(journal->pending, capacity * journal->recordSize);
+        if (pending == NULL)
+        {
+            return false;
+        }
+        journal->pending         = pending;
+        journal->pendingCapacity = capacity;
+    }
+
+    memcpy(journal->pending + (journal->pendingCount * journal->recordSize), record, journal->recordSize);
+    journal->pendingCount++;
+    *checkpoint = journal->pendingCount >= JOURNAL_CHECKPOINT_RECORDS;
+    return true;
+}
+
+/* writes the queued records, the output they describe
+ * has to be durable by now */
+static bool journal_commit(struct journal* journal)
+{
+    if (journal->pendingCount == 0)
+    {
+        return true;
+    }
+
+    bool ret = fwrite(journal->pending, journal->recordSize, journal->pendingCount, journal->file) == journal->pendingCount &&
+               fflush(journal->file) == 0;
+    journal->pendingCount = 0;
+    return ret;
+}
+
+/* closes the journal, it's removed when the work is done */
+static void journal_close(struct journal* journal, const char* filename, bool done)
+{
+    if (journal->file != NULL)
+    {
+        fclose(journal->file);
+        journal->file = NULL;
+    }
+    free(journal->pending);
+    journal->pending = NULL;
+
+    if (done)
+    {
+        unlink(filename);
+    }
+}
+
+#endif /* JOURNAL_H */
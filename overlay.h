@@ -0,0 +1,484 @@
+/*
+ * texturepack_utils - https://github.com/Rosalie241/texturepack_utils
+ *  Copyright (C) 2023 Rosalie Wanders <rosalie@mailbox.org>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 3.
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef OVERLAY_H
+#define OVERLAY_H
+
+#include "hts.h"
+#include "index.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <strings.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+/*
+ * Overlay manifest (.htso)
+ *
+ * An ordered list of base HTS files and the merged mapping of them,
+ * where a texture of a later base replaces the same (checksum,
+ * formatsize) of an earlier one. Reading the textures through the
+ * manifest gives the same result as merging the bases, without
+ * copying any texture data.
+ *
+ * Layout, everything little endian:
+ *
+ *   header    magic, version, base count, format flags, entry count
+ *   bases     path length, path, size, mtime, mtime nsec
+ *   entries   checksum, StorageOffset, base, sorted by base and offset
+ *
+ * The size and mtime of every base are checked when the manifest is
+ * opened, a manifest of a base which changed has to be built again.
+ */
+
+#define OVERLAY_MAGIC   0x4F535448 /* HTSO */
+#define OVERLAY_VERSION 1
+
+#define OVERLAY_FLAG_OLD_FORMAT 0x1
+#define OVERLAY_FLAG_COMPRESSED 0x2
+
+struct overlay_header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t baseCount;
+    uint32_t flags;
+    uint64_t entryCount;
+};
+
+struct overlay_entry
+{
+    uint64_t checksum;
+    /* union StorageOffset */
+    uint64_t offset;
+    uint32_t base;
+    uint32_t reserved;
+};
+
+struct overlay_base
+{
+    char*   path;
+    int64_t size;
+    int64_t mtime;
+    int64_t mtimeNsec;
+    /* -1 until overlay_open_bases() */
+    int     fd;
+};
+
+struct overlay
+{
+    bool                  oldFormat;
+    bool                  compressed;
+    struct overlay_base*  bases;
+    uint32_t              baseCount;
+    struct overlay_entry* entries;
+    uint64_t              entryCount;
+    /* (checksum, formatsize) -> entry */
+    struct hts_index      index;
+};
+
+static bool overlay_stat(const char* path, struct overlay_base* base)
+{
+    struct stat st;
+    if (stat(path, &st) == -1)
+    {
+        return false;
+    }
+
+    base->size      = st.st_size;
+    base->mtime     = st.st_mtime;
+#ifdef __linux__
+    base->mtimeNsec = st.st_mtim.tv_nsec;
+#else
+    base->mtimeNsec = 0;
+#endif /* __linux__ */
+    return true;
+}
+
+static void overlay_free(struct overlay* overlay)
+{
+    for (uint32_t i = 0; i < overlay->baseCount; i++)
+    {
+        if (overlay->bases[i].fd != -1)
+        {
+            close(overlay->bases[i].fd);
+        }
+        free(overlay->bases[i].path);
+    }
+    free(overlay->bases);
+    free(overlay->entries);
+    hts_index_free(&overlay->index);
+    memset(overlay, 0, sizeof(struct overlay));
+}
+
+static int overlay_compare_entry(const void* a, const void* b)
+{
+    const struct overlay_entry* entryA = (const struct overlay_entry*)a;
+    const struct overlay_entry* entryB = (const struct overlay_entry*)b;
+    uint64_t offsetA = entryA->offset & 0xFFFFFFFFFFFFULL;
+    uint64_t offsetB = entryB->offset & 0xFFFFFFFFFFFFULL;
+
+    if (entryA->base != entryB->base)
+    {
+        return entryA->base < entryB->base ? -1 : 1;
+    }
+    return (offsetA > offsetB) - (offsetA < offsetB);
+}
+
+/* the old format doesn't have the format size */
+static uint16_t overlay_formatsize(const struct overlay* overlay, uint64_t offset)
+{
+    union StorageOffset storageOffset;
+    storageOffset._data = offset;
+    return overlay->oldFormat ? 0 : (uint16_t)storageOffset._formatsize;
+}
+
+/* builds the index of the entries */
+static bool overlay_index(struct overlay* overlay)
+{
+    if (!hts_index_init(&overlay->index, overlay->entryCount))
+    {
+        return false;
+    }
+
+    for (uint64_t i = 0; i < overlay->entryCount; i++)
+    {
+        const struct overlay_entry* entry = &overlay->entries[i];
+        if (!hts_index_insert(&overlay->index, entry->checksum,
+                              overlay_formatsize(overlay, entry->offset), (int64_t)i, NULL))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+#define FREAD(x) fread(&x, sizeof(x), 1, file)
+
+/* reads the mapping of the base and adds it to the
+ * entries, replacing what earlier bases have */
+static bool overlay_add_base(struct overlay* overlay, uint32_t baseIndex, uint64_t* capacity)
+{
+    struct overlay_base* base = &overlay->bases[baseIndex];
+    bool oldFormat  = false;
+    bool compressed = false;
+    bool ret = false;
+    int64_t mappingOffset = -1;
+    int32_t mappingSize   = -1;
+
+    FILE* file = fopen(base->path, "rb");
+    if (file == NULL)
+    {
+        fprintf(stderr, "Error: %s: fopen: %s\n", base->path, strerror(errno));
+        return false;
+    }
+
+    if (!check_header(file, &oldFormat, &compressed))
+    {
+        fprintf(stderr, "Error: %s: invalid header\n", base->path);
+        goto out;
+    }
+
+    /* the textures are read as they're stored, so
+     * they have to be stored the same way */
+    if (baseIndex == 0)
+    {
+        overlay->oldFormat  = oldFormat;
+        overlay->compressed = compressed;
+    }
+    else if (oldFormat != overlay->oldFormat || compressed != overlay->compressed)
+    {
+        fprintf(stderr, "Error: %s: has a different format or compression than %s, use hts2merge\n",
+                base->path, overlay->bases[0].path);
+        goto out;
+    }
+
+    if (FREAD(mappingOffset) != 1 ||
+        FSEEK(file, mappingOffset, SEEK_SET) != 0 ||
+        FREAD(mappingSize) != 1 || mappingSize < 0 ||
+        !hts_index_reserve(&overlay->index, mappingSize))
+    {
+        fprintf(stderr, "Error: %s: invalid mapping\n", base->path);
+        goto out;
+    }
+
+    if (overlay->entryCount + mappingSize > *capacity)
+    {
+        uint64_t newCapacity = (overlay->entryCount + mappingSize) * 2;
+        struct overlay_entry* entries = (struct overlay_entry*)realloc(overlay->entries,
+                                                                       newCapacity * sizeof(struct overlay_entry));
+        if (entries == NULL)
+        {
+            fprintf(stderr, "Error: out of memory\n");
+            goto out;
+        }
+        overlay->entries = entries;
+        *capacity = newCapacity;
+    }
+
+    for (int32_t i = 0; i < mappingSize; i++)
+    {
+        struct overlay_entry entry = {0};
+
+        if (FREAD(entry.checksum) != 1 || FREAD(entry.offset) != 1)
+        {
+            fprintf(stderr, "Error: %s: truncated mapping\n", base->path);
+            goto out;
+        }
+        entry.base = baseIndex;
+
+        /* later bases replace earlier ones */
+        uint16_t formatsize = overlay_formatsize(overlay, entry.offset);
+        int64_t  existing   = hts_index_find(&overlay->index, entry.checksum, formatsize);
+        if (existing != -1)
+        {
+            overlay->entries[existing] = entry;
+        }
+        else
+        {
+            hts_index_insert(&overlay->index, entry.checksum, formatsize, (int64_t)overlay->entryCount, NULL);
+            overlay->entries[overlay->entryCount++] = entry;
+        }
+    }
+
+    ret = true;
+out:
+    fclose(file);
+    return ret;
+}
+
+/* builds the overlay of the bases from their mappings,
+ * textures of later bases replace earlier ones */
+static bool overlay_build(struct overlay* overlay, const char* const* paths, uint32_t count)
+{
+    uint64_t capacity = 0;
+
+    memset(overlay, 0, sizeof(struct overlay));
+    overlay->bases = (struct overlay_base*)calloc(count > 0 ? count : 1, sizeof(struct overlay_base));
+    if (overlay->bases == NULL || !hts_index_init(&overlay->index, 0))
+    {
+        overlay_free(overlay);
+        return false;
+    }
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        struct overlay_base* base = &overlay->bases[i];
+        char path[PATH_MAX];
+
+        base->fd = -1;
+        overlay->baseCount++;
+
+        /* the manifest has to work from any directory */
+        if (realpath(paths[i], path) == NULL ||
+            (base->path = strdup(path)) == NULL ||
+            !overlay_stat(path, base))
+        {
+            fprintf(stderr, "Error: %s: %s\n", paths[i], strerror(errno));
+            overlay_free(overlay);
+            return false;
+        }
+
+        if (!overlay_add_base(overlay, i, &capacity))
+        {
+            overlay_free(overlay);
+            return false;
+        }
+    }
+
+    /* reading them in this order reads every base from front to back,
+     * the index is built again because the entries moved */
+    qsort(overlay->entries, overlay->entryCount, sizeof(struct overlay_entry), overlay_compare_entry);
+    hts_index_free(&overlay->index);
+    if (!overlay_index(overlay))
+    {
+        overlay_free(overlay);
+        return false;
+    }
+    return true;
+}
+
+/* writes the manifest, through a temporary file so
+ * a reader never sees a partial manifest */
+static bool overlay_write(const struct overlay* overlay, const char* filename)
+{
+    struct overlay_header header = {0};
+    char partFilename[PATH_MAX + 8];
+    bool ret = true;
+
+    snprintf(partFilename, sizeof(partFilename), "%s.part", filename);
+    FILE* file = fopen(partFilename, "wb");
+    if (file == NULL)
+    {
+        fprintf(stderr, "Error: %s: fopen: %s\n", partFilename, strerror(errno));
+        return false;
+    }
+
+    header.magic      = OVERLAY_MAGIC;
+    header.version    = OVERLAY_VERSION;
+    header.baseCount  = overlay->baseCount;
+    header.flags      = (overlay->oldFormat ? OVERLAY_FLAG_OLD_FORMAT : 0) |
+                        (overlay->compressed ? OVERLAY_FLAG_COMPRESSED : 0);
+    header.entryCount = overlay->entryCount;
+    ret &= fwrite(&header, sizeof(header), 1, file) == 1;
+
+    for (uint32_t i = 0; i < overlay->baseCount; i++)
+    {
+        const struct overlay_base* base = &overlay->bases[i];
+        uint32_t pathLength = (uint32_t)strlen(base->path);
+
+        ret &= fwrite(&pathLength, sizeof(pathLength), 1, file) == 1;
+        ret &= fwrite(base->path, pathLength, 1, file) == 1;
+        ret &= fwrite(&base->size, sizeof(base->size), 1, file) == 1;
+        ret &= fwrite(&base->mtime, sizeof(base->mtime), 1, file) == 1;
+        ret &= fwrite(&base->mtimeNsec, sizeof(base->mtimeNsec), 1, file) == 1;
+    }
+
+    if (overlay->entryCount > 0)
+    {
+        ret &= fwrite(overlay->entries, sizeof(struct overlay_entry), overlay->entryCount, file) == overlay->entryCount;
+    }
+
+    ret &= fflush(file) == 0 && fsync(fileno(file)) == 0;
+    ret &= fclose(file) == 0;
+    if (!ret || rename(partFilename, filename) == -1)
+    {
+        fprintf(stderr, "Error: %s: failed to write manifest\n", filename);
+        unlink(partFilename);
+        return false;
+    }
+    return true;
+}
+
+/* reads the manifest and checks that none of the bases changed */
+static bool overlay_read(struct overlay* overlay, const char* filename)
+{
+    struct overlay_header header;
+
+    memset(overlay, 0, sizeof(struct overlay));
+
+    FILE* file = fopen(filename, "rb");
+    if (file == NULL)
+    {
+        fprintf(stderr, "Error: %s: fopen: %s\n", filename, strerror(errno));
+        return false;
+    }
+
+    if (FREAD(header) != 1 || header.magic != OVERLAY_MAGIC || header.version != OVERLAY_VERSION ||
+        header.baseCount == 0 || header.baseCount > 0xFFFF || header.entryCount > (uint64_t)HTS_INDEX_MAX_VALUE)
+    {
+        fprintf(stderr, "Error: %s: invalid manifest\n", filename);
+        fclose(file);
+        return false;
+    }
+
+    overlay->oldFormat  = (header.flags & OVERLAY_FLAG_OLD_FORMAT) != 0;
+    overlay->compressed = (header.flags & OVERLAY_FLAG_COMPRESSED) != 0;
+    overlay->bases      = (struct overlay_base*)calloc(header.baseCount, sizeof(struct overlay_base));
+    overlay->entries    = (struct overlay_entry*)malloc((header.entryCount + 1) * sizeof(struct overlay_entry));
+    if (overlay->bases == NULL || overlay->entries == NULL)
+    {
+        fprintf(stderr, "Error: %s: out of memory\n", filename);
+        goto error;
+    }
+
+    for (uint32_t i = 0; i < header.baseCount; i++)
+    {
+        struct overlay_base* base = &overlay->bases[i];
+        struct overlay_base current;
+        uint32_t pathLength = 0;
+
+        base->fd = -1;
+        overlay->baseCount++;
+
+        if (FREAD(pathLength) != 1 || pathLength == 0 || pathLength >= PATH_MAX ||
+            (base->path = (char*)calloc(pathLength + 1, 1)) == NULL ||
+            fread(base->path, pathLength, 1, file) != 1 ||
+            FREAD(base->size) != 1 || FREAD(base->mtime) != 1 || FREAD(base->mtimeNsec) != 1)
+        {
+            fprintf(stderr, "Error: %s: invalid manifest\n", filename);
+            goto error;
+        }
+
+        if (!overlay_stat(base->path, &current))
+        {
+            fprintf(stderr, "Error: %s: %s: %s\n", filename, base->path, strerror(errno));
+            goto error;
+        }
+        if (current.size != base->size || current.mtime != base->mtime || current.mtimeNsec != base->mtimeNsec)
+        {
+            fprintf(stderr, "Error: %s: %s changed, the manifest has to be built again\n", filename, base->path);
+            goto error;
+        }
+    }
+
+    if (header.entryCount > 0 &&
+        fread(overlay->entries, sizeof(struct overlay_entry), header.entryCount, file) != header.entryCount)
+    {
+        fprintf(stderr, "Error: %s: truncated manifest\n", filename);
+        goto error;
+    }
+    overlay->entryCount = header.entryCount;
+
+    for (uint64_t i = 0; i < overlay->entryCount; i++)
+    {
+        if (overlay->entries[i].base >= overlay->baseCount)
+        {
+            fprintf(stderr, "Error: %s: invalid manifest\n", filename);
+            goto error;
+        }
+    }
+
+    if (!overlay_index(overlay))
+    {
+        fprintf(stderr, "Error: %s: out of memory\n", filename);
+        goto error;
+    }
+
+    fclose(file);
+    return true;
+
+error:
+    fclose(file);
+    overlay_free(overlay);
+    return false;
+}
+
+#undef FREAD
+
+/* opens every base for reading the textures with pread */
+static bool overlay_open_bases(struct overlay* overlay)
+{
+    for (uint32_t i = 0; i < overlay->baseCount; i++)
+    {
+        struct overlay_base* base = &overlay->bases[i];
+        base->fd = open(base->path, O_RDONLY);
+        if (base->fd == -1)
+        {
+            fprintf(stderr, "Error: %s: open: %s\n", base->path, strerror(errno));
+            return false;
+        }
+    }
+    return true;
+}
+
+/* returns the entry of the texture, or NULL when none of the bases has it */
+static const struct overlay_entry* overlay_find(const struct overlay* overlay, uint64_t checksum, uint16_t formatsize)
+{
+    int64_t index = hts_index_find(&overlay->index, checksum, overlay->oldFormat ? 0 : formatsize);
+    return index == -1 ? NULL : &overlay->entries[index];
+}
+
+static bool overlay_filename(const char* filename)
+{
+    size_t length = strlen(filename);
+    return length >= 5 && strcasecmp(filename + length - 5, ".htso") == 0;
+}
+
+#endif /* OVERLAY_H */
@@ -0,0 +1,1496 @@
+/*
+ * texturepack_utils - https://github.com/Rosalie241/texturepack_utils
+ *  Copyright (C) 2023 Rosalie Wanders <rosalie@mailbox.org>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 3.
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef _WIN32
+#include <linux/limits.h>
+#endif /* _WIN32 */
+#include "hts.h"
+#include "batch.h"
+#include "index.h"
+#include "htsi.h"
+#include <png.h>
+#include <poll.h>
+#include <time.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <libgen.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+
+/*
+ * Builds or updates a HTS file from a directory of PNGs in the layout
+ * hts2png writes, and with --watch keeps updating it while they change
+ *
+ * Changed textures are appended to the HTS file followed by a new
+ * mapping, and only then the mapping offset in the header is pointed
+ * at the new mapping, so the file is valid at every moment. What the
+ * old mappings and replaced textures leave behind is dead space, which
+ * is compacted into a new file once it grows past a threshold.
+ */
+
+/* textures which are encoded at once */
+#define ENCODE_BATCH_SIZE 64
+/* changes which come in this close together are applied at once */
+#define WATCH_SETTLE_MS   50
+
+struct PackTexture
+{
+    uint64_t checksum;
+    uint16_t formatsize;
+    int64_t  offset;
+    /* header and data */
+    int64_t  size;
+    /* removed textures stay in the array */
+    bool     live;
+};
+
+struct Pack
+{
+    char                filename[PATH_MAX];
+    int                 fd;
+    bool                oldFormat;
+    bool                compressed;
+    /* (checksum, formatsize) -> texture */
+    struct hts_index    index;
+    struct PackTexture* textures;
+    size_t              count;
+    size_t              capacity;
+    /* where the next texture goes */
+    int64_t             end;
+    /* header, textures in the mapping and the mapping */
+    int64_t             liveSize;
+    int64_t             mappingSize;
+    /* write a sidecar after every commit */
+    bool                writeIndex;
+};
+
+/* a key of the pack */
+struct PackKey
+{
+    uint64_t checksum;
+    uint16_t formatsize;
+};
+
+struct EncodeJob
+{
+    char                  path[PATH_MAX * 2];
+    /* the keys the PNG is for, key when it's a single one */
+    struct PackKey        key;
+    const struct PackKey* keys;
+    size_t                keyCount;
+    bool                  compress;
+    struct GHQTexInfo     info;
+    bool                  ok;
+};
+
+struct Compaction
+{
+    pthread_t           thread;
+    atomic_bool         done;
+    bool                ok;
+    char                filename[PATH_MAX + 16];
+    int                 inputFd;
+    int                 outputFd;
+    bool                oldFormat;
+    bool                compressed;
+    /* the textures when it started, with their offsets in both files */
+    struct PackTexture* textures;
+    int64_t*            outputOffsets;
+    size_t              count;
+    struct hts_index    index;
+    int64_t             end;
+};
+
+static uint64_t now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+/* version, config and mapping offset */
+static int64_t pack_header_size(bool oldFormat)
+{
+    return (oldFormat ? 0 : sizeof(int32_t)) + sizeof(int32_t) + sizeof(int64_t);
+}
+
+static bool copy_range(int fd, int64_t offset, int outputFd, int64_t outputOffset, int64_t size)
+{
+#ifdef __linux__
+    /* let the kernel copy it when it can */
+    loff_t inputPos  = offset;
+    loff_t outputPos = outputOffset;
+    while (size > 0)
+    {
+        ssize_t ret = copy_file_range(fd, &inputPos, outputFd, &outputPos, size, 0);
+        if (ret <= 0)
+        {
+            break;
+        }
+        size -= ret;
+    }
+    offset       = inputPos;
+    outputOffset = outputPos;
+#endif /* __linux__ */
+
+    uint8_t buffer[64 * 1024];
+    while (size > 0)
+    {
+        size_t chunkSize = size < (int64_t)sizeof(buffer) ? (size_t)size : sizeof(buffer);
+        if (!pread_full(fd, buffer, chunkSize, offset) ||
+            !pwrite_full(outputFd, buffer, chunkSize, outputOffset))
+        {
+            return false;
+        }
+        offset       += chunkSize;
+        outputOffset += chunkSize;
+        size         -= chunkSize;
+    }
+    return true;
+}
+
+/* parses a PNG filename hts2png wrote for the given ident, anyPalette
+ * is set for CI textures of the new format, their name doesn't have
+ * the palette checksum */
+static bool parse_png_filename(const char* filename, const char* ident, bool oldFormat,
+                               uint64_t* checksum, uint16_t* formatsize, bool* anyPalette)
+{
+    size_t   identLength = strlen(ident);
+    uint32_t chksum      = 0;
+    uint32_t palchksum   = 0;
+    uint32_t format      = 0;
+    uint32_t size        = 0;
+    int      length      = 0;
+
+    if (strncmp(filename, ident, identLength) != 0)
+    {
+        return false;
+    }
+    filename += identLength;
+
+    *anyPalette = false;
+    if (sscanf(filename, "#%8X#%1X#%1X_all.png%n", &chksum, &format, &size, &length) == 3 &&
+        filename[length] == '\0')
+    {
+        palchksum   = 0;
+        *anyPalette = !oldFormat && format == 0x02;
+    }
+    else if (sscanf(filename, "#%8X#%1X#%1X#%8X_ciByRGBA.png%n", &chksum, &format, &size, &palchksum, &length) == 4 &&
+             filename[length] == '\0')
+    {
+    }
+    else
+    {
+        return false;
+    }
+
+    *checksum   = ((uint64_t)palchksum << 32) | chksum;
+    /* the old format doesn't have the format size */
+    *formatsize = oldFormat ? 0 : (uint16_t)(format | (size << 8));
+    return true;
+}
+
+/* reads a PNG as RGBA8 */
+static bool read_png(const char* path, struct GHQTexInfo* info)
+{
+    png_structp png_ptr  = NULL;
+    png_infop   info_ptr = NULL;
+    png_bytep* volatile rows = NULL;
+    volatile bool ret   = false;
+
+    FILE* file = fopen(path, "rb");
+    if (file == NULL)
+    {
+        return false;
+    }
+
+    png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    if (png_ptr == NULL)
+    {
+        goto out;
+    }
+    info_ptr = png_create_info_struct(png_ptr);
+    if (info_ptr == NULL || setjmp(png_jmpbuf(png_ptr)))
+    {
+        goto out;
+    }
+
+    png_init_io(png_ptr, file);
+    png_read_info(png_ptr, info_ptr);
+
+    /* every color type ends up as RGBA8 */
+    png_set_expand(png_ptr);
+    png_set_strip_16(png_ptr);
+    png_set_gray_to_rgb(png_ptr);
+    png_set_add_alpha(png_ptr, 0xff, PNG_FILLER_AFTER);
+    png_read_update_info(png_ptr, info_ptr);
+
+    info->width          = png_get_image_width(png_ptr, info_ptr);
+    info->height         = png_get_image_height(png_ptr, info_ptr);
+    info->format         = GL_RGBA8;
+    info->texture_format = GL_RGBA;
+    info->pixel_type     = GL_UNSIGNED_BYTE;
+    info->is_hires_tex   = 1;
+    info->dataSize       = (uint32_t)info->width * info->height * 4;
+    info->data           = malloc(info->dataSize);
+    rows                 = malloc(info->height * sizeof(png_bytep));
+    if (info->data == NULL || rows == NULL || png_get_rowbytes(png_ptr, info_ptr) != (size_t)info->width * 4)
+    {
+        goto out;
+    }
+
+    for (int32_t y = 0; y < info->height; y++)
+    {
+        rows[y] = info->data + ((size_t)y * info->width * 4);
+    }
+    png_read_image(png_ptr, rows);
+    png_read_end(png_ptr, NULL);
+    ret = true;
+
+out:
+    if (!ret)
+    {
+        free(info->data);
+        info->data = NULL;
+    }
+    free(rows);
+    png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+    fclose(file);
+    return ret;
+}
+
+static void encode_texture(void* arg)
+{
+    struct EncodeJob* job = (struct EncodeJob*)arg;
+
+    job->ok = read_png(job->path, &job->info);
+    if (!job->ok)
+    {
+        return;
+    }
+
+    /* stays uncompressed when that doesn't make it smaller */
+    if (job->compress)
+    {
+        compress_texture(&job->info, 1);
+    }
+}
+
+static void pack_free(struct Pack* pack)
+{
+    if (pack->fd != -1)
+    {
+        close(pack->fd);
+    }
+    hts_index_free(&pack->index);
+    free(pack->textures);
+    pack->fd       = -1;
+    pack->textures = NULL;
+}
+
+static struct PackTexture* pack_add_texture(struct Pack* pack, uint64_t checksum, uint16_t formatsize)
+{
+    if (pack->count == pack->capacity)
+    {
+        size_t capacity = pack->capacity == 0 ? 256 : pack->capacity * 2;
+        struct PackTexture* textures = realloc(pack->textures, capacity * sizeof(struct PackTexture));
+        if (textures == NULL)
+        {
+            return NULL;
+        }
+        pack->textures = textures;
+        pack->capacity = capacity;
+    }
+
+    if (!hts_index_insert(&pack->index, checksum, formatsize, (int64_t)pack->count, NULL))
+    {
+        return NULL;
+    }
+
+    struct PackTexture* texture = &pack->textures[pack->count++];
+    memset(texture, 0, sizeof(struct PackTexture));
+    texture->checksum   = checksum;
+    texture->formatsize = formatsize;
+    texture->live       = true;
+    return texture;
+}
+
+static bool pack_open(struct Pack* pack, const char* filename, bool compressed)
+{
+    struct stat st;
+
+    memset(pack, 0, sizeof(struct Pack));
+    strncpy(pack->filename, filename, sizeof(pack->filename) - 1);
+    pack->fd = -1;
+
+    /* a compaction which was killed leaves its file behind */
+    char compactFilename[PATH_MAX + 16];
+    snprintf(compactFilename, sizeof(compactFilename), "%s.compact", filename);
+    unlink(compactFilename);
+    if (!hts_index_init(&pack->index, 0))
+    {
+        return false;
+    }
+
+    /* a new pack is written by the first commit */
+    if (stat(filename, &st) == -1 && errno == ENOENT)
+    {
+        pack->fd = open(filename, O_RDWR | O_CREAT | O_EXCL, 0644);
+        if (pack->fd == -1)
+        {
+            fprintf(stderr, "Error: %s: open: %s\n", filename, strerror(errno));
+            return false;
+        }
+        pack->compressed = compressed;
+        pack->end        = pack_header_size(false);
+        pack->liveSize   = pack->end;
+        return true;
+    }
+
+    FILE* file = fopen(filename, "rb");
+    if (file == NULL)
+    {
+        fprintf(stderr, "Error: %s: fopen: %s\n", filename, strerror(errno));
+        return false;
+    }
+
+    int64_t mappingOffset = -1;
+    int32_t mappingSize   = -1;
+    bool    ret           = false;
+
+#define FREAD(x) fread(&x, sizeof(x), 1, file)
+    if (!check_header(file, &pack->oldFormat, &pack->compressed) ||
+        FREAD(mappingOffset) != 1 ||
+        FSEEK(file, mappingOffset, SEEK_SET) != 0 ||
+        FREAD(mappingSize) != 1 || mappingSize < 0)
+    {
+        fprintf(stderr, "Error: %s: invalid header or mapping\n", filename);
+        goto out;
+    }
+
+    /* the end of the last texture, which isn't
+     * always before the mapping */
+    int64_t texturesEnd = 0;
+
+    pack->liveSize = pack_header_size(pack->oldFormat);
+    for (int32_t i = 0; i < mappingSize; i++)
+    {
+        union StorageOffset offset;
+        uint64_t checksum;
+        struct GHQTexInfo info;
+
+        if (FREAD(checksum) != 1 || FREAD(offset._data) != 1 ||
+            !pread_info(fileno(file), offset._offset, pack->oldFormat, &info, false))
+        {
+            fprintf(stderr, "Error: %s: invalid mapping\n", filename);
+            goto out;
+        }
+
+        uint16_t formatsize = pack->oldFormat ? 0 : (uint16_t)offset._formatsize;
+        int64_t  existing   = hts_index_find(&pack->index, checksum, formatsize);
+        struct PackTexture* texture = existing != -1 ? &pack->textures[existing] :
+                                      pack_add_texture(pack, checksum, formatsize);
+        if (texture == NULL)
+        {
+            fprintf(stderr, "Error: out of memory\n");
+            goto out;
+        }
+        if (existing != -1)
+        {
+            pack->liveSize -= texture->size;
+        }
+        texture->offset = offset._offset;
+        texture->size   = info_header_size(pack->oldFormat) + info.dataSize;
+        pack->liveSize += texture->size;
+        if (texture->offset + texture->size > texturesEnd)
+        {
+            texturesEnd = texture->offset + texture->size;
+        }
+    }
+#undef FREAD
+
+    pack->mappingSize = sizeof(int32_t) + ((int64_t)mappingSize * 16);
+    pack->liveSize   += pack->mappingSize;
+
+    /* anything after the last mapping and the last texture is left
+     * over from being interrupted, it's overwritten by the next change */
+    pack->end = mappingOffset + pack->mappingSize;
+    if (texturesEnd > pack->end)
+    {
+        pack->end = texturesEnd;
+    }
+
+    pack->fd = open(filename, O_RDWR);
+    if (pack->fd == -1)
+    {
+        fprintf(stderr, "Error: %s: open: %s\n", filename, strerror(errno));
+        goto out;
+    }
+    ret = true;
+
+out:
+    fclose(file);
+    return ret;
+}
+
+/* appends the texture, it's only visible after the next commit */
+static bool pack_put(struct Pack* pack, uint64_t checksum, uint16_t formatsize, struct GHQTexInfo* info)
+{
+    uint8_t header[32];
+    int32_t headerSize = info_header_size(pack->oldFormat);
+
+    build_info_header(header, pack->oldFormat, info);
+    if (!pwrite_full(pack->fd, header, headerSize, pack->end) ||
+        !pwrite_full(pack->fd, info->data, info->dataSize, pack->end + headerSize))
+    {
+        fprintf(stderr, "Error: %s: failed to write texture: %s\n", pack->filename, strerror(errno));
+        return false;
+    }
+
+    int64_t existing = hts_index_find(&pack->index, checksum, formatsize);
+    struct PackTexture* texture = NULL;
+    if (existing != -1)
+    {
+        texture = &pack->textures[existing];
+        pack->liveSize -= texture->size;
+    }
+    else
+    {
+        texture = pack_add_texture(pack, checksum, formatsize);
+        if (texture == NULL)
+        {
+            fprintf(stderr, "Error: out of memory\n");
+            return false;
+        }
+    }
+
+    texture->offset = pack->end;
+    texture->size   = headerSize + info->dataSize;
+    pack->end      += texture->size;
+    pack->liveSize += texture->size;
+    return true;
+}
+
+/* removes the texture from the next mapping */
+static bool pack_remove(struct Pack* pack, uint64_t checksum, uint16_t formatsize)
+{
+    int64_t existing = hts_index_find(&pack->index, checksum, formatsize);
+    if (existing == -1)
+    {
+        return false;
+    }
+
+    pack->textures[existing].live = false;
+    pack->liveSize -= pack->textures[existing].size;
+    hts_index_remove(&pack->index, checksum, formatsize);
+    return true;
+}
+
+static int compare_palette_keys(const void* a, const void* b)
+{
+    const struct PackKey* keyA = (const struct PackKey*)a;
+    const struct PackKey* keyB = (const struct PackKey*)b;
+    uint32_t chksumA = (uint32_t)keyA->checksum;
+    uint32_t chksumB = (uint32_t)keyB->checksum;
+
+    if (chksumA != chksumB)
+    {
+        return chksumA < chksumB ? -1 : 1;
+    }
+    if (keyA->formatsize != keyB->formatsize)
+    {
+        return keyA->formatsize < keyB->formatsize ? -1 : 1;
+    }
+    return keyA->checksum < keyB->checksum ? -1 : (keyA->checksum > keyB->checksum);
+}
+
+/* returns the CI textures of the pack sorted by their texture
+ * checksum and format size, which is what their PNG name has */
+static bool pack_palettes(struct Pack* pack, struct PackKey** palettes, size_t* count)
+{
+    *palettes = malloc((pack->count + 1) * sizeof(struct PackKey));
+    *count    = 0;
+    if (*palettes == NULL)
+    {
+        fprintf(stderr, "Error: out of memory\n");
+        return false;
+    }
+
+    for (size_t i = 0; i < pack->count && !pack->oldFormat; i++)
+    {
+        if (pack->textures[i].live && (pack->textures[i].formatsize & 0xFF) == 0x02)
+        {
+            (*palettes)[*count].checksum   = pack->textures[i].checksum;
+            (*palettes)[*count].formatsize = pack->textures[i].formatsize;
+            (*count)++;
+        }
+    }
+    qsort(*palettes, *count, sizeof(struct PackKey), compare_palette_keys);
+    return true;
+}
+
+/* returns the keys of the pack a PNG is for, a CI texture named without
+ * its palette checksum is every palette of it which is in the pack, or
+ * palette checksum 0 when there's none, key is used for a single key */
+static bool resolve_png_filename(const char* filename, const char* ident, struct Pack* pack,
+                                 const struct PackKey* palettes, size_t paletteCount,
+                                 struct PackKey* key, const struct PackKey** keys, size_t* keyCount)
+{
+    bool anyPalette;
+
+    if (!parse_png_filename(filename, ident, pack->oldFormat, &key->checksum, &key->formatsize, &anyPalette))
+    {
+        return false;
+    }
+
+    *keys     = key;
+    *keyCount = 1;
+    if (!anyPalette)
+    {
+        return true;
+    }
+
+    size_t low  = 0;
+    size_t high = paletteCount;
+    while (low < high)
+    {
+        size_t middle = low + ((high - low) / 2);
+        if (compare_palette_keys(&palettes[middle], key) < 0)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+
+    size_t end = low;
+    while (end < paletteCount && (uint32_t)palettes[end].checksum == (uint32_t)key->checksum &&
+           palettes[end].formatsize == key->formatsize)
+    {
+        end++;
+    }
+    if (end > low)
+    {
+        *keys     = &palettes[low];
+        *keyCount = end - low;
+    }
+    return true;
+}
+
+/* writes a new mapping after the textures and points the header
+ * at it, which is a single write of 8 bytes, once everything
+ * before it has reached the disk */
+static bool pack_commit(struct Pack* pack)
+{
+    int32_t header        = TXCACHE_FORMAT_VERSION;
+    int32_t config        = pack->compressed ? HTS_CONFIG_COMPRESSED : HTS_CONFIG_UNCOMPRESSED;
+    int64_t mappingOffset = pack->end;
+    int32_t mappingSize   = (int32_t)pack->index.count;
+    size_t  size          = sizeof(mappingSize) + ((size_t)mappingSize * 16);
+    uint8_t* mapping      = malloc(size);
+    uint8_t* ptr          = mapping;
+
+    if (mapping == NULL)
+    {
+        return false;
+    }
+
+    memcpy(ptr, &mappingSize, sizeof(mappingSize));
+    ptr += sizeof(mappingSize);
+    for (size_t i = 0; i < pack->count; i++)
+    {
+        struct PackTexture* texture = &pack->textures[i];
+        union StorageOffset offset;
+        if (!texture->live)
+        {
+            continue;
+        }
+
+        offset._offset     = texture->offset;
+        offset._formatsize = texture->formatsize;
+        memcpy(ptr, &texture->checksum, sizeof(texture->checksum));
+        memcpy(ptr + 8, &offset._data, sizeof(offset._data));
+        ptr += 16;
+    }
+
+    bool ret = pwrite_full(pack->fd, mapping, size, mappingOffset) &&
+               fdatasync(pack->fd) == 0;
+    free(mapping);
+
+    /* the version and config only change for a new pack */
+    if (ret && !pack->oldFormat)
+    {
+        ret = pwrite_full(pack->fd, &header, sizeof(header), 0) &&
+              pwrite_full(pack->fd, &config, sizeof(config), sizeof(header));
+    }
+    else if (ret)
+    {
+        ret = pwrite_full(pack->fd, &config, sizeof(config), 0);
+    }
+
+    ret = ret &&
+          pwrite_full(pack->fd, &mappingOffset, sizeof(mappingOffset), pack_header_size(pack->oldFormat) - sizeof(mappingOffset)) &&
+          fdatasync(pack->fd) == 0;
+    if (!ret)
+    {
+        fprintf(stderr, "Error: %s: failed to write mapping: %s\n", pack->filename, strerror(errno));
+        return false;
+    }
+
+    pack->liveSize   += (int64_t)size - pack->mappingSize;
+    pack->mappingSize = size;
+    pack->end        += size;
+
+    /* the removed textures aren't needed anymore */
+    size_t count = 0;
+    for (size_t i = 0; i < pack->count; i++)
+    {
+        if (pack->textures[i].live)
+        {
+            if (count != i)
+            {
+                pack->textures[count] = pack->textures[i];
+                hts_index_insert(&pack->index, pack->textures[count].checksum,
+                                 pack->textures[count].formatsize, (int64_t)count, NULL);
+            }
+            count++;
+        }
+    }
+    pack->count = count;
+    return true;
+}
+
+/* the sidecar is written after the pack, a reader which
+ * sees the new pack before it falls back to the mapping */
+static bool pack_write_index(struct Pack* pack)
+{
+    return !pack->writeIndex || htsi_generate(pack->filename);
+}
+
+static int32_t pack_dead_percent(struct Pack* pack)
+{
+    return pack->end > 0 ? (int32_t)(((pack->end - pack->liveSize) * 100) / pack->end) : 0;
+}
+
+/* encodes the PNGs and appends them to the pack, in batches so
+ * only a few of them are in memory at once, returns how many
+ * textures were added or replaced */
+static int32_t update_pack(struct Pack* pack, struct threadpool* pool, const char* directory,
+                           char** names, size_t count, const char* ident,
+                           const struct PackKey* palettes, size_t paletteCount)
+{
+    struct EncodeJob* jobs = calloc(ENCODE_BATCH_SIZE, sizeof(struct EncodeJob));
+    int32_t updated = 0;
+
+    if (jobs == NULL)
+    {
+        return 0;
+    }
+
+    for (size_t start = 0; start < count; start += ENCODE_BATCH_SIZE)
+    {
+        size_t batchSize = (count - start) < ENCODE_BATCH_SIZE ? (count - start) : ENCODE_BATCH_SIZE;
+        size_t submitted = 0;
+
+        for (size_t i = 0; i < batchSize; i++)
+        {
+            struct EncodeJob* job = &jobs[submitted];
+            memset(job, 0, sizeof(struct EncodeJob));
+            if (!resolve_png_filename(names[start + i], ident, pack, palettes, paletteCount,
+                                      &job->key, &job->keys, &job->keyCount))
+            {
+                continue;
+            }
+            snprintf(job->path, sizeof(job->path), "%s/%s", directory, names[start + i]);
+            job->compress = pack->compressed;
+            threadpool_submit(pool, encode_texture, job);
+            submitted++;
+        }
+        threadpool_wait(pool);
+
+        /* written in the order of the names */
+        for (size_t i = 0; i < submitted; i++)
+        {
+            struct EncodeJob* job = &jobs[i];
+            if (!job->ok)
+            {
+                fprintf(stderr, "Error: %s: failed to read PNG\n", job->path);
+            }
+            for (size_t j = 0; j < job->keyCount && job->ok; j++)
+            {
+                job->info.n64_format_size._formatsize = job->keys[j].formatsize;
+                if (pack_put(pack, job->keys[j].checksum, job->keys[j].formatsize, &job->info))
+                {
+                    updated++;
+                }
+            }
+            free(job->info.data);
+        }
+    }
+
+    free(jobs);
+    return updated;
+}
+
+static void* compact_pack(void* arg)
+{
+    struct Compaction* compaction = (struct Compaction*)arg;
+    int64_t offset = pack_header_size(compaction->oldFormat);
+
+    compaction->ok = true;
+    for (size_t i = 0; i < compaction->count && compaction->ok; i++)
+    {
+        struct PackTexture* texture = &compaction->textures[i];
+        compaction->outputOffsets[i] = offset;
+        compaction->ok = copy_range(compaction->inputFd, texture->offset, compaction->outputFd, offset, texture->size);
+        offset += texture->size;
+    }
+    compaction->end = offset;
+
+    atomic_store(&compaction->done, true);
+    return NULL;
+}
+
+/* starts copying the live textures into a new file in the background */
+static bool start_compaction(struct Pack* pack, struct Compaction* compaction)
+{
+    memset(compaction, 0, sizeof(struct Compaction));
+    snprintf(compaction->filename, sizeof(compaction->filename), "%s.compact", pack->filename);
+    compaction->oldFormat     = pack->oldFormat;
+    compaction->compressed    = pack->compressed;
+    compaction->count         = pack->index.count;
+    compaction->inputFd       = dup(pack->fd);
+    compaction->outputFd      = open(compaction->filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    compaction->textures      = malloc((compaction->count + 1) * sizeof(struct PackTexture));
+    compaction->outputOffsets = malloc((compaction->count + 1) * sizeof(int64_t));
+
+    if (compaction->inputFd == -1 || compaction->outputFd == -1 ||
+        compaction->textures == NULL || compaction->outputOffsets == NULL ||
+        !hts_index_init(&compaction->index, compaction->count))
+    {
+        fprintf(stderr, "Error: %s: failed to start compaction\n", pack->filename);
+        goto error;
+    }
+
+    /* the textures are copied in the order of the file */
+    size_t count = 0;
+    for (size_t i = 0; i < pack->count; i++)
+    {
+        if (pack->textures[i].live)
+        {
+            compaction->textures[count++] = pack->textures[i];
+        }
+    }
+    for (size_t i = 1; i < count; i++)
+    {
+        struct PackTexture texture = compaction->textures[i];
+        size_t j = i;
+        while (j > 0 && compaction->textures[j - 1].offset > texture.offset)
+        {
+            compaction->textures[j] = compaction->textures[j - 1];
+            j--;
+        }
+        compaction->textures[j] = texture;
+    }
+    for (size_t i = 0; i < count; i++)
+    {
+        hts_index_insert(&compaction->index, compaction->textures[i].checksum,
+                         compaction->textures[i].formatsize, (int64_t)i, NULL);
+    }
+
+    if (pthread_create(&compaction->thread, NULL, compact_pack, compaction) != 0)
+    {
+        fprintf(stderr, "Error: %s: failed to start compaction\n", pack->filename);
+        goto error;
+    }
+    return true;
+
+error:
+    if (compaction->inputFd != -1)
+    {
+        close(compaction->inputFd);
+    }
+    if (compaction->outputFd != -1)
+    {
+        close(compaction->outputFd);
+        unlink(compaction->filename);
+    }
+    free(compaction->textures);
+    free(compaction->outputOffsets);
+    hts_index_free(&compaction->index);
+    return false;
+}
+
+/* waits for the compaction, moves what changed since it started
+ * into the new file and replaces the pack with it, the pack is
+ * left alone when anything fails */
+static bool finish_compaction(struct Pack* pack, struct Compaction* compaction)
+{
+    int64_t oldSize = pack->end;
+    /* the textures with their offsets in the new file */
+    struct PackTexture* textures = malloc((pack->count + 1) * sizeof(struct PackTexture));
+
+    pthread_join(compaction->thread, NULL);
+    close(compaction->inputFd);
+
+    bool    ret = compaction->ok && textures != NULL;
+    int64_t end = compaction->end;
+    for (size_t i = 0; i < pack->count && ret; i++)
+    {
+        struct PackTexture* texture = &textures[i];
+        int64_t index;
+
+        *texture = pack->textures[i];
+        if (!texture->live)
+        {
+            continue;
+        }
+
+        /* textures are never changed in place, so
+         * the same offset means the same texture */
+        index = hts_index_find(&compaction->index, texture->checksum, texture->formatsize);
+        if (index != -1 && compaction->textures[index].offset == texture->offset)
+        {
+            texture->offset = compaction->outputOffsets[index];
+            continue;
+        }
+
+        ret = copy_range(pack->fd, texture->offset, compaction->outputFd, end, texture->size);
+        texture->offset = end;
+        end += texture->size;
+    }
+
+    free(compaction->textures);
+    free(compaction->outputOffsets);
+    hts_index_free(&compaction->index);
+
+    /* the pack is only switched over once the
+     * new file is complete and in its place */
+    struct Pack oldPack = *pack;
+    if (ret)
+    {
+        pack->fd          = compaction->outputFd;
+        pack->textures    = textures;
+        pack->capacity    = pack->count + 1;
+        pack->end         = end;
+        pack->liveSize    = end;
+        pack->mappingSize = 0;
+        ret = pack_commit(pack);
+        if (ret && rename(compaction->filename, pack->filename) == -1)
+        {
+            fprintf(stderr, "Error: %s: rename: %s\n", compaction->filename, strerror(errno));
+            ret = false;
+        }
+    }
+
+    if (!ret)
+    {
+        fprintf(stderr, "Error: %s: compaction failed, the pack is left alone\n", oldPack.filename);
+        if (pack->textures != oldPack.textures)
+        {
+            /* the commit drops removed textures, which moves the others */
+            struct hts_index index = pack->index;
+            *pack = oldPack;
+            pack->index = index;
+            for (size_t i = 0; i < pack->count; i++)
+            {
+                if (pack->textures[i].live)
+                {
+                    hts_index_insert(&pack->index, pack->textures[i].checksum,
+                                     pack->textures[i].formatsize, (int64_t)i, NULL);
+                }
+            }
+        }
+        free(textures);
+        close(compaction->outputFd);
+        unlink(compaction->filename);
+        return false;
+    }
+
+    close(oldPack.fd);
+    free(oldPack.textures);
+
+    printf("-> Compacted %s from %.1f MiB to %.1f MiB\n", pack->filename,
+           oldSize / (1024.0 * 1024.0), pack->end / (1024.0 * 1024.0));
+    return pack_write_index(pack);
+}
+
+static int compare_names(const void* a, const void* b)
+{
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+/* returns the PNGs of the directory which were changed after since
+ * or aren't in the pack yet, every PNG when since is NULL, a PNG
+ * which was moved into the directory counts as changed */
+static bool scan_directory(const char* directory, const char* ident, struct Pack* pack,
+                           const struct PackKey* palettes, size_t paletteCount,
+                           const struct timespec* since, char*** names, size_t* count)
+{
+    DIR* dir = opendir(directory);
+    size_t capacity = 0;
+    struct dirent* entry;
+    bool ret = true;
+
+    *names = NULL;
+    *count = 0;
+    if (dir == NULL)
+    {
+        fprintf(stderr, "Error: %s: opendir: %s\n", directory, strerror(errno));
+        return false;
+    }
+
+    while (ret && (entry = readdir(dir)) != NULL)
+    {
+        char path[PATH_MAX * 2];
+        struct stat st;
+        struct PackKey key;
+        const struct PackKey* keys;
+        size_t keyCount;
+
+        if (!resolve_png_filename(entry->d_name, ident, pack, palettes, paletteCount, &key, &keys, &keyCount))
+        {
+            continue;
+        }
+
+        snprintf(path, sizeof(path), "%s/%s", directory, entry->d_name);
+        if (since != NULL && stat(path, &st) == 0 &&
+            (st.st_mtim.tv_sec < since->tv_sec ||
+             (st.st_mtim.tv_sec == since->tv_sec && st.st_mtim.tv_nsec < since->tv_nsec)) &&
+            (st.st_ctim.tv_sec < since->tv_sec ||
+             (st.st_ctim.tv_sec == since->tv_sec && st.st_ctim.tv_nsec < since->tv_nsec)) &&
+            hts_index_find(&pack->index, keys[0].checksum, keys[0].formatsize) != -1)
+        {
+            continue;
+        }
+
+        if (*count == capacity)
+        {
+            capacity = capacity == 0 ? 256 : capacity * 2;
+            char** newNames = realloc(*names, capacity * sizeof(char*));
+            if (newNames == NULL)
+            {
+                fprintf(stderr, "Error: out of memory\n");
+                ret = false;
+                break;
+            }
+            *names = newNames;
+        }
+        (*names)[(*count)++] = strdup(entry->d_name);
+    }
+    closedir(dir);
+
+    /* the same order every time */
+    if (*count > 0)
+    {
+        qsort(*names, *count, sizeof(char*), compare_names);
+    }
+    return ret;
+}
+
+static void free_names(char** names, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        free(names[i]);
+    }
+    free(names);
+}
+
+static bool add_name(char*** names, size_t* count, size_t* capacity, const char* name)
+{
+    for (size_t i = 0; i < *count; i++)
+    {
+        if (strcmp((*names)[i], name) == 0)
+        {
+            return true;
+        }
+    }
+
+    if (*count == *capacity)
+    {
+        *capacity = *capacity == 0 ? 64 : *capacity * 2;
+        char** newNames = realloc(*names, *capacity * sizeof(char*));
+        if (newNames == NULL)
+        {
+            return false;
+        }
+        *names = newNames;
+    }
+    (*names)[(*count)++] = strdup(name);
+    return true;
+}
+
+static void remove_name(char** names, size_t* count, const char* name)
+{
+    for (size_t i = 0; i < *count; i++)
+    {
+        if (strcmp(names[i], name) == 0)
+        {
+            free(names[i]);
+            names[i] = names[--(*count)];
+            return;
+        }
+    }
+}
+
+/* adds or removes the keys of the PNGs to the keys which have a PNG */
+static bool track_names(struct hts_index* tracked, char** names, size_t count, bool add, const char* ident,
+                        struct Pack* pack, const struct PackKey* palettes, size_t paletteCount)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        struct PackKey key;
+        const struct PackKey* keys;
+        size_t keyCount;
+
+        if (!resolve_png_filename(names[i], ident, pack, palettes, paletteCount, &key, &keys, &keyCount))
+        {
+            continue;
+        }
+        for (size_t j = 0; j < keyCount; j++)
+        {
+            if (add && !hts_index_insert(tracked, keys[j].checksum, keys[j].formatsize, 0, NULL))
+            {
+                fprintf(stderr, "Error: out of memory\n");
+                return false;
+            }
+            else if (!add)
+            {
+                hts_index_remove(tracked, keys[j].checksum, keys[j].formatsize);
+            }
+        }
+    }
+    return true;
+}
+
+/* when inotify dropped events, the changed PNGs are found by their
+ * time and the removed ones by comparing the tracked keys with the
+ * PNGs which are there, returns the changed PNGs */
+static bool rescan_directory(struct Pack* pack, const char* directory, const char* ident,
+                             const struct PackKey* palettes, size_t paletteCount, const struct timespec* since,
+                             struct hts_index* tracked, char*** changed, size_t* changedCount, int32_t* deleted)
+{
+    struct hts_index present;
+    char** names = NULL;
+    size_t count = 0;
+
+    printf("-> Missed changes in %s, rescanning it\n", directory);
+    if (!scan_directory(directory, ident, pack, palettes, paletteCount, NULL, &names, &count) ||
+        !hts_index_init(&present, count) ||
+        !track_names(&present, names, count, true, ident, pack, palettes, paletteCount))
+    {
+        free_names(names, count);
+        hts_index_free(&present);
+        return false;
+    }
+    free_names(names, count);
+
+    for (size_t i = 0; i <= tracked->mask; i++)
+    {
+        const struct hts_index_slot* slot = &tracked->slots[i];
+        uint16_t formatsize = hts_index_formatsize(slot->data);
+        if (slot->data != HTS_INDEX_EMPTY &&
+            hts_index_find(&present, slot->checksum, formatsize) == -1 &&
+            pack_remove(pack, slot->checksum, formatsize))
+        {
+            (*deleted)++;
+        }
+    }
+    hts_index_free(tracked);
+    *tracked = present;
+
+    return scan_directory(directory, ident, pack, palettes, paletteCount, since, changed, changedCount);
+}
+
+/* set by SIGINT and SIGTERM, which are blocked in every thread
+ * and only let through while watch_directory() waits for changes */
+static volatile sig_atomic_t stopWatching = 0;
+
+static void handle_stop_signal(int signal)
+{
+    (void)signal;
+    stopWatching = 1;
+}
+
+static bool watch_directory(struct Pack* pack, struct threadpool* pool, const char* directory,
+                            const char* ident, int32_t compactPercent)
+{
+    struct Compaction compaction;
+    bool compacting = false;
+    char buffer[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    /* the keys which have a PNG, only those are removed when
+     * their PNG is found missing after events were dropped */
+    struct hts_index tracked;
+    struct timespec  since;
+    struct timespec  batchStart;
+
+    clock_gettime(CLOCK_REALTIME, &batchStart);
+    int fd = inotify_init1(IN_CLOEXEC);
+    if (fd == -1 ||
+        inotify_add_watch(fd, directory, IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE | IN_MOVED_FROM) == -1)
+    {
+        fprintf(stderr, "Error: %s: inotify: %s\n", directory, strerror(errno));
+        return false;
+    }
+
+    struct PackKey* palettes = NULL;
+    size_t paletteCount = 0;
+    char** names = NULL;
+    size_t count = 0;
+    bool tracking = hts_index_init(&tracked, 0) &&
+                    pack_palettes(pack, &palettes, &paletteCount) &&
+                    scan_directory(directory, ident, pack, palettes, paletteCount, NULL, &names, &count) &&
+                    track_names(&tracked, names, count, true, ident, pack, palettes, paletteCount);
+    free_names(names, count);
+    free(palettes);
+    if (!tracking)
+    {
+        hts_index_free(&tracked);
+        close(fd);
+        return false;
+    }
+
+    struct sigaction action;
+    sigset_t waitMask;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handle_stop_signal;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    pthread_sigmask(SIG_BLOCK, NULL, &waitMask);
+    sigdelset(&waitMask, SIGINT);
+    sigdelset(&waitMask, SIGTERM);
+
+    bool ret = false;
+    printf("-> Watching %s, press Ctrl+C to stop\n", directory);
+    fflush(stdout);
+
+    while (true)
+    {
+        char** changed = NULL;
+        char** removed = NULL;
+        size_t changedCount = 0, changedCapacity = 0;
+        size_t removedCount = 0, removedCapacity = 0;
+        bool overflow = false;
+        struct pollfd pfd = { fd, POLLIN, 0 };
+
+        /* a rescan looks at what changed since the previous batch
+         * started, with a second of slack for the file system */
+        since = batchStart;
+        since.tv_sec -= 1;
+        clock_gettime(CLOCK_REALTIME, &batchStart);
+
+        /* wait for the first change, then for them to settle,
+         * an editor saving a file is often more than one event */
+        int timeout = -1;
+        while (true)
+        {
+            /* check on the compaction every now and then */
+            int waitMs = (compacting && (timeout == -1 || timeout > 100)) ? 100 : timeout;
+            struct timespec wait = { waitMs / 1000, (waitMs % 1000) * 1000000L };
+            int pollRet = ppoll(&pfd, 1, waitMs == -1 ? NULL : &wait, &waitMask);
+            if (pollRet == -1 && errno == EINTR)
+            {
+                if (stopWatching)
+                {
+                    /* what's in the pack is committed already */
+                    printf("-> Stopped watching %s\n", directory);
+                    ret = true;
+                    goto stop;
+                }
+                continue;
+            }
+            if (pollRet == -1)
+            {
+                fprintf(stderr, "Error: poll: %s\n", strerror(errno));
+                goto stop;
+            }
+
+            if (compacting && atomic_load(&compaction.done))
+            {
+                compacting = false;
+                if (!finish_compaction(pack, &compaction))
+                {
+                    goto stop;
+                }
+                fflush(stdout);
+            }
+
+            if (pollRet == 0)
+            {
+                if (changedCount > 0 || removedCount > 0 || overflow)
+                {
+                    break;
+                }
+                continue;
+            }
+
+            ssize_t length = read(fd, buffer, sizeof(buffer));
+            for (char* ptr = buffer; length > 0 && ptr < buffer + length; )
+            {
+                const struct inotify_event* event = (const struct inotify_event*)ptr;
+                ptr += sizeof(struct inotify_event) + event->len;
+
+                if (event->mask & IN_Q_OVERFLOW)
+                {
+                    overflow = true;
+                }
+                if (event->len == 0)
+                {
+                    continue;
+                }
+                if (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO))
+                {
+                    remove_name(removed, &removedCount, event->name);
+                    add_name(&changed, &changedCount, &changedCapacity, event->name);
+                }
+                else if (event->mask & (IN_DELETE | IN_MOVED_FROM))
+                {
+                    remove_name(changed, &changedCount, event->name);
+                    add_name(&removed, &removedCount, &removedCapacity, event->name);
+                }
+            }
+            timeout = WATCH_SETTLE_MS;
+        }
+
+        uint64_t start = now_ms();
+        int32_t updated = 0;
+        int32_t deleted = 0;
+        bool    ok      = pack_palettes(pack, &palettes, &paletteCount);
+
+        if (ok && overflow)
+        {
+            /* the events are incomplete, the rescan finds everything */
+            free_names(changed, changedCount);
+            free_names(removed, removedCount);
+            removed      = NULL;
+            removedCount = 0;
+            ok = rescan_directory(pack, directory, ident, palettes, paletteCount, &since,
+                                  &tracked, &changed, &changedCount, &deleted);
+        }
+        else if (ok)
+        {
+            ok = track_names(&tracked, changed, changedCount, true, ident, pack, palettes, paletteCount);
+        }
+
+        if (ok)
+        {
+            updated = update_pack(pack, pool, directory, changed, changedCount, ident, palettes, paletteCount);
+        }
+        for (size_t i = 0; i < removedCount && ok; i++)
+        {
+            struct PackKey key;
+            const struct PackKey* keys;
+            size_t keyCount;
+            if (!resolve_png_filename(removed[i], ident, pack, palettes, paletteCount, &key, &keys, &keyCount))
+            {
+                continue;
+            }
+            for (size_t j = 0; j < keyCount; j++)
+            {
+                hts_index_remove(&tracked, keys[j].checksum, keys[j].formatsize);
+                deleted += pack_remove(pack, keys[j].checksum, keys[j].formatsize) ? 1 : 0;
+            }
+        }
+        free(palettes);
+        free_names(changed, changedCount);
+        free_names(removed, removedCount);
+        changed      = NULL;
+        removed      = NULL;
+        changedCount = 0;
+        removedCount = 0;
+
+        if (!ok)
+        {
+            goto stop;
+        }
+        if (updated == 0 && deleted == 0)
+        {
+            continue;
+        }
+        if (!pack_commit(pack) || !pack_write_index(pack))
+        {
+            goto stop;
+        }
+
+        printf("-> Updated %i and removed %i textures in %llu ms, %i%% dead space\n",
+               updated, deleted, (unsigned long long)(now_ms() - start), pack_dead_percent(pack));
+
+        if (!compacting && compactPercent > 0 && pack_dead_percent(pack) >= compactPercent)
+        {
+            compacting = start_compaction(pack, &compaction);
+        }
+        fflush(stdout);
+        continue;
+
+stop:
+        free_names(changed, changedCount);
+        free_names(removed, removedCount);
+        break;
+    }
+
+    /* a compaction which is still running is discarded,
+     * so is its file */
+    if (compacting)
+    {
+        pthread_join(compaction.thread, NULL);
+        close(compaction.inputFd);
+        close(compaction.outputFd);
+        unlink(compaction.filename);
+        free(compaction.textures);
+        free(compaction.outputOffsets);
+        hts_index_free(&compaction.index);
+    }
+    hts_index_free(&tracked);
+    close(fd);
+    return ret;
+}
+
+int main(int argc, char** argv)
+{
+    const char* directory = NULL;
+    const char* filename  = NULL;
+    bool    compress       = false;
+    bool    watch          = false;
+    bool    writeIndex     = false;
+    int32_t compactPercent = 50;
+    int32_t threads        = threadpool_default_threads();
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--watch") == 0)
+        {
+            watch = true;
+        }
+        else if (strcmp(argv[i], "--compress") == 0)
+        {
+            compress = true;
+        }
+        else if (strcmp(argv[i], "--index") == 0)
+        {
+            writeIndex = true;
+        }
+        else if (strcmp(argv[i], "--compact") == 0 && (i + 1) < argc)
+        {
+            compactPercent = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-j") == 0 && (i + 1) < argc)
+        {
+            threads = atoi(argv[++i]);
+        }
+        else if (directory == NULL)
+        {
+            directory = argv[i];
+        }
+        else if (filename == NULL)
+        {
+            filename = argv[i];
+        }
+    }
+
+    if (directory == NULL || filename == NULL || compactPercent < 0 || compactPercent > 100)
+    {
+        printf("Usage: %s [IDENT DIRECTORY] [HTS FILE] [--compress] [--watch] [--compact PERCENT] [--index] [-j THREADS]\n", argv[0]);
+        printf("\n");
+        printf("The directory contains the PNGs as hts2png writes them, an existing HTS file is updated\n");
+        printf("with the PNGs which are newer than it, --compress only applies to a new HTS file\n");
+        printf("A CI texture hts2png named without its palette checksum replaces every palette of it\n");
+        printf("--watch keeps updating the HTS file when PNGs change and compacts it in the background\n");
+        printf("when more than PERCENT of it is unused (default 50, 0 never compacts)\n");
+        printf("--index keeps a NAME.htsi index sidecar next to the HTS file up to date\n");
+        return 1;
+    }
+
+    /* the PNGs are named after the directory */
+    char identBuffer[PATH_MAX];
+    strncpy(identBuffer, directory, sizeof(identBuffer) - 1);
+    identBuffer[sizeof(identBuffer) - 1] = '\0';
+    size_t length = strlen(identBuffer);
+    while (length > 1 && identBuffer[length - 1] == '/')
+    {
+        identBuffer[--length] = '\0';
+    }
+    const char* ident = basename(identBuffer);
+
+    /* only what changed after the HTS file was written last */
+    struct stat st;
+    bool exists = stat(filename, &st) == 0;
+
+    struct Pack pack;
+    if (!pack_open(&pack, filename, compress))
+    {
+        pack_free(&pack);
+        return 1;
+    }
+    pack.writeIndex = writeIndex;
+
+    /* the threads inherit the blocked signals, watch mode only
+     * takes them while waiting, so Ctrl+C doesn't interrupt an
+     * update or leave a compaction behind */
+    if (watch)
+    {
+        sigset_t stopSignals;
+        sigemptyset(&stopSignals);
+        sigaddset(&stopSignals, SIGINT);
+        sigaddset(&stopSignals, SIGTERM);
+        pthread_sigmask(SIG_BLOCK, &stopSignals, NULL);
+    }
+
+    struct threadpool* pool = threadpool_create(threads);
+    if (pool == NULL)
+    {
+        fprintf(stderr, "Error: failed to create thread pool\n");
+        pack_free(&pack);
+        return 1;
+    }
+
+    uint64_t start = now_ms();
+    struct PackKey* palettes = NULL;
+    size_t paletteCount = 0;
+    size_t count = 0;
+    char** names = NULL;
+    int32_t updated = 0;
+    bool ret = pack_palettes(&pack, &palettes, &paletteCount) &&
+               scan_directory(directory, ident, &pack, palettes, paletteCount, exists ? &st.st_mtim : NULL, &names, &count);
+    if (ret)
+    {
+        updated = update_pack(&pack, pool, directory, names, count, ident, palettes, paletteCount);
+    }
+    free_names(names, count);
+    free(palettes);
+
+    ret = ret && ((updated > 0 || !exists) ? pack_commit(&pack) : true) &&
+          pack_write_index(&pack);
+    if (ret)
+    {
+        printf("-> %s: %i textures updated in %llu ms, %zu textures, %i%% dead space\n", filename, updated,
+               (unsigned long long)(now_ms() - start), pack.index.count, pack_dead_percent(&pack));
+    }
+
+    if (ret && compactPercent > 0 && pack_dead_percent(&pack) >= compactPercent)
+    {
+        struct Compaction compaction;
+        ret = start_compaction(&pack, &compaction) &&
+              finish_compaction(&pack, &compaction);
+    }
+
+    if (ret && watch)
+    {
+        ret = watch_directory(&pack, pool, directory, ident, compactPercent);
+    }
+
+    threadpool_destroy(pool);
+    pack_free(&pack);
+    return ret ? 0 : 1;
+}
@@ -0,0 +1,215 @@
+/*
+ * texturepack_utils - https://github.com/Rosalie241/texturepack_utils
+ *  Copyright (C) 2023 Rosalie Wanders <rosalie@mailbox.org>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 3.
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "hts.h"
+#include "index.h"
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <vector>
+
+/*
+ * Round trip of a texture pack through hts2png and png2hts,
+ * hts2png names CI textures without their palette checksum,
+ * so png2hts has to find them in the pack it updates
+ */
+
+#define CHECK_SIZE 8
+
+struct CheckTexture
+{
+    uint64_t checksum;
+    uint16_t formatsize;
+    uint8_t  pixels[CHECK_SIZE * CHECK_SIZE * 4];
+};
+
+static bool write_pack(const char* filename, std::vector<CheckTexture>& textures)
+{
+    int32_t header        = TXCACHE_FORMAT_VERSION;
+    int32_t config        = HTS_CONFIG_UNCOMPRESSED;
+    int64_t mappingOffset = 0;
+    int32_t mappingSize   = (int32_t)textures.size();
+    std::vector<int64_t> offsets;
+
+    FILE* file = fopen(filename, "wb");
+    if (file == NULL)
+    {
+        perror("fopen");
+        return false;
+    }
+
+#define FWRITE(x) fwrite(&x, sizeof(x), 1, file)
+    FWRITE(header);
+    FWRITE(config);
+    FWRITE(mappingOffset);
+    for (auto& texture : textures)
+    {
+        struct GHQTexInfo info;
+        memset(&info, 0, sizeof(info));
+        info.width          = CHECK_SIZE;
+        info.height         = CHECK_SIZE;
+        info.format         = GL_RGBA8;
+        info.texture_format = GL_RGBA;
+        info.pixel_type     = GL_UNSIGNED_BYTE;
+        info.is_hires_tex   = 1;
+        info.dataSize       = sizeof(texture.pixels);
+        info.n64_format_size._formatsize = texture.formatsize;
+
+        offsets.push_back(FTELL(file));
+        write_info_header(file, false, &info);
+        fwrite(texture.pixels, sizeof(texture.pixels), 1, file);
+    }
+
+    mappingOffset = FTELL(file);
+    FWRITE(mappingSize);
+    for (size_t i = 0; i < textures.size(); i++)
+    {
+        union StorageOffset offset;
+        offset._offset     = offsets[i];
+        offset._formatsize = textures[i].formatsize;
+        FWRITE(textures[i].checksum);
+        FWRITE(offset._data);
+    }
+    FSEEK(file, sizeof(header) + sizeof(config), SEEK_SET);
+    FWRITE(mappingOffset);
+#undef FWRITE
+
+    return fclose(file) == 0;
+}
+
+/* compares the pack png2hts updated with the textures, the
+ * palettes which share a PNG end up with the same pixels */
+static bool check_pack(const char* filename, std::vector<CheckTexture>& textures)
+{
+    struct hts_index index;
+    bool    oldFormat     = false;
+    bool    compressed    = false;
+    int64_t mappingOffset = 0;
+    int32_t mappingSize   = 0;
+    int32_t bad           = 0;
+
+    FILE* file = fopen(filename, "rb");
+#define FREAD(x) fread(&x, sizeof(x), 1, file)
+    if (file == NULL || !check_header(file, &oldFormat, &compressed) ||
+        FREAD(mappingOffset) != 1 || FSEEK(file, mappingOffset, SEEK_SET) != 0 ||
+        FREAD(mappingSize) != 1 || !hts_index_init(&index, mappingSize))
+    {
+        fprintf(stderr, "Error: %s: failed to read header\n", filename);
+        return false;
+    }
+
+    for (int32_t i = 0; i < mappingSize; i++)
+    {
+        uint64_t checksum;
+        union StorageOffset offset;
+        FREAD(checksum);
+        FREAD(offset._data);
+        hts_index_insert(&index, checksum, (uint16_t)offset._formatsize, offset._offset, NULL);
+    }
+#undef FREAD
+
+    if (index.count != textures.size())
+    {
+        fprintf(stderr, "Error: %s: has %zu textures instead of %zu\n", filename, index.count, textures.size());
+        bad++;
+    }
+
+    for (auto& texture : textures)
+    {
+        struct GHQTexInfo info;
+        int64_t offset = hts_index_find(&index, texture.checksum, texture.formatsize);
+        if (offset == -1 || !pread_info(fileno(file), offset, oldFormat, &info, true))
+        {
+            fprintf(stderr, "Error: %s: texture %016llX is missing\n", filename, (unsigned long long)texture.checksum);
+            bad++;
+            continue;
+        }
+
+        bool shared = false;
+        for (auto& other : textures)
+        {
+            shared |= &other != &texture && (uint32_t)other.checksum == (uint32_t)texture.checksum &&
+                      other.formatsize == texture.formatsize;
+        }
+        if (info.dataSize != sizeof(texture.pixels) ||
+            (!shared && memcmp(info.data, texture.pixels, sizeof(texture.pixels)) != 0))
+        {
+            fprintf(stderr, "Error: %s: texture %016llX differs\n", filename, (unsigned long long)texture.checksum);
+            bad++;
+        }
+        free(info.data);
+    }
+
+    hts_index_free(&index);
+    fclose(file);
+    return bad == 0;
+}
+
+int main(int argc, char** argv)
+{
+    char directory[] = "/tmp/roundtrip_check.XXXXXX";
+    char packFilename[PATH_MAX];
+    char updateFilename[PATH_MAX];
+    char command[PATH_MAX * 3];
+    uint64_t state = 0x48545321;
+
+    if (argc > 1)
+    {
+        printf("Usage: %s\n", argv[0]);
+        printf("\n");
+        printf("Converts a texture pack with CI textures to PNGs with ./hts2png and\n");
+        printf("updates a copy of it with them with ./png2hts\n");
+        return 1;
+    }
+
+    /* CI textures with palettes, two of them share a texture checksum,
+     * one without a palette checksum, and textures which aren't CI */
+    std::vector<CheckTexture> textures(12);
+    for (size_t i = 0; i < textures.size(); i++)
+    {
+        textures[i].checksum   = ((uint64_t)(0x1000 + i) << 32) | (0x100 + i);
+        textures[i].formatsize = (i % 2) ? 0x0002 : 0x0102;
+        for (size_t j = 0; j < sizeof(textures[i].pixels); j++)
+        {
+            state = (state * 6364136223846793005ULL) + 1442695040888963407ULL;
+            textures[i].pixels[j] = (uint8_t)(state >> 56);
+        }
+    }
+    textures[8].checksum   = (0x2000ULL << 32) | 0x101;
+    textures[8].formatsize = 0x0002;
+    textures[9].checksum   = 0x109;
+    textures[10].formatsize = 0x0203;
+    textures[11].formatsize = 0x0300;
+
+    if (mkdtemp(directory) == NULL)
+    {
+        perror("mkdtemp");
+        return 1;
+    }
+    snprintf(packFilename, sizeof(packFilename), "%s/CHECK_HIRESTEXTURES.hts", directory);
+    snprintf(updateFilename, sizeof(updateFilename), "%s/update.hts", directory);
+
+    bool ret = write_pack(packFilename, textures) && write_pack(updateFilename, textures);
+
+    /* every PNG is newer than the pack which is updated */
+    struct timespec times[2] = { { 1, 0 }, { 1, 0 } };
+    ret = ret && utimensat(AT_FDCWD, updateFilename, times, 0) == 0;
+
+    snprintf(command, sizeof(command), "./hts2png %s > /dev/null && ./png2hts %s/CHECK %s --compact 0 > /dev/null",
+             packFilename, directory, updateFilename);
+    ret = ret && system(command) == 0 && check_pack(updateFilename, textures);
+
+    snprintf(command, sizeof(command), "rm -rf %s", directory);
+    if (system(command) != 0)
+    {
+        ret = false;
+    }
+
+    printf("-> hts2png and png2hts round trip %s\n", ret ? "ok" : "failed");
+    return ret ? 0 : 1;
+}
@@ -0,0 +1,223 @@
+/*
+ * texturepack_utils - https://github.com/Rosalie241/texturepack_utils
+ *  Copyright (C) 2023 Rosalie Wanders <rosalie@mailbox.org>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 3.
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+/*
+ * Trace
+ *
+ * Records a span for every stage of every texture and writes them
+ * as Chrome trace-event JSON, which can be opened in Perfetto or
+ * chrome://tracing. Every thread records into its own buffer, so
+ * there's no locking per event, and when tracing is off every call
+ * returns right after checking a flag.
+ */
+
+struct trace_event
+{
+    /* must be a string literal */
+    const char* name;
+    uint64_t    start;
+    uint64_t    duration;
+    uint64_t    checksum;
+    int32_t     width;
+    int32_t     height;
+    uint64_t    bytes;
+};
+
+struct trace_buffer
+{
+    struct trace_event*  events;
+    size_t               count;
+    size_t               capacity;
+    int32_t              tid;
+    struct trace_buffer* next;
+};
+
+struct trace_state
+{
+    bool                 enabled;
+    FILE*                file;
+    const char*          process;
+    uint64_t             start;
+    pthread_mutex_t      mutex;
+    struct trace_buffer* buffers;
+    int32_t              threads;
+};
+
+static struct trace_state trace_state = { false, NULL, NULL, 0, PTHREAD_MUTEX_INITIALIZER, NULL, 0 };
+static __thread struct trace_buffer* trace_thread_buffer = NULL;
+/* texture the spans of this thread belong to */
+static __thread uint64_t trace_thread_checksum = 0;
+static __thread int32_t  trace_thread_width    = 0;
+static __thread int32_t  trace_thread_height   = 0;
+
+static uint64_t trace_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000000) + ts.tv_nsec;
+}
+
+/* starts tracing to filename, process is shown as the name of the process */
+static bool trace_open(const char* filename, const char* process)
+{
+    trace_state.file = fopen(filename, "w");
+    if (trace_state.file == NULL)
+    {
+        perror("fopen");
+        return false;
+    }
+
+    trace_state.process = process;
+    trace_state.start   = trace_now();
+    trace_state.enabled = true;
+    return true;
+}
+
+/* tags the following spans of this thread with the texture */
+static inline void trace_texture(uint64_t checksum, int32_t width, int32_t height)
+{
+    if (!trace_state.enabled)
+    {
+        return;
+    }
+    trace_thread_checksum = checksum;
+    trace_thread_width    = width;
+    trace_thread_height   = height;
+}
+
+/* returns the start of a span, 0 when tracing is off */
+static inline uint64_t trace_begin(void)
+{
+    if (!trace_state.enabled)
+    {
+        return 0;
+    }
+    return trace_now();
+}
+
+static struct trace_buffer* trace_get_buffer(void)
+{
+    if (trace_thread_buffer != NULL)
+    {
+        return trace_thread_buffer;
+    }
+
+    struct trace_buffer* buffer = (struct trace_buffer*)calloc(1, sizeof(struct trace_buffer));
+    if (buffer == NULL)
+    {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&trace_state.mutex);
+    buffer->tid = ++trace_state.threads;
+    buffer->next = trace_state.buffers;
+    trace_state.buffers = buffer;
+    pthread_mutex_unlock(&trace_state.mutex);
+
+    trace_thread_buffer = buffer;
+    return buffer;
+}
+
+/* records a span which started at start, as returned by trace_begin(),
+ * bytes is the amount of bytes the stage produced or consumed */
+static void trace_end(const char* name, uint64_t start, uint64_t bytes)
+{
+    if (!trace_state.enabled || start == 0)
+    {
+        return;
+    }
+
+    uint64_t end = trace_now();
+    struct trace_buffer* buffer = trace_get_buffer();
+    if (buffer == NULL)
+    {
+        return;
+    }
+
+    if (buffer->count == buffer->capacity)
+    {
+        size_t capacity = buffer->capacity == 0 ? 4096 : buffer->capacity * 2;
+        struct trace_event* events = (struct trace_event*)realloc(buffer->events, capacity * sizeof(struct trace_event));
+        if (events == NULL)
+        {
+            return;
+        }
+        buffer->events   = events;
+        buffer->capacity = capacity;
+    }
+
+    struct trace_event* event = &buffer->events[buffer->count++];
+    event->name     = name;
+    event->start    = start - trace_state.start;
+    event->duration = end - start;
+    event->checksum = trace_thread_checksum;
+    event->width    = trace_thread_width;
+    event->height   = trace_thread_height;
+    event->bytes    = bytes;
+}
+
+/* writes the trace, every thread which recorded
+ * spans must have finished by now */
+static void trace_close(void)
+{
+    if (!trace_state.enabled)
+    {
+        return;
+    }
+
+    FILE* file = trace_state.file;
+
+    trace_state.enabled = false;
+
+    fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    fprintf(file, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"%s\"}}",
+            trace_state.process);
+
+    struct trace_buffer* buffer = trace_state.buffers;
+    while (buffer != NULL)
+    {
+        fprintf(file, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%i,\"args\":{\"name\":\"thread %i\"}}",
+                buffer->tid, buffer->tid);
+
+        for (size_t i = 0; i < buffer->count; i++)
+        {
+            struct trace_event* event = &buffer->events[i];
+            fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%i,\"ts\":%.3f,\"dur\":%.3f,"
+                          "\"args\":{\"checksum\":\"%016llX\",\"width\":%i,\"height\":%i,\"bytes\":%llu}}",
+                    event->name, buffer->tid, event->start / 1000.0, event->duration / 1000.0,
+                    (unsigned long long)event->checksum, event->width, event->height,
+                    (unsigned long long)event->bytes);
+        }
+
+        struct trace_buffer* next = buffer->next;
+        free(buffer->events);
+        free(buffer);
+        buffer = next;
+    }
+
+    fprintf(file, "\n]}\n");
+    fclose(file);
+
+    trace_state.buffers = NULL;
+    trace_state.file    = NULL;
+    trace_thread_buffer = NULL;
+}
+
+#endif /* TRACE_H */